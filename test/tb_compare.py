@@ -1,12 +1,30 @@
 # SPDX-FileCopyrightText: © 2025 Toivo Henningsson
 # SPDX-License-Identifier: Apache-2.0
 
+import struct
+
 import cocotb
 from cocotb.clock import Clock
 from cocotb.triggers import ClockCycles
 
 INTERFACE_REGISTER_SHIFT = 4
 
+# Binary compare trace, see verilator/compare-test/compare_trace.h
+TRACE_MAGIC = b"PWLSCTRC"
+TRACE_VERSION = 1
+TRACE_HEADER = struct.Struct("<8sIIQQQ") # magic, version, record_size, seed, num_cycles, num_records
+TRACE_RECORD = struct.Struct("<BBHHH") # cmd_ready, uo_out, wdata, data_out, run
+
+def read_compare_trace(fname):
+	"""Yield (cmd_in, wdata_in, uo_out, data_out, data_ready) for each cycle in a compare trace."""
+	with open(fname, "rb") as file:
+		magic, version, record_size, seed, num_cycles, num_records = TRACE_HEADER.unpack(file.read(TRACE_HEADER.size))
+		assert magic == TRACE_MAGIC and version == TRACE_VERSION and record_size == TRACE_RECORD.size, "not a compare trace"
+		for i in range(num_records):
+			cmd_ready, uo_out, wdata, data_out, run = TRACE_RECORD.unpack(file.read(TRACE_RECORD.size))
+			cycle = (cmd_ready & 7, wdata, uo_out, data_out, (cmd_ready >> 3) & 1)
+			for j in range(run + 1): yield cycle
+
 @cocotb.test()
 async def test_project(dut):
 	dut._log.info("Start")
@@ -24,42 +42,36 @@ async def test_project(dut):
 
 	await ClockCycles(dut.clk, 1)
 
-	with open("../verilator/compare-test/compare_data.txt", "r") as file:
-		t = 0
-		while True:
-		#for i in range(16):
-			#print("i =", i, end="\t")
-			line = file.readline()
-			if line == "": break
-			cmd_in, wdata_in, uo_out_expected, data_out_expected, data_ready_expected = [int(s, 0) for s in line.split()]
+	t = 0
+	for cmd_in, wdata_in, uo_out_expected, data_out_expected, data_ready_expected in read_compare_trace("../verilator/compare-test/compare_data.bin"):
 
-			u_in = (cmd_in << 13) | wdata_in
-			dut.ui_in.value = u_in & 255
-			dut.uio_in.value = u_in >> 8
+		u_in = (cmd_in << 13) | wdata_in
+		dut.ui_in.value = u_in & 255
+		dut.uio_in.value = u_in >> 8
 
-			await ClockCycles(dut.clk, 1)
+		await ClockCycles(dut.clk, 1)
 
-			#t += 1; continue
+		#t += 1; continue
 
-			if t >= 66: # compare results; a bit more than one sample time is needed to set the PWM counter
-				uo_out = dut.uo_out.value.integer
+		if t >= 66: # compare results; a bit more than one sample time is needed to set the PWM counter
+			uo_out = dut.uo_out.value.integer
 
-				data_out = dut.data_out.value.integer
-				data_ready = dut.data_ready.value.integer
+			data_out = dut.data_out.value.integer
+			data_ready = dut.data_ready.value.integer
 
-				#print([(uo_out, uo_out_expected), (data_out, data_out_expected), (data_ready, data_ready_expected)])
+			#print([(uo_out, uo_out_expected), (data_out, data_out_expected), (data_ready, data_ready_expected)])
 
-				if not (uo_out == uo_out_expected and data_out == data_out_expected and data_ready == data_ready_expected):
-					print("Mismatch")
-					print("--------")
-					print("t =", t)
-					print("uo_out: ", hex(uo_out), "\texpected: ", hex(uo_out_expected))
-					print("data_out: ", hex(data_out), "\texpected: ", hex(data_out_expected))
-					print("data_ready: ", hex(data_ready), "\texpected: ", hex(data_ready_expected))
+			if not (uo_out == uo_out_expected and data_out == data_out_expected and data_ready == data_ready_expected):
+				print("Mismatch")
+				print("--------")
+				print("t =", t)
+				print("uo_out: ", hex(uo_out), "\texpected: ", hex(uo_out_expected))
+				print("data_out: ", hex(data_out), "\texpected: ", hex(data_out_expected))
+				print("data_ready: ", hex(data_ready), "\texpected: ", hex(data_ready_expected))
 
-				if True:
-					assert uo_out == uo_out_expected
-					assert data_out == data_out_expected
-					assert data_ready == data_ready_expected
+			if True:
+				assert uo_out == uo_out_expected
+				assert data_out == data_out_expected
+				assert data_ready == data_ready_expected
 
-			t += 1
+		t += 1
@@ -8,131 +8,192 @@
 #include <string.h>
 #include <algorithm>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 #include "Vcompare_top.h"
 #include "verilated.h"
 #include <verilated_vcd_c.h>
 
-const int compare_file_cycles = 1 << 16;
-const char* compare_fname = "compare_data.txt";
+#include "compare_trace.h"
+#include "compare_stim.h"
+#include "../model/pwls_parallel.h"
+
+// Usage: Vcompare_top [-cycles n] [-seed n] [-seeds m] [-j threads] [-o file] [-vcd] [mix options]
+//     -seeds <m>    run the seeds seed, seed+1, ..., seed+m-1, each with its own model (default: 1)
+//     -j <n>        number of threads for multiple seeds (default: all cores)
+//     -o <file>     output file; with several seeds, the seed is inserted before the extension (default: compare_data.bin)
+//     -vcd          also write peripheral-test.vcd, for a single seed (needs TRACE_ON)
+//     mix options   -read/-write/-idle/-burst <weight>, -burst_len <n>, see compare_stim.h
+// Writes a binary compare trace per seed, see compare_trace.h, and prints a summary of the command mix.
+// Use trace_diff to compare or print traces.
+
+const int default_compare_file_cycles = 1 << 16;
+const int max_compare_file_cycles = 1 << 28;
+const char* compare_fname = "compare_data.bin";
 
 #define TRACE_ON
 //#define DEBUG_PRINTS
 
 
+// One compare_top model with its own context, writing one trace
+struct CompareSim {
+	VerilatedContext *context;
+	Vcompare_top *top;
+	VerilatedVcdC *m_trace; // NULL if not tracing
+	int sim_time;
+	CompareTraceWriter compare_trace;
 
-Vcompare_top *top;
-VerilatedVcdC *m_trace;
-int sim_time = 0;
-
+	CompareSim() : m_trace(NULL), sim_time(0) {
+		context = new VerilatedContext;
+		top = new Vcompare_top(context);
+	}
+	~CompareSim() {
+		delete top;
+		delete context;
+	}
 
-inline void trace() {
+	inline void trace() {
 #ifdef TRACE_ON
-	m_trace->dump(sim_time); sim_time++;
+		if (m_trace != NULL) { m_trace->dump(sim_time); sim_time++; }
 #endif
-}
+	}
 
-//int pwm_acc;
-//void timestep() { pwm_acc += top->pwm_out; top->clk = 0; top->eval(); top->clk = 1; top->eval(); }
-void timestep() {
-/*
-	top->clk = 0;
-	top->eval();
-	trace();
-*/
-	top->clk = 1;
-	top->eval();
-	trace();
-	top->clk = 0;
-	top->eval();
-	trace();
-//	top->clk = 0; top->eval(); top->clk = 1; top->eval();
-}
+	void timestep() {
+		top->clk = 1;
+		top->eval();
+		trace();
+		top->clk = 0;
+		top->eval();
+		trace();
+	}
 
-int rand_bits(int nbits) {
-	return rand() & ((1 << nbits)-1);
+	// Bus interface for CompareStream
+	bool step(int cmd, int wdata) {
+		top->cmd_in = cmd;
+		top->wdata_in = wdata;
+		timestep();
+		compare_trace.add(cmd, wdata, top->uo_out, top->data_out, top->data_ready);
+		return true;
+	}
+	bool data_ready() { return top->data_ready; }
+};
+
+struct CompareJob {
+	int seed;
+	std::string fname;
+	bool vcd;
+	uint64_t num_records;
+	CompareStats stats;
+	int result;
+};
+
+std::string seed_fname(const char *fname, int seed) {
+	std::string s = fname;
+	size_t dot = s.rfind('.');
+	if (dot == std::string::npos || s.find('/', dot) != std::string::npos) dot = s.size();
+	return s.substr(0, dot) + "_" + std::to_string(seed) + s.substr(dot);
 }
 
-const int CMD_SET_ADDR = 4;
-const int CMD_SET_DATA = 5;
-const int CMD_WRITE = 6;
-const int CMD_READ  = 7;
-
-void cp_timestep(FILE* compare_fp, int &t, int cmd, int wdata) {
-	top->cmd_in = cmd;
-	top->wdata_in = wdata;
-
-	timestep();
-	t++;
+void run_compare_sim(CompareJob &job, int compare_file_cycles, const CompareMix &mix) {
+	CompareSim sim;
+	job.result = 1;
 
-	fprintf(compare_fp, "%d 0x%x  0x%x 0x%x %d\n", cmd, wdata, top->uo_out, top->data_out, top->data_ready);
-}
+#ifdef TRACE_ON
+	if (job.vcd) {
+		sim.context->traceEverOn(true);
+		sim.m_trace = new VerilatedVcdC;
+		sim.top->trace(sim.m_trace, 5);
+		sim.m_trace->open("peripheral-test.vcd");
+	}
+#endif
 
-int run_compare_sim() {
-	top->cmd_in = 0;
+	sim.top->cmd_in = 0;
+	sim.top->rst_n = 0;
+	for (int i = 0; i < 9; i++) sim.timestep();
+	sim.top->rst_n = 1;
 
-	top->rst_n = 0; 
-	for (int i = 0; i < 9; i++) timestep();
-	top->rst_n = 1;
+	if (sim.compare_trace.open(job.fname.c_str(), job.seed)) {
+		CompareStream<CompareSim> stream(sim, mix, job.seed);
+		stream.run(compare_file_cycles);
+		job.stats = stream.stats;
+		job.num_records = sim.compare_trace.header.num_records;
 
-	FILE* compare_fp = fopen(compare_fname, "w+");
-	if (!compare_fp) {
-		printf("Failed to create output file: %s", compare_fname);
-		return 1;
+		if (sim.compare_trace.close()) job.result = 0;
+		else printf("Failed to write output file: %s\n", job.fname.c_str());
 	}
 
-	int t = 0;
-	while (t < compare_file_cycles) {
-		int choice = rand_bits(7);
-		if (choice == 0) {
-			// Random read
-			cp_timestep(compare_fp, t, CMD_SET_ADDR, rand_bits(6));
-			int i = 0;
-			while (true) {
-				cp_timestep(compare_fp, t, CMD_READ, 0);
-				if (top->data_ready) break;
-				i++;
-				if (i > 64+4) {
-					printf("ERROR: read failed to finish in %d cycles!\n", i);
-					break;
-				}
-			}
-		} else if (choice < 63) {
-			// Idle
-			cp_timestep(compare_fp, t, 0, 0);
-		} else {
-			// Random write
-			cp_timestep(compare_fp, t, CMD_SET_ADDR, rand_bits(6));
-			cp_timestep(compare_fp, t, CMD_SET_DATA, rand_bits(13));
-			cp_timestep(compare_fp, t, CMD_WRITE, 0);
-		}
+#ifdef TRACE_ON
+	if (sim.m_trace != NULL) {
+		sim.m_trace->close();
+		delete sim.m_trace;
 	}
-
-	fclose(compare_fp);
-	printf("\nWrote compare data file\n\n");
-	return 0;
+#endif
 }
 
 
 int main(int argc, char** argv) {
 	Verilated::commandArgs(argc, argv);
 
-	top = new Vcompare_top();
-
-#ifdef TRACE_ON
-	Verilated::traceEverOn(true);
-	m_trace = new VerilatedVcdC;
-	top->trace(m_trace, 5);
-	m_trace->open("peripheral-test.vcd");
-#endif
-
-	run_compare_sim();
+	int compare_file_cycles = default_compare_file_cycles;
+	int seed = 1;
+	int num_seeds = 1;
+	int num_threads = default_num_threads();
+	CompareMix mix = default_compare_mix;
+	bool vcd = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-cycles") && i + 1 < argc) compare_file_cycles = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-seed") && i + 1 < argc) seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-seeds") && i + 1 < argc) num_seeds = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc) compare_fname = argv[++i];
+		else if (!strcmp(argv[i], "-vcd")) vcd = true;
+		else if (parse_compare_mix_arg(argc, argv, i, mix)) {}
+		else if (argv[i][0] != '+') { // leave +verilator+ arguments to Verilated
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (compare_file_cycles < 1 || compare_file_cycles > max_compare_file_cycles) {
+		printf("The number of cycles should be between 1 and %d\n", max_compare_file_cycles);
+		return 1;
+	}
+	if (num_seeds < 1 || num_threads < 1) {
+		printf("The number of seeds and threads should be at least 1\n");
+		return 1;
+	}
+	if (vcd && num_seeds != 1) {
+		printf("-vcd needs a single seed\n"); // a VCD for each seed would be too much
+		return 1;
+	}
+	if (!check_compare_mix(mix)) return 1;
+
+	std::vector<CompareJob> jobs(num_seeds);
+	for (int i = 0; i < num_seeds; i++) {
+		jobs[i].seed = seed + i;
+		jobs[i].fname = num_seeds == 1 ? std::string(compare_fname) : seed_fname(compare_fname, seed + i);
+		jobs[i].vcd = vcd;
+		jobs[i].num_records = 0;
+	}
 
-#ifdef TRACE_ON
-	m_trace->close();
-#endif
+	parallel_for(num_seeds, num_threads, [&](int i) { run_compare_sim(jobs[i], compare_file_cycles, mix); });
 
-	// Cleanup
-	delete top;
-	return 0;
+	int result = 0;
+	CompareStats total;
+	printf("\n");
+	for (const CompareJob &job : jobs) {
+		if (job.result != 0) {
+			result = job.result;
+			continue;
+		}
+		printf("Wrote compare data file %s: %llu records\n", job.fname.c_str(), (unsigned long long)job.num_records);
+		job.stats.print(stdout, "    ");
+		total.add(job.stats);
+	}
+	if (num_seeds > 1) {
+		printf("\nTotal for %d seeds:\n", num_seeds);
+		total.print(stdout, "    ");
+	}
+	printf("\n");
+	return result;
 }
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Random command streams for the compare_top bus, shared by the compare and lockstep harnesses.
+//
+// The stream is a sequence of operations, picked at random with the weights in a CompareMix:
+//     read:  SET_ADDR, then READ until data_ready
+//     write: SET_ADDR, SET_DATA, WRITE
+//     idle:  one cycle with no command
+//     burst: a number of back to back register accesses with no idle cycles between them, mixing full writes,
+//            data only writes that reuse the address, repeated SET_ADDR and reads right after writes
+// Each stream has its own random number generator, so that streams can be generated on several threads.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+const int CMD_SET_ADDR = 4;
+const int CMD_SET_DATA = 5;
+const int CMD_WRITE = 6;
+const int CMD_READ  = 7;
+const int NUM_CMDS = 8;
+
+const int MAX_READ_CYCLES = 64+4;
+
+struct CompareMix {
+	int read, write, idle, burst; // relative weights of the operations
+	int max_burst; // maximum number of register accesses in a burst
+};
+
+// The original stimulus: out of every 128 cycles on average, one read, 65 writes and 62 idle
+const CompareMix default_compare_mix = {1, 65, 62, 0, 8};
+
+struct CompareStats {
+	uint64_t cycles;
+	uint64_t cmd_counts[NUM_CMDS];
+	uint64_t reads, writes, bursts, burst_accesses, read_timeouts;
+
+	CompareStats() { memset(this, 0, sizeof(*this)); }
+
+	void add(const CompareStats &s) {
+		cycles += s.cycles;
+		for (int i = 0; i < NUM_CMDS; i++) cmd_counts[i] += s.cmd_counts[i];
+		reads += s.reads;
+		writes += s.writes;
+		bursts += s.bursts;
+		burst_accesses += s.burst_accesses;
+		read_timeouts += s.read_timeouts;
+	}
+
+	void print(FILE *fp, const char *prefix="") const {
+		static const char *cmd_names[NUM_CMDS] = {"idle", NULL, NULL, NULL, "set_addr", "set_data", "write", "read"};
+		fprintf(fp, "%s%llu cycles: %llu reads, %llu writes, %llu bursts (%llu accesses), %llu read timeouts\n", prefix,
+			(unsigned long long)cycles, (unsigned long long)reads, (unsigned long long)writes,
+			(unsigned long long)bursts, (unsigned long long)burst_accesses, (unsigned long long)read_timeouts);
+		fprintf(fp, "%scommands:", prefix);
+		for (int i = 0; i < NUM_CMDS; i++) {
+			if (cmd_names[i] == NULL) continue;
+			fprintf(fp, " %s %.2f%%", cmd_names[i], cycles > 0 ? 100.0 * cmd_counts[i] / cycles : 0.0);
+		}
+		fprintf(fp, "\n");
+	}
+};
+
+// Parse a command mix option at argv[i], advancing i past its value. Returns false if argv[i] is not one.
+//     -read <w> -write <w> -idle <w> -burst <w>    operation weights
+//     -burst_len <n>                               maximum number of accesses in a burst
+bool parse_compare_mix_arg(int argc, char **argv, int &i, CompareMix &mix) {
+	if (i + 1 >= argc) return false;
+	int *value = NULL;
+	if (!strcmp(argv[i], "-read")) value = &mix.read;
+	else if (!strcmp(argv[i], "-write")) value = &mix.write;
+	else if (!strcmp(argv[i], "-idle")) value = &mix.idle;
+	else if (!strcmp(argv[i], "-burst")) value = &mix.burst;
+	else if (!strcmp(argv[i], "-burst_len")) value = &mix.max_burst;
+	else return false;
+	*value = atoi(argv[++i]);
+	return true;
+}
+
+bool check_compare_mix(const CompareMix &mix) {
+	if (mix.read < 0 || mix.write < 0 || mix.idle < 0 || mix.burst < 0 || mix.read + mix.write + mix.idle + mix.burst <= 0) {
+		printf("The operation weights should be non-negative, and not all zero\n");
+		return false;
+	}
+	if (mix.max_burst < 1) {
+		printf("The burst length should be at least 1\n");
+		return false;
+	}
+	return true;
+}
+
+
+// xorshift64*, seeded through splitmix64 so that consecutive seeds give unrelated streams
+struct CompareRng {
+	uint64_t state;
+
+	void seed(uint64_t seed) {
+		uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		state = (z ^ (z >> 31)) | 1;
+	}
+
+	uint32_t next() {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return (state * 0x2545f4914f6cdd1dULL) >> 32;
+	}
+
+	int bits(int nbits) { return next() & ((1 << nbits)-1); }
+	int below(int n) { return (int)(((uint64_t)next() * n) >> 32); }
+};
+
+
+// Drives a bus with a random command stream. The Bus should have
+//     bool step(int cmd, int wdata)  run one cycle with the given inputs, return false to stop the stream
+//     bool data_ready()              data_ready output after the last step
+template<class Bus> struct CompareStream {
+	Bus &bus;
+	CompareMix mix;
+	CompareRng rng;
+	CompareStats stats;
+	int addr; // last address set
+	bool stopped;
+
+	CompareStream(Bus &bus, const CompareMix &mix, uint64_t seed) : bus(bus), mix(mix), addr(0), stopped(false) { rng.seed(seed); }
+
+	bool step(int cmd, int wdata) {
+		stats.cycles++;
+		stats.cmd_counts[cmd]++;
+		if (!bus.step(cmd, wdata)) stopped = true;
+		return !stopped;
+	}
+
+	bool set_addr(int new_addr) {
+		addr = new_addr;
+		return step(CMD_SET_ADDR, addr);
+	}
+
+	bool read() {
+		stats.reads++;
+		for (int i = 0; i <= MAX_READ_CYCLES; i++) {
+			if (!step(CMD_READ, 0)) return false;
+			if (bus.data_ready()) return true;
+		}
+		printf("ERROR: read failed to finish in %d cycles at cycle %llu!\n", MAX_READ_CYCLES + 1, (unsigned long long)stats.cycles);
+		stats.read_timeouts++;
+		return true;
+	}
+
+	bool write() {
+		stats.writes++;
+		return step(CMD_SET_DATA, rng.bits(13)) && step(CMD_WRITE, 0);
+	}
+
+	bool burst() {
+		int n = 1 + rng.below(mix.max_burst);
+		stats.bursts++;
+		stats.burst_accesses += n;
+		for (int i = 0; i < n; i++) {
+			int kind = rng.bits(2);
+			if (kind == 0) {
+				// Full write
+				if (!set_addr(rng.bits(6)) || !write()) return false;
+			} else if (kind == 1) {
+				// Data only write, to the last address
+				if (!write()) return false;
+			} else if (kind == 2) {
+				// SET_ADDR overridden by another one, then write
+				if (!set_addr(rng.bits(6)) || !set_addr(rng.bits(6)) || !write()) return false;
+			} else {
+				// Read back, right after the previous access
+				if (!set_addr(rng.bits(1) ? addr : rng.bits(6)) || !read()) return false;
+			}
+		}
+		return true;
+	}
+
+	// Run until at least the given number of cycles have been generated, or the bus stops the stream
+	void run(uint64_t cycles) {
+		int total = mix.read + mix.write + mix.idle + mix.burst;
+		while (stats.cycles < cycles && !stopped) {
+			int choice = rng.below(total);
+			if ((choice -= mix.read) < 0) {
+				if (set_addr(rng.bits(6))) read();
+			} else if ((choice -= mix.write) < 0) {
+				if (set_addr(rng.bits(6))) write();
+			} else if ((choice -= mix.idle) < 0) {
+				step(0, 0);
+			} else {
+				burst();
+			}
+		}
+	}
+};
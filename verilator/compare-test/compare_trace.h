@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Binary compare trace format: the command stream fed to compare_top and its outputs, one record per run of cycles.
+//
+// File layout (little endian):
+//     CompareTraceHeader
+//     CompareTraceRecord[num_records]
+// Consecutive cycles with identical inputs and outputs (mostly idle cycles) are stored as one record,
+// with run = the number of extra cycles that repeat it.
+// The reader maps the file into memory, so traces with hundreds of millions of cycles can be diffed quickly.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char COMPARE_TRACE_MAGIC[8] = {'P', 'W', 'L', 'S', 'C', 'T', 'R', 'C'};
+const uint32_t COMPARE_TRACE_VERSION = 1;
+const int MAX_COMPARE_TRACE_RUN = 0xffff;
+
+struct CompareTraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t seed;
+	uint64_t num_cycles;
+	uint64_t num_records;
+};
+
+struct CompareTraceRecord {
+	uint8_t cmd_ready; // cmd in bits 0-2, data_ready in bit 3
+	uint8_t uo_out;
+	uint16_t wdata;
+	uint16_t data_out;
+	uint16_t run; // number of following cycles that are the same
+
+	int cmd() const { return cmd_ready & 7; }
+	int data_ready() const { return (cmd_ready >> 3) & 1; }
+	// Same cycle contents, ignoring the run length?
+	bool same(const CompareTraceRecord &r) const {
+		return cmd_ready == r.cmd_ready && uo_out == r.uo_out && wdata == r.wdata && data_out == r.data_out;
+	}
+};
+
+static_assert(sizeof(CompareTraceRecord) == 8, "CompareTraceRecord should be packed into 8 bytes");
+
+// A record for a single cycle
+CompareTraceRecord compare_trace_record(int cmd, int wdata, int uo_out, int data_out, int data_ready) {
+	CompareTraceRecord r;
+	r.cmd_ready = (cmd & 7) | ((data_ready & 1) << 3);
+	r.uo_out = uo_out;
+	r.wdata = wdata;
+	r.data_out = data_out;
+	r.run = 0;
+	return r;
+}
+
+
+struct CompareTraceWriter {
+	FILE *fp;
+	CompareTraceHeader header;
+	CompareTraceRecord pending;
+	bool have_pending;
+
+	CompareTraceWriter() : fp(NULL), have_pending(false) {}
+
+	bool open(const char *fname, uint64_t seed) {
+		fp = fopen(fname, "wb");
+		if (!fp) {
+			printf("Failed to create output file: %s\n", fname);
+			return false;
+		}
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, COMPARE_TRACE_MAGIC, sizeof(header.magic));
+		header.version = COMPARE_TRACE_VERSION;
+		header.record_size = sizeof(CompareTraceRecord);
+		header.seed = seed;
+		fwrite(&header, sizeof(header), 1, fp); // rewritten with the counts in close
+		have_pending = false;
+		return true;
+	}
+
+	void add(int cmd, int wdata, int uo_out, int data_out, int data_ready) {
+		CompareTraceRecord r = compare_trace_record(cmd, wdata, uo_out, data_out, data_ready);
+		header.num_cycles++;
+
+		if (have_pending && pending.same(r) && pending.run < MAX_COMPARE_TRACE_RUN) {
+			pending.run++;
+			return;
+		}
+		flush();
+		pending = r;
+		have_pending = true;
+	}
+
+	void flush() {
+		if (!have_pending) return;
+		fwrite(&pending, sizeof(pending), 1, fp);
+		header.num_records++;
+		have_pending = false;
+	}
+
+	bool close() {
+		flush();
+		fseek(fp, 0, SEEK_SET);
+		fwrite(&header, sizeof(header), 1, fp);
+		bool ok = !ferror(fp);
+		fclose(fp);
+		fp = NULL;
+		return ok;
+	}
+};
+
+
+struct CompareTrace {
+	const CompareTraceHeader *header;
+	const CompareTraceRecord *records;
+	void *data;
+	size_t size;
+
+	CompareTrace() : header(NULL), records(NULL), data(NULL), size(0) {}
+	~CompareTrace() { if (data != NULL) munmap(data, size); }
+
+	bool open(const char *fname) {
+		int fd = ::open(fname, O_RDONLY);
+		if (fd < 0) {
+			printf("Failed to open trace file: %s\n", fname);
+			return false;
+		}
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CompareTraceHeader);
+		if (ok) {
+			size = st.st_size;
+			data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) { data = NULL; ok = false; }
+		}
+		::close(fd);
+		if (!ok) {
+			printf("Failed to map trace file: %s\n", fname);
+			return false;
+		}
+
+		header = (const CompareTraceHeader *)data;
+		records = (const CompareTraceRecord *)(header + 1);
+		if (memcmp(header->magic, COMPARE_TRACE_MAGIC, sizeof(header->magic)) || header->version != COMPARE_TRACE_VERSION ||
+				header->record_size != sizeof(CompareTraceRecord)) {
+			printf("%s: not a compare trace, or unsupported version\n", fname);
+			return false;
+		}
+		if (sizeof(CompareTraceHeader) + header->num_records * sizeof(CompareTraceRecord) > size) {
+			printf("%s: truncated trace\n", fname);
+			return false;
+		}
+		madvise(data, size, MADV_SEQUENTIAL);
+		return true;
+	}
+};
+
+// Steps through a trace one run of cycles at a time
+struct CompareTraceCursor {
+	const CompareTrace *trace;
+	uint64_t index;  // current record
+	uint64_t cycle;  // first cycle not yet consumed
+	int remaining;   // cycles left in the current record
+
+	CompareTraceCursor(const CompareTrace &trace) : trace(&trace), index(0), cycle(0) {
+		remaining = trace.header->num_records > 0 ? trace.records[0].run + 1 : 0;
+	}
+
+	bool done() const { return index >= trace->header->num_records; }
+	const CompareTraceRecord &record() const { return trace->records[index]; }
+
+	void advance(int n) {
+		cycle += n;
+		remaining -= n;
+		if (remaining == 0 && ++index < trace->header->num_records) remaining = trace->records[index].run + 1;
+	}
+};
+
+// Find the first cycle where the traces differ, starting from the cycle first_cycle. Returns -1 if there is none.
+// If one trace is shorter, the first cycle past its end is a difference.
+int64_t compare_traces_first_diff(const CompareTrace &a, const CompareTrace &b, uint64_t first_cycle=0) {
+	CompareTraceCursor ca(a), cb(b);
+	while (!ca.done() && !cb.done()) {
+		// The cursors stay in step, so the current records are shared for n cycles
+		int n = std::min(ca.remaining, cb.remaining);
+		if (ca.cycle + n > first_cycle && !ca.record().same(cb.record())) return std::max(ca.cycle, first_cycle);
+		ca.advance(n);
+		cb.advance(n);
+	}
+	if (ca.done() != cb.done()) return std::max(ca.cycle, first_cycle);
+	return -1;
+}
+
+// Print one cycle in the text format of the old compare_data.txt: cmd wdata  uo_out data_out data_ready
+void print_trace_record(FILE *fp, const CompareTraceRecord &r, const char *prefix="") {
+	fprintf(fp, "%s%d 0x%x  0x%x 0x%x %d\n", prefix, r.cmd(), r.wdata, r.uo_out, r.data_out, r.data_ready());
+}
+
+// Print the cycles from first to last in the text format of the old compare_data.txt
+void print_trace_cycles(FILE *fp, const CompareTrace &trace, uint64_t first, uint64_t last, const char *prefix="") {
+	CompareTraceCursor c(trace);
+	while (!c.done() && c.cycle <= last) {
+		if (c.cycle < first) {
+			c.advance(std::min<uint64_t>(c.remaining, first - c.cycle));
+			continue;
+		}
+		print_trace_record(fp, c.record(), prefix);
+		c.advance(1);
+	}
+}
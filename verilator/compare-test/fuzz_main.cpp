@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Coverage guided fuzzer for the compare_top command bus.
+//
+// Each input is a byte string that is decoded into bus commands, three bytes per command:
+//     byte 0, bits 0-2:  cmd; 0 is an idle run of (byte 1 & 63) + 1 cycles
+//     bytes 1-2:         wdata (13 bits)
+// A READ is held until data_ready rises, as the bus protocol requires. Unless -illegal is given, a WRITE that is not
+// preceded by a SET_DATA since the last WRITE gets one inserted, since the harness drops data_in after each write.
+//
+// Every input is run on a fresh model with the line and toggle coverage counters from Verilator --coverage as feedback.
+// Inputs that reach new counter buckets are added to the corpus. The model is built with --x-assign unique and
+// --x-initial unique, and each input is run on two models with different random initial values, to find outputs
+// that depend on X values. Failures:
+//     read_hang:      data_ready didn't rise within MAX_READ_CYCLES of holding READ
+//     spurious_ready: data_ready was high without a READ in the current or previous cycle
+//     x_output:       the two models' outputs differ after the warm-up cycles
+// Failing inputs are minimized and saved as <crashes dir>/<failure>-<hash>.bin, one per failure and command sequence.
+//
+// Usage: fuzz [options]
+//        fuzz -run file...       run the given inputs and print the cycles of failing ones
+//     -j <n>            number of threads (default: all cores)
+//     -time <s>         stop after the given number of seconds (default: run until interrupted)
+//     -runs <n>         stop after the given number of inputs
+//     -seed <n>         seed for the mutations (default: 1)
+//     -max_len <n>      maximum input length in bytes (default: 3072)
+//     -corpus <dir>     load the initial corpus from dir, and save new corpus entries there
+//     -crashes <dir>    where to save minimized failing inputs (default: .)
+//     -nox              don't run the second model to check for X dependent outputs
+//     -illegal          don't fix up WRITEs without SET_DATA
+// Exit code: 0 if no failures were found, 1 if there were, 2 on errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <dirent.h>
+
+#include "Vcompare_top.h"
+#include "Vcompare_top___024root.h"
+#include "Vcompare_top__Syms.h"
+#include "verilated.h"
+
+#include "compare_trace.h"
+#include "compare_stim.h"
+#include "../model/pwls_parallel.h"
+
+const int FUZZ_CMD_BYTES = 3;
+const int WARMUP_CYCLES = 66; // don't compare outputs while the PWM counter is set up
+const int NUM_BUCKETS = 8;
+
+const int FUZZ_OK = 0;
+const int FUZZ_READ_HANG = 1;
+const int FUZZ_SPURIOUS_READY = 2;
+const int FUZZ_X_OUTPUT = 3;
+const int NUM_FUZZ_RESULTS = 4;
+const char *fuzz_result_names[NUM_FUZZ_RESULTS] = {"ok", "read_hang", "spurious_ready", "x_output"};
+
+typedef std::vector<uint8_t> FuzzInput;
+
+int max_input_len = 1024*FUZZ_CMD_BYTES;
+bool check_x = true;
+bool allow_illegal = false;
+const char *corpus_dir = NULL;
+const char *crashes_dir = ".";
+
+
+// AFL style hit count buckets
+int count_bucket(uint32_t count) {
+	if (count <= 3) return count - 1;
+	if (count <= 7) return 3;
+	if (count <= 15) return 4;
+	if (count <= 31) return 5;
+	if (count <= 127) return 6;
+	return 7;
+}
+
+uint64_t input_hash(const FuzzInput &input) {
+	uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+	for (uint8_t b : input) h = (h ^ b) * 0x100000001b3ULL;
+	return h;
+}
+
+
+// A fresh model with randomized initial values
+struct FuzzSim {
+	VerilatedContext *context;
+	Vcompare_top *top;
+
+	FuzzSim(int rand_seed) {
+		context = new VerilatedContext;
+		context->randReset(2);
+		context->randSeed(rand_seed);
+		top = new Vcompare_top(context);
+
+		top->cmd_in = 0;
+		top->wdata_in = 0;
+		top->rst_n = 0;
+		for (int i = 0; i < 9; i++) timestep();
+		top->rst_n = 1;
+		memset(coverage(), 0, num_coverage()*sizeof(uint32_t)); // only count coverage after reset
+	}
+	~FuzzSim() {
+		delete top;
+		delete context;
+	}
+
+	uint32_t *coverage() { return top->rootp->vlSymsp->__Vcoverage; }
+	static int num_coverage() { return sizeof(((Vcompare_top__Syms *)NULL)->__Vcoverage) / sizeof(uint32_t); }
+
+	void timestep() {
+		top->clk = 1;
+		top->eval();
+		top->clk = 0;
+		top->eval();
+	}
+
+	void step(int cmd, int wdata) {
+		top->cmd_in = cmd;
+		top->wdata_in = wdata;
+		timestep();
+	}
+
+	CompareTraceRecord record(int cmd, int wdata) {
+		return compare_trace_record(cmd, wdata, top->uo_out, top->data_out, top->data_ready);
+	}
+};
+
+struct FuzzExec {
+	int result;
+	uint64_t cycle; // cycle of the failure
+	std::vector<uint32_t> features; // coverage point*NUM_BUCKETS + bucket
+};
+
+struct FuzzRunner {
+	FuzzSim *sims[2];
+	int num_sims;
+	uint64_t t;
+	int prev_cmd;
+	FILE *trace_fp; // print the cycles here if not NULL
+	FuzzExec *exec;
+
+	// Returns false when a failure is found
+	bool step(int cmd, int wdata) {
+		for (int i = 0; i < num_sims; i++) sims[i]->step(cmd, wdata);
+		CompareTraceRecord r = sims[0]->record(cmd, wdata);
+		if (trace_fp != NULL) print_trace_record(trace_fp, r, "    ");
+
+		bool ok = true;
+		if (r.data_ready() && cmd != CMD_READ && prev_cmd != CMD_READ) ok = fail(FUZZ_SPURIOUS_READY);
+		else if (num_sims == 2 && t >= WARMUP_CYCLES && !r.same(sims[1]->record(cmd, wdata))) ok = fail(FUZZ_X_OUTPUT);
+		prev_cmd = cmd;
+		t++;
+		return ok;
+	}
+
+	bool fail(int result) {
+		exec->result = result;
+		exec->cycle = t;
+		return false;
+	}
+
+	bool read() {
+		for (int i = 0; i <= MAX_READ_CYCLES; i++) {
+			if (!step(CMD_READ, 0)) return false;
+			if (sims[0]->top->data_ready) return true;
+		}
+		return fail(FUZZ_READ_HANG);
+	}
+
+	void run(const FuzzInput &input) {
+		bool data_set = false;
+		for (size_t i = 0; i + FUZZ_CMD_BYTES <= input.size(); i += FUZZ_CMD_BYTES) {
+			int cmd = input[i] & 7;
+			int wdata = (input[i+1] | (input[i+2] << 8)) & 0x1fff;
+			bool ok = true;
+			if (cmd == 0) {
+				for (int n = (input[i+1] & 63) + 1; n > 0 && ok; n--) ok = step(0, 0);
+			} else if (cmd == CMD_READ) ok = read();
+			else if (cmd == CMD_WRITE) {
+				if (!data_set && !allow_illegal) ok = step(CMD_SET_DATA, wdata);
+				ok = ok && step(CMD_WRITE, 0);
+				data_set = false;
+			} else {
+				if (cmd == CMD_SET_DATA) data_set = true;
+				ok = step(cmd, wdata);
+			}
+			if (!ok) return;
+		}
+	}
+};
+
+// Run an input on fresh models and collect the coverage features
+void fuzz_execute(const FuzzInput &input, FuzzExec &exec, FILE *trace_fp=NULL) {
+	exec.result = FUZZ_OK;
+	exec.cycle = 0;
+
+	FuzzRunner runner;
+	runner.num_sims = check_x ? 2 : 1;
+	for (int i = 0; i < runner.num_sims; i++) runner.sims[i] = new FuzzSim(i + 1);
+	runner.t = 0;
+	runner.prev_cmd = 0;
+	runner.trace_fp = trace_fp;
+	runner.exec = &exec;
+	runner.run(input);
+
+	exec.features.clear();
+	const uint32_t *coverage = runner.sims[0]->coverage();
+	for (int i = 0; i < FuzzSim::num_coverage(); i++) {
+		if (coverage[i] != 0) exec.features.push_back(i*NUM_BUCKETS + count_bucket(coverage[i]));
+	}
+	for (int i = 0; i < runner.num_sims; i++) delete runner.sims[i];
+}
+
+
+// Shared fuzzer state
+std::mutex fuzz_mutex;
+std::vector<FuzzInput> corpus;
+std::vector<uint8_t> seen_features;
+int num_seen_features = 0;
+std::set<uint64_t> saved_crashes;
+int crash_counts[NUM_FUZZ_RESULTS];
+
+std::atomic<uint64_t> num_execs(0);
+std::atomic<bool> stop_fuzzing(false);
+uint64_t max_runs = 0;
+
+bool save_file(const std::string &fname, const FuzzInput &input) {
+	FILE *fp = fopen(fname.c_str(), "wb");
+	if (!fp) {
+		printf("Failed to create file: %s\n", fname.c_str());
+		return false;
+	}
+	fwrite(input.data(), 1, input.size(), fp);
+	fclose(fp);
+	return true;
+}
+
+bool load_file(const char *fname, FuzzInput &input) {
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) {
+		printf("Failed to open file: %s\n", fname);
+		return false;
+	}
+	input.clear();
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) input.insert(input.end(), buf, buf + n);
+	fclose(fp);
+	return true;
+}
+
+std::string hash_name(const FuzzInput &input) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)input_hash(input));
+	return buf;
+}
+
+// Count the features that haven't been seen before, and mark them as seen if add is set. Call with fuzz_mutex held.
+int new_features(const FuzzExec &exec, bool add) {
+	int n = 0;
+	for (uint32_t f : exec.features) {
+		if (seen_features[f]) continue;
+		n++;
+		if (add) {
+			seen_features[f] = 1;
+			num_seen_features++;
+		}
+	}
+	return n;
+}
+
+// Remove commands from a failing input as long as it still fails the same way, then clear the bytes that don't matter
+void minimize(FuzzInput &input, int result) {
+	input.resize(input.size() / FUZZ_CMD_BYTES * FUZZ_CMD_BYTES);
+	FuzzExec exec;
+	for (size_t chunk = input.size() / FUZZ_CMD_BYTES / 2; chunk >= 1; chunk /= 2) {
+		size_t chunk_bytes = chunk * FUZZ_CMD_BYTES;
+		for (size_t i = 0; i + chunk_bytes <= input.size();) {
+			FuzzInput candidate(input.begin(), input.begin() + i);
+			candidate.insert(candidate.end(), input.begin() + i + chunk_bytes, input.end());
+			fuzz_execute(candidate, exec);
+			if (exec.result == result) input = candidate;
+			else i += chunk_bytes;
+		}
+	}
+	for (size_t i = 0; i < input.size(); i++) {
+		int mask = (i % FUZZ_CMD_BYTES == 0) ? 7 : 0; // keep the command
+		if ((input[i] & ~mask) == 0) continue;
+		FuzzInput candidate = input;
+		candidate[i] &= mask;
+		fuzz_execute(candidate, exec);
+		if (exec.result == result) input = candidate;
+	}
+}
+
+// Failures with the same sequence of commands are considered the same
+uint64_t crash_signature(const FuzzInput &input, int result) {
+	FuzzInput cmds(1, result);
+	for (size_t i = 0; i < input.size(); i += FUZZ_CMD_BYTES) cmds.push_back(input[i] & 7);
+	return input_hash(cmds);
+}
+
+void report_crash(FuzzInput input, int result) {
+	minimize(input, result);
+	std::string fname = std::string(crashes_dir) + "/" + fuzz_result_names[result] + "-" + hash_name(input) + ".bin";
+
+	std::lock_guard<std::mutex> lock(fuzz_mutex);
+	if (!saved_crashes.insert(crash_signature(input, result)).second) return;
+	crash_counts[result]++;
+	if (save_file(fname, input)) printf("Found %s, saved %d byte input as %s\n", fuzz_result_names[result], (int)input.size(), fname.c_str());
+}
+
+
+// A command with the bus commands more likely than the unused codes 1-3
+int random_cmd(CompareRng &rng) {
+	static const int cmds[8] = {0, CMD_SET_ADDR, CMD_SET_DATA, CMD_WRITE, CMD_READ, CMD_SET_ADDR, CMD_WRITE, -1};
+	int cmd = cmds[rng.bits(3)];
+	return cmd >= 0 ? cmd : 1 + rng.below(3);
+}
+
+void mutate(FuzzInput &input, CompareRng &rng, const FuzzInput &other) {
+	int num_cmds = input.size() / FUZZ_CMD_BYTES;
+	int kind = rng.below(num_cmds == 0 ? 1 : 7);
+	if (kind == 0) {
+		// Insert a random command
+		int pos = rng.below(num_cmds + 1) * FUZZ_CMD_BYTES;
+		int cmd = random_cmd(rng);
+		int wdata = cmd == CMD_SET_ADDR ? rng.bits(6) : rng.bits(13);
+		uint8_t bytes[FUZZ_CMD_BYTES] = {(uint8_t)(cmd | (rng.bits(5) << 3)), (uint8_t)wdata, (uint8_t)(wdata >> 8)};
+		input.insert(input.begin() + pos, bytes, bytes + FUZZ_CMD_BYTES);
+	} else if (kind == 1) {
+		// Flip a bit
+		input[rng.below(input.size())] ^= 1 << rng.bits(3);
+	} else if (kind == 2) {
+		// Random byte
+		input[rng.below(input.size())] = rng.bits(8);
+	} else if (kind == 3) {
+		// Delete a range of commands
+		int pos = rng.below(num_cmds);
+		int n = 1 + rng.below(std::min(num_cmds - pos, 16));
+		input.erase(input.begin() + pos*FUZZ_CMD_BYTES, input.begin() + (pos + n)*FUZZ_CMD_BYTES);
+	} else if (kind == 4) {
+		// Duplicate a range of commands
+		int pos = rng.below(num_cmds);
+		int n = 1 + rng.below(std::min(num_cmds - pos, 16));
+		FuzzInput range(input.begin() + pos*FUZZ_CMD_BYTES, input.begin() + (pos + n)*FUZZ_CMD_BYTES);
+		input.insert(input.begin() + rng.below(num_cmds + 1)*FUZZ_CMD_BYTES, range.begin(), range.end());
+	} else if (kind == 5) {
+		// Point a command at a register address
+		int pos = rng.below(num_cmds)*FUZZ_CMD_BYTES;
+		input[pos + 1] = rng.bits(6);
+		input[pos + 2] = 0;
+	} else {
+		// Splice with another corpus entry
+		int other_cmds = other.size() / FUZZ_CMD_BYTES;
+		if (other_cmds == 0) return;
+		int pos = rng.below(num_cmds);
+		int other_pos = rng.below(other_cmds);
+		input.resize(pos*FUZZ_CMD_BYTES);
+		input.insert(input.end(), other.begin() + other_pos*FUZZ_CMD_BYTES, other.end());
+	}
+	if ((int)input.size() > max_input_len) input.resize(max_input_len);
+}
+
+void fuzz_worker(int index, int seed) {
+	CompareRng rng;
+	rng.seed((uint64_t)seed << 16 | index);
+	FuzzExec exec;
+	while (!stop_fuzzing) {
+		FuzzInput input, other;
+		{
+			std::lock_guard<std::mutex> lock(fuzz_mutex);
+			input = corpus[rng.below(corpus.size())];
+			other = corpus[rng.below(corpus.size())];
+		}
+		for (int n = 1 + rng.bits(2); n > 0; n--) mutate(input, rng, other);
+
+		fuzz_execute(input, exec);
+		uint64_t execs = ++num_execs;
+		if (max_runs != 0 && execs >= max_runs) stop_fuzzing = true;
+
+		if (exec.result != FUZZ_OK) {
+			report_crash(input, exec.result);
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(fuzz_mutex);
+		if (new_features(exec, true) == 0) continue;
+		corpus.push_back(input);
+		if (corpus_dir != NULL) save_file(std::string(corpus_dir) + "/" + hash_name(input), input);
+	}
+}
+
+// Load the initial corpus, or make a minimal one
+bool load_corpus() {
+	if (corpus_dir != NULL) {
+		DIR *dir = opendir(corpus_dir);
+		if (dir == NULL) {
+			printf("Failed to open corpus directory: %s\n", corpus_dir);
+			return false;
+		}
+		while (struct dirent *entry = readdir(dir)) {
+			if (entry->d_name[0] == '.') continue;
+			FuzzInput input;
+			if (load_file((std::string(corpus_dir) + "/" + entry->d_name).c_str(), input)) corpus.push_back(input);
+		}
+		closedir(dir);
+	}
+	if (corpus.empty()) {
+		// A write and a read back of each register of channel 0
+		FuzzInput input;
+		for (int addr = 0; addr < 8; addr++) {
+			uint8_t bytes[] = {CMD_SET_ADDR, (uint8_t)addr, 0, CMD_SET_DATA, 0x55, 0x15, CMD_WRITE, 0, 0, CMD_SET_ADDR, (uint8_t)addr, 0, CMD_READ, 0, 0};
+			input.insert(input.end(), bytes, bytes + sizeof(bytes));
+		}
+		corpus.push_back(input);
+	}
+
+	FuzzExec exec;
+	for (const FuzzInput &input : corpus) {
+		fuzz_execute(input, exec);
+		if (exec.result != FUZZ_OK) report_crash(input, exec.result);
+		new_features(exec, true);
+	}
+	return true;
+}
+
+void print_status(double seconds) {
+	std::lock_guard<std::mutex> lock(fuzz_mutex);
+	uint64_t execs = num_execs;
+	printf("%6.0f s: %llu execs (%.0f/s), %d corpus entries, %d features, crashes:", seconds,
+		(unsigned long long)execs, execs / std::max(seconds, 1e-3), (int)corpus.size(), num_seen_features);
+	for (int i = 1; i < NUM_FUZZ_RESULTS; i++) printf(" %s %d", fuzz_result_names[i], crash_counts[i]);
+	printf("\n");
+	fflush(stdout);
+}
+
+int run_inputs(const std::vector<const char *> &fnames) {
+	int result = 0;
+	for (const char *fname : fnames) {
+		FuzzInput input;
+		if (!load_file(fname, input)) return 2;
+		FuzzExec exec;
+		fuzz_execute(input, exec);
+		printf("%s: %s", fname, fuzz_result_names[exec.result]);
+		if (exec.result == FUZZ_OK) {
+			printf(", %d coverage features\n", (int)exec.features.size());
+			continue;
+		}
+		printf(" at cycle %llu\nCycles (cmd wdata  uo_out data_out data_ready):\n", (unsigned long long)exec.cycle);
+		fuzz_execute(input, exec, stdout);
+		result = 1;
+	}
+	return result;
+}
+
+
+int main(int argc, char** argv) {
+	int num_threads = default_num_threads();
+	int seed = 1;
+	double max_seconds = 0;
+	std::vector<const char *> run_fnames;
+	bool run = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-time") && i + 1 < argc) max_seconds = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-runs") && i + 1 < argc) max_runs = strtoull(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-seed") && i + 1 < argc) seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-max_len") && i + 1 < argc) max_input_len = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-corpus") && i + 1 < argc) corpus_dir = argv[++i];
+		else if (!strcmp(argv[i], "-crashes") && i + 1 < argc) crashes_dir = argv[++i];
+		else if (!strcmp(argv[i], "-nox")) check_x = false;
+		else if (!strcmp(argv[i], "-illegal")) allow_illegal = true;
+		else if (!strcmp(argv[i], "-run")) run = true;
+		else if (run) run_fnames.push_back(argv[i]);
+		else if (argv[i][0] != '+') { // leave +verilator+ arguments to Verilated
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 2;
+		}
+	}
+	if (num_threads < 1 || max_input_len < FUZZ_CMD_BYTES) {
+		printf("The number of threads should be at least 1, and the maximum input length at least %d\n", FUZZ_CMD_BYTES);
+		return 2;
+	}
+
+	if (run) return run_inputs(run_fnames);
+
+	seen_features.resize(FuzzSim::num_coverage() * NUM_BUCKETS);
+	if (!load_corpus()) return 2;
+	printf("%d coverage points, %d corpus entries, %d features\n", FuzzSim::num_coverage(), (int)corpus.size(), num_seen_features);
+
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+	std::thread monitor([&]() {
+		double next_report = 10;
+		while (!stop_fuzzing) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			double seconds = elapsed();
+			if (max_seconds > 0 && seconds >= max_seconds) stop_fuzzing = true;
+			if (seconds >= next_report) {
+				print_status(seconds);
+				next_report += 10;
+			}
+		}
+	});
+	parallel_for(num_threads, num_threads, [&](int i) { fuzz_worker(i, seed); });
+	stop_fuzzing = true;
+	monitor.join();
+	print_status(elapsed());
+
+	int num_crashes = 0;
+	for (int i = 1; i < NUM_FUZZ_RESULTS; i++) num_crashes += crash_counts[i];
+	return num_crashes > 0 ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Lockstep check of two Verilated variants of compare_top in the same process.
+//
+// Both variants get the same cmd_in/wdata_in each cycle, and their outputs are compared every cycle,
+// so there is no need to write and diff traces. The run stops at the first cycle where the outputs differ,
+// and the last cycles of both variants are printed. See the Makefile for how the variants are built.
+//
+// Usage: lockstep [-cycles n] [-seed n] [-warmup n] [-context n] [-xrand] [mix options]
+//     -cycles <n>     number of cycles to run after reset (default: 2^20)
+//     -seed <n>       seed for the random command stream (default: 1, same stream as Vcompare_top)
+//     -warmup <n>     don't compare the first cycles, while the PWM counter is set up (default: 66)
+//     -context <n>    number of cycles to print up to the first difference (default: 16)
+//     -xrand          randomize the initial values of variant b, to check that the outputs don't depend on them
+//     mix options     -read/-write/-idle/-burst <weight>, -burst_len <n>, see compare_stim.h
+// Exit code: 0 if the variants agree, 1 if they differ, 2 on errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "Vcompare_a.h"
+#include "Vcompare_b.h"
+#include "verilated.h"
+
+#include "compare_trace.h"
+#include "compare_stim.h"
+
+const int default_lockstep_cycles = 1 << 20;
+const int max_lockstep_cycles = 1 << 30;
+const int max_context = 1024;
+
+
+VerilatedContext *contexts[2];
+Vcompare_a *top_a;
+Vcompare_b *top_b;
+
+int warmup_cycles = 66;
+int context_cycles = 16;
+
+// The last max_context cycles of each variant
+CompareTraceRecord history[2][max_context];
+uint64_t t = 0;
+bool diverged = false;
+
+
+template<class T> void timestep(T *top) {
+	top->clk = 1;
+	top->eval();
+	top->clk = 0;
+	top->eval();
+}
+
+template<class T> void set_inputs(T *top, int cmd, int wdata) {
+	top->cmd_in = cmd;
+	top->wdata_in = wdata;
+}
+
+template<class T> CompareTraceRecord get_record(T *top, int cmd, int wdata) {
+	return compare_trace_record(cmd, wdata, top->uo_out, top->data_out, top->data_ready);
+}
+
+void print_divergence() {
+	const CompareTraceRecord &a = history[0][t % max_context];
+	const CompareTraceRecord &b = history[1][t % max_context];
+	printf("\nVariants differ at cycle %llu in:", (unsigned long long)t);
+	if (a.uo_out != b.uo_out) printf(" uo_out");
+	if (a.data_out != b.data_out) printf(" data_out");
+	if (a.data_ready() != b.data_ready()) printf(" data_ready");
+	printf("\n");
+
+	uint64_t first = t > (uint64_t)context_cycles ? t - context_cycles : 0;
+	for (int i = 0; i < 2; i++) {
+		printf("\nVariant %c, cycles %llu - %llu (cmd wdata  uo_out data_out data_ready):\n", 'a' + i, (unsigned long long)first, (unsigned long long)t);
+		for (uint64_t c = first; c <= t; c++) print_trace_record(stdout, history[i][c % max_context], "    ");
+	}
+}
+
+// Run one cycle on both variants and compare the outputs. Returns false at the first difference.
+bool lockstep_timestep(int cmd, int wdata) {
+	set_inputs(top_a, cmd, wdata);
+	set_inputs(top_b, cmd, wdata);
+	timestep(top_a);
+	timestep(top_b);
+
+	CompareTraceRecord &a = history[0][t % max_context];
+	CompareTraceRecord &b = history[1][t % max_context];
+	a = get_record(top_a, cmd, wdata);
+	b = get_record(top_b, cmd, wdata);
+	if (t >= (uint64_t)warmup_cycles && !a.same(b)) {
+		print_divergence();
+		diverged = true;
+		return false;
+	}
+	t++;
+	return true;
+}
+
+// Bus interface for CompareStream
+struct LockstepBus {
+	bool step(int cmd, int wdata) { return lockstep_timestep(cmd, wdata); }
+	bool data_ready() { return top_a->data_ready; }
+};
+
+// Same command stream as Vcompare_top for the same seed and mix
+void run_lockstep(uint64_t cycles, int seed, const CompareMix &mix) {
+	set_inputs(top_a, 0, 0);
+	set_inputs(top_b, 0, 0);
+
+	top_a->rst_n = top_b->rst_n = 0;
+	for (int i = 0; i < 9; i++) {
+		timestep(top_a);
+		timestep(top_b);
+	}
+	top_a->rst_n = top_b->rst_n = 1;
+
+	LockstepBus bus;
+	CompareStream<LockstepBus> stream(bus, mix, seed);
+	stream.run(cycles);
+}
+
+
+int main(int argc, char** argv) {
+	uint64_t cycles = default_lockstep_cycles;
+	int seed = 1;
+	bool xrand = false;
+	CompareMix mix = default_compare_mix;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-cycles") && i + 1 < argc) cycles = strtoull(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-seed") && i + 1 < argc) seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-warmup") && i + 1 < argc) warmup_cycles = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-context") && i + 1 < argc) context_cycles = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-xrand")) xrand = true;
+		else if (parse_compare_mix_arg(argc, argv, i, mix)) {}
+		else if (argv[i][0] != '+') { // leave +verilator+ arguments to Verilated
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 2;
+		}
+	}
+	if (cycles < 1 || cycles > (uint64_t)max_lockstep_cycles) {
+		printf("The number of cycles should be between 1 and %d\n", max_lockstep_cycles);
+		return 2;
+	}
+	if (context_cycles < 0 || context_cycles >= max_context) {
+		printf("The number of context cycles should be between 0 and %d\n", max_context - 1);
+		return 2;
+	}
+	if (!check_compare_mix(mix)) return 2;
+
+	// Separate contexts, so that the variants can be initialized differently
+	for (int i = 0; i < 2; i++) {
+		contexts[i] = new VerilatedContext;
+		contexts[i]->commandArgs(argc, argv);
+	}
+	if (xrand) {
+		contexts[1]->randReset(2);
+		contexts[1]->randSeed(seed);
+	}
+	top_a = new Vcompare_a(contexts[0]);
+	top_b = new Vcompare_b(contexts[1]);
+
+	run_lockstep(cycles, seed, mix);
+	if (!diverged) printf("Variants agree for %llu cycles (seed = %d)\n", (unsigned long long)t, seed);
+
+	// Cleanup
+	delete top_a;
+	delete top_b;
+	for (int i = 0; i < 2; i++) delete contexts[i];
+	return diverged ? 1 : 0;
+}
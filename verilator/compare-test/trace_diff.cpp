@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Compare two binary compare traces and report the first cycle where they differ, or print a trace as text.
+//
+// Usage: trace_diff [options] a.bin b.bin
+//        trace_diff -text a.bin
+//     -skip <cycles>    don't compare the first cycles, e.g. before the PWM counter has been set up
+//     -context <n>      number of cycles to print around the first difference (default: 8)
+//     -text             print the trace in the text format of compare_data.txt
+// Exit code: 0 if the traces match, 1 if they differ, 2 on errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "compare_trace.h"
+
+void print_header(const char *fname, const CompareTrace &trace) {
+	printf("%s: seed = %llu, %llu cycles in %llu records\n", fname, (unsigned long long)trace.header->seed,
+		(unsigned long long)trace.header->num_cycles, (unsigned long long)trace.header->num_records);
+}
+
+int main(int argc, char** argv) {
+	const char *fnames[2] = {NULL, NULL};
+	int num_fnames = 0;
+	uint64_t skip = 0;
+	int context = 8;
+	bool text = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-skip") && i + 1 < argc) skip = strtoull(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-context") && i + 1 < argc) context = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-text")) text = true;
+		else if (num_fnames < 2) fnames[num_fnames++] = argv[i];
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 2;
+		}
+	}
+	if (num_fnames != (text ? 1 : 2)) {
+		printf("Usage: trace_diff [-skip cycles] [-context n] a.bin b.bin\n       trace_diff -text a.bin\n");
+		return 2;
+	}
+
+	CompareTrace traces[2];
+	for (int i = 0; i < num_fnames; i++) {
+		if (!traces[i].open(fnames[i])) return 2;
+	}
+
+	if (text) {
+		print_trace_cycles(stdout, traces[0], 0, traces[0].header->num_cycles);
+		return 0;
+	}
+
+	for (int i = 0; i < 2; i++) print_header(fnames[i], traces[i]);
+
+	int64_t diff = compare_traces_first_diff(traces[0], traces[1], skip);
+	if (diff < 0) {
+		printf("Traces match\n");
+		return 0;
+	}
+
+	printf("\nFirst difference at cycle %lld\n", (long long)diff);
+	uint64_t first = diff > context ? diff - context : 0;
+	for (int i = 0; i < 2; i++) {
+		printf("\n%s, cycles %llu - %llu (cmd wdata  uo_out data_out data_ready):\n", fnames[i], (unsigned long long)first, (unsigned long long)(diff + context));
+		print_trace_cycles(stdout, traces[i], first, diff + context, "    ");
+	}
+	return 1;
+}
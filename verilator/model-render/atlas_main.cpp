@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Waveform atlas over the slope0/slope1/PWM offset/mode space, and nearest shape lookup in it. See pwls_atlas.h.
+//
+// build renders the cycles of all grid points that aren't in the cache yet, spread over all cores, adds them to the
+// cache, and writes the shape index for the grid. lookup finds the grid points whose cycle looks the most like
+// a query cycle, regardless of its phase and level. The query is a file with one cycle: 16 bit raw audio (.raw) or
+// numbers separated by whitespace or commas, in any scale and at any length, or the cycle of a point with -like.
+//
+// Usage: atlas [options] build
+//        atlas [options] lookup query.txt|query.raw
+//        atlas [options] lookup -like slope0 slope1 pwm_offset mode
+//        atlas [options] cycle slope0 slope1 pwm_offset mode    print the cycle of a point, in the query format
+//     -o <prefix>          atlas files: <prefix>.cycles (cache) and <prefix>.idx (index) (default: atlas)
+//     -slope0 <list>       slope0 values: comma separated values or first:last:step ranges (default: 0:255:8)
+//     -slope1 <list>       slope1 values (default: 0:255:8)
+//     -pwm <list>          PWM offset values (default: 0:255:16)
+//     -modes <list>        comma separated mode register values, or linear, orion, 4bit (default: linear,orion,4bit)
+//     -resolution <n>      cached samples per cycle (default: 256)
+//     -force               render all grid points, and start the cache over
+//     -n <matches>         number of matches to list (default: 10)
+//     -j <threads>         number of threads (default: number of cores)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <chrono>
+
+#include "../model/pwls_atlas.h"
+#include "../model/pwls_parallel.h"
+
+const char* atlas_prefix = "atlas";
+const int default_resolution = 256;
+const int default_num_matches = 10;
+
+struct WaveMode {
+	const char *name;
+	int mode;
+};
+
+const WaveMode wave_modes[] = {
+	{"linear", 0},
+	{"orion", MODE_FLAGS_ORION},
+	{"4bit", MODE_FLAG_OSC_SYNC_SOFT}, // MODE_FLAG_OSC_SYNC_SOFT without MODE_FLAG_OSC_SYNC_EN selects 4 bit mode
+};
+const int NUM_WAVE_MODES = sizeof(wave_modes) / sizeof(wave_modes[0]);
+
+
+// Parse a comma separated list of values (any base strtol accepts) and first:last:step ranges, within 0 to max_value.
+// With modes, wave mode names are accepted too.
+bool parse_list(const char *s, std::vector<int> &values, int max_value, bool modes=false) {
+	values.clear();
+	while (*s) {
+		size_t len = strcspn(s, ",");
+		int name_index = -1;
+		for (int i = 0; modes && i < NUM_WAVE_MODES; i++) {
+			if (strlen(wave_modes[i].name) == len && !strncmp(s, wave_modes[i].name, len)) name_index = i;
+		}
+		if (name_index >= 0) {
+			values.push_back(wave_modes[name_index].mode);
+			s += len;
+		} else {
+			char *end;
+			int first = strtol(s, &end, 0), last = first, step = 1;
+			if (end == s) return false;
+			if (*end == ':') {
+				const char *p = end + 1;
+				last = strtol(p, &end, 0);
+				if (end == p) return false;
+				if (*end == ':') {
+					p = end + 1;
+					step = strtol(p, &end, 0);
+					if (end == p || step < 1) return false;
+				}
+			}
+			if (first < 0 || last > max_value || first > last) return false;
+			for (int value = first; value <= last; value += step) values.push_back(value);
+			s = end;
+		}
+		if (*s == ',') s++;
+		else if (*s) return false;
+	}
+	return !values.empty();
+}
+
+bool parse_point(char **args, AtlasPoint &p) {
+	int values[4];
+	for (int i = 0; i < 4; i++) {
+		char *end;
+		values[i] = strtol(args[i], &end, 0);
+		if (end == args[i] || *end != 0 || values[i] < 0) return false;
+	}
+	if (values[0] > 255 || values[1] > 255 || values[2] > 255 || values[3] >= (1 << reg_data_bits[REG_MODE])) return false;
+	p = {(uint16_t)values[0], (uint16_t)values[1], (uint16_t)values[2], (uint16_t)values[3]};
+	return true;
+}
+
+bool load_query(const char *fname, std::vector<float> &cycle) {
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) {
+		printf("Failed to open query file: %s\n", fname);
+		return false;
+	}
+	size_t len = strlen(fname);
+	if (len >= 4 && !strcmp(fname + len - 4, ".raw")) {
+		int16_t x;
+		while (fread(&x, sizeof(x), 1, fp) == 1) cycle.push_back(x);
+	} else {
+		int c;
+		float x;
+		while ((c = fscanf(fp, " %f ,", &x)) == 1) cycle.push_back(x);
+		if (c != EOF) {
+			printf("%s: expected numbers\n", fname);
+			cycle.clear();
+		}
+	}
+	fclose(fp);
+	if (cycle.empty()) printf("%s: no samples\n", fname);
+	return !cycle.empty();
+}
+
+void print_point(const AtlasPoint &p) {
+	printf("0x%02x    0x%02x    %3d         0x%03x", p.slope0, p.slope1, p.pwm_offset, p.mode);
+}
+
+int build(const std::vector<AtlasPoint> &grid, int resolution, bool force, int num_threads, uint64_t fingerprint) {
+	std::string cache_fname = std::string(atlas_prefix) + ".cycles";
+	std::string index_fname = std::string(atlas_prefix) + ".idx";
+	AtlasCache cache(resolution, fingerprint);
+	if (!force && !cache.load(cache_fname.c_str())) return 1; // -force starts from an empty cache
+
+	std::unordered_map<uint64_t, int> cached;
+	for (int i = 0; i < (int)cache.points.size(); i++) cached[cache.points[i].key()] = i;
+	std::vector<int> grid_index(grid.size());
+	std::vector<AtlasPoint> missing;
+	for (size_t i = 0; i < grid.size(); i++) {
+		uint64_t key = grid[i].key();
+		auto it = cached.find(key);
+		if (it != cached.end()) grid_index[i] = it->second;
+		else {
+			grid_index[i] = cached[key] = cache.points.size() + missing.size();
+			missing.push_back(grid[i]);
+		}
+	}
+	printf("%d grid points, %d cached, %d to render at %d samples per cycle on %d threads\n", (int)grid.size(),
+		(int)(grid.size() - missing.size()), (int)missing.size(), resolution, num_threads);
+
+	auto t0 = std::chrono::steady_clock::now();
+	size_t first_new = cache.points.size();
+	cache.points.insert(cache.points.end(), missing.begin(), missing.end());
+	cache.cycles.resize(cache.points.size() * resolution);
+	parallel_for(missing.size(), num_threads, [&](int i) {
+		atlas_cycle(missing[i], resolution, &cache.cycles[(first_new + i) * resolution]);
+	});
+	printf("Rendered in %.3f s\n", seconds_since(t0));
+	if (!missing.empty() && !cache.save(cache_fname.c_str())) return 1;
+
+	std::vector<AtlasShape> shapes(grid.size());
+	for (size_t i = 0; i < grid.size(); i++) {
+		AtlasShape &s = shapes[i];
+		s.point = grid[i];
+		s.rms = atlas_shape(cache.cycle(grid_index[i]), resolution, ATLAS_FULL_SCALE, s.shape);
+	}
+	if (!save_atlas_index(index_fname.c_str(), shapes, fingerprint)) return 1;
+	printf("Wrote %s (%d cycles) and %s (%d points)\n", cache_fname.c_str(), (int)cache.points.size(), index_fname.c_str(), (int)shapes.size());
+	return 0;
+}
+
+int lookup(const std::vector<float> &query, int num_matches, uint64_t fingerprint) {
+	std::string index_fname = std::string(atlas_prefix) + ".idx";
+	std::vector<AtlasShape> shapes;
+	uint64_t index_fingerprint;
+	if (!load_atlas_index(index_fname.c_str(), shapes, &index_fingerprint)) return 1;
+	if (index_fingerprint != fingerprint) printf("WARNING: %s was built with a different model, rebuild it\n", index_fname.c_str());
+
+	int8_t shape[ATLAS_SHAPE_POINTS];
+	atlas_shape(query.data(), query.size(), 1, shape);
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<AtlasMatch> matches = atlas_lookup(shapes, shape, num_matches);
+	double seconds = seconds_since(t0);
+
+	printf("rank  corr    shift  slope0  slope1  pwm_offset  mode   level dB\n");
+	for (int i = 0; i < (int)matches.size(); i++) {
+		const AtlasMatch &m = matches[i];
+		const AtlasShape &s = shapes[m.index];
+		printf("%4d  %.4f  %5.3f  ", i + 1, m.correlation(), (double)m.shift / ATLAS_SHAPE_POINTS);
+		print_point(s.point);
+		printf("  %8.1f\n", 20*log10(std::max(s.rms, 1e-10f)));
+	}
+	printf("Searched %d points in %.3f s. shift: query phase (in cycles) that lines up with the start of the match\n", (int)shapes.size(), seconds);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	std::vector<int> slope0s, slope1s, pwm_offsets, modes;
+	parse_list("0:255:8", slope0s, 255);
+	parse_list("0:255:8", slope1s, 255);
+	parse_list("0:255:16", pwm_offsets, 255);
+	parse_list("linear,orion,4bit", modes, 0, true);
+	int resolution = default_resolution, num_matches = default_num_matches;
+	int num_threads = default_num_threads();
+	bool force = false, have_point = false;
+	AtlasPoint point;
+	const char *command = NULL, *query_fname = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		bool ok = true;
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) atlas_prefix = argv[++i];
+		else if (!strcmp(argv[i], "-slope0") && i + 1 < argc) ok = parse_list(argv[++i], slope0s, 255);
+		else if (!strcmp(argv[i], "-slope1") && i + 1 < argc) ok = parse_list(argv[++i], slope1s, 255);
+		else if (!strcmp(argv[i], "-pwm") && i + 1 < argc) ok = parse_list(argv[++i], pwm_offsets, 255);
+		else if (!strcmp(argv[i], "-modes") && i + 1 < argc) ok = parse_list(argv[++i], modes, (1 << reg_data_bits[REG_MODE]) - 1, true);
+		else if (!strcmp(argv[i], "-resolution") && i + 1 < argc) resolution = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-force")) force = true;
+		else if (!strcmp(argv[i], "-n") && i + 1 < argc) num_matches = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-like") && i + 4 < argc && !have_point) {
+			ok = have_point = parse_point(argv + i + 1, point);
+			i += 4;
+		}
+		else if (command == NULL) command = argv[i];
+		else if (!strcmp(command, "cycle") && i + 3 < argc && !have_point) {
+			ok = have_point = parse_point(argv + i, point);
+			i += 3;
+		}
+		else if (query_fname == NULL) query_fname = argv[i];
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+		if (!ok) {
+			printf("Bad value: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	bool build_cmd = command != NULL && !strcmp(command, "build");
+	bool lookup_cmd = command != NULL && !strcmp(command, "lookup");
+	bool cycle_cmd = command != NULL && !strcmp(command, "cycle");
+	if (!((build_cmd && !have_point && query_fname == NULL) || (lookup_cmd && have_point != (query_fname != NULL)) || (cycle_cmd && have_point)) ||
+			resolution < ATLAS_SHAPE_POINTS || resolution > ATLAS_CYCLE_LENGTH || num_matches < 1 || num_threads < 1) {
+		printf("Usage: atlas [-o prefix] [-slope0 list] [-slope1 list] [-pwm list] [-modes list] [-resolution n] [-force] [-j threads] build\n");
+		printf("       atlas [-o prefix] [-n matches] lookup query.txt|query.raw\n");
+		printf("       atlas [-o prefix] [-n matches] lookup -like slope0 slope1 pwm_offset mode\n");
+		printf("       atlas [-resolution n] cycle slope0 slope1 pwm_offset mode\n");
+		return 1;
+	}
+	for (int mode : modes) {
+		if (!atlas_mode_ok(mode)) {
+			printf("Mode 0x%03x has no fixed cycle: noise, detune, PWL oscillator or oscillator sync\n", mode);
+			return 1;
+		}
+	}
+	if (have_point && !atlas_mode_ok(point.mode)) {
+		printf("Mode 0x%03x has no fixed cycle: noise, detune, PWL oscillator or oscillator sync\n", point.mode);
+		return 1;
+	}
+
+	if (cycle_cmd) {
+		std::vector<int16_t> cycle(resolution);
+		atlas_cycle(point, resolution, cycle.data());
+		for (int x : cycle) printf("%d\n", x);
+		return 0;
+	}
+
+	uint64_t fingerprint = atlas_fingerprint();
+	if (build_cmd) {
+		std::vector<AtlasPoint> grid;
+		for (int mode : modes) for (int s0 : slope0s) for (int s1 : slope1s) for (int pwm : pwm_offsets) {
+			grid.push_back({(uint16_t)s0, (uint16_t)s1, (uint16_t)pwm, (uint16_t)mode});
+		}
+		return build(grid, resolution, force, num_threads, fingerprint);
+	}
+
+	std::vector<float> query;
+	if (have_point) {
+		std::vector<int> cycle(ATLAS_CYCLE_LENGTH);
+		atlas_full_cycle(point, cycle.data());
+		query.assign(cycle.begin(), cycle.end());
+	} else if (!load_query(query_fname, query)) return 1;
+	return lookup(query, num_matches, fingerprint);
+}
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Compare two 16 bit renders (raw as written by render, or PCM WAV) and write the differences as JSON for regression scripts.
+// The files are memory mapped and compared in a single pass over fixed size blocks, spread over all cores.
+// The per block kernel uses SSE2 where available (all x86-64), with a scalar fallback.
+//
+// Reports sample exact equality, the first differing sample, max abs error, RMS error, SNR, and per block correlation.
+// With -spectral, also the log spectral distance between the files over sliding Hann windows.
+//
+// Usage: audiodiff [options] a.raw b.raw
+//     -o <file>            output JSON file (default: stdout)
+//     -channels <n>        channels in raw files (default: 1). WAV files specify their own.
+//     -rate <hz>           sample rate of raw files, to report times (default: 62500)
+//     -block <frames>      frames per correlation block (default: 4096)
+//     -threshold <corr>    count blocks with correlation below this (default: 0.999)
+//     -blocks              list the correlation of every block in the output
+//     -spectral <frames>   compute the spectral difference over windows of this size, a power of two
+//     -hop <frames>        frames between spectral windows (default: half a window)
+//     -j <threads>         number of threads (default: number of cores)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../model/pwls_render.h"
+#include "../model/pwls_parallel.h"
+#include "../model/pwls_fft.h"
+
+const int default_block_frames = 4096;
+const double default_sample_rate = FRAME_RATE; // the render output
+const double default_corr_threshold = 0.999;
+
+// Power floor for the spectral difference, relative to a full scale sine. Keeps silent bins from dominating.
+const double SPECTRAL_FLOOR = 1e-12; // -120 dB
+
+
+struct AudioFile {
+	const char *fname;
+	void *data;
+	size_t size;
+	const int16_t *samples;
+	uint64_t num_samples;
+	int channels;
+	double sample_rate;
+	bool wav;
+
+	AudioFile() : fname(NULL), data(NULL), size(0), samples(NULL), num_samples(0), channels(1), sample_rate(default_sample_rate), wav(false) {}
+	~AudioFile() { if (data != NULL) munmap(data, size); }
+
+	uint64_t num_frames() const { return num_samples / channels; }
+
+	// Find the fmt and data chunks of a RIFF/WAVE file. Only 16 bit PCM is supported.
+	bool parse_wav() {
+		const uint8_t *p = (const uint8_t *)data;
+		size_t pos = 12;
+		bool have_fmt = false;
+		while (pos + 8 <= size) {
+			uint32_t chunk_size;
+			memcpy(&chunk_size, p + pos + 4, 4);
+			const uint8_t *chunk = p + pos + 8;
+			if (!memcmp(p + pos, "fmt ", 4) && chunk_size >= 16 && pos + 8 + 16 <= size) {
+				uint16_t format, num_channels, bits;
+				uint32_t rate;
+				memcpy(&format, chunk, 2);
+				memcpy(&num_channels, chunk + 2, 2);
+				memcpy(&rate, chunk + 4, 4);
+				memcpy(&bits, chunk + 14, 2);
+				if ((format != 1 && format != 0xfffe) || bits != 16 || num_channels == 0) {
+					printf("%s: only 16 bit PCM WAV files are supported\n", fname);
+					return false;
+				}
+				channels = num_channels;
+				sample_rate = rate;
+				have_fmt = true;
+			} else if (!memcmp(p + pos, "data", 4)) {
+				if (!have_fmt) break;
+				// Streamed WAV files can have a placeholder size, so don't trust it past the end of the file
+				uint64_t bytes = std::min<uint64_t>(chunk_size, size - (pos + 8));
+				if ((pos + 8) & 1) {
+					printf("%s: misaligned data chunk\n", fname);
+					return false;
+				}
+				samples = (const int16_t *)chunk;
+				num_samples = bytes / sizeof(int16_t);
+				num_samples -= num_samples % channels;
+				return true;
+			}
+			pos += 8 + chunk_size + (chunk_size & 1);
+		}
+		printf("%s: no fmt chunk followed by a data chunk\n", fname);
+		return false;
+	}
+
+	bool open(const char *fname, int raw_channels, double raw_sample_rate) {
+		this->fname = fname;
+		int fd = ::open(fname, O_RDONLY);
+		if (fd < 0) {
+			printf("Failed to open audio file: %s\n", fname);
+			return false;
+		}
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0;
+		if (ok && st.st_size > 0) {
+			size = st.st_size;
+			data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) { data = NULL; ok = false; }
+		}
+		::close(fd);
+		if (!ok) {
+			printf("Failed to map audio file: %s\n", fname);
+			return false;
+		}
+		if (data == NULL) return true; // empty file
+		madvise(data, size, MADV_SEQUENTIAL);
+
+		wav = size >= 12 && !memcmp(data, "RIFF", 4) && !memcmp((const char *)data + 8, "WAVE", 4);
+		if (wav) return parse_wav();
+		channels = raw_channels;
+		sample_rate = raw_sample_rate;
+		samples = (const int16_t *)data;
+		num_samples = size / sizeof(int16_t);
+		num_samples -= num_samples % channels;
+		return true;
+	}
+};
+
+
+// Sums over one block of samples. The squared error is summed as aa - 2ab + bb, which is exact in 64 bits.
+struct BlockSums {
+	int64_t sum_a, sum_b, sum_aa, sum_bb, sum_ab, sum_dd;
+	int32_t max_abs;
+	int32_t num_diff;
+
+	void compute(const int16_t *a, const int16_t *b, int n) {
+		int64_t sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+		int32_t m = 0, num_equal = 0;
+		int i = 0;
+#ifdef __SSE2__
+		// madd gives pairwise sums of products: x0*x0 + x1*x1 <= 2^31 fits as unsigned 32 bit,
+		// and x0*y0 + x1*y1 is in [2^16 - 2^31, 2^31], so it fits as unsigned after adding AB_OFFSET.
+		const uint32_t AB_OFFSET = 0x7fff0000;
+		const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1), sign = _mm_set1_epi16(-0x8000);
+		const __m128i ab_offset = _mm_set1_epi32(AB_OFFSET);
+		__m128i vaa = zero, vbb = zero, vab = zero, vmax = sign;
+		int num_vectors = n / 8;
+		// The 32 and 16 bit lane accumulators are flushed often enough that they can't overflow
+		for (int v0 = 0; v0 < num_vectors; v0 += 2048) {
+			int v1 = std::min(num_vectors, v0 + 2048);
+			__m128i va = zero, vb = zero, veq = zero;
+			for (int v = v0; v < v1; v++) {
+				__m128i x = _mm_loadu_si128((const __m128i *)(a + 8*v));
+				__m128i y = _mm_loadu_si128((const __m128i *)(b + 8*v));
+				va = _mm_add_epi32(va, _mm_madd_epi16(x, ones));
+				vb = _mm_add_epi32(vb, _mm_madd_epi16(y, ones));
+				__m128i xx = _mm_madd_epi16(x, x), yy = _mm_madd_epi16(y, y);
+				__m128i xy = _mm_add_epi32(_mm_madd_epi16(x, y), ab_offset);
+				vaa = _mm_add_epi64(vaa, _mm_add_epi64(_mm_unpacklo_epi32(xx, zero), _mm_unpackhi_epi32(xx, zero)));
+				vbb = _mm_add_epi64(vbb, _mm_add_epi64(_mm_unpacklo_epi32(yy, zero), _mm_unpackhi_epi32(yy, zero)));
+				vab = _mm_add_epi64(vab, _mm_add_epi64(_mm_unpacklo_epi32(xy, zero), _mm_unpackhi_epi32(xy, zero)));
+				// |x - y| as unsigned 16 bit, biased so that it can be compared as signed
+				__m128i ad = _mm_sub_epi16(_mm_max_epi16(x, y), _mm_min_epi16(x, y));
+				vmax = _mm_max_epi16(vmax, _mm_xor_si128(ad, sign));
+				veq = _mm_sub_epi16(veq, _mm_cmpeq_epi16(x, y));
+			}
+			int32_t lanes[3][4];
+			_mm_storeu_si128((__m128i *)lanes[0], va);
+			_mm_storeu_si128((__m128i *)lanes[1], vb);
+			_mm_storeu_si128((__m128i *)lanes[2], _mm_madd_epi16(veq, ones));
+			for (int j = 0; j < 4; j++) {
+				sa += lanes[0][j];
+				sb += lanes[1][j];
+				num_equal += lanes[2][j];
+			}
+		}
+		int64_t sums[3][2];
+		_mm_storeu_si128((__m128i *)sums[0], vaa);
+		_mm_storeu_si128((__m128i *)sums[1], vbb);
+		_mm_storeu_si128((__m128i *)sums[2], vab);
+		saa = sums[0][0] + sums[0][1];
+		sbb = sums[1][0] + sums[1][1];
+		sab = sums[2][0] + sums[2][1] - (int64_t)AB_OFFSET * 4 * num_vectors;
+		uint16_t max_lanes[8];
+		_mm_storeu_si128((__m128i *)max_lanes, vmax);
+		for (int j = 0; j < 8; j++) m = std::max<int32_t>(m, max_lanes[j] ^ 0x8000);
+		i = 8 * num_vectors;
+#endif
+		for (; i < n; i++) {
+			int32_t x = a[i], y = b[i];
+			sa += x;
+			sb += y;
+			saa += x*x;
+			sbb += y*y;
+			sab += x*y;
+			m = std::max(m, abs(x - y));
+			num_equal += x == y;
+		}
+		sum_a = sa; sum_b = sb; sum_aa = saa; sum_bb = sbb; sum_ab = sab;
+		sum_dd = saa - 2*sab + sbb;
+		max_abs = m;
+		num_diff = n - num_equal;
+	}
+
+	// Pearson correlation of the block. Constant blocks correlate fully if they are equal, and not at all otherwise.
+	double correlation(int n) const {
+		double cov = sum_ab - (double)sum_a*sum_b/n;
+		double var_a = sum_aa - (double)sum_a*sum_a/n;
+		double var_b = sum_bb - (double)sum_b*sum_b/n;
+		if (var_a <= 0 || var_b <= 0) return num_diff == 0 ? 1 : 0;
+		return cov / sqrt(var_a*var_b);
+	}
+};
+
+struct DiffResult {
+	uint64_t num_diff;
+	int64_t first_diff; // sample index, -1 if none
+	int32_t max_abs;
+	uint64_t max_abs_index;
+	double sum_dd, sum_aa;
+	std::vector<double> correlations;
+	double min_corr, mean_corr;
+	uint64_t min_corr_block, blocks_below;
+
+	// Spectral difference, in dB
+	uint64_t num_windows;
+	double spectral_mean, spectral_max;
+	uint64_t spectral_max_frame;
+
+	DiffResult() : num_diff(0), first_diff(-1), max_abs(0), max_abs_index(0), sum_dd(0), sum_aa(0),
+		min_corr(1), mean_corr(1), min_corr_block(0), blocks_below(0), num_windows(0), spectral_mean(0), spectral_max(0), spectral_max_frame(0) {}
+};
+
+void compare_blocks(const AudioFile &a, const AudioFile &b, uint64_t num_frames, int block_frames, double corr_threshold, int num_threads, DiffResult &r) {
+	int channels = a.channels;
+	uint64_t num_samples = num_frames * channels;
+	uint64_t block_samples = (uint64_t)block_frames * channels;
+	uint64_t num_blocks = (num_samples + block_samples - 1) / block_samples;
+	std::vector<BlockSums> sums(num_blocks);
+
+	// Hand out groups of blocks, so that each job streams through a few MB
+	const int blocks_per_job = std::max<int>(1, (1 << 21) / block_samples);
+	int num_jobs = (num_blocks + blocks_per_job - 1) / blocks_per_job;
+	parallel_for(num_jobs, num_threads, [&](int job) {
+		uint64_t end = std::min<uint64_t>(num_blocks, (uint64_t)(job + 1)*blocks_per_job);
+		for (uint64_t i = (uint64_t)job*blocks_per_job; i < end; i++) {
+			uint64_t start = i * block_samples;
+			int n = std::min(block_samples, num_samples - start);
+			sums[i].compute(a.samples + start, b.samples + start, n);
+		}
+	});
+
+	r.correlations.resize(num_blocks);
+	double sum_corr = 0;
+	for (uint64_t i = 0; i < num_blocks; i++) {
+		const BlockSums &s = sums[i];
+		uint64_t start = i * block_samples;
+		int n = std::min(block_samples, num_samples - start);
+		if (s.num_diff != 0 && r.first_diff < 0) {
+			for (int j = 0; j < n; j++) {
+				if (a.samples[start + j] != b.samples[start + j]) { r.first_diff = start + j; break; }
+			}
+		}
+		if (s.max_abs > r.max_abs) {
+			r.max_abs = s.max_abs;
+			for (int j = 0; j < n; j++) {
+				if (abs(a.samples[start + j] - b.samples[start + j]) == s.max_abs) { r.max_abs_index = start + j; break; }
+			}
+		}
+		r.num_diff += s.num_diff;
+		r.sum_dd += s.sum_dd;
+		r.sum_aa += s.sum_aa;
+
+		double corr = s.correlation(n);
+		r.correlations[i] = corr;
+		sum_corr += corr;
+		if (i == 0 || corr < r.min_corr) {
+			r.min_corr = corr;
+			r.min_corr_block = i;
+		}
+		if (corr < corr_threshold) r.blocks_below++;
+	}
+	if (num_blocks > 0) r.mean_corr = sum_corr / num_blocks;
+}
+
+// Log spectral distance per window: RMS over the bins of the dB difference between the power spectra, averaged over channels
+void compare_spectra(const AudioFile &a, const AudioFile &b, uint64_t num_frames, int window, int hop, int num_threads, DiffResult &r) {
+	if (num_frames < (uint64_t)window) return;
+	int channels = a.channels;
+	uint64_t num_windows = (num_frames - window) / hop + 1;
+	std::vector<double> distances(num_windows);
+
+	const int windows_per_job = 64;
+	int num_jobs = (num_windows + windows_per_job - 1) / windows_per_job;
+	parallel_for(num_jobs, num_threads, [&](int job) {
+		SpectrumAnalyzer analyzer(window);
+		int num_bins = analyzer.num_bins();
+		std::vector<double> pa(num_bins), pb(num_bins);
+		uint64_t end = std::min<uint64_t>(num_windows, (uint64_t)(job + 1)*windows_per_job);
+		for (uint64_t w = (uint64_t)job*windows_per_job; w < end; w++) {
+			uint64_t start = w * hop * channels;
+			double dist = 0;
+			for (int ch = 0; ch < channels; ch++) {
+				analyzer.power(a.samples + start + ch, channels, 1.0/32768, pa.data());
+				analyzer.power(b.samples + start + ch, channels, 1.0/32768, pb.data());
+				double sum = 0;
+				for (int k = 0; k < num_bins; k++) {
+					double db = 10*log10((pa[k] + SPECTRAL_FLOOR) / (pb[k] + SPECTRAL_FLOOR));
+					sum += db*db;
+				}
+				dist += sqrt(sum / num_bins);
+			}
+			distances[w] = dist / channels;
+		}
+	});
+
+	double sum = 0;
+	for (uint64_t w = 0; w < num_windows; w++) {
+		sum += distances[w];
+		if (distances[w] > r.spectral_max) {
+			r.spectral_max = distances[w];
+			r.spectral_max_frame = w * hop;
+		}
+	}
+	r.num_windows = num_windows;
+	r.spectral_mean = sum / num_windows;
+}
+
+
+std::string json_string(const char *s) {
+	std::string out = "\"";
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') out += '\\';
+		if ((unsigned char)*s < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", *s);
+			out += buf;
+		} else out += *s;
+	}
+	return out + "\"";
+}
+
+// JSON has no infinities, so report SNR of identical files as null
+void print_db(FILE *fp, const char *name, double power_ratio) {
+	if (power_ratio > 0 && isfinite(power_ratio)) fprintf(fp, "  \"%s\": %.3f,\n", name, 10*log10(power_ratio));
+	else fprintf(fp, "  \"%s\": null,\n", name);
+}
+
+
+int main(int argc, char** argv) {
+	const char *a_fname = NULL, *b_fname = NULL, *out_fname = NULL;
+	int raw_channels = 1;
+	double raw_sample_rate = default_sample_rate;
+	int block_frames = default_block_frames;
+	double corr_threshold = default_corr_threshold;
+	bool list_blocks = false;
+	int spectral_window = 0, hop = 0;
+	int num_threads = default_num_threads();
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) out_fname = argv[++i];
+		else if (!strcmp(argv[i], "-channels") && i + 1 < argc) raw_channels = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-rate") && i + 1 < argc) raw_sample_rate = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-block") && i + 1 < argc) block_frames = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-threshold") && i + 1 < argc) corr_threshold = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-blocks")) list_blocks = true;
+		else if (!strcmp(argv[i], "-spectral") && i + 1 < argc) spectral_window = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-hop") && i + 1 < argc) hop = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (a_fname == NULL) a_fname = argv[i];
+		else if (b_fname == NULL) b_fname = argv[i];
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 2;
+		}
+	}
+	if (b_fname == NULL || raw_channels < 1 || raw_sample_rate <= 0 || block_frames < 1 || num_threads < 1) {
+		printf("Usage: audiodiff [-o out.json] [-channels n] [-rate hz] [-block frames] [-threshold corr] [-blocks] [-spectral frames] [-hop frames] [-j threads] a.raw b.raw\n");
+		return 2;
+	}
+	if (spectral_window != 0 && (!is_power_of_two(spectral_window) || spectral_window < 16)) {
+		printf("The spectral window must be a power of two, at least 16\n");
+		return 2;
+	}
+	if (hop <= 0) hop = std::max(1, spectral_window / 2);
+
+	AudioFile a, b;
+	if (!a.open(a_fname, raw_channels, raw_sample_rate) || !b.open(b_fname, raw_channels, raw_sample_rate)) return 2;
+	if (a.channels != b.channels) {
+		printf("Channel counts differ: %d in %s, %d in %s\n", a.channels, a_fname, b.channels, b_fname);
+		return 2;
+	}
+	if (a.sample_rate != b.sample_rate) printf("Warning: sample rates differ, %g Hz in %s and %g Hz in %s\n", a.sample_rate, a_fname, b.sample_rate, b_fname);
+
+	auto t0 = std::chrono::steady_clock::now();
+	uint64_t num_frames = std::min(a.num_frames(), b.num_frames());
+	DiffResult r;
+	compare_blocks(a, b, num_frames, block_frames, corr_threshold, num_threads, r);
+	if (spectral_window != 0) compare_spectra(a, b, num_frames, spectral_window, hop, num_threads, r);
+	double seconds = seconds_since(t0);
+
+	FILE *fp = stdout;
+	if (out_fname != NULL && (fp = fopen(out_fname, "w")) == NULL) {
+		printf("Failed to create output file: %s\n", out_fname);
+		return 2;
+	}
+
+	int channels = a.channels;
+	uint64_t num_samples = num_frames * channels;
+	bool same_length = a.num_frames() == b.num_frames();
+	bool identical = same_length && r.num_diff == 0;
+	// A length mismatch is a divergence at the end of the shorter file
+	int64_t first_diff = r.first_diff >= 0 ? r.first_diff : (same_length ? -1 : (int64_t)num_samples);
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"a\": %s,\n", json_string(a_fname).c_str());
+	fprintf(fp, "  \"b\": %s,\n", json_string(b_fname).c_str());
+	fprintf(fp, "  \"channels\": %d,\n", channels);
+	fprintf(fp, "  \"sample_rate\": %g,\n", a.sample_rate);
+	fprintf(fp, "  \"frames_a\": %llu,\n", (unsigned long long)a.num_frames());
+	fprintf(fp, "  \"frames_b\": %llu,\n", (unsigned long long)b.num_frames());
+	fprintf(fp, "  \"frames_compared\": %llu,\n", (unsigned long long)num_frames);
+	fprintf(fp, "  \"identical\": %s,\n", identical ? "true" : "false");
+	fprintf(fp, "  \"num_diff_samples\": %llu,\n", (unsigned long long)r.num_diff);
+	fprintf(fp, "  \"first_divergence\": %lld,\n", (long long)(first_diff < 0 ? -1 : first_diff / channels));
+	if (first_diff >= 0) fprintf(fp, "  \"first_divergence_s\": %.6f,\n", (first_diff / channels) / a.sample_rate);
+	else fprintf(fp, "  \"first_divergence_s\": null,\n");
+	fprintf(fp, "  \"max_abs_error\": %d,\n", r.max_abs);
+	fprintf(fp, "  \"max_abs_error_frame\": %llu,\n", (unsigned long long)(r.max_abs_index / channels));
+	fprintf(fp, "  \"rms_error\": %.6f,\n", num_samples > 0 ? sqrt(r.sum_dd / num_samples) : 0.0);
+	print_db(fp, "snr_db", r.sum_aa / r.sum_dd);
+	fprintf(fp, "  \"correlation\": {\n");
+	fprintf(fp, "    \"block_frames\": %d,\n", block_frames);
+	fprintf(fp, "    \"num_blocks\": %llu,\n", (unsigned long long)r.correlations.size());
+	fprintf(fp, "    \"min\": %.9f,\n", r.min_corr);
+	fprintf(fp, "    \"min_block\": %llu,\n", (unsigned long long)r.min_corr_block);
+	fprintf(fp, "    \"mean\": %.9f,\n", r.mean_corr);
+	fprintf(fp, "    \"threshold\": %g,\n", corr_threshold);
+	fprintf(fp, "    \"blocks_below\": %llu", (unsigned long long)r.blocks_below);
+	if (list_blocks) {
+		fprintf(fp, ",\n    \"blocks\": [");
+		for (size_t i = 0; i < r.correlations.size(); i++) fprintf(fp, "%s%.6f", i == 0 ? "" : ", ", r.correlations[i]);
+		fprintf(fp, "]");
+	}
+	fprintf(fp, "\n  },\n");
+	if (spectral_window != 0) {
+		fprintf(fp, "  \"spectral\": {\n");
+		fprintf(fp, "    \"window\": %d,\n", spectral_window);
+		fprintf(fp, "    \"hop\": %d,\n", hop);
+		fprintf(fp, "    \"num_windows\": %llu,\n", (unsigned long long)r.num_windows);
+		fprintf(fp, "    \"mean_db\": %.6f,\n", r.spectral_mean);
+		fprintf(fp, "    \"max_db\": %.6f,\n", r.spectral_max);
+		fprintf(fp, "    \"max_window_frame\": %llu\n", (unsigned long long)r.spectral_max_frame);
+		fprintf(fp, "  },\n");
+	}
+	fprintf(fp, "  \"seconds\": %.3f\n", seconds);
+	fprintf(fp, "}\n");
+	if (fp != stdout) fclose(fp);
+
+	// Exit codes like cmp: 0 identical, 1 different, 2 errors
+	return identical ? 0 : 1;
+}
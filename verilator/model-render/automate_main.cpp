@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Turn automation curves into a register event script for render, using the hardware sweeps where they can
+// follow the curves and sparse direct writes elsewhere. See pwls_automation.h for the curve file format.
+// Prints the resulting writes per second, compared to writing each parameter whenever its rounded target changes.
+//
+// Usage: automate [options] curves.txt num_frames
+//     -o <file>          output event script (default: automation.txt)
+//     -base <file>       event script to merge the automation into, e.g. with the mode and cfg setup
+//     -lookahead <n>     max number of frames to look ahead when choosing a sweep setting (default: 4096)
+//     -nosweeps          only use direct writes
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "../model/pwls_automation.h"
+
+const char* out_fname = "automation.txt";
+
+
+int main(int argc, char** argv) {
+	const char *curves_fname = NULL, *base_fname = NULL;
+	int num_frames = -1;
+	AutomationOptions options;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) out_fname = argv[++i];
+		else if (!strcmp(argv[i], "-base") && i + 1 < argc) base_fname = argv[++i];
+		else if (!strcmp(argv[i], "-lookahead") && i + 1 < argc) options.lookahead = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-nosweeps")) options.sweeps = false;
+		else if (curves_fname == NULL) curves_fname = argv[i];
+		else if (num_frames < 0) num_frames = atoi(argv[i]);
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (curves_fname == NULL || num_frames < 1 || options.lookahead < 1) {
+		printf("Usage: automate [-o automation.txt] [-base events.txt] [-lookahead frames] [-nosweeps] curves.txt num_frames\n");
+		return 1;
+	}
+
+	std::vector<AutomationLane> lanes;
+	if (!load_automation(curves_fname, lanes)) return 1;
+	std::vector<RegEvent> base_events;
+	if (base_fname != NULL && !load_events(base_fname, base_events)) return 1;
+
+	std::vector<RegEvent> events;
+	AutomationStats stats;
+	auto t0 = std::chrono::steady_clock::now();
+	if (!schedule_automation(lanes, base_events, num_frames, options, events, stats)) return 1;
+	printf("%d lanes scheduled in %.3f s\n", (int)lanes.size(), seconds_since(t0));
+	stats.print(stdout);
+
+	// Replay the result as render would see it, to check that it stays within tolerance
+	std::vector<RegEvent> merged = merge_events(base_events, events);
+	float max_error = automation_max_error(lanes, merged, num_frames);
+	for (const AutomationLane &lane : lanes) {
+		float lane_error = automation_max_error(std::vector<AutomationLane>(1, lane), merged, num_frames);
+		if (lane_error > lane.tolerance) {
+			printf("ERROR: channel %d reg %d is %.2f from its target, tolerance %.2f\n", lane.channel, lane.reg, lane_error, lane.tolerance);
+			return 1;
+		}
+	}
+	if (max_error != stats.max_error) {
+		printf("ERROR: replayed max error %.2f differs from the scheduled %.2f\n", max_error, stats.max_error);
+		return 1;
+	}
+
+	if (!save_events(out_fname, merged)) return 1;
+	printf("Wrote %d events to %s\n", (int)merged.size(), out_fname);
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Render a bank of synth chips from one event script and mix them to stereo, for planning multi chip polyphony.
+// See pwls_bank.h for how the events are routed to the chips.
+// Reports the render cost of each chip, and how many chips one core could run in real time.
+//
+// Usage: bank [options] events.txt num_frames
+//     -o <file>              output file, 16 bit stereo raw audio (default: bank.raw)
+//     -chips <n>             number of chips (default: enough for the highest channel in the script)
+//     -gain <dB>             master gain (default: 0)
+//     -chip <i> <dB> <pan>   gain and pan (-1 = left, 1 = right) for chip i, can be repeated
+//     -spread                pan the chips evenly from left to right
+//     -block <frames>        frames per render round (default: 4096)
+//     -j <threads>           number of threads (default: number of cores)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <stdint.h>
+#include <chrono>
+
+#include "../model/pwls_bank.h"
+
+const char* audio_fname = "bank.raw";
+const int default_block_frames = 4096;
+
+struct ChipSetting {
+	int chip;
+	float gain_db, pan;
+};
+
+
+int main(int argc, char** argv) {
+	const char *events_fname = NULL;
+	int num_frames = -1, num_chips = 0;
+	int num_threads = default_num_threads();
+	int block_frames = default_block_frames;
+	float gain_db = 0;
+	bool spread = false;
+	std::vector<ChipSetting> settings;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) audio_fname = argv[++i];
+		else if (!strcmp(argv[i], "-chips") && i + 1 < argc) num_chips = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-gain") && i + 1 < argc) gain_db = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-chip") && i + 3 < argc) {
+			ChipSetting s;
+			s.chip = atoi(argv[++i]);
+			s.gain_db = atof(argv[++i]);
+			s.pan = atof(argv[++i]);
+			settings.push_back(s);
+		}
+		else if (!strcmp(argv[i], "-spread")) spread = true;
+		else if (!strcmp(argv[i], "-block") && i + 1 < argc) block_frames = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (events_fname == NULL) events_fname = argv[i];
+		else if (num_frames < 0) num_frames = atoi(argv[i]);
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (events_fname == NULL || num_frames < 0 || num_chips < 0 || block_frames < 1 || num_threads < 1) {
+		printf("Usage: bank [-o bank.raw] [-chips n] [-gain dB] [-chip i dB pan]... [-spread] [-block frames] [-j threads] events.txt num_frames\n");
+		return 1;
+	}
+
+	std::vector<RegEvent> events;
+	if (!load_events(events_fname, events)) return 1;
+	if (num_chips == 0) {
+		for (const RegEvent &e : events) num_chips = std::max(num_chips, e.channel / NUM_CHANNELS + 1);
+		num_chips = std::max(num_chips, 1);
+	}
+
+	std::vector<BankChip> chips(num_chips);
+	if (!split_bank_events(events, chips)) return 1;
+	for (int i = 0; i < num_chips; i++) {
+		chips[i].gain = pow(10, gain_db / 20);
+		if (spread && num_chips > 1) chips[i].pan = 2.0f * i / (num_chips - 1) - 1;
+	}
+	for (const ChipSetting &s : settings) {
+		if (!(0 <= s.chip && s.chip < num_chips)) {
+			printf("-chip %d: the bank only has %d chips\n", s.chip, num_chips);
+			return 1;
+		}
+		chips[s.chip].gain = pow(10, (gain_db + s.gain_db) / 20);
+		chips[s.chip].pan = std::min(1.0f, std::max(-1.0f, s.pan));
+	}
+	printf("%d events, %d chips (%d voices), %d frames, %d threads\n", (int)events.size(), num_chips, num_chips*NUM_CHANNELS, num_frames, num_threads);
+
+	FILE *fp = fopen(audio_fname, "wb");
+	if (!fp) {
+		printf("Failed to create audio output file: %s\n", audio_fname);
+		return 1;
+	}
+	int64_t num_clipped = 0;
+	std::vector<int16_t> out_block;
+	auto t0 = std::chrono::steady_clock::now();
+	render_bank(chips, num_frames, block_frames, num_threads, [&](const float *mix, int n) {
+		out_block.resize((size_t)n * 2);
+		for (int i = 0; i < 2*n; i++) {
+			float x = std::round(mix[i]);
+			if (x > 32767 || x < -32768) {
+				num_clipped++;
+				x = std::min(32767.0f, std::max(-32768.0f, x));
+			}
+			out_block[i] = (int16_t)x;
+		}
+		fwrite(out_block.data(), sizeof(int16_t), out_block.size(), fp);
+	});
+	double wall = seconds_since(t0);
+	fclose(fp);
+
+	double audio_seconds = num_frames / FRAME_RATE;
+	double total = 0;
+	printf("\nchip  events  stereo  gain dB    pan  render s  x real time  share\n");
+	for (const BankChip &chip : chips) total += chip.seconds;
+	for (int i = 0; i < num_chips; i++) {
+		const BankChip &c = chips[i];
+		printf("%4d  %6d  %6s  %7.1f  %5.2f  %8.3f  %11.1f  %4.1f%%\n", i, (int)c.events.size(), c.stereo_out ? "yes" : "no",
+			20*log10(std::max(c.gain, 1e-10f)), c.pan, c.seconds, c.seconds > 0 ? audio_seconds / c.seconds : 0.0, total > 0 ? 100 * c.seconds / total : 0.0);
+	}
+	printf("\nRendered %.3f s of audio in %.3f s (%.1fx real time), %.3f s of chip render time\n", audio_seconds, wall, audio_seconds / wall, total);
+	if (total > 0) printf("Real time capacity: %.1f chips per core, %.1f chips on %d threads\n", num_chips * audio_seconds / total, num_chips * audio_seconds / wall, num_threads);
+	if (num_clipped > 0) printf("WARNING: %lld output samples clipped, lower the gain\n", (long long)num_clipped);
+	return 0;
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Golden render database: re-renders only the entries whose inputs changed, and flags renders whose output changed.
+//
+// Each entry in the manifest is keyed by a hash of its definition, its event script and its source dependencies.
+// Sources are hashed with comments and whitespace removed, so edits that can't change the output don't invalidate anything.
+// Render entries are also keyed by a hash of the golden executable, which contains the model renderer, so that they are
+// re-rendered after it has been rebuilt with a changed model, whether or not the model sources are listed as deps.
+// The database stores the key, a hash of the output and summary statistics per entry, along with the golden output.
+//
+// Usage: golden [options] update|check manifest.txt
+//     update           render the entries whose key changed (or all with -force) and store the results as golden
+//     check            render the entries whose key changed (or all with -force) and compare against the golden outputs.
+//                      Unchanged outputs get their key updated; changed outputs are reported and kept as <name>.new.raw
+//     -db <dir>        database directory (default: golden_db)
+//     -force           render all entries
+//     -j <threads>     number of threads for model renders (default: number of cores)
+//     -report <file>   also write the report for changed outputs to a file
+// Exit code: 0 if everything is unchanged, 1 if any output changed, 2 on errors.
+//
+// Manifest format, one item per line, paths relative to the current directory:
+//     deps <file>...                            source files that the following entries depend on (replaces the previous list)
+//     render <name> <events.txt> <num_frames>   render an event script with the model renderer
+//     command <name> <output.raw> <command>     run a shell command that writes 16 bit raw audio to output.raw,
+//                                               e.g. an RTL render with synth-sim
+// Lines starting with # are comments.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../model/pwls_render.h"
+
+const char* db_dirname = "golden_db";
+const char* db_fname = "golden.db";
+const int render_chunk_frames = 1 << 14;
+
+
+// 64 bit FNV-1a
+struct Hash {
+	uint64_t h;
+
+	Hash() : h(0xcbf29ce484222325ull) {}
+	void add(const void *data, size_t n) {
+		const uint8_t *p = (const uint8_t *)data;
+		for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+	}
+	void add(const std::string &s) { add(s.data(), s.size() + 1); }
+};
+
+bool read_file(const char *fname, std::string &data) {
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) return false;
+	char buf[1 << 16];
+	size_t n;
+	data.clear();
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) data.append(buf, n);
+	fclose(fp);
+	return true;
+}
+
+// Source text with // and /* */ comments removed and runs of whitespace collapsed, for C++ and Verilog
+std::string normalize_source(const std::string &s) {
+	std::string out;
+	bool space = false;
+	for (size_t i = 0; i < s.size(); i++) {
+		char c = s[i];
+		if (c == '"') {
+			size_t end = i + 1;
+			while (end < s.size() && s[end] != '"' && s[end] != '\n') end += s[end] == '\\' ? 2 : 1;
+			end = std::min(end + 1, s.size());
+			out.append(s, i, end - i);
+			i = end - 1;
+			space = false;
+			continue;
+		}
+		if (c == '/' && i + 1 < s.size() && s[i + 1] == '/') {
+			while (i < s.size() && s[i] != '\n') i++;
+			c = '\n';
+		} else if (c == '/' && i + 1 < s.size() && s[i + 1] == '*') {
+			size_t end = s.find("*/", i + 2);
+			i = end == std::string::npos ? s.size() : end + 1;
+			c = ' ';
+		}
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			space = true;
+			continue;
+		}
+		if (space && !out.empty()) out += ' ';
+		space = false;
+		out += c;
+	}
+	return out;
+}
+
+
+struct GoldenEntry {
+	std::string type, name, events_fname, output_fname, command;
+	int num_frames;
+	std::vector<std::string> deps;
+	int line_number;
+};
+
+bool load_manifest(const char *fname, std::vector<GoldenEntry> &entries) {
+	FILE *fp = fopen(fname, "r");
+	if (!fp) {
+		printf("Failed to open manifest: %s\n", fname);
+		return false;
+	}
+	std::vector<std::string> deps;
+	char line[4096];
+	int line_number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp)) {
+		line_number++;
+		std::string s = line;
+		while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) s.pop_back();
+		char word[256], name[256], fname2[1024];
+		int pos = 0;
+		if (sscanf(s.c_str(), " %255s %n", word, &pos) != 1 || word[0] == '#') continue;
+		const char *rest = s.c_str() + pos;
+
+		GoldenEntry e;
+		e.type = word;
+		e.line_number = line_number;
+		e.num_frames = 0;
+		if (e.type == "deps") {
+			deps.clear();
+			int n;
+			while (sscanf(rest, "%1023s%n", fname2, &n) == 1) {
+				deps.push_back(fname2);
+				rest += n;
+			}
+			continue;
+		} else if (e.type == "render") {
+			if (sscanf(rest, "%255s %1023s %d", name, fname2, &e.num_frames) != 3 || e.num_frames < 1) {
+				printf("%s:%d: expected: render name events.txt num_frames\n", fname, line_number);
+				ok = false;
+			}
+			e.events_fname = fname2;
+		} else if (e.type == "command") {
+			int n = 0;
+			if (sscanf(rest, "%255s %1023s %n", name, fname2, &n) != 2 || rest[n] == 0) {
+				printf("%s:%d: expected: command name output.raw command\n", fname, line_number);
+				ok = false;
+			}
+			e.output_fname = fname2;
+			e.command = rest + n;
+		} else {
+			printf("%s:%d: unknown item: %s\n", fname, line_number, word);
+			ok = false;
+		}
+		if (!ok) break;
+		e.name = name;
+		e.deps = deps;
+		for (const GoldenEntry &other : entries) {
+			if (other.name == e.name) {
+				printf("%s:%d: duplicate entry name: %s\n", fname, line_number, name);
+				ok = false;
+			}
+		}
+		entries.push_back(e);
+	}
+	fclose(fp);
+	return ok;
+}
+
+// Hash of the golden executable, to identify the build of the model renderer that render entries use
+bool renderer_build_id(const char *argv0, uint64_t &id) {
+	std::string data;
+	if (!read_file("/proc/self/exe", data) && !read_file(argv0, data)) {
+		printf("Failed to read the golden executable to identify the renderer build\n");
+		return false;
+	}
+	Hash h;
+	h.add(data);
+	id = h.h;
+	return true;
+}
+
+// Key of an entry: its definition, the contents of its event script and its normalized dependencies,
+// and for render entries, the renderer build
+bool entry_key(const GoldenEntry &e, uint64_t renderer_id, uint64_t &key) {
+	Hash h;
+	h.add(e.type);
+	if (e.type == "render") h.add(&renderer_id, sizeof(renderer_id));
+	h.add(e.name);
+	h.add(std::to_string(e.num_frames));
+	h.add(e.command);
+	h.add(e.output_fname);
+	std::string data;
+	if (!e.events_fname.empty()) {
+		if (!read_file(e.events_fname.c_str(), data)) {
+			printf("%s: failed to read event script: %s\n", e.name.c_str(), e.events_fname.c_str());
+			return false;
+		}
+		h.add(data);
+	}
+	for (const std::string &dep : e.deps) {
+		if (!read_file(dep.c_str(), data)) {
+			printf("%s: failed to read dependency: %s\n", e.name.c_str(), dep.c_str());
+			return false;
+		}
+		h.add(dep);
+		h.add(normalize_source(data));
+	}
+	key = h.h;
+	return true;
+}
+
+
+struct AudioSummary {
+	uint64_t hash;
+	uint64_t num_samples;
+	int peak;
+	double rms;
+};
+
+AudioSummary summarize_audio(const std::vector<int16_t> &audio) {
+	AudioSummary s;
+	Hash h;
+	h.add(audio.data(), audio.size() * sizeof(int16_t));
+	s.hash = h.h;
+	s.num_samples = audio.size();
+	s.peak = 0;
+	double sum2 = 0;
+	for (int16_t x : audio) {
+		s.peak = std::max(s.peak, abs((int)x));
+		sum2 += (double)x * x;
+	}
+	s.rms = audio.empty() ? 0 : sqrt(sum2 / audio.size());
+	return s;
+}
+
+struct GoldenRecord {
+	uint64_t key;
+	AudioSummary summary;
+};
+
+bool load_db(const std::string &fname, std::map<std::string, GoldenRecord> &db) {
+	FILE *fp = fopen(fname.c_str(), "r");
+	if (!fp) return true; // new database
+	char line[512], name[256];
+	unsigned long long key, hash, num_samples;
+	GoldenRecord r;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#') continue;
+		ok = sscanf(line, "%255s %llx %llx %llu %d %lf", name, &key, &hash, &num_samples, &r.summary.peak, &r.summary.rms) == 6;
+		r.key = key;
+		r.summary.hash = hash;
+		r.summary.num_samples = num_samples;
+		db[name] = r;
+	}
+	fclose(fp);
+	if (!ok) printf("Failed to read database: %s\n", fname.c_str());
+	return ok;
+}
+
+bool save_db(const std::string &fname, const std::map<std::string, GoldenRecord> &db) {
+	std::string tmp_fname = fname + ".tmp";
+	FILE *fp = fopen(tmp_fname.c_str(), "w");
+	if (!fp) {
+		printf("Failed to create database: %s\n", tmp_fname.c_str());
+		return false;
+	}
+	fprintf(fp, "# name key output_hash num_samples peak rms\n");
+	for (const auto &it : db) {
+		const GoldenRecord &r = it.second;
+		fprintf(fp, "%s %016llx %016llx %llu %d %.3f\n", it.first.c_str(), (unsigned long long)r.key, (unsigned long long)r.summary.hash,
+			(unsigned long long)r.summary.num_samples, r.summary.peak, r.summary.rms);
+	}
+	bool ok = fclose(fp) == 0 && rename(tmp_fname.c_str(), fname.c_str()) == 0;
+	if (!ok) printf("Failed to write database: %s\n", fname.c_str());
+	return ok;
+}
+
+bool load_audio(const char *fname, std::vector<int16_t> &audio) {
+	std::string data;
+	if (!read_file(fname, data)) {
+		printf("Failed to read audio file: %s\n", fname);
+		return false;
+	}
+	audio.resize(data.size() / sizeof(int16_t));
+	memcpy(audio.data(), data.data(), audio.size() * sizeof(int16_t));
+	return true;
+}
+
+bool render_entry(const GoldenEntry &e, int num_threads, std::vector<int16_t> &audio) {
+	audio.clear();
+	if (e.type == "render") {
+		std::vector<RegEvent> events;
+		if (!load_events(e.events_fname.c_str(), events)) return false;
+		render_segmented(events, e.num_frames, events_use_stereo(events), render_chunk_frames, num_threads, audio);
+		return true;
+	}
+	remove(e.output_fname.c_str());
+	if (system(e.command.c_str()) != 0) {
+		printf("%s: command failed: %s\n", e.name.c_str(), e.command.c_str());
+		return false;
+	}
+	return load_audio(e.output_fname.c_str(), audio);
+}
+
+// Describe how a render differs from the golden one
+std::string diff_report(const std::string &name, const std::vector<int16_t> &golden, const std::vector<int16_t> &audio) {
+	size_t n = std::min(golden.size(), audio.size());
+	size_t first_diff = n, num_diff = 0;
+	int max_diff = 0;
+	double sum2 = 0;
+	for (size_t i = 0; i < n; i++) {
+		int d = audio[i] - golden[i];
+		if (d == 0) continue;
+		if (first_diff == n) first_diff = i;
+		num_diff++;
+		max_diff = std::max(max_diff, abs(d));
+		sum2 += (double)d * d;
+	}
+	char buf[512];
+	snprintf(buf, sizeof(buf), "%s: %llu / %llu samples differ, first at %llu, max abs diff %d, rms diff %.2f%s\n", name.c_str(),
+		(unsigned long long)num_diff, (unsigned long long)n, (unsigned long long)first_diff, max_diff, n > 0 ? sqrt(sum2 / n) : 0.0,
+		golden.size() != audio.size() ? " (lengths differ)" : "");
+	std::string report = buf;
+	if (golden.size() != audio.size()) {
+		snprintf(buf, sizeof(buf), "    length: golden %llu, new %llu samples\n", (unsigned long long)golden.size(), (unsigned long long)audio.size());
+		report += buf;
+	}
+	return report;
+}
+
+
+int main(int argc, char** argv) {
+	const char *command = NULL, *manifest_fname = NULL, *report_fname = NULL;
+	bool force = false;
+	int num_threads = default_num_threads();
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-db") && i + 1 < argc) db_dirname = argv[++i];
+		else if (!strcmp(argv[i], "-force")) force = true;
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-report") && i + 1 < argc) report_fname = argv[++i];
+		else if (command == NULL) command = argv[i];
+		else if (manifest_fname == NULL) manifest_fname = argv[i];
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 2;
+		}
+	}
+	bool update = command != NULL && !strcmp(command, "update");
+	bool check = command != NULL && !strcmp(command, "check");
+	if ((!update && !check) || manifest_fname == NULL || num_threads < 1) {
+		printf("Usage: golden [-db dir] [-force] [-j threads] [-report file] update|check manifest.txt\n");
+		return 2;
+	}
+
+	std::vector<GoldenEntry> entries;
+	if (!load_manifest(manifest_fname, entries)) return 2;
+	uint64_t renderer_id;
+	if (!renderer_build_id(argv[0], renderer_id)) return 2;
+	mkdir(db_dirname, 0777);
+	std::string dir = db_dirname;
+	std::string db_path = dir + "/" + db_fname;
+	std::map<std::string, GoldenRecord> db;
+	if (!load_db(db_path, db)) return 2;
+
+	int num_skipped = 0, num_rendered = 0, num_changed = 0, num_errors = 0;
+	std::string report;
+	for (const GoldenEntry &e : entries) {
+		uint64_t key;
+		if (!entry_key(e, renderer_id, key)) {
+			num_errors++;
+			continue;
+		}
+		auto it = db.find(e.name);
+		bool known = it != db.end();
+		if (known && it->second.key == key && !force) {
+			num_skipped++;
+			continue;
+		}
+
+		std::vector<int16_t> audio;
+		if (!render_entry(e, num_threads, audio)) {
+			num_errors++;
+			continue;
+		}
+		num_rendered++;
+		AudioSummary summary = summarize_audio(audio);
+		std::string golden_fname = dir + "/" + e.name + ".raw";
+		std::string new_fname = dir + "/" + e.name + ".new.raw";
+
+		if (update || !known) {
+			if (!save_audio(golden_fname.c_str(), audio)) {
+				num_errors++;
+				continue;
+			}
+			remove(new_fname.c_str());
+			db[e.name] = {key, summary};
+			printf("%-24s %s: %llu samples, peak %d, rms %.1f\n", e.name.c_str(), known ? "updated" : "new", (unsigned long long)summary.num_samples, summary.peak, summary.rms);
+		} else if (summary.hash == it->second.summary.hash && summary.num_samples == it->second.summary.num_samples) {
+			it->second.key = key;
+			remove(new_fname.c_str());
+			printf("%-24s unchanged\n", e.name.c_str());
+		} else {
+			num_changed++;
+			std::vector<int16_t> golden;
+			save_audio(new_fname.c_str(), audio);
+			if (load_audio(golden_fname.c_str(), golden)) report += diff_report(e.name, golden, audio);
+			else report += e.name + ": golden output missing\n";
+			printf("%-24s CHANGED, new output in %s\n", e.name.c_str(), new_fname.c_str());
+		}
+	}
+	if (!save_db(db_path, db)) return 2;
+
+	printf("\n%d entries: %d rendered, %d skipped, %d changed, %d errors\n", (int)entries.size(), num_rendered, num_skipped, num_changed, num_errors);
+	if (!report.empty()) {
+		printf("\nChanged outputs:\n%s", report.c_str());
+		if (report_fname != NULL) {
+			FILE *fp = fopen(report_fname, "w");
+			if (fp) {
+				fputs(report.c_str(), fp);
+				fclose(fp);
+			} else printf("Failed to create report file: %s\n", report_fname);
+		}
+	}
+	if (num_errors > 0) return 2;
+	return num_changed > 0 ? 1 : 0;
+}
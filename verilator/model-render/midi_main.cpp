@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Compile a Standard MIDI File into a register event script, to be rendered with render (or bank, with -chips).
+// See pwls_midi.h for the voice allocation and how notes become register writes.
+// Pitch bend and the sustain pedal are supported; other controllers and program changes are ignored.
+//
+// Usage: midi [options] song.mid
+//     -o <file>               output event script (default: events.txt)
+//     -chips <n>              number of chips to allocate voices over, 4 voices each (default: 1)
+//     -a4 <Hz>                tuning (default: 440)
+//     -transpose <semitones>  (default: 0)
+//     -velocity_curve <x>     amp = 63 * (velocity/127)^x (default: 1)
+//     -decay <s>              time from the note on amp to the sustain level (default: 0 = no decay)
+//     -sustain <0-7>          sustain level with -decay, in steps of 9 amp units (default: 0)
+//     -release <s>            time for the release from full amp to zero (default: 0.1)
+//     -bend_range <semitones> pitch bend range (default: 2)
+//     -percussion             also play the notes on MIDI channel 10
+//     -mode <n> -slope0 <n> -slope1 <n> -pwm_offset <n>  patch for all channels (default: 0, 8, 8, 64)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+
+#include "../model/pwls_midi.h"
+
+const char* events_fname = "events.txt";
+
+
+int main(int argc, char** argv) {
+	const char *midi_fname = NULL;
+	int num_chips = 1;
+	MidiCompilerSettings s;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) events_fname = argv[++i];
+		else if (!strcmp(argv[i], "-chips") && i + 1 < argc) num_chips = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-a4") && i + 1 < argc) s.a4 = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-transpose") && i + 1 < argc) s.transpose = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-velocity_curve") && i + 1 < argc) s.velocity_curve = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-decay") && i + 1 < argc) s.decay = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-sustain") && i + 1 < argc) s.sustain = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-release") && i + 1 < argc) s.release = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-bend_range") && i + 1 < argc) s.bend_range = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-percussion")) s.percussion = true;
+		else if (!strcmp(argv[i], "-mode") && i + 1 < argc) s.mode = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-slope0") && i + 1 < argc) s.slope0 = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-slope1") && i + 1 < argc) s.slope1 = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-pwm_offset") && i + 1 < argc) s.pwm_offset = strtol(argv[++i], NULL, 0);
+		else if (midi_fname == NULL) midi_fname = argv[i];
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (midi_fname == NULL || num_chips < 1 || !(s.a4 > 0) || !(0 <= s.sustain && s.sustain <= 7) || s.decay < 0 || s.release < 0) {
+		printf("Usage: midi [-o events.txt] [-chips n] [-a4 Hz] [-transpose semitones] [-velocity_curve x] [-decay s] [-sustain 0-7] [-release s]\n");
+		printf("            [-bend_range semitones] [-percussion] [-mode n] [-slope0 n] [-slope1 n] [-pwm_offset n] song.mid\n");
+		return 1;
+	}
+
+	auto t0 = std::chrono::steady_clock::now();
+	SmfReader reader;
+	if (!reader.load(midi_fname)) return 1;
+
+	FILE *fp = fopen(events_fname, "w");
+	if (!fp) {
+		printf("Failed to create event output file: %s\n", events_fname);
+		return 1;
+	}
+	fprintf(fp, "# compiled from %s by midi, %d chip(s)\n", midi_fname, num_chips);
+
+	MidiCompiler compiler(s, num_chips, fp);
+	MidiEvent e;
+	while (reader.next(e)) compiler.event(e);
+	int64_t num_frames = compiler.finish();
+	fclose(fp);
+	double seconds = seconds_since(t0);
+
+	printf("%s: format %d, %d tracks, %llu channel messages, %llu tempo changes\n", midi_fname, reader.format, (int)reader.tracks.size(),
+		(unsigned long long)reader.num_events, (unsigned long long)reader.num_tempo_changes);
+	printf("%llu notes on %d voices, max polyphony %d, %llu steals", (unsigned long long)compiler.num_notes, num_chips*NUM_CHANNELS,
+		compiler.max_polyphony, (unsigned long long)compiler.num_steals);
+	if (compiler.num_dropped > 0) printf(", %llu percussion notes dropped", (unsigned long long)compiler.num_dropped);
+	if (compiler.num_clamped > 0) printf(", %llu notes out of the period range", (unsigned long long)compiler.num_clamped);
+	printf("\n");
+	double song_seconds = num_frames / FRAME_RATE;
+	printf("%llu register writes (%.0f/s) in %.3f s\n", (unsigned long long)compiler.num_writes, song_seconds > 0 ? compiler.num_writes / song_seconds : 0.0, seconds);
+	printf("Render with: %s %s %lld\n", num_chips > 1 ? "bank" : "render", events_fname, (long long)num_frames);
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Build, list and audition patch banks, see pwls_patch.h for the file formats.
+//
+// audition renders the same short phrase with every patch in the bank, spread over all cores: an arpeggio on channel 0
+// (root, third, fifth, octave), and then the same notes as a chord on all four channels. Each note on writes the period
+// and the whole patch (cfg too), so that sweeps start over from the patch values, and each note off sweeps the amp
+// to zero. Each patch is written to <dir>/<index>_<name>.raw (render format), so that two runs can be compared file
+// by file with audiodiff, and a summary table of loudness and spectral statistics is written to <dir>/summary.csv.
+//
+// Columns:
+//     peak      peak level (dBFS)
+//     rms       rms level while the notes are held, up to the release of the chord (dBFS)
+//     crest     peak - rms (dB)
+//     centroid  spectral centroid of the same part, for both sides mixed (Hz)
+//     rolloff   frequency below which 85% of the power is (Hz)
+//
+// Usage: patches build patches.txt bank.pwlb    compile a text bank to a binary bank
+//        patches list bank.pwlb                 print a binary bank as a text bank
+//        patches [options] audition bank        bank can be binary or text
+//     -o <dir>       output directory (default: audition)
+//     -note <n>      MIDI note number of the root of the phrase (default: 48)
+//     -a4 <Hz>       tuning (default: 440)
+//     -j <threads>   number of threads (default: number of cores)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <sys/stat.h>
+
+#include "../model/pwls_patch.h"
+#include "../model/pwls_midi.h"
+#include "../model/pwls_parallel.h"
+#include "../model/pwls_fft.h"
+
+const char* out_dirname = "audition";
+
+// The phrase, in seconds
+const double NOTE_SECONDS = 0.25;  // arpeggio note spacing
+const double NOTE_GATE = 0.8;      // part of the spacing that the key is held
+const double CHORD_SECONDS = 1.0;
+const double TAIL_SECONDS = 0.5;
+const double RELEASE_SECONDS = 0.04;
+const int phrase_intervals[NUM_CHANNELS] = {0, 4, 7, 12};
+
+const int SPECTRUM_WINDOW = 4096;
+const double ROLLOFF_FRACTION = 0.85;
+const double FULL_SCALE = 32768;
+
+
+int to_frame(double seconds) { return (int)lrint(seconds * FRAME_RATE); }
+
+struct Phrase {
+	const PatchRecord &p;
+	std::vector<RegEvent> events;
+	int release_rate;
+
+	Phrase(const PatchRecord &p) : p(p), release_rate(amp_sweep_rate(RELEASE_SECONDS, 63)) {}
+
+	void note_on(int frame, int channel, double freq) {
+		events.push_back(RegEvent{frame, REG_PERIOD, channel, period_for_freq(freq / SAMPLE_RATE)});
+		patch_events(p, channel, frame, true, events);
+	}
+
+	void note_off(int frame, int channel) {
+		events.push_back(RegEvent{frame, REG_SWEEP_PA, channel, (p.regs[5] & 0xff00) | release_rate}); // amp target 0
+	}
+};
+
+// Returns the number of frames, and the frame where the chord is released in *sounding_frames
+int make_phrase(const PatchRecord &p, int root_note, double a4, std::vector<RegEvent> &events, int *sounding_frames) {
+	Phrase phrase(p);
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) patch_events(p, channel, 0, false, phrase.events);
+
+	double freqs[NUM_CHANNELS];
+	for (int i = 0; i < NUM_CHANNELS; i++) freqs[i] = a4 * pow(2.0, (root_note + phrase_intervals[i] - 69) / 12.0);
+	for (int i = 0; i < NUM_CHANNELS; i++) {
+		phrase.note_on(to_frame(i*NOTE_SECONDS), 0, freqs[i]);
+		phrase.note_off(to_frame((i + NOTE_GATE)*NOTE_SECONDS), 0);
+	}
+	double t = NUM_CHANNELS*NOTE_SECONDS;
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) phrase.note_on(to_frame(t), channel, freqs[channel]);
+	t += CHORD_SECONDS;
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) phrase.note_off(to_frame(t), channel);
+
+	events.swap(phrase.events);
+	*sounding_frames = to_frame(t);
+	return to_frame(t + TAIL_SECONDS);
+}
+
+struct AuditionResult {
+	bool stereo, saved;
+	double peak_db, rms_db, centroid, rolloff;
+};
+
+double to_db(double x) { return 20*log10(std::max(x, 1e-10)); }
+
+void analyze(const std::vector<int16_t> &audio, int num_sides, int sounding_frames, AuditionResult &r) {
+	double peak = 0, sum2 = 0;
+	for (size_t i = 0; i < audio.size(); i++) peak = std::max(peak, fabs((double)audio[i]));
+	int num_frames = std::min(sounding_frames, (int)(audio.size() / num_sides));
+	std::vector<float> mono(num_frames);
+	for (int i = 0; i < num_frames; i++) {
+		float sum = 0;
+		for (int side = 0; side < num_sides; side++) {
+			double x = audio[(size_t)i*num_sides + side];
+			sum2 += x*x;
+			sum += x;
+		}
+		mono[i] = sum / num_sides;
+	}
+	r.peak_db = to_db(peak / FULL_SCALE);
+	r.rms_db = to_db(num_frames > 0 ? sqrt(sum2 / ((double)num_frames * num_sides)) / FULL_SCALE : 0);
+
+	SpectrumAnalyzer analyzer(SPECTRUM_WINDOW);
+	int num_bins = analyzer.num_bins();
+	std::vector<double> power(num_bins), sum_power(num_bins, 0.0);
+	for (int start = 0; start + SPECTRUM_WINDOW <= num_frames; start += SPECTRUM_WINDOW/2) {
+		analyzer.power(&mono[start], 1, 1 / FULL_SCALE, power.data());
+		for (int k = 0; k < num_bins; k++) sum_power[k] += power[k];
+	}
+	// Leave out DC
+	double total = 0, weighted = 0;
+	for (int k = 1; k < num_bins; k++) {
+		total += sum_power[k];
+		weighted += sum_power[k] * k;
+	}
+	double bin_hz = FRAME_RATE / SPECTRUM_WINDOW;
+	r.centroid = total > 0 ? weighted / total * bin_hz : 0;
+	r.rolloff = 0;
+	double acc = 0;
+	for (int k = 1; k < num_bins && total > 0; k++) {
+		acc += sum_power[k];
+		if (acc >= ROLLOFF_FRACTION * total) {
+			r.rolloff = k * bin_hz;
+			break;
+		}
+	}
+}
+
+std::string audition_fname(int index, const char *name) {
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), "/%03d_", index);
+	std::string fname = std::string(out_dirname) + prefix;
+	for (const char *c = name; *c != 0; c++) fname += isalnum((unsigned char)*c) || *c == '-' || *c == '.' ? *c : '_';
+	return fname + ".raw";
+}
+
+bool load_patches(const char *fname, PatchBank &bank, std::vector<PatchRecord> &patches) {
+	if (!is_patch_bank_file(fname)) return load_patch_text(fname, patches);
+	if (!bank.open(fname)) return false;
+	for (int i = 0; i < bank.num_patches; i++) patches.push_back(bank[i]);
+	return true;
+}
+
+int audition(const std::vector<PatchRecord> &patches, int root_note, double a4, int num_threads) {
+	mkdir(out_dirname, 0777);
+	int num_patches = patches.size();
+	std::vector<AuditionResult> results(num_patches);
+	int num_frames = 0;
+	auto t0 = std::chrono::steady_clock::now();
+	parallel_for(num_patches, num_threads, [&](int i) {
+		std::vector<RegEvent> events;
+		int sounding_frames;
+		int n = make_phrase(patches[i], root_note, a4, events, &sounding_frames);
+		if (i == 0) num_frames = n;
+		AuditionResult &r = results[i];
+		r.stereo = events_use_stereo(events);
+		std::vector<int16_t> audio;
+		render_serial(events, n, r.stereo, audio);
+		analyze(audio, r.stereo ? 2 : 1, sounding_frames, r);
+		r.saved = save_audio(audition_fname(i, patches[i].name).c_str(), audio);
+	});
+	double seconds = seconds_since(t0);
+
+	std::string csv_fname = std::string(out_dirname) + "/summary.csv";
+	FILE *csv = fopen(csv_fname.c_str(), "w");
+	if (csv == NULL) printf("Failed to create summary file: %s\n", csv_fname.c_str());
+	else fprintf(csv, "index,name,stereo,peak,rms,crest,centroid,rolloff\n");
+	printf("index  %-*s  stereo   peak    rms  crest  centroid  rolloff\n", PATCH_NAME_LENGTH, "name");
+	int num_failed = 0;
+	for (int i = 0; i < num_patches; i++) {
+		const AuditionResult &r = results[i];
+		num_failed += !r.saved;
+		printf("%5d  %-*s  %6s  %5.1f  %5.1f  %5.1f  %8.0f  %7.0f\n", i, PATCH_NAME_LENGTH, patches[i].name, r.stereo ? "yes" : "no",
+			r.peak_db, r.rms_db, r.peak_db - r.rms_db, r.centroid, r.rolloff);
+		if (csv != NULL) fprintf(csv, "%d,%s,%d,%.2f,%.2f,%.2f,%.1f,%.1f\n", i, patches[i].name, r.stereo, r.peak_db, r.rms_db, r.peak_db - r.rms_db, r.centroid, r.rolloff);
+	}
+	if (csv != NULL) fclose(csv);
+	double audio_seconds = (double)num_frames * num_patches / FRAME_RATE;
+	printf("\nAuditioned %d patches (%.1f s of audio) in %.3f s on %d threads, output in %s/\n", num_patches, audio_seconds, seconds, num_threads, out_dirname);
+	return num_failed > 0 || csv == NULL ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+	const char *command = NULL, *in_fname = NULL, *out_fname = NULL;
+	int num_threads = default_num_threads();
+	int root_note = 48;
+	double a4 = 440;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) out_dirname = argv[++i];
+		else if (!strcmp(argv[i], "-note") && i + 1 < argc) root_note = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-a4") && i + 1 < argc) a4 = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (command == NULL) command = argv[i];
+		else if (in_fname == NULL) in_fname = argv[i];
+		else if (out_fname == NULL) out_fname = argv[i];
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	bool build = command != NULL && !strcmp(command, "build");
+	bool list = command != NULL && !strcmp(command, "list");
+	bool audit = command != NULL && !strcmp(command, "audition");
+	if ((!build && !list && !audit) || in_fname == NULL || (out_fname != NULL) != build || num_threads < 1 || !(a4 > 0)) {
+		printf("Usage: patches build patches.txt bank.pwlb\n");
+		printf("       patches list bank.pwlb\n");
+		printf("       patches [-o dir] [-note n] [-a4 Hz] [-j threads] audition bank\n");
+		return 1;
+	}
+
+	PatchBank bank;
+	std::vector<PatchRecord> patches;
+	if (build) {
+		if (!load_patch_text(in_fname, patches)) return 1;
+		if (!save_patch_bank(out_fname, patches)) return 1;
+		printf("Wrote %d patches to %s\n", (int)patches.size(), out_fname);
+		return 0;
+	}
+	if (!load_patches(in_fname, bank, patches)) return 1;
+	if (list) {
+		printf("# %d patches from %s\n", (int)patches.size(), in_fname);
+		printf("# %-*s amp slope0 slope1 pwm_offset mode sweep_pa sweep_ws cfg\n", PATCH_NAME_LENGTH - 2, "name");
+		for (const PatchRecord &p : patches) save_patch_text(stdout, p);
+		return 0;
+	}
+	return audition(patches, root_note, a4, num_threads);
+}
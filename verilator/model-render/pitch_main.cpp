@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Measure the exact long run frequency and jitter of the oscillator for every period register value,
+// and derive note tables for a tuning reference.
+//
+// The oscillator is stepped through model_oscillator until its state repeats, see pwls_pitch.h, so the frequency is the exact
+// average over a full cycle. Orion and 4 bit mode use the linear oscillator. In noise mode, the frequency is the LFSR shift rate.
+// Jitter is reported in us. For the PWL oscillator, it mostly reflects the intended uneven phase steps within each period.
+//
+// The sub-channel frequencies follow from the oscillator frequency f (see model_detune and model_tri_pwm_offset):
+//     sub-channel 0: 3*f with 3x, f with only x2^n, otherwise f - d(detune_exp + detune_fifth)
+//     sub-channel 1: (f + d(detune_exp)) * 2^n with x2^n
+// where d(e) = fs * 2^(e - 25) for e != 0. With -x3, -x2n, -detune or -fifth, these are added as columns.
+//
+// Note tables give one mantissa per note for use across octaves (period_exp = 7 - octave), chosen to minimize the worst
+// error over octaves 0-5, in the layout of synth-sim's note_mantissas (C to B) and of docs/pwl_synth.py (B to A#).
+// The existing tables are evaluated as well, with the reference that fits them best.
+//
+// Usage: pitch [options]
+//     -o <file>         frequency table output file (default: pitch.txt)
+//     -notes <file>     also write the best period for every note from C0 to B7
+//     -ref <hz>         tuning reference for A4 (default: 440)
+//     -fs <hz>          sample rate (default: 1000000, for a 64 MHz clock)
+//     -channel <n>      channel, selects the 18 bit (0, 3) or 11 bit (1, 2) LFSR for noise (default: 0)
+//     -x3               sub-channel 0 uses 3x
+//     -x2n <n>          sub-channel 1 uses x2^n, 1 <= n <= 3
+//     -detune <exp>     detune_exp, 0-7
+//     -fifth            detune_fifth
+//     -j <threads>      number of threads (default: number of cores)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+
+#include "../model/pwls_pitch.h"
+#include "../model/pwls_parallel.h"
+
+const int NUM_PERIODS = 1 << PERIOD_BITS;
+const int NUM_MANTISSAS = 1 << MANTISSA_BITS;
+const int NUM_OCTAVES = 1 << OCT_BITS;
+
+const int NOTE_A4 = 57; // semitones from C0
+const int TABLE_OCTAVES = 6; // note tables are optimized for octaves 0-5, which have all mantissas available
+
+// The existing tables, see synth-sim/main.cpp and docs/pwl_synth.py
+const int synth_sim_note_mantissas[12] = {909, 801, 698, 601, 510, 424, 343, 266, 194, 125, 61, 0};
+const int pwl_synth_note_mantissas[12] = {1001, 887, 780, 679, 583, 493, 408, 327, 252, 180, 112, 49};
+
+const char *note_names[12] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+
+
+struct OscMode {
+	const char *name;
+	int mode;
+	bool noise;
+};
+
+const OscMode osc_modes[] = {
+	{"linear", 0, false},
+	{"pwl", MODE_FLAG_PWL_OSC, false},
+	{"noise", MODE_FLAG_NOISE, true},
+};
+const int NUM_OSC_MODES = sizeof(osc_modes) / sizeof(osc_modes[0]);
+
+double cents(double f, double target) { return 1200 * log2(f / target); }
+double note_freq(int semitone, double ref) { return ref * pow(2, (semitone - NOTE_A4) / 12.0); }
+
+// Note table layouts: entry i at period_exp e plays the semitone 12*(7 - e) + i + offset
+struct TableLayout {
+	const char *name;
+	int offset;
+	const int *existing;
+};
+const TableLayout table_layouts[] = {
+	{"synth-sim (C to B)", 0, synth_sim_note_mantissas},
+	{"pwl_synth.py (B to A#)", -1, pwl_synth_note_mantissas},
+};
+
+// Worst error in cents over the table octaves for mantissa m at table entry i, and the min and max signed errors
+double table_entry_error(const std::vector<OscPitch> &freqs, double fs, double ref, int offset, int i, int m, double &lo, double &hi) {
+	lo = 1e9;
+	hi = -1e9;
+	for (int octave = 0; octave < TABLE_OCTAVES; octave++) {
+		int e = NUM_OCTAVES - 1 - octave;
+		double err = cents(freqs[(e << MANTISSA_BITS) | m].freq * fs, note_freq(12*octave + i + offset, ref));
+		lo = std::min(lo, err);
+		hi = std::max(hi, err);
+	}
+	return std::max(hi, -lo);
+}
+
+void print_table(FILE *fp, const char *name, const int *mantissas) {
+	fprintf(fp, "    %-12s {", name);
+	for (int i = 0; i < 12; i++) fprintf(fp, "%s%d", i == 0 ? "" : ", ", mantissas[i]);
+	fprintf(fp, "}\n");
+}
+
+void note_tables(FILE *fp, const OscMode &om, const std::vector<OscPitch> &freqs, double fs, double ref) {
+	fprintf(fp, "%s oscillator, A4 = %g Hz, errors in cents over octaves 0-%d:\n", om.name, ref, TABLE_OCTAVES - 1);
+	for (const TableLayout &layout : table_layouts) {
+		int best[12];
+		double best_max = 0, existing_max = 0, existing_lo = 1e9, existing_hi = -1e9;
+		for (int i = 0; i < 12; i++) {
+			double lo, hi, best_err = 1e9;
+			for (int m = 0; m < NUM_MANTISSAS; m++) {
+				double err = table_entry_error(freqs, fs, ref, layout.offset, i, m, lo, hi);
+				if (err < best_err) {
+					best_err = err;
+					best[i] = m;
+				}
+			}
+			best_max = std::max(best_max, best_err);
+			existing_max = std::max(existing_max, table_entry_error(freqs, fs, ref, layout.offset, i, layout.existing[i], lo, hi));
+			existing_lo = std::min(existing_lo, lo);
+			existing_hi = std::max(existing_hi, hi);
+		}
+		// Shifting the reference shifts all errors equally, so the best fit centers them
+		double fit_ref = ref * pow(2, (existing_lo + existing_hi) / 2 / 1200);
+		fprintf(fp, "  %s layout:\n", layout.name);
+		print_table(fp, "best", best);
+		fprintf(fp, "        max error %.2f\n", best_max);
+		print_table(fp, "existing", layout.existing);
+		fprintf(fp, "        max error %.2f, errors from %.2f to %.2f, best fit A4 = %.2f Hz (max error %.2f)\n",
+			existing_max, existing_lo, existing_hi, fit_ref, (existing_hi - existing_lo) / 2);
+	}
+	fprintf(fp, "\n");
+}
+
+// Best period for every note, searching all period values
+void write_notes(FILE *fp, const std::vector<std::vector<OscPitch>> &results, const std::vector<int> &modes, double fs, double ref) {
+	fprintf(fp, "# note");
+	for (int mi : modes) fprintf(fp, "\t%s_period\t%s_hz\t%s_cents", osc_modes[mi].name, osc_modes[mi].name, osc_modes[mi].name);
+	fprintf(fp, "\n");
+	for (int semitone = 0; semitone < 12*NUM_OCTAVES; semitone++) {
+		double target = note_freq(semitone, ref);
+		fprintf(fp, "%s%d", note_names[semitone % 12], semitone / 12);
+		for (int mi : modes) {
+			int best = 0;
+			for (int p = 1; p < NUM_PERIODS; p++) {
+				if (fabs(cents(results[mi][p].freq * fs, target)) < fabs(cents(results[mi][best].freq * fs, target))) best = p;
+			}
+			fprintf(fp, "\t%d:%d\t%.4f\t%.2f", period_exp(best), period_mantissa(best), results[mi][best].freq * fs, cents(results[mi][best].freq * fs, target));
+		}
+		fprintf(fp, "\n");
+	}
+}
+
+
+int main(int argc, char** argv) {
+	const char *out_fname = "pitch.txt", *notes_fname = NULL;
+	double ref = 440, fs = SAMPLE_RATE;
+	int channel = 0;
+	bool x3 = false, fifth = false;
+	int x2n = 0, detune_exp = 0;
+	int num_threads = default_num_threads();
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) out_fname = argv[++i];
+		else if (!strcmp(argv[i], "-notes") && i + 1 < argc) notes_fname = argv[++i];
+		else if (!strcmp(argv[i], "-ref") && i + 1 < argc) ref = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-fs") && i + 1 < argc) fs = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-channel") && i + 1 < argc) channel = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-x3")) x3 = true;
+		else if (!strcmp(argv[i], "-x2n") && i + 1 < argc) x2n = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-detune") && i + 1 < argc) detune_exp = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-fifth")) fifth = true;
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else {
+			printf("Usage: pitch [-o pitch.txt] [-notes notes.txt] [-ref hz] [-fs hz] [-channel n] [-x3] [-x2n n] [-detune exp] [-fifth] [-j threads]\n");
+			return 1;
+		}
+	}
+	if (ref <= 0 || fs <= 0 || channel < 0 || channel >= NUM_CHANNELS || x2n < 0 || x2n > 3 || detune_exp < 0 || detune_exp > 7 || num_threads < 1) {
+		printf("Option out of range\n");
+		return 1;
+	}
+	bool subchannels = x3 || x2n != 0 || detune_exp != 0 || fifth;
+
+	// Noise steps the same way in every octave, so only measure period_exp = 0 and scale
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<int> modes;
+	for (int mi = 0; mi < NUM_OSC_MODES; mi++) modes.push_back(mi);
+	std::vector<std::vector<OscPitch>> results(NUM_OSC_MODES, std::vector<OscPitch>(NUM_PERIODS));
+	std::vector<std::pair<int, int>> jobs;
+	for (int mi : modes) {
+		int n = osc_modes[mi].noise ? NUM_MANTISSAS : NUM_PERIODS;
+		for (int p = 0; p < n; p++) jobs.push_back(std::make_pair(mi, p));
+	}
+	parallel_for(jobs.size(), num_threads, [&](int i) {
+		measure_oscillator(osc_modes[jobs[i].first].mode, jobs[i].second, channel, results[jobs[i].first][jobs[i].second]);
+	});
+	for (int mi : modes) {
+		if (!osc_modes[mi].noise) continue;
+		for (int p = NUM_MANTISSAS; p < NUM_PERIODS; p++) {
+			const OscPitch &base = results[mi][period_mantissa(p)];
+			OscPitch &r = results[mi][p];
+			r = base;
+			r.freq = ldexp(base.freq, -period_exp(p));
+			r.jitter_rms = ldexp(base.jitter_rms, period_exp(p));
+			r.jitter_peak = ldexp(base.jitter_peak, period_exp(p));
+		}
+	}
+	double seconds = seconds_since(t0);
+
+	FILE *fp = fopen(out_fname, "w");
+	if (!fp) {
+		printf("Failed to create output file: %s\n", out_fname);
+		return 1;
+	}
+	fprintf(fp, "# fs = %g Hz. Frequencies in Hz, errors in cents relative to docs/info.md, jitter in us.\n", fs);
+	fprintf(fp, "# Noise frequencies are LFSR shift rates. Cycle = oscillator steps before the state repeats, 0 if not found.\n");
+	fprintf(fp, "# period");
+	for (int mi : modes) {
+		const char *n = osc_modes[mi].name;
+		fprintf(fp, "\t%s_hz\t%s_cents\t%s_jitter_rms\t%s_jitter_peak\t%s_cycle", n, n, n, n, n);
+		if (subchannels && !osc_modes[mi].noise) fprintf(fp, "\t%s_sub0_hz\t%s_sub1_hz", n, n);
+	}
+	fprintf(fp, "\n");
+	int unclosed = 0;
+	double d0 = 0, d1 = 0;
+	if (!x3 && x2n == 0 && detune_exp + fifth != 0) d0 = fs * ldexp(1, detune_exp + fifth - 25);
+	if (detune_exp != 0) d1 = fs * ldexp(1, detune_exp - 25);
+	for (int p = 0; p < NUM_PERIODS; p++) {
+		fprintf(fp, "%d:%d", period_exp(p), period_mantissa(p));
+		for (int mi : modes) {
+			const OscPitch &r = results[mi][p];
+			double f = r.freq * fs;
+			fprintf(fp, "\t%.6f\t%.3f\t%.3f\t%.3f\t%d", f, cents(r.freq, osc_nominal_freq(osc_modes[mi].mode, p)), r.jitter_rms * 1e6 / fs, r.jitter_peak * 1e6 / fs, r.cycle_steps);
+			if (subchannels && !osc_modes[mi].noise) fprintf(fp, "\t%.6f\t%.6f", x3 ? 3*f : f - d0, (f + d1) * (1 << x2n));
+			if (r.cycle_steps == 0 && !(osc_modes[mi].noise && p >= NUM_MANTISSAS)) unclosed++;
+		}
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+	printf("Measured %d oscillator configurations in %.1f s, wrote %s\n", (int)jobs.size(), seconds, out_fname);
+	if (unclosed > 0) printf("Warning: %d configurations did not repeat within %d steps, averaged over that instead\n", unclosed, OSC_MAX_CYCLE_STEPS);
+
+	// Largest deviations from the documented frequencies
+	for (int mi : modes) {
+		double worst = 0, worst_jitter = 0;
+		int worst_p = 0, worst_jitter_p = 0;
+		for (int p = 0; p < NUM_PERIODS; p++) {
+			double c = cents(results[mi][p].freq, osc_nominal_freq(osc_modes[mi].mode, p));
+			if (fabs(c) > fabs(worst)) { worst = c; worst_p = p; }
+			if (results[mi][p].jitter_peak > worst_jitter) { worst_jitter = results[mi][p].jitter_peak; worst_jitter_p = p; }
+		}
+		printf("%-7s max deviation from docs/info.md %+.3f cents at %d:%d, max peak jitter %.1f us at %d:%d\n", osc_modes[mi].name,
+			worst, period_exp(worst_p), period_mantissa(worst_p), worst_jitter * 1e6 / fs, period_exp(worst_jitter_p), period_mantissa(worst_jitter_p));
+	}
+	printf("\n");
+
+	for (int mi : modes) {
+		if (!osc_modes[mi].noise) note_tables(stdout, osc_modes[mi], results[mi], fs, ref);
+	}
+
+	if (notes_fname != NULL) {
+		FILE *notes_fp = fopen(notes_fname, "w");
+		if (!notes_fp) {
+			printf("Failed to create notes file: %s\n", notes_fname);
+			return 1;
+		}
+		std::vector<int> tonal_modes;
+		for (int mi : modes) if (!osc_modes[mi].noise) tonal_modes.push_back(mi);
+		write_notes(notes_fp, results, tonal_modes, fs, ref);
+		fclose(notes_fp);
+		printf("Wrote %s\n", notes_fname);
+	}
+	return 0;
+}
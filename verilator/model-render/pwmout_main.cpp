@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Render what the board outputs: the PWM pin bit streams through an analog RC filter, decimated to audio rate.
+//
+// The bit streams either come from rendering an event script through the bit exact model (see pwls_pwm.h for
+// how the pins are reconstructed from out_acc), or from a capture by synth-sim with SAVE_PWM defined.
+// The filter output is averaged over each 64 cycle sample and decimated with the same filter as render,
+// and scaled the same way, so that an ideal filter (-rc 0) gives the same output as render as long as the
+// PWM doesn't clip. The ripple that is left on the filter output within each sample is reported.
+//
+// Usage: pwmout [options] events.txt num_frames
+//        pwmout [options] -bits pwm.bin
+//     -o <file>       output file, 16 bit raw audio (default: pwm.raw)
+//     -bits <file>    read a captured bit stream: 64 bit words, 64 cycles per word, bit i = cycle i
+//     -stereo         the captured bit stream has interleaved pwm_out and pwm_out_right words
+//     -common_sat     the stereo capture was made with common_sat on in channel 0, which changes the DC level of the pins
+//     -rc <Hz>        cutoff of the first RC section (default: 20000, 0 = none)
+//     -rc2 <Hz>       cutoff of a second RC section (default: 0 = none)
+//     -os <file>      also write the filter output every 8 cycles (8 MHz) as 32 bit floats, interleaved if stereo
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <stdint.h>
+#include <chrono>
+
+#include "../model/pwls_render.h"
+#include "../model/pwls_pwm.h"
+
+const char* audio_fname = "pwm.raw";
+const double default_rc_fc = 20000;
+
+
+// Filters and decimates the pin bit streams, one sample (64 cycles) per side at a time
+struct PwmOutput {
+	int num_sides;
+	RcOutputStage stages[2];
+	DecimationFilter filters[2];
+	std::vector<int16_t> audio;
+	FILE *os_fp;
+	int subsample;
+
+	// Ripple: filter output every 8 cycles minus the mean over its sample
+	double ripple_sum2, ripple_peak;
+	int64_t ripple_count;
+
+	// The filters start settled at the pin level for a zero sample, given as high cycles per sample for each pin
+	PwmOutput(int num_sides, double fc1, double fc2, const int *level_offset, FILE *os_fp) : num_sides(num_sides), os_fp(os_fp), subsample(0), ripple_sum2(0), ripple_peak(0), ripple_count(0) {
+		for (int side = 0; side < 2; side++) {
+			stages[side].init(fc1, fc2);
+			stages[side].reset((double)level_offset[side] / PWM_CYCLES);
+		}
+	}
+
+	void sample(const uint64_t *words, const int *level_offset) {
+		if (subsample == 0) {
+			for (int side = 0; side < num_sides; side++) audio.push_back(filtered_to_output(filters[side].next()));
+		}
+
+		float os[2][PWM_STEPS];
+		for (int side = 0; side < num_sides; side++) {
+			double level = stages[side].word(words[side], os[side]);
+			filters[side].add(pwm_level_to_sample(level, level_offset[side]) * FILTER_INPUT_SCALE, subsample);
+			for (int i = 0; i < PWM_STEPS; i++) {
+				double r = os[side][i] - level;
+				ripple_sum2 += r*r;
+				ripple_peak = std::max(ripple_peak, fabs(r));
+			}
+			ripple_count += PWM_STEPS;
+		}
+		if (os_fp != NULL) {
+			for (int i = 0; i < PWM_STEPS; i++) {
+				for (int side = 0; side < num_sides; side++) fwrite(&os[side][i], sizeof(float), 1, os_fp);
+			}
+		}
+		subsample = (subsample + 1) & (SAMPLES_PER_FRAME - 1);
+	}
+
+	void print_ripple() const {
+		if (ripple_count == 0) return;
+		double rms = sqrt(ripple_sum2 / ripple_count);
+		// relative to a sine over the full pin swing, which has an rms value of 1/(2*sqrt(2))
+		printf("PWM ripple: rms %.3g (%.1f dB), peak %.3g of the pin swing\n", rms, 20*log10(std::max(rms, 1e-30) * 2*sqrt(2.0)), ripple_peak);
+	}
+};
+
+const int mono_level_offset[2] = {PWM_LEVEL_OFFSET, PWM_LEVEL_OFFSET};
+
+void render_events(const std::vector<RegEvent> &events, int num_frames, PwmOutput &pwm) {
+	Model m;
+	PwmStereoTiming stereo_timing;
+	RenderState state(RENDER_DEFAULT);
+	SweepScheduler &sched = state.sched;
+	sched.reset(m);
+	size_t next_event = 0;
+	for (int frame = 0; frame < num_frames; frame++) {
+		next_event = apply_frame_events(m, sched, events, next_event, frame);
+		bool stereo_en = m.stereo_en();
+		if (stereo_en) stereo_timing.update(m);
+		const int *level_offset = stereo_en ? stereo_timing.level_offset : mono_level_offset;
+		for (int subsample = 0; subsample < SAMPLES_PER_FRAME; subsample++) {
+			int out[2] = {0, 0};
+			sched.sample(m, out);
+			uint64_t words[2];
+			if (stereo_en) stereo_timing.words(out, words);
+			else words[0] = words[1] = pwm_mono_word(out[0]);
+			pwm.sample(words, level_offset);
+		}
+	}
+}
+
+bool load_bits(const char *fname, std::vector<uint64_t> &words) {
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) {
+		printf("Failed to open bit stream file: %s\n", fname);
+		return false;
+	}
+	uint64_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, sizeof(uint64_t), 4096, fp)) > 0) words.insert(words.end(), buf, buf + n);
+	fclose(fp);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	const char *events_fname = NULL, *bits_fname = NULL, *os_fname = NULL;
+	int num_frames = -1;
+	bool stereo_bits = false, common_sat = false;
+	double fc1 = default_rc_fc, fc2 = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) audio_fname = argv[++i];
+		else if (!strcmp(argv[i], "-bits") && i + 1 < argc) bits_fname = argv[++i];
+		else if (!strcmp(argv[i], "-stereo")) stereo_bits = true;
+		else if (!strcmp(argv[i], "-common_sat")) common_sat = true;
+		else if (!strcmp(argv[i], "-rc") && i + 1 < argc) fc1 = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-rc2") && i + 1 < argc) fc2 = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-os") && i + 1 < argc) os_fname = argv[++i];
+		else if (events_fname == NULL && bits_fname == NULL) events_fname = argv[i];
+		else if (events_fname != NULL && num_frames < 0) num_frames = atoi(argv[i]);
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if ((bits_fname == NULL) == (events_fname == NULL) || (events_fname != NULL && num_frames < 0) || fc1 < 0 || fc2 < 0) {
+		printf("Usage: pwmout [-o pwm.raw] [-rc Hz] [-rc2 Hz] [-os os.f32] events.txt num_frames\n");
+		printf("       pwmout [-o pwm.raw] [-rc Hz] [-rc2 Hz] [-os os.f32] [-stereo] [-common_sat] -bits pwm.bin\n");
+		return 1;
+	}
+
+	std::vector<RegEvent> events;
+	std::vector<uint64_t> words;
+	bool stereo_out;
+	if (events_fname != NULL) {
+		if (!load_events(events_fname, events)) return 1;
+		stereo_out = events_use_stereo(events);
+		printf("%d events, %d frames, %s\n", (int)events.size(), num_frames, stereo_out ? "stereo" : "mono");
+	} else {
+		if (!load_bits(bits_fname, words)) return 1;
+		stereo_out = stereo_bits;
+		num_frames = words.size() / ((stereo_out ? 2 : 1) * SAMPLES_PER_FRAME);
+		printf("%d words, %d frames, %s\n", (int)words.size(), num_frames, stereo_out ? "stereo" : "mono");
+	}
+	printf("RC sections: %g Hz, %g Hz (0 = none)\n", fc1, fc2);
+
+	FILE *os_fp = NULL;
+	if (os_fname != NULL) {
+		os_fp = fopen(os_fname, "wb");
+		if (!os_fp) {
+			printf("Failed to create oversampled output file: %s\n", os_fname);
+			return 1;
+		}
+	}
+
+	// Pin levels at zero for the start, and for the whole of a capture
+	int level_offset[2] = {PWM_LEVEL_OFFSET, PWM_LEVEL_OFFSET};
+	if (stereo_out) {
+		Model m;
+		m.cfg = CFG_FLAG_STEREO_EN;
+		if (common_sat) m.set_reg(0, REG_MODE, MODE_FLAG_COMMON_SAT);
+		PwmStereoTiming stereo_timing;
+		stereo_timing.update(m);
+		level_offset[0] = stereo_timing.level_offset[0];
+		level_offset[1] = stereo_timing.level_offset[1];
+	}
+
+	int num_sides = stereo_out ? 2 : 1;
+	PwmOutput pwm(num_sides, fc1, fc2, level_offset, os_fp);
+	auto t0 = std::chrono::steady_clock::now();
+	if (events_fname != NULL) render_events(events, num_frames, pwm);
+	else {
+		int num_samples = num_frames * SAMPLES_PER_FRAME;
+		for (int i = 0; i < num_samples; i++) pwm.sample(&words[(size_t)i * num_sides], level_offset);
+	}
+	printf("Rendered in %.3f s\n", seconds_since(t0));
+	pwm.print_ripple();
+
+	if (os_fp != NULL) fclose(os_fp);
+	if (!save_audio(audio_fname, pwm.audio)) return 1;
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Render a register event script to audio through the bit exact model, splitting long renders over all cores.
+// Event scripts can be produced by synth-sim with SAVE_EVENTS defined.
+//
+// Usage: render [options] events.txt num_frames
+//     -o <file>       output file, 16 bit raw audio (default: audio.raw)
+//     -j <threads>    number of threads (default: number of cores)
+//     -chunk <frames> frames per chunk (default: 16384)
+//     -serial         render serially, one sample at a time
+//     -nocache        evaluate all waveform terms in full instead of using the wavetable cache
+//     -nokernels      use the generic model steps instead of the mode specialized kernels
+//     -check          render both serially and segmented, and check that the results are identical.
+//                     The reference render uses the generic model without the wavetable cache.
+//     -stems <prefix> also write what each subchannel adds to the mix to <prefix>ch<channel>_sub<subchannel>.raw,
+//                     captured in the same serial render pass
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <stdint.h>
+#include <chrono>
+
+#include "../model/pwls_render.h"
+
+const char* audio_fname = "audio.raw";
+const int default_chunk_frames = 1 << 14;
+
+
+int main(int argc, char** argv) {
+	const char *events_fname = NULL;
+	int num_frames = -1;
+	int num_threads = default_num_threads();
+	int chunk_frames = default_chunk_frames;
+	bool serial = false, check = false;
+	int features = RENDER_DEFAULT;
+	const char *stems_prefix = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) audio_fname = argv[++i];
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-chunk") && i + 1 < argc) chunk_frames = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-serial")) serial = true;
+		else if (!strcmp(argv[i], "-nocache")) features &= ~RENDER_WAVETABLES;
+		else if (!strcmp(argv[i], "-nokernels")) features &= ~RENDER_KERNELS;
+		else if (!strcmp(argv[i], "-check")) check = true;
+		else if (!strcmp(argv[i], "-stems") && i + 1 < argc) { stems_prefix = argv[++i]; serial = true; }
+		else if (events_fname == NULL) events_fname = argv[i];
+		else if (num_frames < 0) num_frames = atoi(argv[i]);
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (events_fname == NULL || num_frames < 0 || num_threads < 1 || chunk_frames < 1) {
+		printf("Usage: render [-o audio.raw] [-j threads] [-chunk frames] [-serial] [-nocache] [-nokernels] [-check] [-stems prefix] events.txt num_frames\n");
+		return 1;
+	}
+
+	std::vector<RegEvent> events;
+	if (!load_events(events_fname, events)) return 1;
+	bool stereo_out = events_use_stereo(events);
+	printf("%d events, %d frames, %s\n", (int)events.size(), num_frames, stereo_out ? "stereo" : "mono");
+
+	std::vector<int16_t> audio;
+	std::vector<int16_t> stems[NUM_STEMS];
+	auto t0 = std::chrono::steady_clock::now();
+	if (stems_prefix != NULL) render_serial_stems(events, num_frames, stereo_out, audio, stems, features);
+	else if (serial) render_serial(events, num_frames, stereo_out, audio, features);
+	else render_segmented(events, num_frames, stereo_out, chunk_frames, num_threads, audio, features);
+	printf("Rendered in %.3f s (%s)\n", seconds_since(t0), serial ? "serial" : "segmented");
+
+	if (check) {
+		std::vector<int16_t> ref;
+		t0 = std::chrono::steady_clock::now();
+		if (serial) render_segmented(events, num_frames, stereo_out, chunk_frames, num_threads, ref, 0);
+		else render_serial(events, num_frames, stereo_out, ref, 0);
+		printf("Rendered in %.3f s (%s)\n", seconds_since(t0), serial ? "segmented" : "serial");
+
+		size_t n = std::min(audio.size(), ref.size());
+		size_t first_diff = n;
+		for (size_t i = 0; i < n; i++) {
+			if (audio[i] != ref[i]) { first_diff = i; break; }
+		}
+		if (first_diff != n || audio.size() != ref.size()) {
+			printf("ERROR: serial and segmented renders differ at output sample %d!\n", (int)first_diff);
+			return 1;
+		}
+		printf("Serial and segmented renders are identical\n");
+	}
+
+	if (!save_audio(audio_fname, audio)) return 1;
+	if (stems_prefix != NULL) {
+		for (int term_index = 0; term_index < NUM_STEMS; term_index++) {
+			char fname[1024];
+			snprintf(fname, sizeof(fname), "%sch%d_sub%d.raw", stems_prefix, term_index >> 1, term_index & 1);
+			if (!save_audio(fname, stems[term_index])) return 1;
+		}
+		printf("Wrote %d stems to %sch*_sub*.raw\n", NUM_STEMS, stems_prefix);
+	}
+	return 0;
+}
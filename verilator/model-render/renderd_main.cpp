@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Local render daemon: keeps a pool of render workers ready on a Unix domain socket, so that short renders
+// don't pay for process startup. Each worker keeps its RenderState (kernels and wavetable cache) between jobs,
+// optionally prewarmed with a render at startup. Jobs are queued and handed out to the workers in order,
+// and each job's audio is streamed back to its client while it renders.
+//
+// Usage: renderd [options]                                 run the daemon
+//        renderd -client [options] events.txt num_frames   render through the daemon
+//        renderd -stats [options]                          print the daemon's statistics
+//     -socket <path>         socket path (default: renderd.sock)
+//     -j <workers>           number of workers (default: number of cores)
+//     -queue <n>             max number of queued jobs, more are rejected (default: 256)
+//     -warm <events> <n>     render n frames of the event script in each worker at startup, to fill the wavetable caches
+//     -nocache, -nokernels   as for render
+//     -o <file>              client output file, 16 bit raw audio (default: audio.raw)
+//
+// Protocol: the client sends requests as text lines, and can send several requests over one connection.
+//     render <num_frames> <num_events>   followed by num_events lines "frame reg channel data", sorted by frame.
+//                                        Reply: "ok <num_frames> <num_sides>" when a worker takes the job, followed by
+//                                        num_frames*num_sides interleaved 16 bit little endian samples,
+//                                        or "error <message>".
+//     stats                              Reply: "<name> <value>" lines, ending with "end".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "../model/pwls_render.h"
+
+const char* socket_fname = "renderd.sock";
+const char* audio_fname = "audio.raw";
+
+const int max_job_frames = 1 << 26;
+const int max_job_events = 1 << 22;
+const int stream_block_frames = 1 << 12;
+const int latency_history = 1024;
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_between(Clock::time_point t0, Clock::time_point t1) {
+	return std::chrono::duration<double>(t1 - t0).count();
+}
+
+
+// Buffered line reads and full writes on a socket
+struct Connection {
+	int fd;
+	char buf[4096];
+	size_t len, pos;
+
+	Connection(int fd) : fd(fd), len(0), pos(0) {}
+
+	bool read_line(std::string &line) {
+		line.clear();
+		for (;;) {
+			while (pos < len) {
+				char c = buf[pos++];
+				if (c == '\n') return true;
+				if (c != '\r') line += c;
+				if (line.size() > 256) return false;
+			}
+			ssize_t n = recv(fd, buf, sizeof(buf), 0);
+			if (n <= 0) return false;
+			len = n;
+			pos = 0;
+		}
+	}
+
+	// Read exactly n bytes, after any buffered data
+	bool read_bytes(void *data, size_t n) {
+		char *p = (char *)data;
+		size_t m = std::min(n, len - pos);
+		memcpy(p, buf + pos, m);
+		pos += m;
+		for (size_t done = m; done < n;) {
+			ssize_t r = recv(fd, p + done, n - done, 0);
+			if (r <= 0) return false;
+			done += r;
+		}
+		return true;
+	}
+
+	bool write_bytes(const void *data, size_t n) {
+		const char *p = (const char *)data;
+		while (n > 0) {
+			ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+			if (r <= 0) return false;
+			p += r;
+			n -= r;
+		}
+		return true;
+	}
+
+	bool write_line(const std::string &line) { return write_bytes((line + "\n").data(), line.size() + 1); }
+};
+
+
+struct Job {
+	Connection *conn;
+	std::vector<RegEvent> events;
+	int num_frames;
+	Clock::time_point queued;
+
+	bool done, ok;
+
+	Job() : conn(NULL), num_frames(0), done(false), ok(false) {}
+};
+
+struct DaemonStats {
+	uint64_t jobs_done, jobs_failed, jobs_rejected, frames;
+	int max_queue_depth;
+	double wait[latency_history], latency[latency_history]; // seconds, for the last jobs
+	int num_latencies;
+
+	DaemonStats() { memset(this, 0, sizeof(*this)); }
+
+	void add(double job_wait, double job_latency) {
+		wait[num_latencies % latency_history] = job_wait;
+		latency[num_latencies % latency_history] = job_latency;
+		num_latencies++;
+	}
+};
+
+struct Daemon {
+	int num_workers, max_queue;
+	int features;
+	std::vector<RegEvent> warm_events;
+	int warm_frames;
+
+	std::mutex mutex;
+	std::condition_variable job_added, job_done;
+	std::deque<Job *> queue;
+	int busy_workers;
+	DaemonStats stats;
+	Clock::time_point start_time;
+
+	Daemon() : num_workers(default_num_threads()), max_queue(256), features(RENDER_DEFAULT), warm_frames(0), busy_workers(0) {}
+
+	// Queue a job and wait for it to finish. Returns false if the queue is full.
+	bool run_job(Job &job) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if ((int)queue.size() >= max_queue) {
+			stats.jobs_rejected++;
+			return false;
+		}
+		job.queued = Clock::now();
+		queue.push_back(&job);
+		stats.max_queue_depth = std::max(stats.max_queue_depth, (int)queue.size());
+		job_added.notify_one();
+		job_done.wait(lock, [&]() { return job.done; });
+		return true;
+	}
+
+	void worker() {
+		RenderState state(features);
+		if (warm_frames > 0) render_serial_blocks(state, warm_events, warm_frames, events_use_stereo(warm_events), stream_block_frames, [](const int16_t *, size_t) { return true; });
+
+		for (;;) {
+			Job *job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				job_added.wait(lock, [&]() { return !queue.empty(); });
+				job = queue.front();
+				queue.pop_front();
+				busy_workers++;
+			}
+
+			Clock::time_point t_start = Clock::now();
+			bool stereo_out = events_use_stereo(job->events);
+			Connection &conn = *job->conn;
+			bool ok = conn.write_line("ok " + std::to_string(job->num_frames) + " " + std::to_string(stereo_out ? 2 : 1));
+			// Samples are sent as little endian, like the raw files
+			if (ok) ok = render_serial_blocks(state, job->events, job->num_frames, stereo_out, stream_block_frames,
+				[&](const int16_t *samples, size_t n) { return conn.write_bytes(samples, n * sizeof(int16_t)); });
+			Clock::time_point t_end = Clock::now();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			busy_workers--;
+			if (ok) {
+				stats.jobs_done++;
+				stats.frames += job->num_frames;
+				stats.add(seconds_between(job->queued, t_start), seconds_between(job->queued, t_end));
+			} else stats.jobs_failed++;
+			job->ok = ok;
+			job->done = true;
+			job_done.notify_all();
+		}
+	}
+
+	static double percentile(std::vector<double> &v, double p) {
+		if (v.empty()) return 0;
+		size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+		std::nth_element(v.begin(), v.begin() + i, v.end());
+		return v[i];
+	}
+
+	std::vector<std::string> stats_lines() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<std::string> lines;
+		char line[128];
+		auto add = [&](const char *name, double value) {
+			snprintf(line, sizeof(line), "%s %.6g", name, value);
+			lines.push_back(line);
+		};
+		add("uptime_s", seconds_between(start_time, Clock::now()));
+		add("workers", num_workers);
+		add("busy_workers", busy_workers);
+		add("queue_depth", queue.size());
+		add("max_queue_depth", stats.max_queue_depth);
+		add("jobs_done", stats.jobs_done);
+		add("jobs_failed", stats.jobs_failed);
+		add("jobs_rejected", stats.jobs_rejected);
+		add("frames", stats.frames);
+
+		int n = std::min(stats.num_latencies, latency_history);
+		std::vector<double> wait(stats.wait, stats.wait + n), latency(stats.latency, stats.latency + n);
+		add("wait_p50_ms", 1e3 * percentile(wait, 0.5));
+		add("wait_p95_ms", 1e3 * percentile(wait, 0.95));
+		add("latency_p50_ms", 1e3 * percentile(latency, 0.5));
+		add("latency_p95_ms", 1e3 * percentile(latency, 0.95));
+		add("latency_max_ms", 1e3 * percentile(latency, 1.0));
+		return lines;
+	}
+
+	// Parse the events of a render request
+	bool read_events(Connection &conn, int num_events, std::vector<RegEvent> &events, std::string &error) {
+		std::string line;
+		for (int i = 0; i < num_events; i++) {
+			RegEvent e;
+			if (!conn.read_line(line)) {
+				error = "connection closed";
+				return false;
+			}
+			if (sscanf(line.c_str(), "%i %i %i %i", &e.frame, &e.reg, &e.channel, &e.data) != 4) {
+				error = "expected: frame reg channel data";
+				return false;
+			}
+			if (!events.empty() && e.frame < events.back().frame) {
+				error = "events are not sorted by frame";
+				return false;
+			}
+			events.push_back(e);
+		}
+		return true;
+	}
+
+	void serve(int fd) {
+		Connection conn(fd);
+		std::string line;
+		while (conn.read_line(line)) {
+			int num_frames, num_events;
+			if (line == "stats") {
+				bool ok = true;
+				for (const std::string &s : stats_lines()) ok = ok && conn.write_line(s);
+				if (!ok || !conn.write_line("end")) break;
+			} else if (sscanf(line.c_str(), "render %d %d", &num_frames, &num_events) == 2) {
+				Job job;
+				job.conn = &conn;
+				job.num_frames = num_frames;
+				std::string error;
+				// After a bad request, the rest of it can't be skipped reliably, so the connection is closed
+				if (num_frames < 1 || num_frames > max_job_frames || num_events < 0 || num_events > max_job_events) error = "bad number of frames or events";
+				else if (!read_events(conn, num_events, job.events, error)) {}
+				else if (!run_job(job)) {
+					if (conn.write_line("error queue full")) continue;
+				} else if (job.ok) continue; // else the client went away, or its connection broke
+
+				if (!error.empty()) conn.write_line("error " + error);
+				break;
+			} else {
+				conn.write_line("error unknown request");
+				break;
+			}
+		}
+		close(fd);
+	}
+
+	int run() {
+		int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(socket_fname) >= sizeof(addr.sun_path)) {
+			printf("Socket path too long: %s\n", socket_fname);
+			return 1;
+		}
+		strcpy(addr.sun_path, socket_fname);
+		unlink(socket_fname);
+		if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+			printf("Failed to listen on socket: %s\n", socket_fname);
+			return 1;
+		}
+
+		start_time = Clock::now();
+		for (int i = 0; i < num_workers; i++) std::thread(&Daemon::worker, this).detach();
+		printf("Listening on %s with %d workers\n", socket_fname, num_workers);
+		fflush(stdout);
+
+		for (;;) {
+			int fd = accept(listen_fd, NULL, NULL);
+			if (fd < 0) continue;
+			std::thread(&Daemon::serve, this, fd).detach();
+		}
+	}
+};
+
+
+int connect_daemon() {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_fname, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+		printf("Failed to connect to the render daemon: %s\n", socket_fname);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int run_stats_client() {
+	int fd = connect_daemon();
+	if (fd < 0) return 1;
+	Connection conn(fd);
+	std::string line;
+	bool ok = conn.write_line("stats");
+	while (ok && (ok = conn.read_line(line)) && line != "end") printf("%s\n", line.c_str());
+	close(fd);
+	return ok ? 0 : 1;
+}
+
+int run_render_client(const char *events_fname, int num_frames) {
+	std::vector<RegEvent> events;
+	if (!load_events(events_fname, events)) return 1;
+	int fd = connect_daemon();
+	if (fd < 0) return 1;
+
+	Clock::time_point t0 = Clock::now();
+	Connection conn(fd);
+	std::string request = "render " + std::to_string(num_frames) + " " + std::to_string(events.size()) + "\n";
+	for (const RegEvent &e : events) request += std::to_string(e.frame) + " " + std::to_string(e.reg) + " " + std::to_string(e.channel) + " " + std::to_string(e.data) + "\n";
+
+	std::string reply;
+	int reply_frames, num_sides;
+	if (!conn.write_bytes(request.data(), request.size()) || !conn.read_line(reply)) {
+		printf("Lost the connection to the render daemon\n");
+		close(fd);
+		return 1;
+	}
+	if (sscanf(reply.c_str(), "ok %d %d", &reply_frames, &num_sides) != 2) {
+		printf("Render daemon: %s\n", reply.c_str());
+		close(fd);
+		return 1;
+	}
+
+	std::vector<int16_t> audio((size_t)reply_frames * num_sides);
+	bool ok = conn.read_bytes(audio.data(), audio.size() * sizeof(int16_t));
+	close(fd);
+	if (!ok) {
+		printf("Lost the connection to the render daemon\n");
+		return 1;
+	}
+	printf("%d events, %d frames, %s, rendered by the daemon in %.3f s\n", (int)events.size(), reply_frames, num_sides == 2 ? "stereo" : "mono", seconds_between(t0, Clock::now()));
+	return save_audio(audio_fname, audio) ? 0 : 1;
+}
+
+void handle_exit_signal(int) {
+	unlink(socket_fname);
+	_exit(0);
+}
+
+
+int main(int argc, char** argv) {
+	Daemon daemon;
+	bool client = false, stats = false;
+	const char *events_fname = NULL, *warm_fname = NULL;
+	int num_frames = -1;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-socket") && i + 1 < argc) socket_fname = argv[++i];
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) daemon.num_workers = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-queue") && i + 1 < argc) daemon.max_queue = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-warm") && i + 2 < argc) {
+			warm_fname = argv[++i];
+			daemon.warm_frames = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-nocache")) daemon.features &= ~RENDER_WAVETABLES;
+		else if (!strcmp(argv[i], "-nokernels")) daemon.features &= ~RENDER_KERNELS;
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc) audio_fname = argv[++i];
+		else if (!strcmp(argv[i], "-client")) client = true;
+		else if (!strcmp(argv[i], "-stats")) stats = true;
+		else if (client && events_fname == NULL) events_fname = argv[i];
+		else if (client && num_frames < 0) num_frames = atoi(argv[i]);
+		else {
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (stats) return run_stats_client();
+	if (client) {
+		if (events_fname == NULL || num_frames < 1) {
+			printf("Usage: renderd -client [-socket path] [-o audio.raw] events.txt num_frames\n");
+			return 1;
+		}
+		return run_render_client(events_fname, num_frames);
+	}
+
+	if (daemon.num_workers < 1 || daemon.max_queue < 1 || (warm_fname != NULL && daemon.warm_frames < 1)) {
+		printf("Usage: renderd [-socket path] [-j workers] [-queue n] [-warm events.txt frames] [-nocache] [-nokernels]\n");
+		return 1;
+	}
+	if (warm_fname != NULL && !load_events(warm_fname, daemon.warm_events)) return 1;
+
+	signal(SIGINT, handle_exit_signal);
+	signal(SIGTERM, handle_exit_signal);
+	return daemon.run();
+}
@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Measure aliasing and quantization noise of the waveform modes over a grid of periods and slopes.
+// Each configuration plays a single channel at full amplitude through the bit exact model steps (the mode specialized
+// kernels), and the raw synth output at 1 MHz is analyzed with a Blackman-Harris windowed FFT, up to the audio band limit.
+// Configurations are spread over all cores.
+//
+// Columns:
+//     f0        exact long run oscillator frequency, see pwls_pitch.h (Hz)
+//     fund      power of the fundamental, relative to a full scale sine (dB)
+//     harm      power in the harmonics, including the fundamental (dB)
+//     inharm    power in the band outside the harmonics and DC: aliasing and quantization noise (dB)
+//     snr       harm - inharm (dB)
+//     spur      strongest inharmonic tone: frequency (Hz) and power relative to the fundamental (dBc).
+//               For noise, relative to the median noise floor over the same number of bins instead.
+//               The frequency is - when there is nothing but rounding errors outside the harmonics.
+//     spurs     number of inharmonic tones above the spur threshold
+//     flat      spectral flatness of the band (dB, 0 for white noise)
+//
+// Usage: spectrum [options]
+//     -modes <list>       comma separated modes out of linear, pwl, noise, orion, 4bit (default: all)
+//     -periods <list>     comma separated period register values, or oct:mantissa pairs
+//                         (default: all octaves with mantissas 0, 256, 512, 768)
+//     -slopes <list>      comma separated slope register values, used for both slopes (default: 0x08, 0x28, 0x48, 0x68)
+//     -pwm <value>        PWM offset register value (default: 64)
+//     -channel <n>        channel to play on; noise uses the 18 bit LFSR on channels 0 and 3 (default: 0)
+//     -band <hz>          upper edge of the analyzed band (default: 20000)
+//     -spur <db>          count tones above this many dBc as spurs (default: -60)
+//     -noise_spur <db>    count tones this many dB above the noise floor as spurs in noise mode (default: 10)
+//     -csv <file>         also write the table as CSV
+//     -j <threads>        number of threads (default: number of cores)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "../model/pwls_render.h"
+#include "../model/pwls_fft.h"
+#include "../model/pwls_pitch.h"
+
+const double SAMPLE_SCALE = 1.0 / (1 << (BITS - 1)); // out_acc_to_sample to full scale
+
+const int WARMUP_SAMPLES = 1 << 16;
+const int MIN_WINDOW = 1 << 14;
+const int MAX_WINDOW = 1 << 22;
+const int BINS_PER_HARMONIC = 16;   // minimum harmonic spacing in bins, sets the window size for low notes
+const int NOISE_WINDOW = 1 << 14;
+const int NOISE_AVERAGES = 32;      // windows averaged for the noise spectrum
+
+const int default_pwm_offset = 64;  // same defaults as synth-sim
+const int default_slopes[] = {0x08, 0x28, 0x48, 0x68};
+const int default_mantissas[] = {0, 256, 512, 768};
+
+
+struct WaveMode {
+	const char *name;
+	int mode;
+};
+
+const WaveMode wave_modes[] = {
+	{"linear", 0},
+	{"pwl", MODE_FLAG_PWL_OSC},
+	{"noise", MODE_FLAG_NOISE},
+	{"orion", MODE_FLAGS_ORION},
+	{"4bit", MODE_FLAG_OSC_SYNC_SOFT}, // MODE_FLAG_OSC_SYNC_SOFT without MODE_FLAG_OSC_SYNC_EN selects 4 bit mode
+};
+const int NUM_WAVE_MODES = sizeof(wave_modes) / sizeof(wave_modes[0]);
+
+struct SpectrumConfig {
+	int wave_mode; // index into wave_modes
+	int period, slope;
+};
+
+struct SpectrumResult {
+	double f0;
+	double fund, harm, inharm; // power, full scale sine = 1
+	double spur_freq, spur;    // spur relative to the reference (fundamental, or noise floor)
+	int num_spurs;
+	double flatness;
+	int window;
+};
+
+
+// Play the configuration and return the raw output samples after a warmup, along with the exact f0 from pwls_pitch.h
+void render_config(const SpectrumConfig &c, int channel, int pwm_offset, std::vector<int16_t> &samples, double &f0) {
+	const WaveMode &wm = wave_modes[c.wave_mode];
+	bool noise = (wm.mode & MODE_FLAGS_WAVEFORM) == MODE_FLAG_NOISE;
+
+	f0 = 0;
+	int n = NOISE_WINDOW * NOISE_AVERAGES;
+	if (!noise) {
+		OscPitch pitch;
+		measure_oscillator(wm.mode, c.period, channel, pitch);
+		f0 = pitch.freq * SAMPLE_RATE;
+		n = MIN_WINDOW;
+		while (n < MAX_WINDOW && n * f0 < BINS_PER_HARMONIC * SAMPLE_RATE) n <<= 1;
+	}
+
+	Model m;
+	m.set_reg(channel, REG_PERIOD, c.period);
+	m.set_reg(channel, REG_AMP, (1 << reg_bits[REG_AMP]) - 1);
+	m.set_reg(channel, REG_SLOPE0, c.slope);
+	m.set_reg(channel, REG_SLOPE1, c.slope);
+	m.set_reg(channel, REG_PWM_OFFSET, pwm_offset);
+	m.set_reg(channel, REG_MODE, wm.mode);
+	ModelKernels kernels;
+	SweepScheduler sched(NULL, &kernels);
+	sched.reset(m);
+
+	int out[2] = {0, 0};
+	for (int i = 0; i < WARMUP_SAMPLES; i++) sched.sample(m, out);
+	samples.resize(n);
+	for (int i = 0; i < n; i++) {
+		sched.sample(m, out);
+		samples[i] = out_acc_to_sample(out[0], false);
+	}
+}
+
+// Sum of the inharmonic bins within lobe of k, clipped to [0, end)
+double lobe_power(const std::vector<double> &p, const std::vector<bool> &harmonic, int k, int lobe, int end) {
+	double sum = 0;
+	for (int i = std::max(0, k - lobe); i <= std::min(end - 1, k + lobe); i++) {
+		if (!harmonic[i]) sum += p[i];
+	}
+	return sum;
+}
+
+void analyze_config(const SpectrumConfig &c, int channel, int pwm_offset, double band, double spur_db, double noise_spur_db, SpectrumResult &r) {
+	bool noise = (wave_modes[c.wave_mode].mode & MODE_FLAGS_WAVEFORM) == MODE_FLAG_NOISE;
+	std::vector<int16_t> samples;
+	render_config(c, channel, pwm_offset, samples, r.f0);
+
+	// Power spectrum, averaged over several windows for noise
+	int window = noise ? NOISE_WINDOW : samples.size();
+	int num_windows = samples.size() / window;
+	SpectrumAnalyzer analyzer(window, WINDOW_BLACKMAN_HARRIS);
+	int num_bins = analyzer.num_bins();
+	std::vector<double> p(num_bins), pw(num_bins);
+	for (int w = 0; w < num_windows; w++) {
+		analyzer.power(samples.data() + (size_t)w*window, 1, SAMPLE_SCALE, pw.data());
+		for (int k = 0; k < num_bins; k++) p[k] += pw[k] / num_windows;
+	}
+	r.window = window;
+
+	// Scale so that a full scale sine has power 1
+	for (int k = 0; k < num_bins; k++) p[k] *= 2;
+
+	int lobe = analyzer.lobe_bins;
+	int end = std::min(num_bins, (int)(band * window / SAMPLE_RATE) + 1);
+	double bins_per_f0 = r.f0 * window / SAMPLE_RATE;
+
+	// Classify the bins: DC, harmonic (within a main lobe of a multiple of f0), or inharmonic
+	std::vector<bool> harmonic(std::max(end, 0), false);
+	for (int k = 0; k <= lobe && k < end; k++) harmonic[k] = true; // exclude DC like the harmonics
+	r.fund = r.harm = r.inharm = 0;
+	double log_sum = 0, sum = 0;
+	for (int k = lobe + 1; k < end; k++) {
+		if (!noise) {
+			int h = (int)floor(k / bins_per_f0 + 0.5);
+			harmonic[k] = h >= 1 && fabs(k - h*bins_per_f0) <= lobe + 1;
+			if (harmonic[k] && h == 1) r.fund += p[k];
+		}
+		if (harmonic[k]) r.harm += p[k];
+		else r.inharm += p[k];
+		log_sum += log(p[k] + 1e-30);
+		sum += p[k];
+	}
+	int num_band_bins = end - (lobe + 1);
+	r.flatness = num_band_bins > 0 && sum > 0 ? 10*(log_sum/num_band_bins - log(sum/num_band_bins)) / log(10) : 0;
+
+	// Reference for the spurs: the fundamental, or the median noise power over a main lobe
+	double ref = r.fund, threshold = spur_db;
+	if (noise) {
+		std::vector<double> sorted(p.begin() + lobe + 1, p.begin() + std::max(end, lobe + 1));
+		double median = 0;
+		if (!sorted.empty()) {
+			std::nth_element(sorted.begin(), sorted.begin() + sorted.size()/2, sorted.end());
+			median = sorted[sorted.size()/2];
+		}
+		ref = median * (2*lobe + 1);
+		threshold = noise_spur_db;
+	}
+
+	// Spurs: local maxima among the inharmonic bins, measured over their main lobe
+	r.spur = 0;
+	r.spur_freq = 0;
+	r.num_spurs = 0;
+	for (int k = lobe + 2; k < end - 1; k++) {
+		if (harmonic[k] || p[k] < p[k-1] || p[k] < p[k+1]) continue;
+		double power = lobe_power(p, harmonic, k, lobe, end);
+		if (power > r.spur) {
+			r.spur = power;
+			r.spur_freq = k * SAMPLE_RATE / window;
+		}
+		if (ref > 0 && 10*log10(power / ref) > threshold) r.num_spurs++;
+	}
+	if (ref > 0) r.spur /= ref;
+	else r.spur = 0;
+}
+
+
+// Exactly periodic signals leave only rounding errors outside the harmonics, so clamp to a floor
+const double DB_FLOOR = -200;
+double to_db(double power) { return power > 0 ? std::max(DB_FLOOR, 10*log10(power)) : DB_FLOOR; }
+
+void format_row(const SpectrumConfig &c, const SpectrumResult &r, bool noise, char *columns[12], char buf[12][32]) {
+	for (int i = 0; i < 12; i++) columns[i] = buf[i];
+	snprintf(buf[0], 32, "%s", wave_modes[c.wave_mode].name);
+	snprintf(buf[1], 32, "%d:%d", c.period >> MANTISSA_BITS, c.period & ((1 << MANTISSA_BITS) - 1));
+	snprintf(buf[2], 32, "0x%02x", c.slope);
+	if (noise) {
+		for (int i = 3; i < 8; i++) snprintf(buf[i], 32, "-");
+		snprintf(buf[6], 32, "%.1f", to_db(r.inharm));
+	} else {
+		snprintf(buf[3], 32, "%.3f", r.f0);
+		snprintf(buf[4], 32, "%.1f", to_db(r.fund));
+		snprintf(buf[5], 32, "%.1f", to_db(r.harm));
+		snprintf(buf[6], 32, "%.1f", to_db(r.inharm));
+		snprintf(buf[7], 32, "%.1f", to_db(r.harm) - to_db(r.inharm));
+	}
+	if (to_db(r.spur) > DB_FLOOR) snprintf(buf[8], 32, "%.0f", r.spur_freq);
+	else snprintf(buf[8], 32, "-"); // only rounding errors outside the harmonics
+	snprintf(buf[9], 32, "%.1f", to_db(r.spur));
+	snprintf(buf[10], 32, "%d", r.num_spurs);
+	snprintf(buf[11], 32, "%.1f", r.flatness);
+}
+
+const char *column_names[12] = {"mode", "period", "slope", "f0", "fund", "harm", "inharm", "snr", "spur_hz", "spur_db", "spurs", "flat"};
+const int column_widths[12] = {-7, 8, 6, 11, 7, 7, 7, 6, 8, 8, 6, 6};
+
+
+// Parse a comma separated list of integers (any base strtol accepts), or oct:mantissa pairs if allow_pairs
+bool parse_list(const char *s, std::vector<int> &values, bool allow_pairs) {
+	values.clear();
+	while (*s) {
+		char *end;
+		int value = strtol(s, &end, 0);
+		if (end == s) return false;
+		if (allow_pairs && *end == ':') {
+			const char *m = end + 1;
+			value = (value << MANTISSA_BITS) | strtol(m, &end, 0);
+			if (end == m) return false;
+		}
+		values.push_back(value);
+		s = end;
+		if (*s == ',') s++;
+		else if (*s) return false;
+	}
+	return !values.empty();
+}
+
+bool parse_modes(const char *s, std::vector<int> &modes) {
+	modes.clear();
+	std::string list = s;
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos) end = list.size();
+		std::string name = list.substr(start, end - start);
+		int index = -1;
+		for (int i = 0; i < NUM_WAVE_MODES; i++) if (name == wave_modes[i].name) index = i;
+		if (index < 0) {
+			printf("Unknown mode: %s\n", name.c_str());
+			return false;
+		}
+		modes.push_back(index);
+		start = end + 1;
+	}
+	return true;
+}
+
+
+int main(int argc, char** argv) {
+	std::vector<int> modes, periods, slopes;
+	for (int i = 0; i < NUM_WAVE_MODES; i++) modes.push_back(i);
+	for (int oct = 0; oct < (1 << OCT_BITS); oct++) {
+		for (int mantissa : default_mantissas) periods.push_back((oct << MANTISSA_BITS) | mantissa);
+	}
+	slopes.assign(default_slopes, default_slopes + sizeof(default_slopes)/sizeof(default_slopes[0]));
+	int pwm_offset = default_pwm_offset;
+	int channel = 0;
+	double band = 20000, spur_db = -60, noise_spur_db = 10;
+	const char *csv_fname = NULL;
+	int num_threads = default_num_threads();
+
+	for (int i = 1; i < argc; i++) {
+		bool ok = true;
+		if (!strcmp(argv[i], "-modes") && i + 1 < argc) ok = parse_modes(argv[++i], modes);
+		else if (!strcmp(argv[i], "-periods") && i + 1 < argc) ok = parse_list(argv[++i], periods, true);
+		else if (!strcmp(argv[i], "-slopes") && i + 1 < argc) ok = parse_list(argv[++i], slopes, false);
+		else if (!strcmp(argv[i], "-pwm") && i + 1 < argc) pwm_offset = strtol(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-channel") && i + 1 < argc) channel = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-band") && i + 1 < argc) band = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-spur") && i + 1 < argc) spur_db = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-noise_spur") && i + 1 < argc) noise_spur_db = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-csv") && i + 1 < argc) csv_fname = argv[++i];
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else {
+			printf("Usage: spectrum [-modes list] [-periods list] [-slopes list] [-pwm value] [-channel n] [-band hz] [-spur db] [-noise_spur db] [-csv file] [-j threads]\n");
+			return 1;
+		}
+		if (!ok) {
+			printf("Bad list: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	for (int period : periods) {
+		if (period < 0 || period >= (1 << PERIOD_BITS)) { printf("Period out of range: %d\n", period); return 1; }
+	}
+	for (int slope : slopes) {
+		if (slope < 0 || slope >= (1 << reg_bits[REG_SLOPE0])) { printf("Slope out of range: %d\n", slope); return 1; }
+	}
+	if (pwm_offset < 0 || pwm_offset >= (1 << reg_bits[REG_PWM_OFFSET]) || channel < 0 || channel >= NUM_CHANNELS ||
+			band <= 0 || band > SAMPLE_RATE/2 || num_threads < 1) {
+		printf("Option out of range\n");
+		return 1;
+	}
+
+	std::vector<SpectrumConfig> configs;
+	for (int mode : modes) {
+		for (int period : periods) {
+			for (int slope : slopes) configs.push_back({mode, period, slope});
+		}
+	}
+
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<SpectrumResult> results(configs.size());
+	parallel_for(configs.size(), num_threads, [&](int i) {
+		analyze_config(configs[i], channel, pwm_offset, band, spur_db, noise_spur_db, results[i]);
+	});
+	double seconds = seconds_since(t0);
+
+	FILE *csv = NULL;
+	if (csv_fname != NULL && (csv = fopen(csv_fname, "w")) == NULL) {
+		printf("Failed to create CSV file: %s\n", csv_fname);
+		return 1;
+	}
+
+	for (int i = 0; i < 12; i++) printf("%*s ", column_widths[i], column_names[i]);
+	printf("\n");
+	if (csv != NULL) {
+		for (int i = 0; i < 12; i++) fprintf(csv, "%s%s", i == 0 ? "" : ",", column_names[i]);
+		fprintf(csv, "\n");
+	}
+	for (size_t i = 0; i < configs.size(); i++) {
+		char *columns[12], buf[12][32];
+		bool noise = (wave_modes[configs[i].wave_mode].mode & MODE_FLAGS_WAVEFORM) == MODE_FLAG_NOISE;
+		format_row(configs[i], results[i], noise, columns, buf);
+		for (int j = 0; j < 12; j++) printf("%*s ", column_widths[j], columns[j]);
+		printf("\n");
+		if (csv != NULL) {
+			for (int j = 0; j < 12; j++) fprintf(csv, "%s%s", j == 0 ? "" : ",", columns[j]);
+			fprintf(csv, "\n");
+		}
+	}
+	if (csv != NULL) fclose(csv);
+
+	printf("\n%d configurations analyzed in %.1f s, band 0-%.0f Hz\n", (int)configs.size(), seconds, band);
+	return 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Waveform atlas: one oscillator cycle for each point of a grid over the waveform parameters, for finding the
+// parameters that give a waveform shape.
+//
+// An atlas point is a set of slope0, slope1, pwm_offset and mode register values. Its cycle is the channel output
+// (both subchannels, amp 63) for each of the 2^PHASE_BITS phase values, evaluated with the bit exact model the same way
+// as the wavetables, and box filtered down to the atlas resolution. Modes with detune or noise have no fixed cycle.
+// Neither has the PWL oscillator, whose shape depends on the period (evaluated over the phase it is the same as linear),
+// or oscillator sync, which restarts the cycle from the other oscillator.
+//
+// Cycle cache file (little endian), so that points are only rendered once:
+//     header: magic "PWLSATLC", version, resolution, num_points (uint32 each), fingerprint (uint64)
+//     num_points records of AtlasPoint followed by resolution int16 samples
+// The fingerprint is a hash of the full resolution cycles of a fixed set of probe points. When a model change alters
+// the probes, the cache is discarded. Changes that leave all the probes the same need a forced rebuild.
+//
+// Shape index file (little endian), for nearest shape lookup:
+//     header: magic "PWLSATLI", version, shape_points, num_points (uint32 each), fingerprint (uint64)
+//     num_points AtlasShape records
+// A shape is the cycle box filtered to ATLAS_SHAPE_POINTS points, with DC removed and scaled to unit rms.
+// Lookup compares a query shape against every shape at every circular shift, so the phase of the query doesn't matter.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "pwls_model.h"
+#include "pwls_wavetable.h"
+
+const char ATLAS_CACHE_MAGIC[8] = {'P', 'W', 'L', 'S', 'A', 'T', 'L', 'C'};
+const char ATLAS_INDEX_MAGIC[8] = {'P', 'W', 'L', 'S', 'A', 'T', 'L', 'I'};
+const uint32_t ATLAS_VERSION = 1;
+const int ATLAS_CYCLE_LENGTH = 1 << PHASE_BITS;
+const int ATLAS_SHAPE_POINTS = 32;
+const float ATLAS_SHAPE_SCALE = 32; // shape value for an rms of 1, leaves room for a crest factor of 4
+const int ATLAS_AMP = 63;
+
+struct AtlasPoint {
+	uint16_t slope0, slope1, pwm_offset, mode;
+
+	uint64_t key() const { return slope0 | ((uint64_t)slope1 << 16) | ((uint64_t)pwm_offset << 32) | ((uint64_t)mode << 48); }
+};
+
+struct AtlasHeader {
+	char magic[8];
+	uint32_t version, size, num_points, reserved; // size: resolution or shape_points
+	uint64_t fingerprint;
+};
+
+struct AtlasShape {
+	AtlasPoint point;
+	float rms;                          // of the cycle, relative to full scale
+	int8_t shape[ATLAS_SHAPE_POINTS];
+};
+
+static_assert(sizeof(AtlasHeader) == 32, "AtlasHeader must match the file format");
+static_assert(sizeof(AtlasShape) == 44, "AtlasShape must match the file format");
+
+// Can the point be put in the atlas? Noise, detune, the PWL oscillator and oscillator sync don't give a fixed cycle.
+bool atlas_mode_ok(int mode) {
+	return !get_lfsr_en(mode) && !get_pwl_osc_en(mode) && (mode & 7) == 0 && (mode & MODE_FLAG_DETUNE_FIFTH) == 0 &&
+		(mode & MODE_FLAG_OSC_SYNC_EN) == 0;
+}
+
+// Full resolution cycle of the point: the sum of both subchannel contributions for each phase.
+// Uses the wavetable scratch model, so the result is exactly what a wavetable would play.
+void atlas_full_cycle(const AtlasPoint &p, int *cycle) {
+	int key[WAVETABLE_KEY_SIZE] = {ATLAS_AMP, p.slope0, p.slope1, p.pwm_offset, p.mode, 0};
+	Wavetable t;
+	t.init(key);
+	for (int phase = 0; phase < ATLAS_CYCLE_LENGTH; phase++) cycle[phase] = t.eval(0, phase) + t.eval(1, phase);
+}
+
+// Box filter a cycle of length n down to resolution points. n doesn't have to be a multiple of resolution;
+// points are taken by nearest neighbor if n < resolution.
+template<typename T> void atlas_resample(const T *cycle, int n, int resolution, float *out) {
+	for (int i = 0; i < resolution; i++) {
+		int start = (int)((int64_t)i * n / resolution);
+		int end = std::max(start + 1, (int)((int64_t)(i + 1) * n / resolution));
+		double sum = 0;
+		for (int j = start; j < end; j++) sum += cycle[j];
+		out[i] = sum / (end - start);
+	}
+}
+
+void atlas_cycle(const AtlasPoint &p, int resolution, int16_t *out) {
+	std::vector<int> cycle(ATLAS_CYCLE_LENGTH);
+	std::vector<float> resampled(resolution);
+	atlas_full_cycle(p, cycle.data());
+	atlas_resample(cycle.data(), ATLAS_CYCLE_LENGTH, resolution, resampled.data());
+	for (int i = 0; i < resolution; i++) out[i] = (int16_t)std::min(32767.0f, std::max(-32768.0f, roundf(resampled[i])));
+}
+
+// Full scale for the cycle values: the largest contribution of both subchannels at ATLAS_AMP, see model_amp_clamp
+const float ATLAS_FULL_SCALE = 2.0f * ((ATLAS_AMP << (BITS-2-6)) >> OUT_RSHIFT);
+
+// Shape descriptor of a cycle of any length. Returns the rms of the cycle relative to full_scale.
+template<typename T> float atlas_shape(const T *cycle, int n, float full_scale, int8_t *shape) {
+	float x[ATLAS_SHAPE_POINTS];
+	atlas_resample(cycle, n, ATLAS_SHAPE_POINTS, x);
+	double mean = 0, sum2 = 0;
+	for (int i = 0; i < ATLAS_SHAPE_POINTS; i++) mean += x[i];
+	mean /= ATLAS_SHAPE_POINTS;
+	for (int i = 0; i < ATLAS_SHAPE_POINTS; i++) sum2 += (x[i] - mean)*(x[i] - mean);
+	double rms = sqrt(sum2 / ATLAS_SHAPE_POINTS);
+	double scale = rms > 0 ? ATLAS_SHAPE_SCALE / rms : 0;
+	for (int i = 0; i < ATLAS_SHAPE_POINTS; i++) shape[i] = (int8_t)std::min(127.0, std::max(-127.0, round((x[i] - mean) * scale)));
+
+	double cycle_sum2 = 0;
+	for (int i = 0; i < n; i++) cycle_sum2 += (double)cycle[i]*cycle[i];
+	return sqrt(cycle_sum2 / n) / full_scale;
+}
+
+// Hash of the full resolution cycles of a fixed set of points over all waveforms, to detect model changes
+uint64_t atlas_fingerprint() {
+	static const int slopes[] = {0x00, 0x08, 0x5c, 0xf3};
+	static const int pwm_offsets[] = {0, 64, 200};
+	static const int modes[] = {0, MODE_FLAG_PWL_OSC, MODE_FLAGS_ORION, MODE_FLAG_OSC_SYNC_SOFT, MODE_FLAG_3X | (1 << MODE_BIT_X2N0)};
+	std::vector<int> cycle(ATLAS_CYCLE_LENGTH);
+	uint64_t h = 0xcbf29ce484222325ull; // 64 bit FNV-1a over the values
+	for (int mode : modes) for (int s0 : slopes) for (int s1 : slopes) for (int pwm : pwm_offsets) {
+		AtlasPoint p = {(uint16_t)s0, (uint16_t)s1, (uint16_t)pwm, (uint16_t)mode};
+		atlas_full_cycle(p, cycle.data());
+		for (int x : cycle) {
+			for (int b = 0; b < 4; b++) h = (h ^ ((x >> (8*b)) & 0xff)) * 0x100000001b3ull;
+		}
+	}
+	return h;
+}
+
+
+// Cycle cache: points and their cycles, with a lookup from point to index
+struct AtlasCache {
+	int resolution;
+	uint64_t fingerprint;
+	std::vector<AtlasPoint> points;
+	std::vector<int16_t> cycles; // resolution samples per point
+
+	AtlasCache(int resolution, uint64_t fingerprint) : resolution(resolution), fingerprint(fingerprint) {}
+
+	const int16_t *cycle(int i) const { return &cycles[(size_t)i * resolution]; }
+
+	// Load the cached points if the file is there and matches. Returns false only on read errors.
+	bool load(const char *fname) {
+		FILE *fp = fopen(fname, "rb");
+		if (!fp) return true;
+		AtlasHeader h;
+		bool ok = fread(&h, sizeof(h), 1, fp) == 1 && !memcmp(h.magic, ATLAS_CACHE_MAGIC, sizeof(h.magic));
+		if (!ok) printf("%s: not an atlas cache file\n", fname);
+		else if (h.version != ATLAS_VERSION || (int)h.size != resolution || h.fingerprint != fingerprint) {
+			printf("%s: made with a different %s, not used\n", fname, h.fingerprint != fingerprint ? "model" : "version or resolution");
+		} else {
+			points.resize(h.num_points);
+			cycles.resize((size_t)h.num_points * resolution);
+			for (uint32_t i = 0; ok && i < h.num_points; i++) {
+				ok = fread(&points[i], sizeof(AtlasPoint), 1, fp) == 1 && fread(&cycles[(size_t)i * resolution], sizeof(int16_t), resolution, fp) == (size_t)resolution;
+			}
+			if (!ok) {
+				printf("%s: truncated\n", fname);
+				points.clear();
+				cycles.clear();
+			}
+		}
+		fclose(fp);
+		return ok;
+	}
+
+	bool save(const char *fname) const {
+		FILE *fp = fopen(fname, "wb");
+		if (!fp) {
+			printf("Failed to create atlas cache file: %s\n", fname);
+			return false;
+		}
+		AtlasHeader h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, ATLAS_CACHE_MAGIC, sizeof(h.magic));
+		h.version = ATLAS_VERSION;
+		h.size = resolution;
+		h.num_points = points.size();
+		h.fingerprint = fingerprint;
+		bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+		for (size_t i = 0; ok && i < points.size(); i++) {
+			ok = fwrite(&points[i], sizeof(AtlasPoint), 1, fp) == 1 && fwrite(cycle(i), sizeof(int16_t), resolution, fp) == (size_t)resolution;
+		}
+		ok = (fclose(fp) == 0) && ok;
+		if (!ok) printf("Failed to write atlas cache file: %s\n", fname);
+		return ok;
+	}
+};
+
+
+bool save_atlas_index(const char *fname, const std::vector<AtlasShape> &shapes, uint64_t fingerprint) {
+	FILE *fp = fopen(fname, "wb");
+	if (!fp) {
+		printf("Failed to create atlas index file: %s\n", fname);
+		return false;
+	}
+	AtlasHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, ATLAS_INDEX_MAGIC, sizeof(h.magic));
+	h.version = ATLAS_VERSION;
+	h.size = ATLAS_SHAPE_POINTS;
+	h.num_points = shapes.size();
+	h.fingerprint = fingerprint;
+	bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+	if (!shapes.empty()) ok = ok && fwrite(shapes.data(), sizeof(AtlasShape), shapes.size(), fp) == shapes.size();
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok) printf("Failed to write atlas index file: %s\n", fname);
+	return ok;
+}
+
+bool load_atlas_index(const char *fname, std::vector<AtlasShape> &shapes, uint64_t *fingerprint=NULL) {
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) {
+		printf("Failed to open atlas index file: %s\n", fname);
+		return false;
+	}
+	AtlasHeader h;
+	bool ok = fread(&h, sizeof(h), 1, fp) == 1 && !memcmp(h.magic, ATLAS_INDEX_MAGIC, sizeof(h.magic)) &&
+		h.version == ATLAS_VERSION && h.size == ATLAS_SHAPE_POINTS;
+	if (!ok) printf("%s: not a version %u atlas index file\n", fname, ATLAS_VERSION);
+	else {
+		shapes.resize(h.num_points);
+		ok = h.num_points == 0 || fread(shapes.data(), sizeof(AtlasShape), h.num_points, fp) == h.num_points;
+		if (!ok) printf("%s: truncated\n", fname);
+		if (fingerprint != NULL) *fingerprint = h.fingerprint;
+	}
+	fclose(fp);
+	return ok;
+}
+
+struct AtlasMatch {
+	int index, shift;
+	int distance; // squared distance between the shapes
+	// Correlation between the shapes, from the distance between two unit rms shapes
+	double correlation() const { return 1 - distance / (2.0 * ATLAS_SHAPE_POINTS * ATLAS_SHAPE_SCALE * ATLAS_SHAPE_SCALE); }
+};
+
+// The num_matches closest shapes to the query, best first, each at its best circular shift
+std::vector<AtlasMatch> atlas_lookup(const std::vector<AtlasShape> &shapes, const int8_t *query, int num_matches) {
+	int8_t shifted[ATLAS_SHAPE_POINTS][ATLAS_SHAPE_POINTS];
+	for (int s = 0; s < ATLAS_SHAPE_POINTS; s++) {
+		for (int i = 0; i < ATLAS_SHAPE_POINTS; i++) shifted[s][i] = query[(i + s) % ATLAS_SHAPE_POINTS];
+	}
+
+	std::vector<AtlasMatch> best; // kept sorted, at most num_matches long
+	for (int index = 0; index < (int)shapes.size(); index++) {
+		const int8_t *shape = shapes[index].shape;
+		AtlasMatch m = {index, 0, INT32_MAX};
+		for (int s = 0; s < ATLAS_SHAPE_POINTS; s++) {
+			int d = 0;
+			for (int i = 0; i < ATLAS_SHAPE_POINTS; i++) {
+				int diff = shifted[s][i] - shape[i];
+				d += diff*diff;
+			}
+			if (d < m.distance) {
+				m.distance = d;
+				m.shift = s;
+			}
+		}
+		if ((int)best.size() == num_matches && m.distance >= best.back().distance) continue;
+		auto pos = std::upper_bound(best.begin(), best.end(), m, [](const AtlasMatch &a, const AtlasMatch &b) { return a.distance < b.distance; });
+		best.insert(pos, m);
+		if ((int)best.size() > num_matches) best.pop_back();
+	}
+	return best;
+}
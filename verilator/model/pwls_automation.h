@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Automation scheduler: turns target curves for the sweepable parameters into a sparse register event script.
+//
+// Each automated parameter (a lane) has a target value per frame, from keyframes with linear interpolation
+// plus optional sine LFO segments. The scheduler steps the sweeps the same way as the synth, and whenever a lane
+// is further than its tolerance from the target at the start of a frame, it writes the rounded target value
+// together with the sweep setting that keeps the lane within tolerance for the most frames per register write,
+// looking ahead up to lookahead frames. A sweep setting can be off, or any rate and direction
+// (for amp: any rate and target). The result is within tolerance at the start of every frame.
+//
+// The sweep registers hold two sweeps each: REG_SWEEP_PA {period, amp} and REG_SWEEP_WS {pwm_offset, slope}.
+// The scheduler owns the sweep registers of all automated channels, and updates to both halves of a sweep register
+// in the same frame become one write. The slope sweep is used to move one slope only (dir = 1 or 2),
+// so if both slopes of a channel are automated, slope0 gets the sweep and slope1 only direct writes.
+//
+// Curve file format:
+//     curve <channel> <reg> <tolerance>    starts a lane; reg is REG_PERIOD to REG_PWM_OFFSET, tolerance in register steps (>= 0.5)
+//     <frame> <value>                      keyframe; the curve is linear between keyframes and held outside them
+//     lfo <frame0> <frame1> <depth> <period>  adds depth*sin(2*pi*(frame - frame0)/period) for frame0 <= frame < frame1
+// Lines starting with # are comments.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "pwls_model.h"
+#include "pwls_events.h"
+#include "pwls_render.h"
+
+const int default_automation_lookahead = 4096;
+
+struct AutomationKey {
+	int frame;
+	float value;
+};
+
+struct AutomationLfo {
+	int frame0, frame1;
+	float depth, period;
+};
+
+struct AutomationLane {
+	int channel, reg;
+	float tolerance;
+	std::vector<AutomationKey> keys;
+	std::vector<AutomationLfo> lfos;
+
+	std::vector<float> targets; // one per frame, filled in by expand
+	bool owns_sweep;
+
+	void expand(int num_frames) {
+		targets.resize(num_frames);
+		size_t k = 0;
+		for (int frame = 0; frame < num_frames; frame++) {
+			while (k < keys.size() && keys[k].frame <= frame) k++;
+			float value;
+			if (keys.empty()) value = 0;
+			else if (k == 0) value = keys[0].value;
+			else if (k == keys.size()) value = keys.back().value;
+			else {
+				const AutomationKey &a = keys[k - 1], &b = keys[k];
+				value = a.value + (b.value - a.value) * (frame - a.frame) / (b.frame - a.frame);
+			}
+			for (const AutomationLfo &lfo : lfos) {
+				if (lfo.frame0 <= frame && frame < lfo.frame1) value += lfo.depth * sinf(2 * (float)M_PI * (frame - lfo.frame0) / lfo.period);
+			}
+			targets[frame] = std::min(std::max(value, 0.0f), (float)((1 << reg_bits[reg]) - 1));
+		}
+	}
+
+	float target(int frame) const { return targets[std::min(frame, (int)targets.size() - 1)]; }
+	bool within(int value, int frame) const { return fabsf(value - target(frame)) <= tolerance; }
+	int rounded_target(int frame) const { return (int)lrintf(target(frame)); }
+};
+
+bool load_automation(const char *fname, std::vector<AutomationLane> &lanes) {
+	FILE *fp = fopen(fname, "r");
+	if (!fp) {
+		printf("Failed to open automation file: %s\n", fname);
+		return false;
+	}
+
+	char line[256];
+	int line_number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp)) {
+		line_number++;
+		char *p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+
+		if (!strncmp(p, "curve", 5)) {
+			AutomationLane lane;
+			if (sscanf(p + 5, "%i %i %f", &lane.channel, &lane.reg, &lane.tolerance) != 3) {
+				printf("%s:%d: expected: curve channel reg tolerance\n", fname, line_number);
+				ok = false;
+			} else if (!(0 <= lane.channel && lane.channel < NUM_CHANNELS && REG_PERIOD <= lane.reg && lane.reg <= REG_PWM_OFFSET)) {
+				printf("%s:%d: only the period, amp, slope and pwm_offset registers of channels 0-%d can be automated\n", fname, line_number, NUM_CHANNELS - 1);
+				ok = false;
+			} else if (!(lane.tolerance >= 0.5f)) {
+				printf("%s:%d: the tolerance should be at least 0.5\n", fname, line_number);
+				ok = false;
+			} else {
+				for (const AutomationLane &other : lanes) {
+					if (other.channel == lane.channel && other.reg == lane.reg) {
+						printf("%s:%d: channel %d reg %d is already automated\n", fname, line_number, lane.channel, lane.reg);
+						ok = false;
+					}
+				}
+				lane.owns_sweep = false;
+				lanes.push_back(lane);
+			}
+			continue;
+		}
+
+		if (lanes.empty()) {
+			printf("%s:%d: expected a curve line first\n", fname, line_number);
+			ok = false;
+			continue;
+		}
+		AutomationLane &lane = lanes.back();
+
+		if (!strncmp(p, "lfo", 3)) {
+			AutomationLfo lfo;
+			if (sscanf(p + 3, "%i %i %f %f", &lfo.frame0, &lfo.frame1, &lfo.depth, &lfo.period) != 4 || !(lfo.period > 0)) {
+				printf("%s:%d: expected: lfo frame0 frame1 depth period\n", fname, line_number);
+				ok = false;
+			} else lane.lfos.push_back(lfo);
+			continue;
+		}
+
+		AutomationKey key;
+		if (sscanf(p, "%i %f", &key.frame, &key.value) != 2) {
+			printf("%s:%d: expected: frame value\n", fname, line_number);
+			ok = false;
+		} else if (!lane.keys.empty() && key.frame <= lane.keys.back().frame) {
+			printf("%s:%d: keyframes are not sorted by frame\n", fname, line_number);
+			ok = false;
+		} else lane.keys.push_back(key);
+	}
+	fclose(fp);
+	return ok;
+}
+
+
+struct AutomationOptions {
+	int lookahead;
+	bool sweeps;
+
+	AutomationOptions() : lookahead(default_automation_lookahead), sweeps(true) {}
+};
+
+struct AutomationStats {
+	int num_frames;
+	uint64_t value_writes, sweep_writes;
+	uint64_t direct_writes; // writes needed to write the rounded target whenever it changes, without sweeps
+	uint64_t replans;
+	float max_error;
+
+	AutomationStats() { memset(this, 0, sizeof(*this)); }
+
+	uint64_t writes() const { return value_writes + sweep_writes; }
+	double seconds() const { return num_frames / FRAME_RATE; }
+
+	void print(FILE *fp) const {
+		double s = seconds();
+		fprintf(fp, "%d frames (%.3f s)\n", num_frames, s);
+		fprintf(fp, "Scheduled writes: %llu (%llu value, %llu sweep), %.1f writes/s\n", (unsigned long long)writes(),
+			(unsigned long long)value_writes, (unsigned long long)sweep_writes, s > 0 ? writes() / s : 0.0);
+		fprintf(fp, "Direct writes:    %llu, %.1f writes/s\n", (unsigned long long)direct_writes, s > 0 ? direct_writes / s : 0.0);
+		if (writes() > 0) fprintf(fp, "Reduction:        %.1fx\n", (double)direct_writes / writes());
+		fprintf(fp, "Max error:        %.2f\n", max_error);
+	}
+};
+
+
+// Location of the sweep setting for a parameter: register and bit shift
+void automation_sweep_field(int reg, int &sweep_reg, int &shift) {
+	sweep_reg = (reg == REG_PERIOD || reg == REG_AMP) ? REG_SWEEP_PA : REG_SWEEP_WS;
+	shift = (reg == REG_PERIOD || reg == REG_PWM_OFFSET) ? 8 : 0;
+}
+
+// Sweep settings that the scheduler can choose from for a lane, starting with off.
+// A lane that doesn't own its sweep can only keep the current setting.
+std::vector<int> automation_sweep_candidates(const AutomationLane &lane, int current) {
+	std::vector<int> candidates;
+	if (!lane.owns_sweep) {
+		candidates.push_back(current);
+		return candidates;
+	}
+	candidates.push_back(0);
+	for (int rate = 1; rate < 16; rate++) {
+		if (lane.reg == REG_AMP) {
+			for (int target = 0; target < 8; target++) candidates.push_back(rate | (target << 4));
+		} else {
+			int dir = lane.reg == REG_SLOPE0 ? 1 << 5 : (lane.reg == REG_SLOPE1 ? 2 << 5 : 0);
+			for (int sign = 0; sign < 2; sign++) candidates.push_back(rate | (sign << 4) | dir);
+		}
+	}
+	return candidates;
+}
+
+// The oct_counter values that run the sweep step for a lane: (oct_counter & mask) == match
+void automation_sweep_slot(const AutomationLane &lane, int &mask, int &match) {
+	int pre_sweep_index = lane.reg == REG_PERIOD ? 0 : (lane.reg == REG_PWM_OFFSET ? 1 : (lane.reg << 1) | 1);
+	mask = lane.reg == REG_PERIOD ? (1 << (LOG2_NUM_CHANNELS + 1)) - 1 : (1 << (LOG2_NUM_CHANNELS + 3)) - 1;
+	match = (lane.channel | (pre_sweep_index << LOG2_NUM_CHANNELS)) & mask;
+}
+
+// Number of frames, starting with frame, that the lane stays within tolerance from the state in m.
+// Only runs the sweep steps for the lane itself, the other lanes can't affect it.
+int automation_run_length(Model m, const AutomationLane &lane, int frame, int max_frames) {
+	int mask, match;
+	automation_sweep_slot(lane, mask, match);
+	int n = 0;
+	while (n < max_frames && lane.within(m.get_reg(lane.channel, lane.reg), frame + n)) {
+		for (int i = 0; i < SAMPLES_PER_FRAME; i++) {
+			if ((m.oct_counter & mask) == match) model_sample_sweep(m);
+			model_next_sample(m);
+		}
+		n++;
+	}
+	return n;
+}
+
+// Schedule the writes for the lanes over num_frames frames, on top of the base events, which should not write
+// the automated parameters or the sweep registers of automated channels. Appends the scheduled events to events,
+// sorted by frame, without the base events.
+bool schedule_automation(std::vector<AutomationLane> &lanes, const std::vector<RegEvent> &base_events, int num_frames,
+		const AutomationOptions &options, std::vector<RegEvent> &events, AutomationStats &stats) {
+	if (num_frames < 1 || options.lookahead < 1) {
+		printf("The number of frames and the lookahead should be at least 1\n");
+		return false;
+	}
+
+	bool automated_channel[NUM_CHANNELS] = {};
+	bool automated_reg[NUM_CHANNELS][REG_PWM_OFFSET + 1] = {};
+	for (AutomationLane &lane : lanes) {
+		lane.expand(num_frames);
+		automated_channel[lane.channel] = true;
+		automated_reg[lane.channel][lane.reg] = true;
+	}
+	for (AutomationLane &lane : lanes) lane.owns_sweep = options.sweeps && !(lane.reg == REG_SLOPE1 && automated_reg[lane.channel][REG_SLOPE0]);
+	for (const RegEvent &e : base_events) {
+		bool sweep_reg = e.reg == REG_SWEEP_PA || e.reg == REG_SWEEP_WS;
+		if (0 <= e.channel && e.channel < NUM_CHANNELS && ((e.reg <= REG_PWM_OFFSET && automated_reg[e.channel][e.reg]) || (sweep_reg && automated_channel[e.channel]))) {
+			printf("Warning: the base events write reg %d of automated channel %d\n", e.reg, e.channel);
+			break;
+		}
+	}
+
+	stats = AutomationStats();
+	stats.num_frames = num_frames;
+	for (const AutomationLane &lane : lanes) {
+		stats.direct_writes++;
+		for (int frame = 1; frame < num_frames; frame++) stats.direct_writes += lane.rounded_target(frame) != lane.rounded_target(frame - 1);
+	}
+
+	Model m;
+	size_t next_base = 0;
+	size_t first_event = events.size();
+	for (int frame = 0; frame < num_frames; frame++) {
+		next_base = apply_events(m, base_events, next_base, frame);
+
+		int sweep_before[NUM_CHANNELS][2];
+		for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+			sweep_before[channel][0] = m.get_reg(channel, REG_SWEEP_PA);
+			sweep_before[channel][1] = m.get_reg(channel, REG_SWEEP_WS);
+		}
+
+		for (const AutomationLane &lane : lanes) {
+			int value = m.get_reg(lane.channel, lane.reg);
+			if (frame > 0 && lane.within(value, frame)) continue;
+			stats.replans++;
+
+			int sweep_reg, shift;
+			automation_sweep_field(lane.reg, sweep_reg, shift);
+			int sweep_data = m.get_reg(lane.channel, sweep_reg);
+			int current = (sweep_data >> shift) & 255;
+			// A sweep register that is already written in this frame costs nothing more to change
+			bool sweep_written = sweep_data != sweep_before[lane.channel][sweep_reg - REG_SWEEP_PA];
+
+			int new_value = lane.rounded_target(frame);
+			int max_frames = std::min(options.lookahead, num_frames - frame);
+			int best_sweep = current, best_run = 0, best_cost = 1;
+			for (int sweep : automation_sweep_candidates(lane, current)) {
+				Model s = m;
+				s.set_reg(lane.channel, lane.reg, new_value);
+				s.set_reg(lane.channel, sweep_reg, (sweep_data & ~(255 << shift)) | (sweep << shift));
+				int run = automation_run_length(s, lane, frame, max_frames);
+				int cost = (new_value != value || frame == 0) + (sweep != current && !sweep_written);
+				if (cost == 0) cost = 1;
+				// Most frames per write, then fewest writes
+				if ((int64_t)run*best_cost > (int64_t)best_run*cost || ((int64_t)run*best_cost == (int64_t)best_run*cost && cost < best_cost)) {
+					best_sweep = sweep;
+					best_run = run;
+					best_cost = cost;
+				}
+				if (run == max_frames && cost == 1) break;
+			}
+
+			if (new_value != value || frame == 0) {
+				events.push_back({frame, lane.reg, lane.channel, new_value});
+				stats.value_writes++;
+				m.set_reg(lane.channel, lane.reg, new_value);
+			}
+			m.set_reg(lane.channel, sweep_reg, (sweep_data & ~(255 << shift)) | (best_sweep << shift));
+		}
+
+		for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+			for (int i = 0; i < 2; i++) {
+				int data = m.get_reg(channel, REG_SWEEP_PA + i);
+				if (data == sweep_before[channel][i] && !(frame == 0 && automated_channel[channel])) continue;
+				events.push_back({frame, REG_SWEEP_PA + i, channel, data});
+				stats.sweep_writes++;
+			}
+		}
+
+		for (const AutomationLane &lane : lanes) stats.max_error = std::max(stats.max_error, fabsf(m.get_reg(lane.channel, lane.reg) - lane.target(frame)));
+		for (int i = 0; i < SAMPLES_PER_FRAME; i++) {
+			model_sample_sweep(m);
+			model_next_sample(m);
+		}
+	}
+	// Value writes come before sweep writes within a frame, which is fine since they take effect together
+	std::stable_sort(events.begin() + first_event, events.end(), [](const RegEvent &a, const RegEvent &b) { return a.frame < b.frame; });
+	return true;
+}
+
+// Replay an event script and return the largest distance from the targets at the start of each frame
+float automation_max_error(const std::vector<AutomationLane> &lanes, const std::vector<RegEvent> &events, int num_frames) {
+	Model m;
+	size_t next_event = 0;
+	float max_error = 0;
+	for (int frame = 0; frame < num_frames; frame++) {
+		next_event = apply_events(m, events, next_event, frame);
+		for (const AutomationLane &lane : lanes) max_error = std::max(max_error, fabsf(m.get_reg(lane.channel, lane.reg) - lane.target(frame)));
+		for (int i = 0; i < SAMPLES_PER_FRAME; i++) {
+			model_sample_sweep(m);
+			model_next_sample(m);
+		}
+	}
+	return max_error;
+}
+
+// Merge two event scripts that are sorted by frame, keeping the events from a first within each frame
+std::vector<RegEvent> merge_events(const std::vector<RegEvent> &a, const std::vector<RegEvent> &b) {
+	std::vector<RegEvent> merged;
+	merged.reserve(a.size() + b.size());
+	size_t i = 0, j = 0;
+	while (i < a.size() || j < b.size()) {
+		if (j == b.size() || (i < a.size() && a[i].frame <= b[j].frame)) merged.push_back(a[i++]);
+		else merged.push_back(b[j++]);
+	}
+	return merged;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// A bank of synth chips, each an independent bit exact model, driven from one event script and mixed to stereo.
+//
+// Bank event scripts use the normal event format (see pwls_events.h), with the channel numbering continuing
+// over the chips: channel c addresses channel c % NUM_CHANNELS of chip c / NUM_CHANNELS. The same goes for
+// the REG_OCT_COUNTER writes, e.g. channel 4*k + 2 is cfg for chip k.
+//
+// The chips are rendered in rounds of block_frames frames. In each round, the chips are handed out to the threads
+// as they become free, and then the round is mixed. Each chip keeps its own SerialRenderer between rounds,
+// so its output is identical to rendering its events with render.
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <time.h>
+
+#include "pwls_render.h"
+#include "pwls_parallel.h"
+
+struct BankChip {
+	std::vector<RegEvent> events; // with chip local channel numbers
+	bool stereo_out;
+	float gain, pan; // linear gain, pan from -1 (left) to 1 (right)
+	float side_gains[2];
+
+	std::unique_ptr<RenderState> state;
+	std::unique_ptr<SerialRenderer> renderer;
+	std::vector<int16_t> block;
+	double seconds; // CPU time spent rendering
+
+	BankChip() : stereo_out(false), gain(1), pan(0), seconds(0) {}
+
+	// Call after setting up events, gain and pan
+	void start(int block_frames) {
+		stereo_out = events_use_stereo(events);
+		// Constant power panning for mono chips, balance for stereo ones
+		double angle = (pan + 1) * M_PI/4;
+		double scale = stereo_out ? sqrt(2.0) : 1;
+		side_gains[0] = gain * std::min(1.0, scale * cos(angle));
+		side_gains[1] = gain * std::min(1.0, scale * sin(angle));
+		state.reset(new RenderState(RENDER_DEFAULT));
+		renderer.reset(new SerialRenderer(*state, events, stereo_out));
+		block.resize((size_t)block_frames * 2);
+	}
+
+	// Measured in thread CPU time, so that the cost is right even with more threads than cores
+	static double thread_seconds() {
+		timespec t;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+		return t.tv_sec + 1e-9 * t.tv_nsec;
+	}
+
+	void render(int num_frames) {
+		double t0 = thread_seconds();
+		int num_sides = renderer->num_sides;
+		for (int i = 0; i < num_frames; i++) renderer->render_frame(&block[(size_t)i * num_sides]);
+		seconds += thread_seconds() - t0;
+	}
+
+	// Add num_frames frames of the last rendered block to the interleaved stereo mix
+	void mix(float *out, int num_frames) const {
+		const int16_t *b = block.data();
+		for (int i = 0; i < num_frames; i++) {
+			float l = b[0], r = stereo_out ? b[1] : b[0];
+			b += stereo_out ? 2 : 1;
+			out[2*i]     += l * side_gains[0];
+			out[2*i + 1] += r * side_gains[1];
+		}
+	}
+};
+
+// Split bank events into chip local event lists. Returns false if an event addresses a chip beyond num_chips.
+bool split_bank_events(const std::vector<RegEvent> &events, std::vector<BankChip> &chips) {
+	int num_chips = chips.size();
+	for (const RegEvent &e : events) {
+		int chip = e.channel / NUM_CHANNELS;
+		if (e.channel < 0 || chip >= num_chips) {
+			printf("Event at frame %d addresses channel %d, but the bank only has %d chips\n", e.frame, e.channel, num_chips);
+			return false;
+		}
+		RegEvent local = e;
+		local.channel = e.channel % NUM_CHANNELS;
+		chips[chip].events.push_back(local);
+	}
+	return true;
+}
+
+// Render num_frames frames of all chips and mix them to interleaved stereo float samples, in the same scale as render.
+// Calls out(samples, n) with each mixed block of n frames.
+template<typename F> void render_bank(std::vector<BankChip> &chips, int num_frames, int block_frames, int num_threads, F out) {
+	for (BankChip &chip : chips) chip.start(block_frames);
+	std::vector<float> mix((size_t)block_frames * 2);
+	for (int frame = 0; frame < num_frames; frame += block_frames) {
+		int n = std::min(block_frames, num_frames - frame);
+		parallel_for(chips.size(), num_threads, [&](int i) { chips[i].render(n); });
+
+		std::fill(mix.begin(), mix.end(), 0.0f);
+		for (const BankChip &chip : chips) chip.mix(mix.data(), n);
+		out(mix.data(), n);
+	}
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Register write driver that keeps a shadow of the synth's registers and cfg, and skips writes that wouldn't change anything.
+//
+// Updates are staged with set and set_field, and issued with flush, which writes each changed register once,
+// so that updates to several fields of the same register become a single write. Registers are flushed in register map
+// order, with cfg first. The shadow only trusts registers that the synth doesn't change by itself:
+// phase and the oct_counter halves are always written, and so is any parameter that a sweep could have changed
+// since it was last written. All registers start out unknown, so the first write to each one is always issued.
+// Register and channel numbers follow the register map, REG_OCT_COUNTER channel 2 is cfg.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+
+#include "pwls_model.h"
+
+const int DRIVER_NUM_REG_TYPES = REG_OCT_COUNTER + 1;
+const int DRIVER_NUM_REGS = DRIVER_NUM_REG_TYPES * NUM_CHANNELS;
+const int DRIVER_CFG_INDEX = REG_OCT_COUNTER*NUM_CHANNELS + 2;
+
+struct RegDriver {
+	typedef std::function<void(int reg, int channel, int data)> WriteFn;
+
+	WriteFn write_fn;
+	int values[DRIVER_NUM_REGS]; // last value written to each register, indexed by reg*NUM_CHANNELS + channel
+	int pending[DRIVER_NUM_REGS];
+	bool known[DRIVER_NUM_REGS]; // does values hold the current contents of the register?
+	bool dirty[DRIVER_NUM_REGS];
+	Model sweep_model; // the written values, to see which sweeps are active
+
+	// Statistics, per register type
+	uint64_t num_issued[DRIVER_NUM_REG_TYPES], num_elided[DRIVER_NUM_REG_TYPES];
+
+	RegDriver(WriteFn write_fn) : write_fn(write_fn) {
+		memset(values, 0, sizeof(values));
+		memset(pending, 0, sizeof(pending));
+		memset(dirty, 0, sizeof(dirty));
+		memset(num_issued, 0, sizeof(num_issued));
+		memset(num_elided, 0, sizeof(num_elided));
+		invalidate();
+	}
+
+	// Forget the register contents, e.g. after a reset or if something else has written to the synth
+	void invalidate() { memset(known, 0, sizeof(known)); }
+
+	static bool valid_reg(int reg, int channel) { return 0 <= reg && reg < DRIVER_NUM_REG_TYPES && 0 <= channel && channel < NUM_CHANNELS; }
+
+	// Registers that the synth updates by itself
+	static bool volatile_reg(int reg, int channel) { return reg == REG_PHASE || (reg == REG_OCT_COUNTER && channel != 2); }
+
+	static int reg_mask(int reg, int channel) {
+		if (reg != REG_OCT_COUNTER) return (1 << reg_data_bits[reg]) - 1;
+		return channel == 2 ? CFG_FLAG_STEREO_EN | CFG_FLAG_STEREO_POS_EN : 0xfff;
+	}
+
+	// Stage a register write
+	void set(int reg, int channel, int data) {
+		if (!valid_reg(reg, channel)) return;
+		int i = reg*NUM_CHANNELS + channel;
+		pending[i] = data & reg_mask(reg, channel);
+		dirty[i] = true;
+	}
+
+	// Stage a write to the bit field [shift, shift + nbits) of a register, keeping the other bits.
+	// The other bits come from earlier staged or written values, and are zero if the register has never been written.
+	void set_field(int reg, int channel, int shift, int nbits, int value) {
+		if (!valid_reg(reg, channel)) return;
+		int i = reg*NUM_CHANNELS + channel;
+		int mask = ((1 << nbits) - 1) << shift;
+		set(reg, channel, ((dirty[i] ? pending[i] : values[i]) & ~mask) | ((value << shift) & mask));
+	}
+
+	// Issue the staged writes that change something
+	void flush() {
+		if (dirty[DRIVER_CFG_INDEX]) flush_reg(DRIVER_CFG_INDEX);
+		for (int i = 0; i < DRIVER_NUM_REGS; i++) if (dirty[i]) flush_reg(i);
+		update_sweeps();
+	}
+
+	void write(int reg, int channel, int data) {
+		set(reg, channel, data);
+		flush();
+	}
+
+	void flush_reg(int i) {
+		int reg = i / NUM_CHANNELS, channel = i % NUM_CHANNELS;
+		dirty[i] = false;
+		if (known[i] && values[i] == pending[i]) {
+			num_elided[reg]++;
+			return;
+		}
+
+		write_fn(reg, channel, pending[i]);
+		num_issued[reg]++;
+		values[i] = pending[i];
+		known[i] = !volatile_reg(reg, channel);
+		if (i == DRIVER_CFG_INDEX) sweep_model.cfg = values[i];
+		else if (reg < REGS_PER_CHANNEL) sweep_model.set_reg(channel, reg, values[i]);
+	}
+
+	// A parameter that a sweep can change is unknown from now on, until it is written again
+	void update_sweeps() {
+		for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+			for (int sweep_index = REG_PERIOD; sweep_index <= REG_PWM_OFFSET; sweep_index++) {
+				int sweep_reg = (sweep_index == REG_PERIOD || sweep_index == REG_AMP) ? REG_SWEEP_PA : REG_SWEEP_WS;
+				int rate;
+				bool sweep_known = known[sweep_reg*NUM_CHANNELS + channel];
+				if (!sweep_known || sweep_can_update(sweep_model, channel, sweep_index, rate)) known[sweep_index*NUM_CHANNELS + channel] = false;
+			}
+		}
+	}
+
+	uint64_t total_issued() const {
+		uint64_t n = 0;
+		for (int reg = 0; reg < DRIVER_NUM_REG_TYPES; reg++) n += num_issued[reg];
+		return n;
+	}
+	uint64_t total_elided() const {
+		uint64_t n = 0;
+		for (int reg = 0; reg < DRIVER_NUM_REG_TYPES; reg++) n += num_elided[reg];
+		return n;
+	}
+
+	void print_stats(FILE *fp) const {
+		static const char *reg_names[DRIVER_NUM_REG_TYPES] = {"period", "amp", "slope0", "slope1", "pwm_offset", "mode", "sweep_pa", "sweep_ws", "phase", "oct_counter/cfg"};
+		fprintf(fp, "Register writes: %llu issued, %llu elided\n", (unsigned long long)total_issued(), (unsigned long long)total_elided());
+		for (int reg = 0; reg < DRIVER_NUM_REG_TYPES; reg++) {
+			if (num_issued[reg] + num_elided[reg] == 0) continue;
+			fprintf(fp, "    %-16s %8llu issued %8llu elided\n", reg_names[reg], (unsigned long long)num_issued[reg], (unsigned long long)num_elided[reg]);
+		}
+	}
+};
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Register event scripts: timestamped register writes that drive a render.
+//
+// Text format, one event per line:
+//     frame reg channel data
+// where frame is the output sample index (after decimation) that the write takes effect from,
+// reg and channel use the same numbering as the register map (REG_OCT_COUNTER channel 2 is cfg).
+// Lines starting with # are comments. Events must be sorted by frame.
+
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+
+#include "pwls_model.h"
+
+struct RegEvent {
+	int frame;
+	int reg, channel, data;
+};
+
+// Apply a register write to the model, masking the data to the register width like the RTL does
+void apply_event(Model &m, const RegEvent &e) {
+	if (e.reg == REG_OCT_COUNTER) {
+		if (e.channel == 2) m.cfg = e.data & (CFG_FLAG_STEREO_EN | CFG_FLAG_STEREO_POS_EN);
+		else if (e.channel == 0) m.oct_counter = (m.oct_counter & ~0xfff) | (e.data & 0xfff);
+		else if (e.channel == 1) m.oct_counter = (m.oct_counter & 0xfff) | ((e.data & 0xfff) << 12);
+		return;
+	}
+	if (!(0 <= e.reg && e.reg < REGS_PER_CHANNEL)) return;
+	m.set_reg(e.channel, e.reg, e.data & ((1 << reg_data_bits[e.reg]) - 1));
+}
+
+// Apply all events for the given frame, starting at index next_event. Returns the index of the first event not applied.
+size_t apply_events(Model &m, const std::vector<RegEvent> &events, size_t next_event, int frame) {
+	while (next_event < events.size() && events[next_event].frame <= frame) apply_event(m, events[next_event++]);
+	return next_event;
+}
+
+// Index of the first event at or after the given frame
+size_t find_event(const std::vector<RegEvent> &events, int frame) {
+	size_t lo = 0, hi = events.size();
+	while (lo < hi) {
+		size_t mid = (lo + hi) >> 1;
+		if (events[mid].frame < frame) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+bool load_events(const char *fname, std::vector<RegEvent> &events) {
+	FILE *fp = fopen(fname, "r");
+	if (!fp) {
+		printf("Failed to open event file: %s\n", fname);
+		return false;
+	}
+
+	char line[256];
+	int line_number = 0;
+	bool ok = true;
+	while (fgets(line, sizeof(line), fp)) {
+		line_number++;
+		char *p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+
+		RegEvent e;
+		if (sscanf(p, "%i %i %i %i", &e.frame, &e.reg, &e.channel, &e.data) != 4) {
+			printf("%s:%d: expected: frame reg channel data\n", fname, line_number);
+			ok = false;
+			break;
+		}
+		if (!events.empty() && e.frame < events.back().frame) {
+			printf("%s:%d: events are not sorted by frame\n", fname, line_number);
+			ok = false;
+			break;
+		}
+		events.push_back(e);
+	}
+	fclose(fp);
+	return ok;
+}
+
+void save_event(FILE *fp, const RegEvent &e) {
+	fprintf(fp, "%d %d %d %d\n", e.frame, e.reg, e.channel, e.data);
+}
+
+bool save_events(const char *fname, const std::vector<RegEvent> &events) {
+	FILE *fp = fopen(fname, "w");
+	if (!fp) {
+		printf("Failed to create event file: %s\n", fname);
+		return false;
+	}
+	for (const RegEvent &e : events) save_event(fp, e);
+	fclose(fp);
+	return true;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Small FFT and windowed power spectrum helpers for the analysis tools.
+
+#pragma once
+
+#include <math.h>
+#include <complex>
+#include <vector>
+
+typedef std::complex<double> fft_complex;
+
+bool is_power_of_two(int n) { return n > 0 && (n & (n - 1)) == 0; }
+
+// In place radix 2 FFT. n must be a power of two.
+void fft(fft_complex *x, int n) {
+	for (int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1) j ^= bit;
+		j ^= bit;
+		if (i < j) std::swap(x[i], x[j]);
+	}
+	for (int len = 2; len <= n; len <<= 1) {
+		fft_complex w_len = std::polar(1.0, -2*M_PI / len);
+		for (int i = 0; i < n; i += len) {
+			fft_complex w = 1;
+			for (int k = 0; k < len/2; k++) {
+				fft_complex u = x[i + k], v = x[i + k + len/2] * w;
+				x[i + k] = u + v;
+				x[i + k + len/2] = u - v;
+				w *= w_len;
+			}
+		}
+	}
+}
+
+const int WINDOW_HANN = 0;
+const int WINDOW_BLACKMAN_HARRIS = 1; // 4 term, -92 dB sidelobes, for measuring weak tones next to strong ones
+
+// Power spectrum of real windows of n samples. Keeps its buffers between calls.
+struct SpectrumAnalyzer {
+	int n;
+	std::vector<double> window;
+	std::vector<fft_complex> buf;
+	double window_power; // sum of squared window values, to normalize the spectrum
+	int lobe_bins;       // half width of the main lobe, in bins
+
+	SpectrumAnalyzer(int n, int window_type=WINDOW_HANN) : n(n), window(n), buf(n), window_power(0) {
+		static const double bh[4] = {0.35875, 0.48829, 0.14128, 0.01168};
+		lobe_bins = window_type == WINDOW_BLACKMAN_HARRIS ? 4 : 2;
+		for (int i = 0; i < n; i++) {
+			double x = 2*M_PI*i/n;
+			if (window_type == WINDOW_BLACKMAN_HARRIS) window[i] = bh[0] - bh[1]*cos(x) + bh[2]*cos(2*x) - bh[3]*cos(3*x);
+			else window[i] = 0.5 - 0.5*cos(x);
+			window_power += window[i]*window[i];
+		}
+	}
+
+	int num_bins() const { return n/2 + 1; }
+
+	// Write num_bins() power values for the samples in[0], in[stride], ..., in[(n-1)*stride], scaled by scale.
+	// A full scale sine ends up with a total power of about 1/2 (summed over the bins of its peak).
+	template<typename T> void power(const T *in, int stride, double scale, double *out) {
+		for (int i = 0; i < n; i++) buf[i] = in[i*stride] * scale * window[i];
+		fft(buf.data(), n);
+		double norm = 2.0 / (n * window_power);
+		for (int i = 0; i < num_bins(); i++) out[i] = std::norm(buf[i]) * norm;
+		out[0] *= 0.5;
+		out[n/2] *= 0.5;
+	}
+};
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Polyphase decimation filter used to downsample the synth output to audio rate.
+
+#pragma once
+
+#include <string.h>
+
+const int FILTER_OUT_TAPS = 8;
+const int LOG2_FILTER_DOWNSAMPLING = 4;
+const int FILTER_DOWNSAMPLING = 1 << LOG2_FILTER_DOWNSAMPLING;
+const int FILTER_SIZE = FILTER_OUT_TAPS * FILTER_DOWNSAMPLING;
+
+// sum = 1
+const float filter_kernel[FILTER_SIZE] = {1.9704187094300935e-5, 1.672124152367472e-5, 2.2091120095941078e-5, 2.685891825533267e-5, 2.986240567308994e-5, 2.9534150836547966e-5, 2.383946150169849e-5, 1.021951780838429e-5, -1.4411480429666529e-5, -5.36959988669223e-5, -0.00011180932123201447, -0.00019337588931160458, -0.00030342804910631955, -0.0004472782832528414, -0.0006303462676022846, -0.0008579957004840749, -0.001135309212249831, -0.0014667842276546196, -0.0018561320074222429, -0.002305912685078532, -0.002817258691731319, -0.0033895263704930615, -0.004020051222580581, -0.004703836003274322, -0.005433308142276695, -0.006198184498962297, -0.006985310407430402, -0.007778614246666663, -0.008559181086983851, -0.009305396042280256, -0.009993152391113985, -0.01059623243525253, -0.011086746809076363, -0.011435691266594215, -0.011613589672186135, -0.011591213583084728, -0.01134036359811593, -0.01083472103358854, -0.010050661114540156, -0.008968128717767905, -0.007571458653177024, -0.005850114301831013, -0.0037993853835723837, -0.0014209444872459675, 0.0012766983496119864, 0.00427794488352387, 0.007559983645916518, 0.011092860474231525, 0.014839750460875892, 0.018757433256881124, 0.022796916419864335, 0.026904280440575086, 0.031021680252996835, 0.03508844165879476, 0.03904232782324128, 0.0428208684017619, 0.04636270832694564, 0.04960900440934792, 0.05250477911818976, 0.05500018257543565, 0.05705170155105929, 0.05862317927162731, 0.059686702941030734, 0.060223274017816915, 0.060223274017816915, 0.059686702941030734, 0.05862317927162731, 0.05705170155105929, 0.05500018257543565, 0.05250477911818976, 0.04960900440934792, 0.04636270832694564, 0.0428208684017619, 0.03904232782324128, 0.03508844165879476, 0.031021680252996835, 0.026904280440575086, 0.022796916419864335, 0.018757433256881124, 0.014839750460875892, 0.011092860474231525, 0.007559983645916518, 0.00427794488352387, 0.0012766983496119864, -0.0014209444872459675, -0.0037993853835723837, -0.005850114301831013, -0.007571458653177024, -0.008968128717767905, -0.010050661114540156, -0.01083472103358854, -0.01134036359811593, -0.011591213583084728, -0.011613589672186135, -0.011435691266594215, -0.011086746809076363, -0.01059623243525253, -0.009993152391113985, -0.009305396042280256, -0.008559181086983851, -0.007778614246666663, -0.006985310407430402, -0.006198184498962297, -0.005433308142276695, -0.004703836003274322, -0.004020051222580581, -0.0033895263704930615, -0.002817258691731319, -0.002305912685078532, -0.0018561320074222429, -0.0014667842276546196, -0.001135309212249831, -0.0008579957004840749, -0.0006303462676022846, -0.0004472782832528414, -0.00030342804910631955, -0.00019337588931160458, -0.00011180932123201447, -5.36959988669223e-5, -1.4411480429666529e-5, 1.021951780838429e-5, 2.383946150169849e-5, 2.9534150836547966e-5, 2.986240567308994e-5, 2.685891825533267e-5, 2.2091120095941078e-5, 1.672124152367472e-5, 1.9704187094300935e-5};
+
+
+// Decimates by FILTER_DOWNSAMPLING, keeping FILTER_OUT_TAPS partial output sums.
+// Call next() at the start of each output sample, then add() for each of its FILTER_DOWNSAMPLING input samples.
+struct DecimationFilter {
+	float accs[FILTER_OUT_TAPS];
+
+	DecimationFilter() { memset(accs, 0, sizeof(accs)); }
+
+	// Returns the output sample that was completed by the previous FILTER_DOWNSAMPLING inputs
+	float next() {
+		float filtered_sample = accs[FILTER_OUT_TAPS - 1];
+		memmove(accs + 1, accs, sizeof(float)*(FILTER_OUT_TAPS - 1));
+		accs[0] = 0;
+		return filtered_sample;
+	}
+
+	// x is the input sample scaled by FILTER_OUT_TAPS / full scale
+	void add(float x, int subsample) {
+		for (int j = 0; j < FILTER_OUT_TAPS; j++) accs[j] += x * filter_kernel[j*FILTER_DOWNSAMPLING + subsample];
+	}
+};
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Mode specialized term kernels for the model.
+//
+// The generic model steps decode REG_MODE and cfg for every term of every sample. ModelKernels instead picks
+// a model_term instance for each term that is specialized on the waveform, oscillator sync/4 bit mode and
+// phase factor bits of its channel, so that those decisions are made at compile time.
+// The table only depends on REG_MODE and cfg, so it needs to be updated only when they are written.
+// Terms that take part in common_sat use the generic model_term.
+
+#pragma once
+
+#include <utility>
+
+#include "pwls_model.h"
+
+typedef void (*TermKernel)(Model &m);
+
+constexpr int NUM_WAVE_KERNELS = 4;
+constexpr int NUM_SYNC_KERNELS = 4;
+constexpr int NUM_TERM_KERNELS = NUM_WAVE_KERNELS * NUM_SYNC_KERNELS * NUM_PF;
+
+// Mode flag values for the kernel table indices
+constexpr int kernel_waveforms[NUM_WAVE_KERNELS] = {0, MODE_FLAG_NOISE, MODE_FLAG_PWL_OSC, MODE_FLAG_NOISE | MODE_FLAG_PWL_OSC};
+constexpr int kernel_syncs[NUM_SYNC_KERNELS] = {0, MODE_FLAG_OSC_SYNC_EN, MODE_FLAG_OSC_SYNC_SOFT, MODE_FLAG_OSC_SYNC_EN | MODE_FLAG_OSC_SYNC_SOFT};
+
+template<int K> void term_kernel(Model &m) {
+	model_term<kernel_waveforms[K / (NUM_SYNC_KERNELS * NUM_PF)], kernel_syncs[(K / NUM_PF) % NUM_SYNC_KERNELS], K % NUM_PF>(m);
+}
+
+template<size_t... K> const TermKernel *make_term_kernels(std::index_sequence<K...>) {
+	static const TermKernel kernels[] = {&term_kernel<K>...};
+	return kernels;
+}
+
+// All specialized kernels, indexed by (waveform*NUM_SYNC_KERNELS + sync)*NUM_PF + phase factor
+const TermKernel *term_kernels = make_term_kernels(std::make_index_sequence<NUM_TERM_KERNELS>());
+
+
+struct ModelKernels {
+	TermKernel terms[2*NUM_CHANNELS]; // indexed by term_index
+
+	ModelKernels() { for (int i = 0; i < 2*NUM_CHANNELS; i++) terms[i] = &model_term<>; }
+
+	// Pick the kernel for each term. Call after writing REG_MODE or cfg.
+	void update(const Model &m) {
+		Model t = m;
+		for (int term_index = 0; term_index < 2*NUM_CHANNELS; term_index++) {
+			t.term_index = term_index;
+			if (t.common_sat_store() || t.common_sat_add()) {
+				terms[term_index] = &model_term<>;
+				continue;
+			}
+
+			int mode = t.get_channel_reg(REG_MODE);
+			int wave = ((mode & MODE_FLAG_NOISE) != 0) | (((mode & MODE_FLAG_PWL_OSC) != 0) << 1);
+			int sync = ((mode & MODE_FLAG_OSC_SYNC_EN) != 0) | (((mode & MODE_FLAG_OSC_SYNC_SOFT) != 0) << 1);
+			terms[term_index] = term_kernels[(wave*NUM_SYNC_KERNELS + sync)*NUM_PF + decode_phase_factor(t, mode)];
+		}
+	}
+
+	// Same as model_sample_terms
+	void sample_terms(Model &m, int *out) const {
+		bool stereo_en = m.stereo_en();
+
+		for (int term_i = 0; term_i < 2*NUM_CHANNELS; term_i++) {
+			m.term_index = model_term_index(term_i, stereo_en);
+			terms[m.term_index](m);
+
+			if (stereo_en && term_i == NUM_CHANNELS - 1) out[0] = m.out_acc;
+		}
+		if (stereo_en) out[1] = m.out_acc;
+		else out[0] = m.out_acc;
+	}
+};
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Standard MIDI File reader and note to register event compiler.
+//
+// SmfReader merges the tracks of a format 0 or 1 file on the fly and returns the channel messages in time order,
+// with times in seconds from the tempo map. MidiCompiler allocates the notes to the synth channels and writes
+// the register events through one RegDriver per chip, so that writes that wouldn't change anything are skipped:
+// - note on: period from the note number (and pitch bend), amp from the velocity, and an optional amp sweep
+//   for the decay toward the sustain level
+// - note off: an amp sweep toward zero, with the rate that comes closest to the release time
+// Voices are picked in this order: the voice that is releasing the same note, the free voice that was released first,
+// the releasing voice that was released first, and last, the voice that has been held the longest (a steal).
+// With more than one chip, the channel numbers continue over the chips like in pwls_bank.h.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "pwls_model.h"
+#include "pwls_events.h"
+#include "pwls_driver.h"
+#include "pwls_render.h"
+
+const int MIDI_PERCUSSION_CHANNEL = 9;
+
+// Amp sweep timing, from model_sweep: rate 1 steps every 32 samples, rates 5 to 15 every 2^(rate + 1) samples,
+// and rates 2 to 4 never step.
+const int AMP_SWEEP_FASTEST_LOG2_SAMPLES = 5;
+const int AMP_SWEEP_MAX_RATE = 15;
+const int AMP_TARGET_STEP = 9; // the amp sweep target is 9 times the 3 bit target field
+
+int amp_sweep_log2_samples(int rate) { return rate == 1 ? AMP_SWEEP_FASTEST_LOG2_SAMPLES : rate + 1; }
+
+// Sweep rate that comes closest to sweeping the amp by steps steps in the given time
+int amp_sweep_rate(double seconds, int steps) {
+	if (steps <= 0 || seconds <= 0) return 1;
+	double log2_samples = log2(seconds * SAMPLE_RATE / steps);
+	int best = 1;
+	for (int rate = AMP_SWEEP_FASTEST_LOG2_SAMPLES; rate <= AMP_SWEEP_MAX_RATE; rate++) {
+		if (fabs(amp_sweep_log2_samples(rate) - log2_samples) < fabs(amp_sweep_log2_samples(best) - log2_samples)) best = rate;
+	}
+	return best;
+}
+
+// Period register value with the closest frequency to freq (in units of fs), for the linear and PWL oscillators:
+// f = 1 / (2^(exp + 8) * (1 + mantissa/1024)). Clamped to the range of the register.
+int period_for_freq(double freq, bool *clamped=NULL) {
+	const int max_period = (1 << (OCT_BITS + MANTISSA_BITS)) - 1, max_exp = (1 << OCT_BITS) - 1;
+	double x = 1 / (256 * freq);
+	int exp = (int)floor(log2(x));
+	if (clamped != NULL) *clamped = exp < 0 || exp > max_exp;
+	if (exp < 0) return 0;
+	if (exp > max_exp) return max_period;
+
+	double mantissa = (ldexp(x, -exp) - 1) * (1 << MANTISSA_BITS);
+	int m0 = (int)floor(mantissa);
+	// Pick the neighbor with the smallest error in cents, which is not always the rounded mantissa
+	int m = log((1024.0 + m0 + 1) / (1024 + mantissa)) < log((1024 + mantissa) / (1024.0 + m0)) ? m0 + 1 : m0;
+	if (m == 1 << MANTISSA_BITS) {
+		if (exp == max_exp) return max_period;
+		exp++;
+		m = 0;
+	}
+	return (exp << MANTISSA_BITS) | m;
+}
+
+
+// Channel message from a MIDI file
+struct MidiEvent {
+	double seconds;
+	int status, data1, data2; // data2 is 0 for two byte messages
+
+	int type() const { return status & 0xf0; }
+	int channel() const { return status & 0x0f; }
+};
+
+struct SmfTrack {
+	const uint8_t *p, *end;
+	uint64_t tick; // time of the next event
+	int running_status;
+	bool done;
+};
+
+struct SmfReader {
+	std::vector<uint8_t> data;
+	std::vector<SmfTrack> tracks;
+	int format, division;
+
+	// Tempo map state, updated as the events are merged in time order
+	uint64_t tempo_tick;
+	double tempo_seconds, seconds_per_tick;
+
+	// Statistics
+	uint64_t num_events, num_tempo_changes;
+
+	SmfReader() : format(0), division(0), tempo_tick(0), tempo_seconds(0), seconds_per_tick(0), num_events(0), num_tempo_changes(0) {}
+
+	static uint32_t be32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+	static int be16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+	static bool read_varlen(SmfTrack &t, uint32_t &value) {
+		value = 0;
+		for (int i = 0; i < 4; i++) {
+			if (t.p >= t.end) return false;
+			int b = *(t.p++);
+			value = (value << 7) | (b & 0x7f);
+			if (!(b & 0x80)) return true;
+		}
+		return false;
+	}
+
+	bool load(const char *fname) {
+		FILE *fp = fopen(fname, "rb");
+		if (!fp) {
+			printf("Failed to open MIDI file: %s\n", fname);
+			return false;
+		}
+		uint8_t buf[1 << 16];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) data.insert(data.end(), buf, buf + n);
+		fclose(fp);
+
+		const uint8_t *p = data.data(), *end = p + data.size();
+		if (data.size() < 14 || memcmp(p, "MThd", 4) || be32(p + 4) < 6) {
+			printf("%s: not a Standard MIDI File\n", fname);
+			return false;
+		}
+		format = be16(p + 8);
+		int num_tracks = be16(p + 10);
+		division = be16(p + 12);
+		if (format > 1) {
+			printf("%s: MIDI file format %d is not supported, only 0 and 1\n", fname, format);
+			return false;
+		}
+		p += 8 + be32(p + 4);
+
+		while (p + 8 <= end && (int)tracks.size() < num_tracks) {
+			uint32_t len = be32(p + 4);
+			const uint8_t *chunk_end = len > (size_t)(end - p) - 8 ? end : p + 8 + len; // tolerate a truncated last track
+			if (!memcmp(p, "MTrk", 4)) {
+				SmfTrack t;
+				t.p = p + 8;
+				t.end = chunk_end;
+				t.tick = 0;
+				t.running_status = 0;
+				t.done = false;
+				uint32_t delta;
+				if (read_varlen(t, delta)) t.tick = delta;
+				else t.done = true;
+				tracks.push_back(t);
+			}
+			p = chunk_end;
+		}
+
+		if (division & 0x8000) {
+			// SMPTE: frames per second and ticks per frame
+			int fps = -(int8_t)(division >> 8);
+			seconds_per_tick = 1.0 / ((fps == 29 ? 29.97 : fps) * (division & 255));
+		} else set_tempo(500000);
+		return true;
+	}
+
+	void set_tempo(int us_per_quarter) {
+		if (division & 0x8000) return;
+		seconds_per_tick = us_per_quarter * 1e-6 / division;
+	}
+
+	// Get the next channel message in time order. Returns false at the end of all tracks.
+	bool next(MidiEvent &e) {
+		while (true) {
+			SmfTrack *t = NULL;
+			for (SmfTrack &track : tracks) {
+				if (!track.done && (t == NULL || track.tick < t->tick)) t = &track;
+			}
+			if (t == NULL) return false;
+
+			// Move the tempo map up to the event
+			tempo_seconds += (t->tick - tempo_tick) * seconds_per_tick;
+			tempo_tick = t->tick;
+
+			bool channel_message = false;
+			if (t->p >= t->end) {
+				t->done = true;
+				continue;
+			}
+			int status = *t->p;
+			if (status & 0x80) t->p++;
+			else status = t->running_status;
+
+			if (status == 0xff) {
+				if (t->p >= t->end) { t->done = true; continue; }
+				int type = *(t->p++);
+				uint32_t len;
+				if (!read_varlen(*t, len) || len > (uint32_t)(t->end - t->p)) { t->done = true; continue; }
+				if (type == 0x51 && len == 3) {
+					set_tempo((t->p[0] << 16) | (t->p[1] << 8) | t->p[2]);
+					num_tempo_changes++;
+				}
+				t->p += len;
+				if (type == 0x2f) { t->done = true; continue; }
+			} else if (status == 0xf0 || status == 0xf7) {
+				uint32_t len;
+				if (!read_varlen(*t, len) || len > (uint32_t)(t->end - t->p)) { t->done = true; continue; }
+				t->p += len;
+			} else if (status >= 0x80) {
+				int num_data = (status & 0xe0) == 0xc0 ? 1 : 2; // program change and channel pressure have one data byte
+				if (t->end - t->p < num_data) { t->done = true; continue; }
+				t->running_status = status;
+				e.seconds = tempo_seconds;
+				e.status = status;
+				e.data1 = t->p[0] & 0x7f;
+				e.data2 = num_data == 2 ? t->p[1] & 0x7f : 0;
+				t->p += num_data;
+				channel_message = true;
+			} else {
+				// Data byte without a running status
+				t->done = true;
+				continue;
+			}
+
+			uint32_t delta;
+			if (read_varlen(*t, delta)) t->tick += delta;
+			else t->done = true;
+
+			if (channel_message) {
+				num_events++;
+				return true;
+			}
+		}
+	}
+};
+
+
+struct MidiCompilerSettings {
+	double a4;             // tuning, in Hz
+	int transpose;         // semitones
+	double velocity_curve; // amp = 63 * (velocity/127)^velocity_curve
+	double decay;          // seconds from the note on amp to the sustain level, 0 = hold the note on amp
+	int sustain;           // sustain level as an amp sweep target (amp = 9*sustain), used when decay > 0
+	double release;        // seconds to sweep from full amp to zero
+	double bend_range;     // semitones
+	bool percussion;       // also play notes on MIDI channel 10
+	int mode, slope0, slope1, pwm_offset; // patch for all channels
+
+	MidiCompilerSettings() : a4(440), transpose(0), velocity_curve(1), decay(0), sustain(0), release(0.1), bend_range(2),
+		percussion(false), mode(0), slope0(8), slope1(8), pwm_offset(64) {}
+};
+
+struct MidiVoice {
+	int midi_channel, note; // -1 if never used
+	bool held, sustained;   // key down / kept on by the sustain pedal
+	uint64_t note_index;    // number of notes started before this one, orders notes started in the same frame
+	int64_t release_frame, silent_frame; // silent_frame: when the release has reached zero
+
+	MidiVoice() : midi_channel(-1), note(-1), held(false), sustained(false), note_index(0), release_frame(0), silent_frame(0) {}
+};
+
+struct MidiCompiler {
+	MidiCompilerSettings s;
+	int num_chips;
+	FILE *fp;
+	std::vector<std::unique_ptr<RegDriver>> drivers;
+	std::vector<MidiVoice> voices;
+	int64_t frame; // current frame
+	bool sustain_pedal[16];
+	int bend[16]; // -8192 to 8191
+
+	// Statistics
+	uint64_t num_notes, num_steals, num_dropped, num_clamped, num_writes;
+	int max_polyphony;
+
+	MidiCompiler(const MidiCompilerSettings &s, int num_chips, FILE *fp) : s(s), num_chips(num_chips), fp(fp), voices(num_chips * NUM_CHANNELS), frame(0),
+			num_notes(0), num_steals(0), num_dropped(0), num_clamped(0), num_writes(0), max_polyphony(0) {
+		memset(sustain_pedal, 0, sizeof(sustain_pedal));
+		memset(bend, 0, sizeof(bend));
+		for (int chip = 0; chip < num_chips; chip++) {
+			drivers.emplace_back(new RegDriver([this, chip](int reg, int channel, int data) {
+				fprintf(this->fp, "%lld %d %d %d\n", (long long)frame, reg, chip*NUM_CHANNELS + channel, data);
+				num_writes++;
+			}));
+		}
+		// Patch for all channels, silent
+		for (int v = 0; v < (int)voices.size(); v++) {
+			RegDriver &d = driver(v);
+			int channel = v % NUM_CHANNELS;
+			d.set(REG_AMP, channel, 0);
+			d.set(REG_SWEEP_PA, channel, 0);
+			d.set(REG_MODE, channel, s.mode);
+			d.set(REG_SLOPE0, channel, s.slope0);
+			d.set(REG_SLOPE1, channel, s.slope1);
+			d.set(REG_PWM_OFFSET, channel, s.pwm_offset);
+		}
+		flush();
+	}
+
+	RegDriver &driver(int voice) { return *drivers[voice / NUM_CHANNELS]; }
+
+	void flush() { for (auto &d : drivers) d->flush(); }
+
+	int voice_period(int voice, bool *clamped=NULL) {
+		const MidiVoice &v = voices[voice];
+		double semitones = v.note + s.transpose - 69 + s.bend_range * bend[v.midi_channel] / 8192.0;
+		return period_for_freq(s.a4 * pow(2, semitones / 12) / SAMPLE_RATE, clamped);
+	}
+
+	int velocity_amp(int velocity) const {
+		return std::max(1, (int)lrint(63 * pow(velocity / 127.0, s.velocity_curve)));
+	}
+
+	int pick_voice(int midi_channel, int note) {
+		int best = -1;
+		// The voice that is releasing the same note
+		for (int i = 0; i < (int)voices.size(); i++) {
+			const MidiVoice &v = voices[i];
+			if (!v.held && !v.sustained && v.midi_channel == midi_channel && v.note == note) return i;
+		}
+		// The free voice, or failing that, the releasing voice, that was released first
+		for (int pass = 0; pass < 2 && best < 0; pass++) {
+			for (int i = 0; i < (int)voices.size(); i++) {
+				const MidiVoice &v = voices[i];
+				if (v.held || v.sustained) continue;
+				if (pass == 0 && v.silent_frame > frame) continue;
+				if (best < 0 || v.release_frame < voices[best].release_frame) best = i;
+			}
+		}
+		if (best >= 0) return best;
+		// Steal the voice with the oldest note
+		for (int i = 0; i < (int)voices.size(); i++) {
+			if (best < 0 || voices[i].note_index < voices[best].note_index) best = i;
+		}
+		num_steals++;
+		return best;
+	}
+
+	void note_on(int midi_channel, int note, int velocity) {
+		int i = pick_voice(midi_channel, note);
+		MidiVoice &v = voices[i];
+		v.midi_channel = midi_channel;
+		v.note = note;
+		v.held = true;
+		v.sustained = false;
+		v.note_index = num_notes++;
+
+		bool clamped;
+		int period = voice_period(i, &clamped);
+		num_clamped += clamped;
+		int amp = velocity_amp(velocity);
+		int channel = i % NUM_CHANNELS;
+		RegDriver &d = driver(i);
+		d.set(REG_PERIOD, channel, period);
+		d.set(REG_AMP, channel, amp);
+		int sweep = 0;
+		if (s.decay > 0) sweep = amp_sweep_rate(s.decay, abs(amp - AMP_TARGET_STEP*s.sustain)) | (s.sustain << 4);
+		d.set_field(REG_SWEEP_PA, channel, 0, 8, sweep);
+		d.flush();
+
+		int polyphony = 0;
+		for (const MidiVoice &other : voices) polyphony += other.held || other.sustained;
+		max_polyphony = std::max(max_polyphony, polyphony);
+	}
+
+	void release_voice(int i) {
+		MidiVoice &v = voices[i];
+		v.held = v.sustained = false;
+		v.release_frame = frame;
+		int rate = amp_sweep_rate(s.release, 63);
+		int channel = i % NUM_CHANNELS;
+		RegDriver &d = driver(i);
+		d.set_field(REG_SWEEP_PA, channel, 0, 8, rate); // target 0
+		d.flush();
+		// Upper bound for when the amp reaches zero
+		v.silent_frame = frame + (int64_t)ceil(63 * ldexp(1.0, amp_sweep_log2_samples(rate)) / SAMPLE_RATE * FRAME_RATE) + 1;
+	}
+
+	void note_off(int midi_channel, int note) {
+		for (int i = 0; i < (int)voices.size(); i++) {
+			MidiVoice &v = voices[i];
+			if (!v.held || v.midi_channel != midi_channel || v.note != note) continue;
+			if (sustain_pedal[midi_channel]) {
+				v.held = false;
+				v.sustained = true;
+			} else release_voice(i);
+		}
+	}
+
+	void event(const MidiEvent &e) {
+		frame = std::max(frame, (int64_t)lrint(e.seconds * FRAME_RATE));
+		int ch = e.channel();
+		if (ch == MIDI_PERCUSSION_CHANNEL && !s.percussion && (e.type() == 0x90 || e.type() == 0x80)) {
+			if (e.type() == 0x90 && e.data2 > 0) num_dropped++;
+			return;
+		}
+		switch (e.type()) {
+			case 0x90:
+				if (e.data2 > 0) {
+					note_on(ch, e.data1, e.data2);
+					break;
+				}
+				// fall through: note on with velocity 0 is a note off
+			case 0x80:
+				note_off(ch, e.data1);
+				break;
+			case 0xb0:
+				if (e.data1 == 64) {
+					sustain_pedal[ch] = e.data2 >= 64;
+					if (!sustain_pedal[ch]) {
+						for (int i = 0; i < (int)voices.size(); i++) if (voices[i].sustained && voices[i].midi_channel == ch) release_voice(i);
+					}
+				} else if (e.data1 == 120 || e.data1 == 123) { // all sound off, all notes off
+					sustain_pedal[ch] = false;
+					for (int i = 0; i < (int)voices.size(); i++) {
+						if ((voices[i].held || voices[i].sustained) && voices[i].midi_channel == ch) release_voice(i);
+					}
+				}
+				break;
+			case 0xe0:
+				bend[ch] = ((e.data2 << 7) | e.data1) - 8192;
+				for (int i = 0; i < (int)voices.size(); i++) {
+					if (voices[i].midi_channel == ch && (voices[i].held || voices[i].sustained || voices[i].silent_frame > frame)) {
+						driver(i).set(REG_PERIOD, i % NUM_CHANNELS, voice_period(i));
+					}
+				}
+				flush();
+				break;
+		}
+	}
+
+	// Release any notes that are still on, and return the number of frames needed to render everything
+	int64_t finish() {
+		for (int i = 0; i < (int)voices.size(); i++) if (voices[i].held || voices[i].sustained) release_voice(i);
+		int64_t end = frame;
+		for (const MidiVoice &v : voices) end = std::max(end, v.silent_frame);
+		return end;
+	}
+};
@@ -0,0 +1,826 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Bit exact C++ model of the synth core, shared by the RTL test harnesses and the tools that render from it.
+// The USE_ flags select the same features as the RTL configuration that the model is tested against.
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+
+
+#define USE_ORION_WAVE
+#define USE_ORION_WAVE_MASK
+#define USE_ORION_WAVE_PWM
+#define USE_OCT_COUNTER_LATCHES
+#define USE_OSC_SYNC
+#define USE_4_BIT_MODE
+#define USE_OSC_SYNC_ONLY_FOR_SOME_CHANNELS
+#define USE_SWAPPED_DETUNE_SIGNS
+#define USE_COMMON_SAT_STEREO
+#define USE_DETUNE_FIFTH
+
+
+const int MAX_CYCLES_PER_SAMPLE = 64;
+const double CLOCK_FREQUENCY = 64e6; // the TinyQV project clock
+const double SAMPLE_RATE = CLOCK_FREQUENCY / MAX_CYCLES_PER_SAMPLE; // fs
+const int LOG2_NUM_CHANNELS = 2;
+const int NUM_CHANNELS = 1 << LOG2_NUM_CHANNELS;
+
+const int BITS = 12;
+const int PHASE_BITS = BITS;
+const int OCT_BITS = 3;
+const int MANTISSA_BITS = 10;
+const int PERIOD_BITS = OCT_BITS + MANTISSA_BITS;
+const int OUT_ACC_FRAC_BITS = 4;
+const int OUT_ACC_INITIAL_TOP = 512 >> OUT_ACC_FRAC_BITS;
+const int OUT_ACC_INITIAL_TOP_STEREO = 768 >> OUT_ACC_FRAC_BITS;
+const int OCT_COUNTER_BITS = 24;
+
+const int OUT_RSHIFT = 4;
+const int REV_PHASE_SHR = 0;
+
+
+const int REG_PERIOD = 0;
+const int REG_AMP = 1;
+const int REG_SLOPE0 = 2;
+const int REG_SLOPE1 = 3;
+const int REG_PWM_OFFSET = 4;
+const int REG_MODE = 5;
+const int REG_SWEEP_PA = 6; // {period, amp} sweep
+const int REG_SWEEP_WS = 7; // {pwm_offset, slope} sweep
+const int REG_PHASE = 8;
+#ifdef USE_OCT_COUNTER_LATCHES
+const int REG_OCT_COUNTER = 9;
+#endif
+const int REGS_PER_CHANNEL = 9; // Keep at 9; Don't count oct_counter; it is still counted as a core register
+
+const int OCT_COUNTER_MASK = (1 << OCT_COUNTER_BITS) - 1;
+
+const int reg_bits[] = {OCT_BITS + MANTISSA_BITS, 6, 8, 8, 8};
+const int reg_data_bits[REGS_PER_CHANNEL] = {OCT_BITS + MANTISSA_BITS, 6, 8, 8, 8, 12, 16, 16, BITS};
+
+
+const int MODE_BIT_DETUNE0 = 0;
+const int MODE_BIT_NOISE = 3;
+const int MODE_FLAG_NOISE = 1 << MODE_BIT_NOISE;
+const int MODE_BIT_3X = 4;
+const int MODE_FLAG_3X = 1 << MODE_BIT_3X;
+const int MODE_BIT_X2N0 = 5;
+const int MODE_BIT_X2N1 = 6;
+const int MODE_FLAG_COMMON_SAT = 128;
+const int MODE_FLAG_PWL_OSC = 256;
+const int MODE_FLAG_OSC_SYNC_EN = 1 << 9;
+const int MODE_FLAG_OSC_SYNC_SOFT = 1 << 10;
+const int MODE_BIT_DETUNE_FIFTH = 11;
+const int MODE_FLAG_DETUNE_FIFTH = 1 << MODE_BIT_DETUNE_FIFTH;
+
+
+const int MODE_FLAGS_OSC_SYNC_MASK = MODE_FLAG_OSC_SYNC_EN | MODE_FLAG_OSC_SYNC_SOFT;
+
+
+const int CFG_FLAG_STEREO_EN = 1;
+const int CFG_FLAG_STEREO_POS_EN = 2;
+
+
+struct Model {
+	int term_index;
+	int acc, out_acc, out_acc_alt_frac, pred, part, lfsr_extra_bits, oct_counter, cfg;
+	bool last_osc_wrapped;
+	int regs[NUM_CHANNELS*REGS_PER_CHANNEL];
+	// What each term added to out_acc in the last sample, indexed by term_index. Not part of the RTL state, used for stems.
+	// A common_sat pair adds its shared contribution in the common_sat add term.
+	int term_out[2*NUM_CHANNELS];
+
+	Model() {
+		term_index = 0;
+		acc = out_acc = out_acc_alt_frac = pred = part = lfsr_extra_bits = oct_counter = cfg = 0;
+		last_osc_wrapped = false;
+		memset(regs, 0, sizeof(regs));
+		memset(term_out, 0, sizeof(term_out));
+	}
+
+	int get_reg(int channel, int reg) const { return regs[channel + reg*NUM_CHANNELS]; }
+	void set_reg(int channel, int reg, int data) {
+		if (!(0 <= channel && channel < NUM_CHANNELS)) return;
+		if (!(0 <= reg && reg < REGS_PER_CHANNEL)) return;
+		regs[channel + reg*NUM_CHANNELS] = data;
+	}
+	int get_channel() const { return (term_index>>1) & (NUM_CHANNELS-1); }
+	int get_channel_reg(int reg) const { return get_reg(get_channel(), reg); }
+	void set_channel_reg(int reg, int data) { set_reg(get_channel(), reg, data); }
+	int get_subchannel() const { return term_index&1; }
+	bool stereo_en() const { return (cfg & CFG_FLAG_STEREO_EN) != 0; }
+	bool stereo_pos_en() const { return (cfg & CFG_FLAG_STEREO_POS_EN) != 0; }
+	int get_channel_stereo_pos() const { return (get_channel_reg(REG_MODE) >> MODE_BIT_3X) & 7; }
+	bool phase_factor_en() const { return !stereo_pos_en(); }
+	//bool common_sat() { return get_channel() == 0 && ((get_channel_reg(REG_MODE) & MODE_FLAG_COMMON_SAT) != 0) && !stereo_en(); }
+#ifdef USE_COMMON_SAT_STEREO
+	bool _common_sat() const { return ((get_reg(0, REG_MODE) & MODE_FLAG_COMMON_SAT) != 0); }
+	bool common_sat_store() const {
+		return _common_sat() && (stereo_en()
+			? (get_channel() == 0)
+			: (get_channel() == 0 && get_subchannel() == 0)
+		);
+	}
+	bool common_sat_add() const {
+		return _common_sat() && (stereo_en()
+			? (get_channel() == 1)
+			: (get_channel() == 0 && get_subchannel() == 1)
+		);
+	}
+#else
+	bool _common_sat() const { return ((get_channel_reg(REG_MODE) & MODE_FLAG_COMMON_SAT) != 0) && !stereo_en(); }
+	bool common_sat_store() const { return _common_sat() && get_channel() == 0 && get_subchannel() == 0; }
+	bool common_sat_add() const { return _common_sat() && get_channel() == 0 && get_subchannel() == 1; }
+#endif
+};
+
+const int MODE_FLAGS_WAVEFORM = MODE_FLAG_NOISE | MODE_FLAG_PWL_OSC;
+#ifdef USE_ORION_WAVE
+const int MODE_FLAGS_ORION = MODE_FLAG_NOISE | MODE_FLAG_PWL_OSC;
+bool get_lfsr_en(int mode) { return (mode & MODE_FLAGS_WAVEFORM ) == MODE_FLAG_NOISE; }
+bool get_pwl_osc_en(int mode) { return (mode & MODE_FLAGS_WAVEFORM ) == MODE_FLAG_PWL_OSC; }
+bool get_orion_en(int mode) { return (mode & MODE_FLAGS_WAVEFORM ) == MODE_FLAGS_ORION; }
+#else
+bool get_lfsr_en(int mode) { return (mode & MODE_FLAG_NOISE) != 0; }
+bool get_pwl_osc_en(int mode) { return (mode & MODE_FLAG_PWL_OSC) != 0; }
+bool get_orion_en(int mode) { return 0; }
+#endif
+
+
+// The model steps can be specialized at compile time on the mode bits that select their behavior, see pwls_kernels.h.
+// The template parameters hold the decoded values, or MODE_ANY to decode them from the registers at run time:
+// - WAVE: mode & MODE_FLAGS_WAVEFORM
+// - SYNC: mode & MODE_FLAGS_OSC_SYNC_MASK (MODE_FLAG_OSC_SYNC_SOFT alone selects 4 bit mode)
+// - PF: phase factor flags from decode_phase_factor.
+//   Specialized PF values also assume that the term is not involved in common_sat.
+const int MODE_ANY = -1;
+
+const int PF_3X = 1;
+const int PF_X2N = 2;
+const int PF_STEREO_POS = 4; // stereo_pos_en: the 3x and x2n bits hold the stereo position instead
+constexpr int NUM_PF = 5;
+
+template<int WAVE> int mode_waveform(int mode) { return WAVE == MODE_ANY ? mode & MODE_FLAGS_WAVEFORM : WAVE; }
+template<int SYNC> int mode_sync(int mode) { return SYNC == MODE_ANY ? mode & MODE_FLAGS_OSC_SYNC_MASK : SYNC; }
+
+int decode_phase_factor(const Model &m, int mode) {
+	if (m.stereo_pos_en()) return PF_STEREO_POS;
+	return ((mode & MODE_FLAG_3X) != 0 ? PF_3X : 0) | ((mode & (3 << MODE_BIT_X2N0)) != 0 ? PF_X2N : 0);
+}
+template<int PF> bool pf_stereo_pos_en(const Model &m) { return PF == MODE_ANY ? m.stereo_pos_en() : PF == PF_STEREO_POS; }
+template<int PF> bool pf_3x_en(const Model &m, int mode) {
+	return PF == MODE_ANY ? m.phase_factor_en() && ((mode & MODE_FLAG_3X) != 0) : (PF & PF_3X) != 0;
+}
+template<int PF> bool pf_x2n_en(const Model &m, int mode) {
+	return PF == MODE_ANY ? m.phase_factor_en() && ((mode & (3 << MODE_BIT_X2N0)) != 0) : (PF & PF_X2N) != 0;
+}
+template<int PF> bool pf_common_sat_store(const Model &m) { return PF == MODE_ANY && m.common_sat_store(); }
+template<int PF> bool pf_common_sat_add(const Model &m) { return PF == MODE_ANY && m.common_sat_add(); }
+
+
+int signed_wrap(int x) {
+	x += 1 << (BITS - 1);
+	x &= (1 << BITS) - 1;
+	x -= 1 << (BITS - 1);
+	return x;
+}
+
+int sat(int x) {
+	if (x >= (1 << (BITS-2))) return (1 << (BITS-2))-1;
+	else if (x < (-1 << (BITS-2))) return -(1 << (BITS-2));
+	else return x;
+}
+
+static uint16_t bitreverse(uint16_t x, int num_bits) {
+	int shift, mask;
+	shift = 1; mask = 0x5555;
+	x = ((x & mask) << shift) | ((x >> shift) & mask);
+	shift = 2; mask = 0x3333;
+	x = ((x & mask) << shift) | ((x >> shift) & mask);
+	shift = 4; mask = 0x0f0f;
+	x = ((x & mask) << shift) | ((x >> shift) & mask);
+	shift = 8; mask = 0x00ff;
+	x = ((x & mask) << shift) | ((x >> shift) & mask);
+
+	return x >> (16 - num_bits);
+}
+
+// Depends on channel, period and phase for the channel, oct_counter
+template<int WAVE=MODE_ANY, int SYNC=MODE_ANY> void model_oscillator(Model &m) {
+	int phase = m.get_channel_reg(REG_PHASE);
+
+	int mode = m.get_channel_reg(REG_MODE);
+	int sync = mode_sync<SYNC>(mode);
+	bool osc_sync_en = (sync & MODE_FLAG_OSC_SYNC_EN) != 0;
+	bool osc_sync_soft = (sync & MODE_FLAG_OSC_SYNC_SOFT) != 0;
+	bool lfsr_en = get_lfsr_en(mode_waveform<WAVE>(mode));
+	bool pwl_osc_en = get_pwl_osc_en(mode_waveform<WAVE>(mode));
+
+#ifdef DEBUG_OSC
+	printf("phase = 0x%x, osc_sync_en = %d, osc_sync_soft = %d, last_osc_wrapped = %d, lfsr_en = %d, pwl_osc_en = %d\n", phase, osc_sync_en, osc_sync_soft, m.last_osc_wrapped, lfsr_en, pwl_osc_en);
+#endif
+
+	bool do_osc_sync = false;
+	int sync_phase = 0;
+	if (osc_sync_en && m.last_osc_wrapped) {
+		do_osc_sync = true;
+		sync_phase = osc_sync_soft ? ~phase : -1;
+		sync_phase &= ((1 << BITS) - 1);
+		//m.acc = sync_phase & ((1 << BITS) - 1);
+#ifdef DEBUG_OSC
+		printf("sync_phase = 0x%x", sync_phase);
+#endif
+		if (!lfsr_en) m.last_osc_wrapped = 1; // The inversion of src1 sets carry_out
+	}
+
+
+	int f_period = m.get_channel_reg(REG_PERIOD);
+	int mantissa = f_period & ((1 << MANTISSA_BITS) - 1);
+	int period_exp = f_period >> MANTISSA_BITS;
+
+	//bool lfsr_18 = (m.get_channel() == NUM_CHANNELS - 1);
+	bool lfsr_18 = (m.get_channel() == 0 || m.get_channel() == 3);
+
+	int shift_count = 3 - period_exp - (lfsr_en ? 6 : 0); // TODO: is 6 the right offset?
+	bool skip = false;
+	if (shift_count < 0) {
+		//int oct_enables = (m.oct_counter + 1) & ~m.oct_counter;
+		int oct_enables = m.oct_counter & ~(m.oct_counter + 1);
+		if (((oct_enables >> (-shift_count - 1)) & 1) == 0) skip = true;
+		shift_count = 0;
+	}
+
+	bool delayed = (((phase >> shift_count) & 1) != 0);
+	bool small_step;
+
+	//if (pwl_osc_en) printf("delayed = %d, phase = 0x%x\n", delayed, phase);
+
+#ifdef DEBUG_OSC
+	printf("phase = 0x%x ", phase);
+#endif
+	if (delayed) small_step = true;
+	else {
+		//int mantissa_ext = (mantissa << (PHASE_BITS - 1 - MANTISSA_BITS));
+		int mantissa_ext = (mantissa << (PHASE_BITS - 1 - MANTISSA_BITS - REV_PHASE_SHR));
+		if (pwl_osc_en) {
+			int phase_mod = phase & ((1 << (PHASE_BITS-1)) - 1); // remove msb
+			phase_mod &= (-1 << (shift_count + 1)); // remove unused LSBs
+			phase_mod |= ((phase >> (PHASE_BITS-1)) & 1) << shift_count; // put the removed msb back as lowest used bit
+
+#ifdef DEBUG_OSC
+			printf(("phase = 0x%x, phase_mod = 0x%x)\n"), phase, phase_mod);
+#endif
+
+			small_step = (phase_mod < mantissa_ext);
+		} else {
+
+			int rev_phase = bitreverse(phase >> 1, PHASE_BITS-1) >> REV_PHASE_SHR;
+			int rev_phase_shifted = (rev_phase << shift_count) & ((1 << (PHASE_BITS-1)) - 1);
+
+			//if (phase == 2048) printf("phase = 0x%x, mantissa_ext = 0x%x, rev_phase_shifted = 0x%x\n", phase, mantissa_ext, rev_phase_shifted);
+
+
+			small_step = (rev_phase_shifted < mantissa_ext);
+			//small_step = ((rev_phase_shifted >> REV_PHASE_SHR) < (mantissa_ext >> REV_PHASE_SHR));
+
+#ifdef DEBUG_OSC
+			printf("rev_phase_shifted = 0x%x, mantissa_ext = 0x%x ", rev_phase_shifted, mantissa_ext);
+#endif
+		}
+	}
+
+#ifdef DEBUG_OSC
+	printf("delayed = %d, small_step = 0x%x, lfsr_en = %d\n", delayed, small_step, lfsr_en);
+#endif
+
+	if (lfsr_en) {
+		if (!delayed && small_step) phase += 1;
+		else {
+			int x = ((phase >> 1)&((1<<BITS)-1)) | (m.lfsr_extra_bits << (BITS-1));
+
+			int lfsr_bit;
+			if (lfsr_18) {
+#ifdef DEBUG_OSC
+				printf("18 bit: lfsr_extra_bits = 0x%x, x = 0x%x\n", m.lfsr_extra_bits, x);
+#endif
+
+				// 18 bit LFSR
+				bool bit17 = ((x>>17)&1);
+				bool bit6 = ((x>>6)&1);
+				bool zeros = ( (x & ((1<<17)-1) ) == 0);
+				lfsr_bit = bit17 ^ (bit6 | zeros); // include zero state
+			} else {
+				// 11 bit LFSR
+				bool bit10 = ((x>>10)&1);
+				bool bit8 = ((x>>8)&1);
+				bool zeros = ( (x & ((1<<10)-1) ) == 0);
+				lfsr_bit = bit10 ^ (bit8 | zeros); // include zero state
+			}
+			x = (x << 1) | lfsr_bit;
+			phase = (x & ((1<<BITS)-1)) << 1;
+			if (!skip && lfsr_18) m.lfsr_extra_bits = (x >> (BITS-1)) & 127;
+		}
+	} else {
+		int prev_phase = phase;
+		phase = (phase + ((small_step ? 1 : 2) << shift_count)) & ((1 << PHASE_BITS) - 1);
+		if (!do_osc_sync) m.last_osc_wrapped = !skip && ((phase & (1 << (BITS-1)))==0) && ((prev_phase & (1 << (BITS-1)))!=0);
+	}
+
+	if (do_osc_sync) {
+		m.acc = sync_phase & ((1 << BITS) - 1);
+		m.set_channel_reg(REG_PHASE, m.acc);
+	} else {
+		m.acc = phase & ((1 << BITS) - 1);
+		if (!skip) m.set_channel_reg(REG_PHASE, m.acc);
+	}
+}
+
+
+// Depends on channel, subchannel, detune_exp for channel, phase for channel
+template<int PF=MODE_ANY> void model_detune(Model &m, int old_phase) {
+	int detune_exp = m.get_channel_reg(REG_MODE) & 7;
+	int subchannel = m.get_subchannel();
+
+	int mode = m.get_channel_reg(REG_MODE);
+	bool enable_3x = (subchannel == 0) && pf_3x_en<PF>(m, mode);
+
+#ifdef DEBUG_DETUNE
+	printf("detune_exp_orig = 0x%x\n", detune_exp);
+#endif
+	//if ((mode & MODE_FLAG_DETUNE_FIFTH) != 0 && subchannel == 0 && detune_exp != 0) detune_exp++;
+	if ((mode & MODE_FLAG_DETUNE_FIFTH) != 0 && subchannel == 0) detune_exp++;
+#ifdef DEBUG_DETUNE
+	printf("detune_exp_mod = 0x%x\n", detune_exp);
+#endif
+
+	bool detune_disable = (subchannel == 0 && !enable_3x && pf_x2n_en<PF>(m, mode));
+
+	bool swap_detune_sign = false;
+	int stereo_pos = m.get_channel_stereo_pos();
+	if (pf_stereo_pos_en<PF>(m) && stereo_pos <= 4) swap_detune_sign = (m.oct_counter & 1) != 0;
+
+	//int x = old_phase;
+	int x = m.get_channel_reg(REG_PHASE);
+
+#ifdef USE_SWAPPED_DETUNE_SIGNS
+	swap_detune_sign = !swap_detune_sign;
+#endif
+
+#ifdef DEBUG_DETUNE
+	printf("enable_3x = %d, detune_disable = %d, subchannel = %d, cfg = 0x%x, swap_detune_sign = %d, x = 0x%x\n", enable_3x, detune_disable, subchannel, m.cfg, swap_detune_sign, x);
+#endif
+
+	if (enable_3x) {
+		x += m.acc << 1;
+	} else {
+		int detune = 0;
+		if (detune_exp != 0 && !detune_disable) {
+			//int detune_src = m.oct_counter >> 6;
+			//detune = detune_src >> (7 - detune_exp);
+			detune = m.oct_counter >> ((6+7) - detune_exp);
+
+			if ((subchannel == 0) != swap_detune_sign) x += detune;
+			else x -= detune;
+		}
+
+		x -= subchannel ^ swap_detune_sign;
+
+#ifdef DEBUG_DETUNE
+		printf("detune = 0x%x, x = 0x%x\n", detune, x);
+#endif
+	}
+
+
+	m.acc = signed_wrap(x);
+}
+
+template<int PF=MODE_ANY> void model_detune(Model &m) {
+	model_detune<PF>(m, m.get_channel_reg(REG_PHASE));
+}
+
+// Depends on acc, PWM offset for channel
+template<int WAVE=MODE_ANY, int PF=MODE_ANY> void model_tri_pwm_offset(Model &m) {
+	int mode = m.get_channel_reg(REG_MODE);
+	int pwm_offset = (m.get_channel_reg(REG_PWM_OFFSET) << (BITS-2-8)) - (1 << (BITS-2));
+	int lshift = (m.get_subchannel() == 1 && pf_x2n_en<PF>(m, mode)) ? (mode >> MODE_BIT_X2N0) & 3 : 0;
+
+	int x = m.acc & ((1 << BITS) - 1);
+#ifdef DEBUG_TRI
+		printf("initial:\tpwm_offset = 0x%x, x = 0x%x\n", pwm_offset, x);
+#endif
+
+	if (get_orion_en(mode_waveform<WAVE>(mode))) {
+#ifdef USE_ORION_WAVE_PWM
+		if (((m.acc << lshift)&(1 << (BITS-1))) != 0) pwm_offset = ~pwm_offset;
+#endif
+
+#ifdef DEBUG_TRI
+		printf("orion:\tpwm_offset = 0x%x, x = 0x%x\n", pwm_offset, x);
+#endif
+
+		m.acc = signed_wrap((x << lshift) + pwm_offset);
+		m.part = 0;
+		return;
+	}
+
+	// Left shift
+	x = (x << lshift) & ((1 << BITS)-1);
+
+	bool part = (x >= (1 << (BITS-1)));
+
+	// Triangle wave
+	if (part) x = ~x;
+	x &= ((1 << (BITS - 1)) - 1);
+#ifdef DEBUG_TRI
+	printf("x = 0x%x\n", x);
+#endif
+
+	// Apply PWM offset and saturate
+	x += pwm_offset;
+#ifdef DEBUG_TRI
+	printf("x = 0x%x\n", x);
+#endif
+	if (x >= (1 << (BITS-2))) x = (1 << (BITS-2)) - 1;
+#ifdef DEBUG_TRI
+	printf("x = 0x%x\n", x);
+#endif
+
+	m.acc = x;
+	m.part = part;
+}
+
+int bitshuffle(int x) {
+	int y = 0;
+#ifndef USE_ORION_WAVE_MASK
+	// y |= ((x >> -1)&1) <<  0;
+	y |= ((x >>  4)&1) <<  1;
+	// y |= ((x >> -1)&1) <<  2;
+	y |= ((x >>  7)&1) <<  3;
+	y |= ((x >>  8)&1) <<  4;
+	// y |= ((x >> -1)&1) <<  5;
+	y |= ((x >> 10)&1) <<  6;
+	// y |= ((x >> -1)&1) <<  7;
+	// y |= ((x >> -1)&1) <<  8;
+	y |= ((x >>  9)&1) <<  9;
+	y |= ((x >> 11)&1) << 10;
+	// y |= ((x >> -1)&1) << 11;
+	// y |= ((x >> -1)&1) << 12;
+#else
+	//y |= ((x >> 11)&1) <<  0;
+	y |= ((x >>  4)&1) <<  1;
+	//y |= ((x >> 10)&1) <<  2;
+	y |= ((x >>  7)&1) <<  3;
+	y |= ((x >>  8)&1) <<  4;
+	y |= ((x >> 6)&1) <<  5;
+	y |= ((x >> 10)&1) <<  6;
+	y |= ((x >> 11)&1) <<  7;
+	y |= ((x >> 8)&1) <<  8;
+	y |= ((x >>  9)&1) <<  9;
+	y |= ((x >> 11)&1) << 10;
+	// y |= ((x >> -1)&1) << 11;
+	// y |= ((x >> -1)&1) << 12;
+#endif
+	return y;
+}
+
+// Depends on channel, part, slope for the channel and part, acc
+template<int WAVE=MODE_ANY, int SYNC=MODE_ANY, int PF=MODE_ANY> void model_slope(Model &m) {
+	int mode = m.get_channel_reg(REG_MODE);
+	//printf("get_orion_en = %d\n", get_orion_en(mode));
+	int y;
+	if (get_orion_en(mode_waveform<WAVE>(mode))) {
+		//acc = (bitshuffle(acc) & mask) + offset
+		int acc = bitshuffle(m.acc);
+		//printf("orion: acc in = 0x%x, bitshuffle = 0x%x\n", m.acc, acc);
+
+		int slope1 = m.get_channel_reg(REG_SLOPE1);
+		int src2_mask = -1;
+		src2_mask &= ~0xff << (BITS-1-8);
+		if (slope1&1) src2_mask |= ~(-1 << (BITS-1-8)); // replicate the bottom mask bit
+		src2_mask |= slope1 << (BITS-1-8);
+		acc &= src2_mask;
+		//printf("orion: src2_mask = 0x%x, acc = 0x%x\n", src2_mask, acc);
+
+		acc += m.get_channel_reg(REG_SLOPE0) << (BITS-3-4);
+		//printf("orion: offset: acc = 0x%x\n", acc);
+		m.acc = acc;
+
+		//acc = acc + (acc << 1)
+		acc *= 3;
+		//printf("orion: 3x: acc = 0x%x\n", acc);
+		// acc = sext_wrap(acc)
+		acc = acc & ((1 << (BITS-1))-1);
+		acc |= ((acc >> (BITS-2))&1) << (BITS-1);
+		//printf("orion: sext: acc = 0x%x\n", acc);
+
+		y = signed_wrap(acc);
+	} else {
+		int slope = m.get_channel_reg(m.part ? REG_SLOPE1 : REG_SLOPE0);
+		int slope_exp = slope >> 4;
+		int slope_offset = (slope & 15) << (BITS-3-4);
+		int x = m.acc;
+
+		//printf("slope = 0x%x, part = %d, acc = 0x%x\n", slope, m.part, x);
+
+		x <<= slope_exp;
+		int x1 = 2*x;
+		int x2 = x + (x >= 0 ? slope_offset : -slope_offset);
+
+		y = x1;
+		if ((x >= 0 && x2 < y) || (x < 0 && x2 > y)) y = x2;
+		bool cmp = ((x1 - x2) < 0) ^ (x < 0);
+
+		y = sat(y);
+		m.pred = cmp;
+	}
+
+	if (pf_common_sat_store<PF>(m)) { // store result to out_acc instead
+		m.out_acc &= ((1 << OUT_ACC_FRAC_BITS) - 1);
+		m.out_acc |= y & (-1 << OUT_ACC_FRAC_BITS);
+	} else {
+#ifdef USE_4_BIT_MODE
+		if (mode_sync<SYNC>(mode) == MODE_FLAG_OSC_SYNC_SOFT) y &= -1 << (BITS-1-4);
+#endif
+		m.acc = y;
+	}
+
+	//printf("slope = %d, x = %d, x1 = %d, x2 = %d, y = %d\n", slope, x, x1, x2, y);
+}
+
+void model_add_common_sat(Model &m) {
+	int out_acc = m.out_acc;
+	out_acc &= -1 << OUT_ACC_FRAC_BITS;
+#ifdef DEBUG_ADD_COMMON_SAT
+	printf("add_common_sat:\tout_acc = 0x%x, out_acc_masked = 0x%x, acc = 0x%x\n", m.out_acc, out_acc, m.acc);
+#endif
+	m.acc = sat(m.acc + out_acc);
+#ifdef DEBUG_ADD_COMMON_SAT
+	printf("add_common_sat:\tacc = 0x%x\n", m.acc);
+#endif
+}
+
+// Depends on channel, amp for channel, acc. Returns the contribution to out_acc.
+template<int PF=MODE_ANY> int model_amp_clamp(Model &m) {
+	int x = m.acc;
+	int amp = m.get_channel_reg(REG_AMP) << (BITS-2-6);
+
+#ifdef DEBUG_AMP_CLAMP
+	printf("initial:\tx = 0x%x, amp = 0x%x\n", x, amp);
+#endif
+
+	if (pf_stereo_pos_en<PF>(m)) {
+		int factor = 2;
+		int stereo_pos = m.get_channel_stereo_pos();
+		if (m.get_subchannel() == 0) {
+			if ((stereo_pos&3) == 3) factor = 1;
+			else if (stereo_pos == 4) factor = 0;
+		} else {
+			if ((stereo_pos&3) == 1) factor = 1;
+			else if (stereo_pos == 0) factor = 0;
+		}
+		amp = (amp * factor) >> 1;
+	}
+
+	bool saturated_neg = false;
+	if (x >= 0 && x >  amp) x = amp;
+	if (x <  0 && x < -amp) { x = -amp; saturated_neg = true; }
+
+#ifdef DEBUG_AMP_CLAMP
+	printf("clamp:\tamp = 0x%x, x = 0x%x\n", amp, x);
+#endif
+
+	if (saturated_neg) x = -x; // amp is right shifted before negation, compensate
+	if (pf_common_sat_add<PF>(m)) x >>= (OUT_RSHIFT-1);
+	else x >>= OUT_RSHIFT;
+	if (saturated_neg) x = -x; // amp is right shifted before negation, compensate
+
+	return x;
+}
+
+// Depends on out_acc. Special behavior for term_index == 0 (sigma-delta)
+template<int PF=MODE_ANY> void model_out_acc_add(Model &m, int x) {
+	int y = m.out_acc;
+#ifdef DEBUG_AMP_CLAMP
+	printf("rshift:\tx = 0x%x, y = 0x%x\n", x, y);
+#endif
+
+
+	if (m.term_index == 0 || (m.term_index == 1 && m.stereo_en()) || pf_common_sat_add<PF>(m)) {
+		// Reset out_acc except the frac bits
+		y &= (1 << OUT_ACC_FRAC_BITS) - 1;
+		if (m.stereo_en()) {
+			int old_alt_frac = m.out_acc_alt_frac;
+			m.out_acc_alt_frac = y;
+			y = old_alt_frac;
+		}
+		y |= (m.stereo_en() ? OUT_ACC_INITIAL_TOP_STEREO : OUT_ACC_INITIAL_TOP) << OUT_ACC_FRAC_BITS;
+	}
+
+#ifdef DEBUG_AMP_CLAMP
+	printf("mask:\tx = 0x%x, y = 0x%x\n", x, y);
+#endif
+
+	y += x;
+	m.term_out[m.term_index] = x;
+#ifdef DEBUG_AMP_CLAMP
+	printf("add:\ty = 0x%x\n", y);
+#endif
+
+	m.out_acc = signed_wrap(y);
+}
+
+// Depends on channel, amp for channel, acc, out_acc. Special behavior for term_index == 0 (sigma-delta)
+template<int PF=MODE_ANY> void model_amp_clamp_out(Model &m) {
+	model_out_acc_add<PF>(m, model_amp_clamp<PF>(m));
+}
+
+// Depends on oct_counter (oct_enables, sweep_channel, sweep_index), value and sweep value for swept parameter
+int model_sweep(Model &m) {
+	int sweep_channel = m.oct_counter & ((1 << LOG2_NUM_CHANNELS) - 1);
+
+	int sweep_index;
+	int pre_sweep_index = (m.oct_counter >> LOG2_NUM_CHANNELS) & 7;
+	int sweep_oct_counter_term = 8;
+	if ((pre_sweep_index & 1) == 0) sweep_index = 0;
+	else {
+		sweep_index = (pre_sweep_index >> 1) & 3;
+		if (sweep_index == 0) sweep_index = 4;
+		sweep_oct_counter_term = 32;
+	}
+
+	int sweep = 0;
+	switch (sweep_index) {
+		case REG_PERIOD: sweep = m.get_reg(sweep_channel, REG_SWEEP_PA) >> 8; break;
+		case REG_AMP: sweep = m.get_reg(sweep_channel, REG_SWEEP_PA) & 255; break;
+		case REG_SLOPE0: case REG_SLOPE1: sweep = m.get_reg(sweep_channel, REG_SWEEP_WS) & 255; break;
+		case REG_PWM_OFFSET: sweep = m.get_reg(sweep_channel, REG_SWEEP_WS) >> 8; break;
+	}
+
+	int rate = sweep & 15;
+	int sign = (sweep >> 4) & 1;
+
+	int oct_enables = m.oct_counter & ~(m.oct_counter + sweep_oct_counter_term);
+	bool enable;
+	if (rate == 0) enable = false;
+	else if (rate == 1) enable = true;
+	else enable = (oct_enables >> rate) & 1;
+
+	int value = m.get_reg(sweep_channel, sweep_index);
+
+	if (sweep_index == REG_AMP) {
+		int amp_target = ((sweep >> 4)&7)*9;
+		sign = (value > amp_target);
+		if (value == amp_target) enable = 0;
+	} else if (sweep_index == REG_SLOPE0 || sweep_index == REG_SLOPE1) {
+		int dir = (sweep >> 5) & 3;
+		if (dir == 0 && sweep_index == REG_SLOPE1) sign = !sign;
+		if (dir == 2 && sweep_index == REG_SLOPE0) enable = false;
+		if (dir == 1 && sweep_index == REG_SLOPE1) enable = false;
+	}
+
+	if (sign && value == 0) enable = false;
+	if (!sign && value == (1 << reg_bits[sweep_index]) - 1) enable = false;
+
+	value += sign ? -1 : 1;
+	m.acc = value;
+	if (enable) m.set_reg(sweep_channel, sweep_index, value);
+
+	return reg_bits[sweep_index];
+}
+
+
+// Run one waveform term, for m.term_index
+template<int WAVE=MODE_ANY, int SYNC=MODE_ANY, int PF=MODE_ANY> void model_term(Model &m) {
+	int old_phase = m.get_channel_reg(REG_PHASE);
+	if ((m.term_index & 1) == 0) model_oscillator<WAVE, SYNC>(m);
+	model_detune<PF>(m, old_phase);
+	model_tri_pwm_offset<WAVE, PF>(m);
+	model_slope<WAVE, SYNC, PF>(m);
+	if (pf_common_sat_add<PF>(m)) model_add_common_sat(m);
+	if (!pf_common_sat_store<PF>(m)) model_amp_clamp_out<PF>(m);
+	else m.term_out[m.term_index] = 0;
+}
+
+// Term index of the term_i:th term in a sample. In stereo, the first subchannel of all channels comes first.
+int model_term_index(int term_i, bool stereo_en) {
+	if (stereo_en) return ((term_i & 3) << 1) | ((term_i & 4) >> 2);
+	else return term_i;
+}
+
+// Run all waveform terms of one sample in the same order as the RTL state sequence.
+// out[0] receives out_acc after the last mono/left term, out[1] after the last right term (only written when stereo is enabled).
+void model_sample_terms(Model &m, int *out) {
+	bool stereo_en = m.stereo_en();
+
+	for (int term_i = 0; term_i < 2*NUM_CHANNELS; term_i++) {
+		m.term_index = model_term_index(term_i, stereo_en);
+		model_term(m);
+
+		if (stereo_en && term_i == NUM_CHANNELS - 1) out[0] = m.out_acc;
+	}
+	if (stereo_en) out[1] = m.out_acc;
+	else out[0] = m.out_acc;
+}
+
+void model_sample_oscillators(Model &m) {
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+		m.term_index = 2*channel;
+		model_oscillator(m);
+	}
+}
+
+void model_sample_sweep(Model &m) {
+	m.term_index = 2*NUM_CHANNELS;
+	model_sweep(m);
+}
+
+void model_next_sample(Model &m) { m.oct_counter = (m.oct_counter + 1) & OCT_COUNTER_MASK; }
+
+// Run one full sample in the same order as the RTL state sequence: all waveform terms, then the sweep step.
+void model_sample(Model &m, int *out) {
+	model_sample_terms(m, out);
+	model_sample_sweep(m);
+	model_next_sample(m);
+}
+
+// Advance only the state that carries over between samples: oscillators, sweeps and oct_counter.
+// Leaves the registers, lfsr_extra_bits, last_osc_wrapped and oct_counter exactly as model_sample would,
+// but skips the output path, so out_acc and out_acc_alt_frac are not updated.
+void model_sample_state(Model &m) {
+	model_sample_oscillators(m);
+	model_sample_sweep(m);
+	model_next_sample(m);
+}
+
+
+const int SWEEP_NEVER = 1 << 30;
+
+// Can the sweep for the given channel and parameter change its value, and at which rate?
+// Mirrors the enable logic in model_sweep, except for the oct_counter dependence.
+bool sweep_can_update(const Model &m, int channel, int sweep_index, int &rate) {
+	int sweep = 0;
+	switch (sweep_index) {
+		case REG_PERIOD: sweep = m.get_reg(channel, REG_SWEEP_PA) >> 8; break;
+		case REG_AMP: sweep = m.get_reg(channel, REG_SWEEP_PA) & 255; break;
+		case REG_SLOPE0: case REG_SLOPE1: sweep = m.get_reg(channel, REG_SWEEP_WS) & 255; break;
+		case REG_PWM_OFFSET: sweep = m.get_reg(channel, REG_SWEEP_WS) >> 8; break;
+	}
+
+	rate = sweep & 15;
+	int sign = (sweep >> 4) & 1;
+	if (rate == 0) return false;
+
+	int value = m.get_reg(channel, sweep_index);
+	if (sweep_index == REG_AMP) {
+		int amp_target = ((sweep >> 4)&7)*9;
+		if (value == amp_target) return false;
+		sign = (value > amp_target);
+	} else if (sweep_index == REG_SLOPE0 || sweep_index == REG_SLOPE1) {
+		int dir = (sweep >> 5) & 3;
+		if (dir == 0 && sweep_index == REG_SLOPE1) sign = !sign;
+		if (dir == 2 && sweep_index == REG_SLOPE0) return false;
+		if (dir == 1 && sweep_index == REG_SLOPE1) return false;
+	}
+
+	if (sign && value == 0) return false;
+	if (!sign && value == (1 << reg_bits[sweep_index]) - 1) return false;
+	return true;
+}
+
+// Number of samples, starting with the current one, that will run the sweep step without changing any register.
+// model_sample_sweep can be skipped for these samples. Returns SWEEP_NEVER if no sweep can change anything.
+int model_sweep_distance(const Model &m) {
+	int distance = SWEEP_NEVER;
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+		for (int sweep_index = 0; sweep_index <= REG_PWM_OFFSET; sweep_index++) {
+			int rate;
+			if (!sweep_can_update(m, channel, sweep_index, rate)) continue;
+
+			// The sweep for a channel and parameter is selected by the low oct_counter bits: {pre_sweep_index, sweep_channel}.
+			// Period sweeps use even pre_sweep_index and oct_enables from bit 3 up, the others one odd pre_sweep_index and bit 5 up.
+			int pre_sweep_index = sweep_index == REG_PERIOD ? 0 : (sweep_index == REG_PWM_OFFSET ? 1 : (sweep_index << 1) | 1);
+			int low_bits = sweep_index == REG_PERIOD ? LOG2_NUM_CHANNELS + 1 : LOG2_NUM_CHANNELS + 3;
+			int mask = (1 << low_bits) - 1;
+			int match = channel | (pre_sweep_index << LOG2_NUM_CHANNELS);
+			if (rate > 1) {
+				// oct_enables bit rate is set when oct_counter bits low_bits..rate are all ones
+				if (rate < low_bits) continue;
+				mask = (2 << rate) - 1;
+				match |= mask & (-1 << low_bits);
+			}
+			match &= mask;
+
+			int oct_counter = (m.oct_counter & ~mask) | match;
+			if (oct_counter < m.oct_counter) oct_counter += mask + 1;
+			distance = std::min(distance, oct_counter - m.oct_counter);
+		}
+	}
+	return distance;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Minimal helpers for running independent jobs on all cores.
+
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
+
+// Wall clock time since t0, for reporting speed
+double seconds_since(std::chrono::steady_clock::time_point t0) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int default_num_threads() {
+	int n = std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+// Call f(i) for 0 <= i < n, spread over num_threads threads. Jobs are handed out in order as threads become free.
+template<typename F> void parallel_for(int n, int num_threads, F f) {
+	if (num_threads > n) num_threads = n;
+	if (num_threads <= 1) {
+		for (int i = 0; i < n; i++) f(i);
+		return;
+	}
+
+	std::atomic<int> next_index(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < num_threads; t++) {
+		threads.emplace_back([&]() {
+			for (int i; (i = next_index++) < n;) f(i);
+		});
+	}
+	for (std::thread &thread : threads) thread.join();
+}
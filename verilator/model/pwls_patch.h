@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Patch banks: named sounds for the synth, as the per-channel registers that stay the same from note to note.
+//
+// A patch holds amp, slope0, slope1, pwm_offset, mode, sweep_pa and sweep_ws for a channel, plus the cfg that it
+// was made for. The period is left to the notes. The amp is the level for a note on, and the period half of sweep_pa
+// is a rate, so it works the same for every note.
+//
+// Binary bank file (little endian):
+//     header, PATCH_HEADER_SIZE bytes: magic "PWLSBANK", version, header_size, record_size, num_patches (uint32 each),
+//                                       then zeros up to header_size
+//     num_patches records of record_size bytes each, starting at header_size, see PatchRecord
+// The fields are naturally aligned, so a mapped file is used in place. Newer versions may only add fields at the end of the
+// header and of the records, and raise header_size and record_size; older readers skip what they don't know.
+//
+// Text bank file, one patch per line (numbers in C syntax, e.g. 0x108), for keeping banks under version control:
+//     name amp slope0 slope1 pwm_offset mode sweep_pa sweep_ws cfg
+// Names have at most PATCH_NAME_LENGTH characters and no whitespace. Lines starting with # are comments.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pwls_model.h"
+#include "pwls_events.h"
+
+const char PATCH_MAGIC[8] = {'P', 'W', 'L', 'S', 'B', 'A', 'N', 'K'};
+const uint32_t PATCH_VERSION = 1;
+const int PATCH_HEADER_SIZE = 32;
+const int PATCH_NAME_LENGTH = 23;
+const int PATCH_NUM_REGS = 8;
+
+// The patch registers, in the order that they are stored in. REG_OCT_COUNTER stands for cfg.
+const int patch_regs[PATCH_NUM_REGS] = {REG_AMP, REG_SLOPE0, REG_SLOPE1, REG_PWM_OFFSET, REG_MODE, REG_SWEEP_PA, REG_SWEEP_WS, REG_OCT_COUNTER};
+const char *const patch_reg_names[PATCH_NUM_REGS] = {"amp", "slope0", "slope1", "pwm_offset", "mode", "sweep_pa", "sweep_ws", "cfg"};
+
+struct PatchHeader {
+	char magic[8];
+	uint32_t version, header_size, record_size, num_patches;
+	uint32_t reserved[2];
+};
+
+struct PatchRecord {
+	char name[PATCH_NAME_LENGTH + 1]; // zero terminated
+	uint16_t regs[PATCH_NUM_REGS];    // in the order of patch_regs
+
+	int amp() const { return regs[0]; }
+	int cfg() const { return regs[PATCH_NUM_REGS - 1]; }
+	bool stereo_en() const { return (cfg() & CFG_FLAG_STEREO_EN) != 0; }
+};
+
+static_assert(sizeof(PatchHeader) == PATCH_HEADER_SIZE, "PatchHeader must match the file format");
+static_assert(sizeof(PatchRecord) == 40, "PatchRecord must match the file format");
+
+int patch_reg_mask(int i) {
+	int reg = patch_regs[i];
+	return reg == REG_OCT_COUNTER ? CFG_FLAG_STEREO_EN | CFG_FLAG_STEREO_POS_EN : (1 << reg_data_bits[reg]) - 1;
+}
+
+// Append the events to set up the patch on a channel at the given frame, including cfg.
+// With amp_on = false, amp and the amp half of sweep_pa are zeroed, to set up a channel before its first note.
+void patch_events(const PatchRecord &p, int channel, int frame, bool amp_on, std::vector<RegEvent> &events) {
+	for (int i = 0; i < PATCH_NUM_REGS; i++) {
+		int reg = patch_regs[i];
+		int data = p.regs[i];
+		if (!amp_on && reg == REG_AMP) data = 0;
+		if (!amp_on && reg == REG_SWEEP_PA) data &= 0xff00;
+		events.push_back(RegEvent{frame, reg, reg == REG_OCT_COUNTER ? 2 : channel, data});
+	}
+}
+
+
+// Read a text bank. Returns false on errors, after printing them.
+bool load_patch_text(const char *fname, std::vector<PatchRecord> &patches) {
+	FILE *fp = fopen(fname, "r");
+	if (!fp) {
+		printf("Failed to open patch file: %s\n", fname);
+		return false;
+	}
+	char line[512];
+	int line_number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp)) {
+		line_number++;
+		char *p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+
+		char name[64];
+		long values[PATCH_NUM_REGS];
+		int n = 0;
+		if (sscanf(p, "%63s %n", name, &n) != 1) ok = false;
+		p += n;
+		for (int i = 0; ok && i < PATCH_NUM_REGS; i++) {
+			char *end;
+			values[i] = strtol(p, &end, 0);
+			if (end == p) {
+				printf("%s:%d: expected %s\n", fname, line_number, patch_reg_names[i]);
+				ok = false;
+			} else if (values[i] < 0 || values[i] > patch_reg_mask(i)) {
+				printf("%s:%d: %s = %ld is out of range (0 to %d)\n", fname, line_number, patch_reg_names[i], values[i], patch_reg_mask(i));
+				ok = false;
+			}
+			p = end;
+		}
+		if (!ok) break;
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+		if (*p != 0) {
+			printf("%s:%d: unexpected text after cfg\n", fname, line_number);
+			ok = false;
+			break;
+		}
+		if (strlen(name) > (size_t)PATCH_NAME_LENGTH) {
+			printf("%s:%d: patch name %s is longer than %d characters\n", fname, line_number, name, PATCH_NAME_LENGTH);
+			ok = false;
+			break;
+		}
+
+		PatchRecord r;
+		memset(&r, 0, sizeof(r));
+		strcpy(r.name, name);
+		for (int i = 0; i < PATCH_NUM_REGS; i++) r.regs[i] = values[i];
+		patches.push_back(r);
+	}
+	fclose(fp);
+	return ok;
+}
+
+void save_patch_text(FILE *fp, const PatchRecord &p) {
+	fprintf(fp, "%-*s %2d %3d %3d %3d 0x%03x 0x%04x 0x%04x %d\n", PATCH_NAME_LENGTH, p.name,
+		p.regs[0], p.regs[1], p.regs[2], p.regs[3], p.regs[4], p.regs[5], p.regs[6], p.regs[7]);
+}
+
+bool save_patch_bank(const char *fname, const std::vector<PatchRecord> &patches) {
+	FILE *fp = fopen(fname, "wb");
+	if (!fp) {
+		printf("Failed to create patch bank file: %s\n", fname);
+		return false;
+	}
+	PatchHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PATCH_MAGIC, sizeof(h.magic));
+	h.version = PATCH_VERSION;
+	h.header_size = sizeof(PatchHeader);
+	h.record_size = sizeof(PatchRecord);
+	h.num_patches = patches.size();
+	bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+	if (!patches.empty()) ok = ok && fwrite(patches.data(), sizeof(PatchRecord), patches.size(), fp) == patches.size();
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok) printf("Failed to write patch bank file: %s\n", fname);
+	return ok;
+}
+
+// Does the file start like a binary bank? Otherwise it is taken to be a text bank.
+bool is_patch_bank_file(const char *fname) {
+	FILE *fp = fopen(fname, "rb");
+	if (!fp) return false;
+	char magic[sizeof(PATCH_MAGIC)];
+	bool result = fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, PATCH_MAGIC, sizeof(magic));
+	fclose(fp);
+	return result;
+}
+
+// A mapped binary bank
+struct PatchBank {
+	void *data;
+	size_t size;
+	PatchHeader header;
+	int num_patches;
+
+	PatchBank() : data(NULL), size(0), num_patches(0) {}
+	~PatchBank() { if (data != NULL) munmap(data, size); }
+
+	const PatchRecord &operator[](int i) const {
+		return *(const PatchRecord *)((const char *)data + header.header_size + (size_t)i * header.record_size);
+	}
+
+	bool open(const char *fname) {
+		int fd = ::open(fname, O_RDONLY);
+		if (fd < 0) {
+			printf("Failed to open patch bank file: %s\n", fname);
+			return false;
+		}
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0 && st.st_size >= PATCH_HEADER_SIZE;
+		if (ok) {
+			size = st.st_size;
+			data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) { data = NULL; ok = false; }
+		}
+		::close(fd);
+		if (!ok || memcmp(data, PATCH_MAGIC, sizeof(PATCH_MAGIC))) {
+			printf("%s: not a patch bank file\n", fname);
+			return false;
+		}
+
+		memcpy(&header, data, sizeof(header));
+		if (header.version < 1 || header.header_size < sizeof(PatchHeader) || header.record_size < sizeof(PatchRecord) ||
+				(header.header_size | header.record_size) % alignof(PatchRecord) != 0) {
+			printf("%s: unsupported patch bank version %u (header size %u, record size %u)\n", fname, header.version, header.header_size, header.record_size);
+			return false;
+		}
+		if (header.header_size > size || (size - header.header_size) / header.record_size < header.num_patches) {
+			printf("%s: truncated, expected %u patches\n", fname, header.num_patches);
+			return false;
+		}
+		num_patches = header.num_patches;
+		for (int i = 0; i < num_patches; i++) {
+			if (memchr((*this)[i].name, 0, sizeof(PatchRecord::name)) == NULL) {
+				printf("%s: patch %d has an unterminated name\n", fname, i);
+				return false;
+			}
+		}
+		return true;
+	}
+};
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Exact long run oscillator frequency and jitter, from stepping model_oscillator through a full cycle of its state.
+//
+// Only the steps where the oscillator is enabled are simulated. The enabled steps are evenly spaced:
+// one every 2^(period_exp - 3) samples for the lower octaves, and in noise mode, where the period is offset by 6 octaves,
+// one every 2^(period_exp + 3) samples. The frequency of noise is its LFSR shift rate.
+// Jitter is how far the oscillator phase (or the shift count, for noise) strays from an ideal, evenly advancing one,
+// expressed in samples.
+
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+
+#include "pwls_model.h"
+
+const int OSC_CYCLE_WARMUP_STEPS = 1 << 16; // to get into the cycle that the oscillator ends up in
+const int OSC_MAX_CYCLE_STEPS = 1 << 21;    // give up on finding the cycle after this, and average over this many steps
+const int NOISE_OCTAVE_OFFSET = 6;          // see shift_count in model_oscillator
+
+struct OscPitch {
+	double freq;                     // in units of fs
+	double jitter_rms, jitter_peak;  // in samples
+	int cycle_steps;                 // 0 if no cycle was found within OSC_MAX_CYCLE_STEPS
+};
+
+int period_exp(int period) { return period >> MANTISSA_BITS; }
+int period_mantissa(int period) { return period & ((1 << MANTISSA_BITS) - 1); }
+
+// log2 of the number of samples per enabled oscillator step
+int osc_step_samples_log2(int mode, int period) {
+	int shift_count = 3 - period_exp(period) - (get_lfsr_en(mode) ? NOISE_OCTAVE_OFFSET : 0);
+	return shift_count < 0 ? -shift_count : 0;
+}
+
+// Nominal frequency from docs/info.md, in units of fs
+double osc_nominal_freq(int mode, int period) {
+	double mantissa_factor = (1024 + period_mantissa(period)) / 1024.0;
+	if (get_lfsr_en(mode)) return 1 / (8 * ldexp(mantissa_factor, period_exp(period)));
+	return 1 / ldexp(mantissa_factor, period_exp(period) + 8);
+}
+
+// Take one enabled oscillator step for m.term_index. Returns the phase advance, or for noise, whether the LFSR shifted.
+int osc_step(Model &m, bool noise) {
+	int phase = m.get_channel_reg(REG_PHASE);
+	model_oscillator(m);
+	int new_phase = m.get_channel_reg(REG_PHASE);
+	if (noise) return new_phase != phase && (new_phase & 1) == 0; // the increment step sets bit 0, the LFSR shift clears it
+	return (new_phase - phase) & ((1 << PHASE_BITS) - 1);
+}
+
+// Measure the oscillator of channel with the given period and mode (only the waveform bits matter)
+void measure_oscillator(int mode, int period, int channel, OscPitch &r) {
+	bool noise = get_lfsr_en(mode);
+	Model m;
+	m.set_reg(channel, REG_PERIOD, period);
+	m.set_reg(channel, REG_MODE, mode & MODE_FLAGS_WAVEFORM);
+	m.term_index = 2*channel;
+	m.oct_counter = OCT_COUNTER_MASK; // all octave enables on: every call is an enabled step
+
+	for (int i = 0; i < OSC_CYCLE_WARMUP_STEPS; i++) osc_step(m, noise);
+
+	// Find the cycle and the total advance over it. The state is the phase, and the LFSR bits beyond the phase for noise.
+	Model start = m;
+	int64_t total = 0;
+	int steps = 0;
+	r.cycle_steps = 0;
+	while (steps < OSC_MAX_CYCLE_STEPS) {
+		total += osc_step(m, noise);
+		steps++;
+		if (m.get_channel_reg(REG_PHASE) == start.get_channel_reg(REG_PHASE) && m.lfsr_extra_bits == start.lfsr_extra_bits) {
+			r.cycle_steps = steps;
+			break;
+		}
+	}
+	double per_step = (double)total / steps; // phase units or shifts per step
+	int log2_samples = osc_step_samples_log2(mode, period);
+	r.freq = ldexp(noise ? per_step : ldexp(per_step, -PHASE_BITS), -log2_samples);
+
+	// Replay the cycle and measure how far the accumulated advance strays from the average, in steps
+	m = start;
+	double sum = 0, sum2 = 0, min_err = 0, max_err = 0;
+	int64_t acc = 0;
+	for (int i = 1; i <= steps; i++) {
+		acc += osc_step(m, noise);
+		double err = per_step > 0 ? (acc - i*per_step) / per_step : 0;
+		sum += err;
+		sum2 += err*err;
+		min_err = std::min(min_err, err);
+		max_err = std::max(max_err, err);
+	}
+	double mean = sum / steps;
+	r.jitter_rms = ldexp(sqrt(std::max(0.0, sum2/steps - mean*mean)), log2_samples);
+	r.jitter_peak = ldexp(std::max(max_err - mean, mean - min_err), log2_samples);
+}
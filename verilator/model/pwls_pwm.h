@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Cycle level model of the PWM output pins and the analog RC filter after them.
+//
+// The PWM bit streams are packed 64 cycles to a word, bit i = cycle i. In the RTL, pwm_counter is loaded with
+// out_acc[10:4] at each new sample and counts up until its top bit is set, so the pin is low first and then high
+// for the rest of the sample: min(c, 64) high cycles out of 64 for a counter value c.
+// With stereo, the counter is loaded once per side and each pin only follows it during its own side, for about
+// half of the sample. The rest of the time, the pin outputs inactive_pwm, which is high during terms 0 to 3 (except
+// when the counter is loaded) and low after them. PwmStereoTiming takes both from the cycle timing model.
+//
+// RcOutputStage filters a bit stream with one or two cascaded RC sections, stepped at the clock frequency.
+// The filter is linear and the input is binary, so the state change over 8 cycles is a fixed 2x2 matrix
+// times the state plus a contribution that only depends on the 8 input bits. These are tabulated for all 256 bytes,
+// and a 64 cycle word takes 8 table steps.
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include "pwls_model.h"
+#include "pwls_timing.h"
+
+const int PWM_CYCLES = MAX_CYCLES_PER_SAMPLE;
+const int PWM_COUNTER_BITS = 7;
+const int PWM_CYCLES_PER_STEP = 8; // cycles per table step in RcOutputStage, and per oversampled output
+const int PWM_STEPS = PWM_CYCLES / PWM_CYCLES_PER_STEP;
+
+// High cycles at a sample value of zero, for the mono pin. See PwmStereoTiming::level_offset for stereo.
+const int PWM_LEVEL_OFFSET = OUT_ACC_INITIAL_TOP;
+
+inline uint64_t pwm_high_bits(int high, int end) {
+	if (high <= 0) return 0;
+	uint64_t bits = high >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << high) - 1);
+	return bits << (end - high);
+}
+
+inline int pwm_counter_value(int out_acc) { return (out_acc >> OUT_ACC_FRAC_BITS) & ((1 << PWM_COUNTER_BITS) - 1); }
+
+// Pin bits for one sample, from out_acc as returned by model_sample.
+// The word starts at the cycle after the counter is loaded, one sample after out_acc was computed.
+inline uint64_t pwm_mono_word(int out_acc) {
+	return pwm_high_bits(std::min(pwm_counter_value(out_acc), PWM_CYCLES), PWM_CYCLES);
+}
+
+// Stereo pin timing for the cfg and common_sat setting of a model.
+// In the RTL, the counter is loaded with the left out_acc in the first cycle of term 1, and with the right one in the
+// first cycle of the next sample. The left pin follows the counter from the left load up to and including the right load,
+// and the right pin from there up to and including the next left load; the other pin outputs inactive_pwm.
+// Like the mono word, a stereo sample's words start at the cycle after its first (left) load.
+struct PwmStereoTiming {
+	int key; // cfg and common_sat setting that the timing was found for, -1 if none
+	bool left_active[PWM_CYCLES]; // per cycle of the words: does the left pin follow the counter (otherwise the right one does)
+	bool inactive_high[PWM_CYCLES]; // inactive_pwm
+	int right_load; // cycle where the counter is loaded with the right out_acc
+	int level_offset[2]; // high cycles per sample at a sample value of zero, per pin
+
+	PwmStereoTiming() : key(-1) {}
+
+	static int timing_key(const Model &m) {
+		return (m.cfg & CFG_FLAG_STEREO_EN) | ((m.get_reg(0, REG_MODE) & MODE_FLAG_COMMON_SAT) != 0 ? 0x100 : 0);
+	}
+
+	// Find the timing for the registers in m if they have changed; m must have stereo enabled
+	void update(const Model &m) {
+		if (timing_key(m) == key) return;
+		key = timing_key(m);
+
+		// Record a sample's worth of cycles, starting after the first left load
+		TimingState s = {0, 0};
+		int n = -1;
+		for (int cycle = 0; cycle < 3*PWM_CYCLES && n < PWM_CYCLES; cycle++) {
+			bool load = timing_sample_out_acc(m, s);
+			bool side = ((s.term_index & 1) != 0 || (s.term_index & 8) != 0) != load; // stereo_side: 1 for the left pin
+			if (n >= 0) {
+				left_active[n] = side;
+				inactive_high[n] = !((s.term_index & 4) != 0 || (s.term_index & 8) != 0 || load);
+				if (load && s.term_index == 0) right_load = n;
+				n++;
+			}
+			if (load && s.term_index == 1 && n < 0) n = 0;
+			timing_step(m, s);
+		}
+
+		int zero[2] = {OUT_ACC_INITIAL_TOP_STEREO << OUT_ACC_FRAC_BITS, OUT_ACC_INITIAL_TOP_STEREO << OUT_ACC_FRAC_BITS};
+		uint64_t words[2];
+		this->words(zero, words);
+		for (int side = 0; side < 2; side++) {
+			level_offset[side] = 0;
+			for (int i = 0; i < PWM_CYCLES; i++) level_offset[side] += (words[side] >> i) & 1;
+		}
+	}
+
+	// Left and right pin bits for one stereo sample, from out_acc as returned by model_sample
+	void words(const int *out_acc, uint64_t *words) const {
+		words[0] = words[1] = 0;
+		int counter = pwm_counter_value(out_acc[0]);
+		for (int i = 0; i < PWM_CYCLES; i++) {
+			bool counter_pin = (counter >> (PWM_COUNTER_BITS - 1)) & 1;
+			bool left = left_active[i] ? counter_pin : inactive_high[i];
+			bool right = left_active[i] ? inactive_high[i] : counter_pin;
+			words[0] |= (uint64_t)left << i;
+			words[1] |= (uint64_t)right << i;
+			if (i == right_load) counter = pwm_counter_value(out_acc[1]);
+			else if (!counter_pin) counter++;
+		}
+	}
+};
+
+// Sample value (like out_acc_to_sample) that a mean pin level corresponds to, with level_offset high cycles at zero
+inline double pwm_level_to_sample(double level, int level_offset) {
+	return (level * PWM_CYCLES - level_offset) * (1 << OUT_ACC_FRAC_BITS);
+}
+
+
+// Filter coefficient for an RC section with cutoff fc, stepped at CLOCK_FREQUENCY. fc = 0 gives a pass through section.
+inline double rc_pole(double fc) { return fc > 0 ? exp(-2*M_PI*fc / CLOCK_FREQUENCY) : 0; }
+
+// One or two cascaded (buffered) RC sections: per cycle, y1 += (1 - a1)*(x - y1), then y2 += (1 - a2)*(y1 - y2).
+// The output is y2, in units of the pin high level.
+struct RcOutputStage {
+	double a[2];
+	double y[2];
+
+	// Per 8 cycles: y <- m*y + step[byte], and sum of the y2 values after each cycle = dot(sum_m, y) + sum[byte]
+	double m[2][2], sum_m[2];
+	double step[256][2], sum[256];
+
+	RcOutputStage(double fc1=0, double fc2=0) { init(fc1, fc2); }
+
+	// Start settled at a constant pin level
+	void reset(double level) { y[0] = y[1] = level; }
+
+	static void cycle(const double *a, double *y, int x) {
+		y[0] += (1 - a[0]) * (x - y[0]);
+		y[1] += (1 - a[1]) * (y[0] - y[1]);
+	}
+
+	void init(double fc1, double fc2) {
+		a[0] = rc_pole(fc1);
+		a[1] = rc_pole(fc2);
+		y[0] = y[1] = 0;
+
+		// Response to each unit start state with zero input
+		for (int k = 0; k < 2; k++) {
+			double s[2] = {0, 0};
+			s[k] = 1;
+			sum_m[k] = 0;
+			for (int i = 0; i < PWM_CYCLES_PER_STEP; i++) {
+				cycle(a, s, 0);
+				sum_m[k] += s[1];
+			}
+			m[0][k] = s[0];
+			m[1][k] = s[1];
+		}
+		// Response to each byte from zero state
+		for (int b = 0; b < 256; b++) {
+			double s[2] = {0, 0};
+			sum[b] = 0;
+			for (int i = 0; i < PWM_CYCLES_PER_STEP; i++) {
+				cycle(a, s, (b >> i) & 1);
+				sum[b] += s[1];
+			}
+			step[b][0] = s[0];
+			step[b][1] = s[1];
+		}
+	}
+
+	// Filter 64 cycles of pin bits and return the mean output over them.
+	// If os is not NULL, write the output after every 8 cycles to os[0..PWM_STEPS-1].
+	double word(uint64_t bits, float *os=NULL) {
+		double y0 = y[0], y1 = y[1], total = 0;
+		for (int i = 0; i < PWM_STEPS; i++, bits >>= 8) {
+			int b = bits & 255;
+			total += sum_m[0]*y0 + sum_m[1]*y1 + sum[b];
+			double n0 = m[0][0]*y0 + m[0][1]*y1 + step[b][0];
+			double n1 = m[1][0]*y0 + m[1][1]*y1 + step[b][1];
+			y0 = n0; y1 = n1;
+			if (os != NULL) os[i] = y1;
+		}
+		y[0] = y0; y[1] = y1;
+		return total * (1.0 / PWM_CYCLES);
+	}
+};
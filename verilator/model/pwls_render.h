@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Rendering of register event scripts to audio through the bit exact model.
+//
+// Each frame (output sample) consists of FILTER_DOWNSAMPLING synth samples, decimated with the same filter as synth-sim.
+// The events for a frame are applied before its first synth sample.
+//
+// render_segmented splits the timeline into chunks that are rendered in parallel and gives output that is
+// bit identical to render_serial:
+// - A serial pre-pass runs only model_sample_state to find the exact state at each chunk boundary.
+//   The only state that it does not track is the fractional bits of out_acc and out_acc_alt_frac.
+// - Each chunk is rendered from its boundary state with the fractional bits cleared.
+//   The fractional bits are only ever swapped between out_acc and out_acc_alt_frac or added to,
+//   so the true values differ from the chunk local ones by a constant offset (mod 2^OUT_ACC_FRAC_BITS)
+//   during the whole chunk. The offsets are found serially from the end fractions of the previous chunks,
+//   and each output sample is corrected by replacing the incoming fraction with the true one.
+// - The decimation filter is warmed up with the last FILTER_OUT_TAPS frames of the previous chunk,
+//   which recreates the filter state exactly.
+//
+// Both renderers run the samples through a SweepScheduler, which only evaluates the sweep step on the samples
+// where a sweep actually changes a register. Optionally, it runs the terms through mode specialized kernels
+// (see pwls_kernels.h) and plays them from a wavetable cache (see pwls_wavetable.h). Each render thread has its own cache.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+#include "pwls_model.h"
+#include "pwls_events.h"
+#include "pwls_filter.h"
+#include "pwls_parallel.h"
+#include "pwls_kernels.h"
+#include "pwls_wavetable.h"
+
+const int LOG2_SAMPLES_PER_FRAME = LOG2_FILTER_DOWNSAMPLING;
+const int SAMPLES_PER_FRAME = 1 << LOG2_SAMPLES_PER_FRAME;
+const double FRAME_RATE = SAMPLE_RATE / SAMPLES_PER_FRAME; // rate of the rendered output
+const int OUT_ACC_FRAC_MASK = (1 << OUT_ACC_FRAC_BITS) - 1;
+
+const float FILTER_INPUT_SCALE = 1.0f * FILTER_OUT_TAPS / (1 << BITS);
+const int OUTPUT_SCALE = 16384 << (LOG2_FILTER_DOWNSAMPLING - LOG2_SAMPLES_PER_FRAME);
+
+// Render features, the output is the same with all of them
+const int RENDER_WAVETABLES = 1;
+const int RENDER_KERNELS = 2;
+const int RENDER_DEFAULT = RENDER_WAVETABLES | RENDER_KERNELS;
+
+
+// Convert out_acc to a signed sample around the output offset, like synth-sim does with out_acc_out
+int out_acc_to_sample(int out_acc, bool stereo_en) {
+	int output_offset = stereo_en ? OUT_ACC_INITIAL_TOP_STEREO : OUT_ACC_INITIAL_TOP;
+	int sample = (out_acc & ((1 << BITS) - 1) & (-1 << OUT_ACC_FRAC_BITS)) - (output_offset << OUT_ACC_FRAC_BITS);
+	if (sample >= (1 << (BITS - 1))) sample -= (1 << BITS);
+	return sample;
+}
+
+int16_t filtered_to_output(float filtered_sample) {
+	int int_sample = filtered_sample * OUTPUT_SCALE;
+	return int_sample;
+}
+
+// Does any event turn on stereo? Then the render is written with two channels.
+bool events_use_stereo(const std::vector<RegEvent> &events) {
+	for (const RegEvent &e : events) {
+		if (e.reg == REG_OCT_COUNTER && e.channel == 2 && (e.data & CFG_FLAG_STEREO_EN)) return true;
+	}
+	return false;
+}
+
+
+// Runs samples in blocks between register changes.
+// Registers only change through event writes and sweeps, and model_sweep_distance predicts exactly when the next sweep update
+// is due, so the samples in between can skip the sweep step. Call reset after applying register writes.
+// If a WavetablePlayer is given, it is rebound whenever the registers change,
+// and the kernels are updated when REG_MODE or cfg may have been written.
+struct SweepScheduler {
+	int steady_samples; // samples left before the next sweep update
+	WavetablePlayer *player;
+	ModelKernels *kernels;
+
+	SweepScheduler(WavetablePlayer *player=NULL, ModelKernels *kernels=NULL) : steady_samples(0), player(player), kernels(kernels) {}
+
+	void reset(const Model &m, bool mode_written=true) {
+		steady_samples = model_sweep_distance(m);
+		if (kernels != NULL && mode_written) kernels->update(m);
+		if (player != NULL) player->bind(m);
+	}
+
+	void end_sample(Model &m) {
+		if (steady_samples > 0) {
+			steady_samples--;
+			model_next_sample(m);
+			return;
+		}
+		model_sample_sweep(m);
+		model_next_sample(m);
+		reset(m, false); // sweeps don't change the mode
+	}
+
+	void sample(Model &m, int *out) {
+		if (player != NULL) player->sample_terms(m, out);
+		else if (kernels != NULL) kernels->sample_terms(m, out);
+		else model_sample_terms(m, out);
+		end_sample(m);
+	}
+
+	void sample_state(Model &m) {
+		model_sample_oscillators(m);
+		end_sample(m);
+	}
+};
+
+// Apply the events for a frame and reset the scheduler if any registers were written
+size_t apply_frame_events(Model &m, SweepScheduler &sched, const std::vector<RegEvent> &events, size_t next_event, int frame) {
+	size_t e = apply_events(m, events, next_event, frame);
+	if (e == next_event) return e;
+
+	bool mode_written = false;
+	for (size_t i = next_event; i < e; i++) {
+		if (events[i].reg == REG_MODE || (events[i].reg == REG_OCT_COUNTER && events[i].channel == 2)) mode_written = true;
+	}
+	sched.reset(m, mode_written);
+	return e;
+}
+
+// Scheduler, kernels and wavetable cache for one render thread
+struct RenderState {
+	ModelKernels kernels;
+	WavetableCache cache;
+	WavetablePlayer player;
+	SweepScheduler sched;
+
+	RenderState(int features) : player(&cache, (features & RENDER_KERNELS) ? &kernels : NULL),
+		sched((features & RENDER_WAVETABLES) ? &player : NULL, (features & RENDER_KERNELS) ? &kernels : NULL) {}
+};
+
+
+// Renders one frame at a time from reset, so that a render can be continued block by block.
+// Uses a RenderState that may have been used before; its wavetable cache carries over.
+struct SerialRenderer {
+	RenderState &state;
+	const std::vector<RegEvent> &events;
+	int num_sides;
+	Model m;
+	DecimationFilter filters[2];
+	size_t next_event;
+	int frame;
+
+	SerialRenderer(RenderState &state, const std::vector<RegEvent> &events, bool stereo_out) : state(state), events(events), num_sides(stereo_out ? 2 : 1), next_event(0), frame(0) {
+		state.sched.reset(m);
+	}
+
+	// Render the next frame and write its num_sides output samples to out
+	void render_frame(int16_t *out) {
+		for (int side = 0; side < num_sides; side++) out[side] = filtered_to_output(filters[side].next());
+
+		next_event = apply_frame_events(m, state.sched, events, next_event, frame);
+		bool stereo_en = m.stereo_en();
+		for (int subsample = 0; subsample < SAMPLES_PER_FRAME; subsample++) {
+			int out[2] = {0, 0};
+			state.sched.sample(m, out);
+			if (!stereo_en) out[1] = out[0];
+			for (int side = 0; side < num_sides; side++) filters[side].add(out_acc_to_sample(out[side], stereo_en) * FILTER_INPUT_SCALE, subsample);
+		}
+		frame++;
+	}
+};
+
+// Render num_frames frames one sample at a time, starting from reset, with a RenderState that may have been used before;
+// its wavetable cache carries over. Calls out(samples, n) with the next n interleaved output samples every block_frames frames
+// and at the end. Stops and returns false if out returns false.
+template<typename F> bool render_serial_blocks(RenderState &state, const std::vector<RegEvent> &events, int num_frames, bool stereo_out, int block_frames, F out) {
+	SerialRenderer r(state, events, stereo_out);
+	std::vector<int16_t> block((size_t)block_frames * r.num_sides);
+	int n = 0;
+	for (int frame = 0; frame < num_frames; frame++) {
+		r.render_frame(&block[(size_t)n * r.num_sides]);
+		n++;
+		if (n == block_frames || frame == num_frames - 1) {
+			if (!out(block.data(), (size_t)n * r.num_sides)) return false;
+			n = 0;
+		}
+	}
+	return true;
+}
+
+// Render num_frames frames one sample at a time, appending interleaved output samples to audio
+void render_serial(const std::vector<RegEvent> &events, int num_frames, bool stereo_out, std::vector<int16_t> &audio, int features=RENDER_DEFAULT) {
+	RenderState state(features);
+	render_serial_blocks(state, events, num_frames, stereo_out, 1 << 14, [&](const int16_t *samples, size_t n) {
+		audio.insert(audio.end(), samples, samples + n);
+		return true;
+	});
+}
+
+
+const int NUM_STEMS = 2*NUM_CHANNELS; // one per term
+
+// Decimates the stems of all terms and both sides together, with the same arithmetic as a DecimationFilter for each.
+// The stems are interleaved (index 2*term_index + side) so that the inner loop runs over them.
+struct StemDecimationFilter {
+	static const int NUM_INPUTS = 2*NUM_STEMS;
+	float accs[FILTER_OUT_TAPS][NUM_INPUTS];
+
+	StemDecimationFilter() { memset(accs, 0, sizeof(accs)); }
+
+	void next(float *out) {
+		memcpy(out, accs[FILTER_OUT_TAPS - 1], sizeof(accs[0]));
+		memmove(accs + 1, accs, sizeof(accs[0])*(FILTER_OUT_TAPS - 1));
+		memset(accs[0], 0, sizeof(accs[0]));
+	}
+
+	void add(const float *x, int subsample) {
+		for (int j = 0; j < FILTER_OUT_TAPS; j++) {
+			float k = filter_kernel[j*FILTER_DOWNSAMPLING + subsample];
+			for (int i = 0; i < NUM_INPUTS; i++) accs[j][i] += x[i] * k;
+		}
+	}
+};
+
+// Like render_serial, but also capture what each term adds to out_acc (after amp_clamp scaling), decimated in the same way,
+// and append it to stems[term_index], interleaved like audio. Stereo sums the first subchannels to the left and the
+// second subchannels to the right, so each stereo stem only has one side. With common_sat, the shared contribution
+// of a pair goes to the stem of its common_sat add term.
+// The sum of the stems only differs from the mix by the rounding of the out_acc fractional bits.
+void render_serial_stems(const std::vector<RegEvent> &events, int num_frames, bool stereo_out, std::vector<int16_t> &audio, std::vector<int16_t> *stems, int features=RENDER_DEFAULT) {
+	int num_sides = stereo_out ? 2 : 1;
+	RenderState state(features);
+	Model m;
+	SweepScheduler &sched = state.sched;
+	sched.reset(m);
+	DecimationFilter filters[2];
+	StemDecimationFilter stem_filter;
+	size_t next_event = 0;
+
+	for (int frame = 0; frame < num_frames; frame++) {
+		for (int side = 0; side < num_sides; side++) audio.push_back(filtered_to_output(filters[side].next()));
+		float stem_out[StemDecimationFilter::NUM_INPUTS];
+		stem_filter.next(stem_out);
+		for (int stem = 0; stem < NUM_STEMS; stem++) {
+			for (int side = 0; side < num_sides; side++) stems[stem].push_back(filtered_to_output(stem_out[2*stem + side]));
+		}
+
+		next_event = apply_frame_events(m, sched, events, next_event, frame);
+		bool stereo_en = m.stereo_en();
+		for (int subsample = 0; subsample < SAMPLES_PER_FRAME; subsample++) {
+			int out[2] = {0, 0};
+			sched.sample(m, out);
+			if (!stereo_en) out[1] = out[0];
+			for (int side = 0; side < num_sides; side++) filters[side].add(out_acc_to_sample(out[side], stereo_en) * FILTER_INPUT_SCALE, subsample);
+
+			float x[StemDecimationFilter::NUM_INPUTS];
+			for (int term_index = 0; term_index < NUM_STEMS; term_index++) {
+				float v = m.term_out[term_index] * FILTER_INPUT_SCALE;
+				int subchannel = term_index & 1;
+				x[2*term_index]     = (!stereo_en || subchannel == 0) ? v : 0;
+				x[2*term_index + 1] = (!stereo_en || subchannel == 1) ? v : 0;
+			}
+			stem_filter.add(x, subsample);
+		}
+	}
+}
+
+
+struct RenderChunk {
+	int first_frame, num_frames;
+	Model start; // state before the events of first_frame, with out_acc and out_acc_alt_frac cleared
+
+	// Filled in by render_chunk_raw
+	// Per synth sample and side: chunk local out_acc in the low BITS bits, the local incoming fraction above
+	std::vector<uint16_t> raw;
+	std::vector<uint8_t> stereo; // per frame: was stereo enabled?
+	int end_frac, end_alt_frac;
+
+	// True fractions of out_acc and out_acc_alt_frac at the start of the chunk
+	int frac, alt_frac;
+};
+
+void render_chunk_raw(RenderChunk &c, const std::vector<RegEvent> &events, int features) {
+	Model m = c.start;
+	RenderState state(features);
+	SweepScheduler &sched = state.sched;
+	sched.reset(m);
+	size_t next_event = find_event(events, c.first_frame);
+
+	c.raw.resize(c.num_frames << (LOG2_SAMPLES_PER_FRAME + 1));
+	c.stereo.resize(c.num_frames);
+	uint16_t *raw = c.raw.data();
+	for (int frame = 0; frame < c.num_frames; frame++) {
+		next_event = apply_frame_events(m, sched, events, next_event, c.first_frame + frame);
+		bool stereo_en = m.stereo_en();
+		c.stereo[frame] = stereo_en;
+		for (int subsample = 0; subsample < SAMPLES_PER_FRAME; subsample++) {
+			// Fractions that the left/mono and right sums will start from
+			int frac_in[2];
+			frac_in[0] = stereo_en ? m.out_acc_alt_frac : m.out_acc & OUT_ACC_FRAC_MASK;
+			frac_in[1] = m.out_acc & OUT_ACC_FRAC_MASK;
+
+			int out[2] = {0, 0};
+			sched.sample(m, out);
+			if (!stereo_en) out[1] = out[0];
+			for (int side = 0; side < 2; side++) *(raw++) = (out[side] & ((1 << BITS) - 1)) | (frac_in[side] << BITS);
+		}
+	}
+	c.end_frac = m.out_acc & OUT_ACC_FRAC_MASK;
+	c.end_alt_frac = m.out_acc_alt_frac;
+}
+
+// Correct a raw chunk sample with the true fractions at the start of the chunk
+inline int fix_raw_sample(const RenderChunk &c, uint16_t raw, int side, bool stereo_en) {
+	int frac_in = raw >> BITS;
+	int offset = (stereo_en && side == 0) ? c.alt_frac : c.frac;
+	int out_acc = (raw & ((1 << BITS) - 1)) - frac_in + ((frac_in + offset) & OUT_ACC_FRAC_MASK);
+	return out_acc_to_sample(out_acc, stereo_en);
+}
+
+// Feed one frame of a chunk through the filters
+void filter_chunk_frame(const RenderChunk &c, int frame, DecimationFilter *filters, int num_sides) {
+	const uint16_t *raw = c.raw.data() + (frame << (LOG2_SAMPLES_PER_FRAME + 1));
+	bool stereo_en = c.stereo[frame];
+	for (int subsample = 0; subsample < SAMPLES_PER_FRAME; subsample++) {
+		for (int side = 0; side < num_sides; side++) filters[side].add(fix_raw_sample(c, raw[2*subsample + side], side, stereo_en) * FILTER_INPUT_SCALE, subsample);
+	}
+}
+
+// Filter a chunk, warming up the filters with the end of the previous chunk if there is one
+void filter_chunk(const RenderChunk &c, const RenderChunk *prev, bool stereo_out, int16_t *audio) {
+	int num_sides = stereo_out ? 2 : 1;
+	DecimationFilter filters[2];
+	if (prev != NULL) {
+		for (int frame = prev->num_frames - FILTER_OUT_TAPS; frame < prev->num_frames; frame++) {
+			for (int side = 0; side < num_sides; side++) filters[side].next();
+			filter_chunk_frame(*prev, frame, filters, num_sides);
+		}
+	}
+	for (int frame = 0; frame < c.num_frames; frame++) {
+		for (int side = 0; side < num_sides; side++) *(audio++) = filtered_to_output(filters[side].next());
+		filter_chunk_frame(c, frame, filters, num_sides);
+	}
+}
+
+// Render num_frames frames in chunks of chunk_frames, processing num_threads chunks at a time in parallel.
+// Appends interleaved output samples to audio; the result is identical to render_serial.
+void render_segmented(const std::vector<RegEvent> &events, int num_frames, bool stereo_out, int chunk_frames, int num_threads, std::vector<int16_t> &audio, int features=RENDER_DEFAULT) {
+	if (chunk_frames < FILTER_OUT_TAPS) chunk_frames = FILTER_OUT_TAPS; // need a full filter history from the previous chunk
+	int num_sides = stereo_out ? 2 : 1;
+	int num_chunks = (num_frames + chunk_frames - 1) / chunk_frames;
+
+	// Serial pre-pass to find the state at each chunk boundary
+	std::vector<Model> starts(num_chunks);
+	Model m;
+	SweepScheduler sched;
+	sched.reset(m);
+	size_t next_event = 0;
+	for (int frame = 0; frame < num_frames; frame++) {
+		if (frame % chunk_frames == 0) {
+			starts[frame / chunk_frames] = m;
+			starts[frame / chunk_frames].out_acc = 0;
+			starts[frame / chunk_frames].out_acc_alt_frac = 0;
+		}
+		next_event = apply_frame_events(m, sched, events, next_event, frame);
+		for (int subsample = 0; subsample < SAMPLES_PER_FRAME; subsample++) sched.sample_state(m);
+	}
+
+	// Render in waves of num_threads chunks to bound the memory use for long renders
+	size_t audio_start = audio.size();
+	audio.resize(audio_start + (size_t)num_frames * num_sides);
+	RenderChunk prev;
+	bool have_prev = false;
+	for (int wave_start = 0; wave_start < num_chunks; wave_start += num_threads) {
+		int wave_size = std::min(num_threads, num_chunks - wave_start);
+		std::vector<RenderChunk> chunks(wave_size);
+		for (int i = 0; i < wave_size; i++) {
+			RenderChunk &c = chunks[i];
+			int chunk_index = wave_start + i;
+			c.first_frame = chunk_index * chunk_frames;
+			c.num_frames = std::min(chunk_frames, num_frames - c.first_frame);
+			c.start = starts[chunk_index];
+		}
+
+		parallel_for(wave_size, num_threads, [&](int i) { render_chunk_raw(chunks[i], events, features); });
+
+		// Propagate the true fractions from chunk to chunk
+		for (int i = 0; i < wave_size; i++) {
+			RenderChunk &c = chunks[i];
+			const RenderChunk *p = i > 0 ? &chunks[i - 1] : (have_prev ? &prev : NULL);
+			if (p == NULL) c.frac = c.alt_frac = 0;
+			else {
+				c.frac = (p->end_frac + p->frac) & OUT_ACC_FRAC_MASK;
+				c.alt_frac = (p->end_alt_frac + p->alt_frac) & OUT_ACC_FRAC_MASK;
+			}
+		}
+
+		parallel_for(wave_size, num_threads, [&](int i) {
+			const RenderChunk *p = i > 0 ? &chunks[i - 1] : (have_prev ? &prev : NULL);
+			filter_chunk(chunks[i], p, stereo_out, audio.data() + audio_start + (size_t)chunks[i].first_frame * num_sides);
+		});
+
+		prev = std::move(chunks[wave_size - 1]);
+		have_prev = true;
+	}
+}
+
+bool save_audio(const char *fname, const std::vector<int16_t> &audio) {
+	FILE *fp = fopen(fname, "wb");
+	if (!fp) {
+		printf("Failed to create audio output file: %s\n", fname);
+		return false;
+	}
+	fwrite(audio.data(), sizeof(int16_t), audio.size(), fp);
+	fclose(fp);
+	return true;
+}
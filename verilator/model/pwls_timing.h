@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Cycle timing model of the RTL state sequence in pwls_multichannel_ALU_unit.
+//
+// Mirrors the term_index/state update logic, so that the cycle of each term and each new_out_acc pulse in a sample
+// can be predicted from the registers. The sequence only depends on cfg and the common_sat flag in REG_MODE.
+// Assumes that the state machine is never stalled, i.e. en_external is high, there are no register reads,
+// and no register writes collide with internal register writes.
+// Checked against the RTL by run_timing_tests in peripheral-test (TEST_TIMING), which has not been run yet, so the
+// harnesses still find sample boundaries by polling new_out_acc.
+
+#pragma once
+
+#include "pwls_model.h"
+
+const int STATE_CMP_REV_PHASE = 0;
+const int STATE_UPDATE_PHASE = 1;
+const int STATE_DETUNE = 2;
+const int STATE_TRI = 3;
+const int STATE_COMBINED_SLOPE_CMP = 4;
+const int STATE_COMBINED_SLOPE_ADD = 5;
+const int STATE_AMP_CMP = 6;
+const int STATE_OUT_ACC = 7;
+const int STATE_LAST = 7;
+
+const int STATE_OCT_COUNTER_INC_LOW = 4;
+const int STATE_OCT_COUNTER_INC_HIGH = 5;
+
+const int NUM_EXTRA_STATES = 8; // states in the extra term, for sweeps and oct_counter updates
+const int EXTRA_TERM_INDEX = 2*NUM_CHANNELS;
+const int NUM_TERMS = EXTRA_TERM_INDEX + 1;
+
+
+// The state machine position during one cycle
+struct TimingState {
+	int term_index, state;
+};
+
+struct TimingControl {
+	bool common_sat_store, common_sat_add;
+};
+
+// The common_sat control signals for the current cycle
+TimingControl timing_control(const Model &m, const TimingState &s) {
+	TimingControl c = {false, false};
+	if (s.term_index == EXTRA_TERM_INDEX) return c; // only used for waveform terms
+	int channel = s.term_index >> 1;
+	int subchannel = s.term_index & 1;
+#ifdef USE_COMMON_SAT_STEREO
+	if ((m.get_reg(0, REG_MODE) & MODE_FLAG_COMMON_SAT) == 0) return c;
+	if (m.stereo_en()) {
+		c.common_sat_store = (channel == 0);
+		c.common_sat_add = (s.state & 4) ? (channel == 1) : (subchannel == 1);
+	} else if (channel == 0) {
+		c.common_sat_store = (subchannel == 0);
+		c.common_sat_add = (subchannel == 1);
+	}
+#else
+	bool common_sat = ((m.get_reg(channel, REG_MODE) & MODE_FLAG_COMMON_SAT) != 0) && channel == 0 && !m.stereo_en();
+	c.common_sat_store = common_sat && subchannel == 0;
+	c.common_sat_add = common_sat && subchannel == 1;
+#endif
+	return c;
+}
+
+// Is this the last cycle of the current term?
+bool timing_term_ends(const Model &m, const TimingState &s) {
+	if (s.term_index == EXTRA_TERM_INDEX) return s.state == NUM_EXTRA_STATES - 1;
+	return s.state == (timing_control(m, s).common_sat_store ? STATE_AMP_CMP : STATE_LAST);
+}
+
+// Is new_out_acc high during this cycle?
+bool timing_new_out_acc(const Model &m, const TimingState &s) {
+	if (m.stereo_en()) return (s.term_index == 0 && s.state == 0) || (s.term_index == 1 && s.state == STATE_DETUNE);
+	else return s.term_index == 0 && s.state == STATE_UPDATE_PHASE;
+}
+
+// Is sample_out_acc high during this cycle? The PWM counter is loaded from out_acc at the end of the cycle.
+bool timing_sample_out_acc(const Model &m, const TimingState &s) {
+	return (s.term_index == 0 && s.state == 0) || (m.stereo_en() && s.term_index == 1 && s.state == STATE_DETUNE);
+}
+
+// Advance one cycle. Returns true if a new sample starts.
+bool timing_step(const Model &m, TimingState &s) {
+	bool stereo_en = m.stereo_en();
+	bool next_term = timing_term_ends(m, s);
+	bool next_sample = next_term && s.term_index == EXTRA_TERM_INDEX;
+
+	int next_term_index = s.term_index;
+	if (next_term) {
+		next_term_index += stereo_en ? 2 : 1;
+		if (stereo_en && (s.term_index >> 1) == 3) next_term_index = (s.term_index & 1) ? EXTRA_TERM_INDEX : 1;
+		if (next_sample) next_term_index = 0;
+	}
+
+	int next_state = s.state + 1;
+	if (timing_control(m, s).common_sat_add) {
+#ifdef USE_COMMON_SAT_STEREO
+		if (s.state == STATE_COMBINED_SLOPE_ADD) {
+			// Insert an extra add step on the odd term of the channel
+			next_state = s.term_index & 1;
+			next_term_index |= 1;
+		} else if ((s.term_index & 1) == 1 && (s.state >> 1) == 0) {
+			next_state = STATE_AMP_CMP;
+			next_term_index = (next_term_index & ~1) | (s.state & 1);
+		}
+#else
+		// Insert STATE_CMP_REV_PHASE between STATE_COMBINED_SLOPE_ADD and STATE_AMP_CMP, repurposed for common_sat
+		if (s.state == STATE_COMBINED_SLOPE_ADD) next_state = STATE_CMP_REV_PHASE;
+		else if (s.state == STATE_CMP_REV_PHASE) next_state = STATE_AMP_CMP;
+#endif
+	}
+
+	if (next_term) {
+		// The oscillator update is only done for the first subchannel
+		bool next_initial_state_detune = next_term_index != EXTRA_TERM_INDEX && (next_term_index & 1) != 0;
+		next_state = next_initial_state_detune ? STATE_DETUNE : 0;
+	}
+
+	s.term_index = next_term_index;
+	s.state = next_state;
+	return next_sample;
+}
+
+
+struct SampleTiming {
+	int num_cycles;
+	int term_start[NUM_TERMS], term_cycles[NUM_TERMS]; // indexed by term_index, cycles from the start of the sample
+	int num_new_out_acc;
+	int new_out_acc_cycles[2]; // two per sample in stereo, one in mono
+};
+
+// Predict the timing of a sample that starts with the current registers, which must stay the same during the sample
+void model_sample_timing(const Model &m, SampleTiming &t) {
+	memset(&t, 0, sizeof(t));
+	TimingState s = {0, 0};
+	int term_index = 0; // the term that the current cycle belongs to; common_sat can move s.term_index within a term
+	for (int cycle = 0;; cycle++) {
+		if (timing_new_out_acc(m, s) && t.num_new_out_acc < 2) t.new_out_acc_cycles[t.num_new_out_acc++] = cycle;
+		t.term_cycles[term_index]++;
+
+		bool next_term = timing_term_ends(m, s);
+		bool next_sample = timing_step(m, s);
+		if (next_sample) {
+			t.num_cycles = cycle + 1;
+			return;
+		}
+		if (next_term) {
+			term_index = s.term_index;
+			t.term_start[term_index] = cycle + 1;
+		}
+	}
+}
+
+int model_cycles_per_sample(const Model &m) {
+	SampleTiming t;
+	model_sample_timing(m, t);
+	return t.num_cycles;
+}
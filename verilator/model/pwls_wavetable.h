@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2025 Toivo Henningsson
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Wavetable cache for the waveform terms of the model.
+//
+// Unless detune or stereo position sign swapping is active, the out_acc contribution of a waveform term only depends on
+// the channel's phase and on the patch registers (amp, slopes, PWM offset, mode) and cfg, not on the channel or period.
+// A Wavetable stores the contribution for each phase and subchannel, i.e. one oscillator cycle of the rendered waveform,
+// filled in lazily from the bit exact model. The oscillators are still run exactly each sample, so noise, oscillator sync
+// and the octave skipping of low notes stay exact. Channels that don't qualify, or that take part in common_sat,
+// fall back to full evaluation.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "pwls_model.h"
+#include "pwls_kernels.h"
+
+const int WAVETABLE_KEY_SIZE = 6;
+const int WAVETABLE_SIZE = 1 << BITS;
+
+struct Wavetable {
+	// The scratch channel is one that common_sat never involves
+	static const int WAVETABLE_CHANNEL = 2;
+
+	int key[WAVETABLE_KEY_SIZE]; // amp, slope0, slope1, pwm_offset, mode, cfg
+	int16_t contribution[2][WAVETABLE_SIZE];
+	uint64_t valid[2][WAVETABLE_SIZE / 64];
+	uint64_t last_used;
+	Model m; // scratch model with the patch registers set, used to fill in entries
+
+	void init(const int *new_key) {
+		memcpy(key, new_key, sizeof(key));
+		memset(valid, 0, sizeof(valid));
+		m = Model();
+		m.set_reg(WAVETABLE_CHANNEL, REG_AMP, key[0]);
+		m.set_reg(WAVETABLE_CHANNEL, REG_SLOPE0, key[1]);
+		m.set_reg(WAVETABLE_CHANNEL, REG_SLOPE1, key[2]);
+		m.set_reg(WAVETABLE_CHANNEL, REG_PWM_OFFSET, key[3]);
+		m.set_reg(WAVETABLE_CHANNEL, REG_MODE, key[4]);
+		m.cfg = key[5];
+	}
+
+	int get(int subchannel, int phase) {
+		if (((valid[subchannel][phase >> 6] >> (phase & 63)) & 1) == 0) {
+			valid[subchannel][phase >> 6] |= (uint64_t)1 << (phase & 63);
+			contribution[subchannel][phase] = eval(subchannel, phase);
+		}
+		return contribution[subchannel][phase];
+	}
+
+	int eval(int subchannel, int phase) {
+		m.term_index = 2*WAVETABLE_CHANNEL + subchannel;
+		m.set_reg(WAVETABLE_CHANNEL, REG_PHASE, phase);
+		m.acc = phase; // oscillator output, used by the 3x phase factor
+		model_detune(m);
+		model_tri_pwm_offset(m);
+		model_slope(m);
+		return model_amp_clamp(m);
+	}
+};
+
+// Can the waveform terms of the channel be played from a wavetable with the current registers?
+bool wavetable_channel_ok(const Model &m, int channel) {
+	int mode = m.get_reg(channel, REG_MODE);
+
+	// common_sat makes the terms depend on each other
+	if (m._common_sat() && (channel == 0 || (channel == 1 && m.stereo_en()))) return false;
+
+	// Stereo position detune sign swapping depends on oct_counter
+	int stereo_pos = (mode >> MODE_BIT_3X) & 7;
+	if (m.stereo_pos_en() && stereo_pos <= 4) return false;
+
+	// Detune depends on oct_counter, see model_detune
+	bool phase_factor_en = m.phase_factor_en();
+	bool enable_3x = phase_factor_en && ((mode & MODE_FLAG_3X) != 0);
+	bool detune_disable = phase_factor_en && !enable_3x && ((mode & (3 << MODE_BIT_X2N0)) != 0);
+	int detune_exp0 = (mode & 7) + ((mode & MODE_FLAG_DETUNE_FIFTH) != 0);
+	if (!enable_3x && !detune_disable && detune_exp0 != 0) return false;
+	if ((mode & 7) != 0) return false;
+
+	// With the 3x phase factor, detune uses the oscillator output, which differs from the stored phase when the update is skipped
+	if (enable_3x) {
+		int period_exp = m.get_reg(channel, REG_PERIOD) >> MANTISSA_BITS;
+		if (get_lfsr_en(mode) || period_exp > 3) return false;
+	}
+
+	// Don't create a new table for each step of a patch register sweep, they would hardly be reused
+	for (int sweep_index = REG_AMP; sweep_index <= REG_PWM_OFFSET; sweep_index++) {
+		int rate;
+		if (sweep_can_update(m, channel, sweep_index, rate)) return false;
+	}
+	return true;
+}
+
+void wavetable_key(const Model &m, int channel, int *key) {
+	key[0] = m.get_reg(channel, REG_AMP);
+	key[1] = m.get_reg(channel, REG_SLOPE0);
+	key[2] = m.get_reg(channel, REG_SLOPE1);
+	key[3] = m.get_reg(channel, REG_PWM_OFFSET);
+	key[4] = m.get_reg(channel, REG_MODE);
+	key[5] = m.cfg;
+}
+
+struct WavetableCache {
+	std::vector<Wavetable *> tables;
+	int capacity;
+	uint64_t use_counter;
+
+	// Statistics, in terms evaluated
+	uint64_t num_table_terms, num_full_terms, num_tables_created;
+
+	WavetableCache(int capacity=64) : capacity(capacity), use_counter(0), num_table_terms(0), num_full_terms(0), num_tables_created(0) {}
+	~WavetableCache() { for (Wavetable *t : tables) delete t; }
+
+	// Find or create the table for the channel's patch, least recently used tables are reused when the cache is full
+	Wavetable *lookup(const Model &m, int channel) {
+		int key[WAVETABLE_KEY_SIZE];
+		wavetable_key(m, channel, key);
+
+		Wavetable *lru = NULL;
+		for (Wavetable *t : tables) {
+			if (!memcmp(t->key, key, sizeof(key))) {
+				t->last_used = ++use_counter;
+				return t;
+			}
+			if (lru == NULL || t->last_used < lru->last_used) lru = t;
+		}
+
+		Wavetable *t;
+		if ((int)tables.size() < capacity) {
+			t = new Wavetable;
+			tables.push_back(t);
+		} else t = lru;
+		t->init(key);
+		t->last_used = ++use_counter;
+		num_tables_created++;
+		return t;
+	}
+};
+
+// Per channel wavetable bindings for a model. Call bind after any register write, including sweep updates.
+// Terms that are evaluated in full use the given kernels, or the generic model if there are none.
+struct WavetablePlayer {
+	WavetableCache *cache;
+	const ModelKernels *kernels;
+	Wavetable *channel_tables[NUM_CHANNELS]; // NULL: evaluate in full
+	int num_bound;
+
+	WavetablePlayer(WavetableCache *cache, const ModelKernels *kernels=NULL) : cache(cache), kernels(kernels), num_bound(0) {
+		memset(channel_tables, 0, sizeof(channel_tables));
+	}
+
+	void bind(const Model &m) {
+		num_bound = 0;
+		for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+			Wavetable *t = channel_tables[channel];
+			if (!wavetable_channel_ok(m, channel)) t = NULL;
+			else {
+				int key[WAVETABLE_KEY_SIZE];
+				wavetable_key(m, channel, key);
+				if (t == NULL || memcmp(t->key, key, sizeof(key))) t = cache->lookup(m, channel);
+			}
+			channel_tables[channel] = t;
+			num_bound += (t != NULL);
+		}
+	}
+
+	// Same as model_sample_terms, but taking the contributions of bound channels from their wavetables.
+	// Leaves acc, part and pred differently, but they are overwritten before being used in the next sample.
+	void sample_terms(Model &m, int *out) {
+		if (num_bound == 0) {
+			if (kernels != NULL) kernels->sample_terms(m, out);
+			else model_sample_terms(m, out);
+			cache->num_full_terms += 2*NUM_CHANNELS;
+			return;
+		}
+
+		bool stereo_en = m.stereo_en();
+
+		for (int term_i = 0; term_i < 2*NUM_CHANNELS; term_i++) {
+			m.term_index = model_term_index(term_i, stereo_en);
+
+			Wavetable *t = channel_tables[m.get_channel()];
+			if (t != NULL) {
+				if (m.get_subchannel() == 0) model_oscillator(m);
+				model_out_acc_add(m, t->get(m.get_subchannel(), m.get_channel_reg(REG_PHASE)));
+			} else if (kernels != NULL) kernels->terms[m.term_index](m);
+			else model_term(m);
+
+			if (stereo_en && term_i == NUM_CHANNELS - 1) out[0] = m.out_acc;
+		}
+		if (stereo_en) out[1] = m.out_acc;
+		else out[0] = m.out_acc;
+		cache->num_table_terms += 2*num_bound;
+		cache->num_full_terms += 2*(NUM_CHANNELS - num_bound);
+	}
+};
@@ -8,6 +8,9 @@
 #include <string.h>
 #include <algorithm>
 #include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "Vtqvp_toivoh_pwl_synth.h"
 #include "verilated.h"
@@ -33,100 +36,29 @@
 #define TEST_PWL_OSC
 #define TEST_SHORT_SEQS
 #define TEST_LONG_SEQS
+//#define TEST_TIMING // check the cycle timing model in pwls_timing.h against new_out_acc, not yet run against the RTL
+//#define TEST_SNAPSHOT // snapshot round trip and register readback checks, not yet run against the RTL
+//#define TEST_SEQ_SNAPSHOTS // diff the full state against a snapshot after every sample of the sequence tests
+//#define TEST_SOAK // add the -soak option, see run_soak_test; not yet run against the RTL
 
 
 const int seq_extra_exp = 0;
 
 
 #define USE_NEW_READ
-#define USE_ORION_WAVE
-#define USE_ORION_WAVE_MASK
-#define USE_ORION_WAVE_PWM
-#define USE_OCT_COUNTER_LATCHES
-#define USE_OSC_SYNC
-#define USE_4_BIT_MODE
-#define USE_OSC_SYNC_ONLY_FOR_SOME_CHANNELS
-#define USE_SWAPPED_DETUNE_SIGNS
-#define USE_COMMON_SAT_STEREO
-#define USE_DETUNE_FIFTH
 
+#include "../model/pwls_model.h"
+#include "../model/pwls_timing.h"
+#include "../model/pwls_parallel.h"
 
-const int INTERFACE_REGISTER_SHIFT = 0;
 
-const int MAX_CYCLES_PER_SAMPLE = 64;
-const int LOG2_NUM_CHANNELS = 2;
-const int NUM_CHANNELS = 1 << LOG2_NUM_CHANNELS;
-
-const int BITS = 12;
-const int PHASE_BITS = BITS;
-const int OCT_BITS = 3;
-const int MANTISSA_BITS = 10;
-const int PERIOD_BITS = OCT_BITS + MANTISSA_BITS;
-const int OUT_ACC_FRAC_BITS = 4;
-const int OUT_ACC_INITIAL_TOP = 512 >> OUT_ACC_FRAC_BITS;
-const int OUT_ACC_INITIAL_TOP_STEREO = 768 >> OUT_ACC_FRAC_BITS;
-const int OCT_COUNTER_BITS = 24;
-
-const int OUT_RSHIFT = 4;
-const int REV_PHASE_SHR = 0;
-
-
-const int REG_PERIOD = 0;
-const int REG_AMP = 1;
-const int REG_SLOPE0 = 2;
-const int REG_SLOPE1 = 3;
-const int REG_PWM_OFFSET = 4;
-const int REG_MODE = 5;
-const int REG_SWEEP_PA = 6; // {period, amp} sweep
-const int REG_SWEEP_WS = 7; // {pwm_offset, slope} sweep
-const int REG_PHASE = 8;
-#ifdef USE_OCT_COUNTER_LATCHES
-const int REG_OCT_COUNTER = 9;
-#endif
-const int REGS_PER_CHANNEL = 9; // Keep at 9; Don't count oct_counter; it is still counted as a core register
+const int INTERFACE_REGISTER_SHIFT = 0;
 
 const int num_reg_rand_bits[REGS_PER_CHANNEL] = {OCT_BITS + MANTISSA_BITS, 6, 8, 8, 8, 12, 16, 16, BITS};
-const int reg_bits[] = {OCT_BITS + MANTISSA_BITS, 6, 8, 8, 8};
 const int sweep_bits[] = {5, 7, 7, 7, 5};
 const int pre_sweep[] = {0, 3, 5, 7, 1}; // Used to set oct_counter values that will activate the sweep for the corresponding parameter
 
 
-const int MODE_BIT_DETUNE0 = 0;
-const int MODE_BIT_NOISE = 3;
-const int MODE_FLAG_NOISE = 1 << MODE_BIT_NOISE;
-const int MODE_BIT_3X = 4;
-const int MODE_FLAG_3X = 1 << MODE_BIT_3X;
-const int MODE_BIT_X2N0 = 5;
-const int MODE_BIT_X2N1 = 6;
-const int MODE_FLAG_COMMON_SAT = 128;
-const int MODE_FLAG_PWL_OSC = 256;
-const int MODE_FLAG_OSC_SYNC_EN = 1 << 9;
-const int MODE_FLAG_OSC_SYNC_SOFT = 1 << 10;
-const int MODE_BIT_DETUNE_FIFTH = 11;
-const int MODE_FLAG_DETUNE_FIFTH = 1 << MODE_BIT_DETUNE_FIFTH;
-
-
-const int MODE_FLAGS_OSC_SYNC_MASK = MODE_FLAG_OSC_SYNC_EN | MODE_FLAG_OSC_SYNC_SOFT;
-
-
-const int CFG_FLAG_STEREO_EN = 1;
-const int CFG_FLAG_STEREO_POS_EN = 2;
-
-
-const int STATE_CMP_REV_PHASE = 0;
-const int STATE_UPDATE_PHASE = 1;
-const int STATE_DETUNE = 2;
-const int STATE_TRI = 3;
-const int STATE_COMBINED_SLOPE_CMP = 4;
-const int STATE_COMBINED_SLOPE_ADD = 5;
-const int STATE_AMP_CMP = 6;
-const int STATE_OUT_ACC = 7;
-const int STATE_LAST = 7;
-
-const int STATE_OCT_COUNTER_INC_LOW = 4;
-const int STATE_OCT_COUNTER_INC_HIGH = 5;
-
-
 const int TST_ADDR_NOTHING = -1;
 const int TST_ADDR_ACC = 0;
 const int TST_ADDR_OUT_ACC = 1;
@@ -145,8 +77,18 @@ const int core_reg_bits[TST_ADDR_NUM] = {BITS+1, BITS, 1, 1, 18-(BITS-1), 24, OU
 // - How to handle bit width/mask limitation of register banks? Need to mask the bits somewhere...
 
 
-Vtqvp_toivoh_pwl_synth *top;
-VerilatedVcdC *m_trace;
+#ifdef TEST_SOAK
+#ifdef TRACE_ON
+#error "TEST_SOAK runs one model per thread and doesn't support TRACE_ON"
+#endif
+// Per thread, so that the soak test can run one model per thread
+#define SOAK_THREAD_LOCAL thread_local
+#else
+#define SOAK_THREAD_LOCAL
+#endif
+
+SOAK_THREAD_LOCAL Vtqvp_toivoh_pwl_synth *top;
+SOAK_THREAD_LOCAL VerilatedVcdC *m_trace;
 int sim_time = 0;
 
 
@@ -193,16 +135,17 @@ void write_core_reg_to_rtl(int addr, int data) {
 	top->ireg_waddr = -1;
 }
 
+int core_reg_from_rdata(int addr, int data) {
+	if (addr == TST_ADDR_ACC && data >= (1 << BITS)) data -= (1 << (BITS + 1));
+	return data;
+}
+
 // assumes en_external = 0
 int read_core_reg_from_rtl(int addr) {
 	top->ireg_raddr = addr;
 	timestep();
 	top->ireg_raddr = -1;
-	int data = top->ireg_rdata;
-
-	if (addr == TST_ADDR_ACC && data >= (1 << BITS)) data -= (1 << (BITS + 1));
-
-	return data;
+	return core_reg_from_rdata(addr, top->ireg_rdata);
 }
 	
 int read_acc12() {
@@ -255,566 +198,102 @@ int read_reg_from_rtl(int channel, int reg) {
 #endif
 }
 
-
-struct Model {
-	int term_index;
-	int acc, out_acc, out_acc_alt_frac, pred, part, lfsr_extra_bits, oct_counter, cfg;
-	bool last_osc_wrapped;
-	int regs[NUM_CHANNELS*REGS_PER_CHANNEL];
-
-	Model() {
-		term_index = 0;
-		acc = out_acc = out_acc_alt_frac = pred = part = lfsr_extra_bits = oct_counter = cfg = 0;
-		last_osc_wrapped = false;
-		memset(regs, 0, sizeof(regs));
+// Registers that can be read back through reg_raddr_p. The sweep registers and cfg can't be read.
+bool reg_readable(int reg) { return reg <= REG_MODE || reg == REG_PHASE; }
+
+void set_core_reg(Model &m, int addr, int data) {
+	switch (addr) {
+		case TST_ADDR_ACC: m.acc = data; break;
+		case TST_ADDR_OUT_ACC: m.out_acc = data; break;
+		case TST_ADDR_PRED: m.pred = data; break;
+		case TST_ADDR_PART: m.part = data; break;
+		case TST_ADDR_LFSR_EXTRA_BITS: m.lfsr_extra_bits = data; break;
+		case TST_ADDR_OCT_COUNTER: m.oct_counter = data; break;
+		case TST_ADDR_OUT_ACC_ALT_FRAC: m.out_acc_alt_frac = data; break;
+		case TST_ADDR_LAST_OSC_WRAPPED: m.last_osc_wrapped = data; break;
 	}
-
-	int get_reg(int channel, int reg) { return regs[channel + reg*NUM_CHANNELS]; }
-	void set_reg(int channel, int reg, int data) {
-		if (!(0 <= channel && channel < NUM_CHANNELS)) return;
-		if (!(0 <= reg && reg < REGS_PER_CHANNEL)) return;
-		regs[channel + reg*NUM_CHANNELS] = data;
-	}
-	void set_reg_both(int channel, int reg, int data) { set_reg(channel, reg, data); write_reg_to_rtl(channel, reg, data); }
-	int get_channel() { return (term_index>>1) & (NUM_CHANNELS-1); }
-	int get_channel_reg(int reg) { return get_reg(get_channel(), reg); }
-	void set_channel_reg(int reg, int data) { set_reg(get_channel(), reg, data); }
-	int get_subchannel() { return term_index&1; }
-	bool stereo_en() { return (cfg & CFG_FLAG_STEREO_EN) != 0; }
-	bool stereo_pos_en() { return (cfg & CFG_FLAG_STEREO_POS_EN) != 0; }
-	int get_channel_stereo_pos() { return (get_channel_reg(REG_MODE) >> MODE_BIT_3X) & 7; }
-	bool phase_factor_en() { return !stereo_pos_en(); }
-	//bool common_sat() { return get_channel() == 0 && ((get_channel_reg(REG_MODE) & MODE_FLAG_COMMON_SAT) != 0) && !stereo_en(); }
-#ifdef USE_COMMON_SAT_STEREO
-	bool _common_sat() { return ((get_reg(0, REG_MODE) & MODE_FLAG_COMMON_SAT) != 0); }
-	bool common_sat_store() {
-		return _common_sat() && (stereo_en()
-			? (get_channel() == 0)
-			: (get_channel() == 0 && get_subchannel() == 0)
-		);
-	}
-	bool common_sat_add() {
-		return _common_sat() && (stereo_en()
-			? (get_channel() == 1)
-			: (get_channel() == 0 && get_subchannel() == 1)
-		);
-	}
-#else
-	bool _common_sat() { return ((get_channel_reg(REG_MODE) & MODE_FLAG_COMMON_SAT) != 0) && !stereo_en(); }
-	bool common_sat_store() { return _common_sat() && get_channel() == 0 && get_subchannel() == 0; }
-	bool common_sat_add() { return _common_sat() && get_channel() == 0 && get_subchannel() == 1; }
-#endif
-};
-
-#ifdef USE_ORION_WAVE
-const int MODE_FLAGS_WAVEFORM = MODE_FLAG_NOISE | MODE_FLAG_PWL_OSC;
-const int MODE_FLAGS_ORION = MODE_FLAG_NOISE | MODE_FLAG_PWL_OSC;
-bool get_lfsr_en(int mode) { return (mode & MODE_FLAGS_WAVEFORM ) == MODE_FLAG_NOISE; }
-bool get_pwl_osc_en(int mode) { return (mode & MODE_FLAGS_WAVEFORM ) == MODE_FLAG_PWL_OSC; }
-bool get_orion_en(int mode) { return (mode & MODE_FLAGS_WAVEFORM ) == MODE_FLAGS_ORION; }
-#else
-bool get_lfsr_en(int mode) { return (mode & MODE_FLAG_NOISE) != 0; }
-bool get_pwl_osc_en(int mode) { return (mode & MODE_FLAG_PWL_OSC) != 0; }
-bool get_orion_en(int mode) { return 0; }
-#endif
-
-int signed_wrap(int x) {
-	x += 1 << (BITS - 1);
-	x &= (1 << BITS) - 1;
-	x -= 1 << (BITS - 1);
-	return x;
-}
-
-int sat(int x) {
-	if (x >= (1 << (BITS-2))) return (1 << (BITS-2))-1;
-	else if (x < (-1 << (BITS-2))) return -(1 << (BITS-2));
-	else return x;
-}
-
-static uint16_t bitreverse(uint16_t x, int num_bits) {
-	int shift, mask;
-	shift = 1; mask = 0x5555;
-	x = ((x & mask) << shift) | ((x >> shift) & mask);
-	shift = 2; mask = 0x3333;
-	x = ((x & mask) << shift) | ((x >> shift) & mask);
-	shift = 4; mask = 0x0f0f;
-	x = ((x & mask) << shift) | ((x >> shift) & mask);
-	shift = 8; mask = 0x00ff;
-	x = ((x & mask) << shift) | ((x >> shift) & mask);
-
-	return x >> (16 - num_bits);
 }
 
-// Depends on channel, period and phase for the channel, oct_counter
-void model_oscillator(Model &m) {
-	int phase = m.get_channel_reg(REG_PHASE);
-
-	int mode = m.get_channel_reg(REG_MODE);
-	bool osc_sync_en = (mode & MODE_FLAG_OSC_SYNC_EN) != 0;
-	bool osc_sync_soft = (mode & MODE_FLAG_OSC_SYNC_SOFT) != 0;
-	bool lfsr_en = get_lfsr_en(mode);
-	bool pwl_osc_en = get_pwl_osc_en(mode);
-
-#ifdef DEBUG_OSC
-	printf("phase = 0x%x, osc_sync_en = %d, osc_sync_soft = %d, last_osc_wrapped = %d, lfsr_en = %d, pwl_osc_en = %d\n", phase, osc_sync_en, osc_sync_soft, m.last_osc_wrapped, lfsr_en, pwl_osc_en);
-#endif
-
-	bool do_osc_sync = false;
-	int sync_phase = 0;
-	if (osc_sync_en && m.last_osc_wrapped) {
-		do_osc_sync = true;
-		sync_phase = osc_sync_soft ? ~phase : -1;
-		sync_phase &= ((1 << BITS) - 1);
-		//m.acc = sync_phase & ((1 << BITS) - 1);
-#ifdef DEBUG_OSC
-		printf("sync_phase = 0x%x", sync_phase);
-#endif
-		if (!lfsr_en) m.last_osc_wrapped = 1; // The inversion of src1 sets carry_out
-	}
-
-
-	int f_period = m.get_channel_reg(REG_PERIOD);
-	int mantissa = f_period & ((1 << MANTISSA_BITS) - 1);
-	int period_exp = f_period >> MANTISSA_BITS;
-
-	//bool lfsr_18 = (m.get_channel() == NUM_CHANNELS - 1);
-	bool lfsr_18 = (m.get_channel() == 0 || m.get_channel() == 3);
-
-	int shift_count = 3 - period_exp - (lfsr_en ? 6 : 0); // TODO: is 6 the right offset?
-	bool skip = false;
-	if (shift_count < 0) {
-		//int oct_enables = (m.oct_counter + 1) & ~m.oct_counter;
-		int oct_enables = m.oct_counter & ~(m.oct_counter + 1);
-		if (((oct_enables >> (-shift_count - 1)) & 1) == 0) skip = true;
-		shift_count = 0;
-	}
-
-	bool delayed = (((phase >> shift_count) & 1) != 0);
-	bool small_step;
-
-	//if (pwl_osc_en) printf("delayed = %d, phase = 0x%x\n", delayed, phase);
-
-#ifdef DEBUG_OSC
-	printf("phase = 0x%x ", phase);
-#endif
-	if (delayed) small_step = true;
-	else {
-		//int mantissa_ext = (mantissa << (PHASE_BITS - 1 - MANTISSA_BITS));
-		int mantissa_ext = (mantissa << (PHASE_BITS - 1 - MANTISSA_BITS - REV_PHASE_SHR));
-		if (pwl_osc_en) {
-			int phase_mod = phase & ((1 << (PHASE_BITS-1)) - 1); // remove msb
-			phase_mod &= (-1 << (shift_count + 1)); // remove unused LSBs
-			phase_mod |= ((phase >> (PHASE_BITS-1)) & 1) << shift_count; // put the removed msb back as lowest used bit
-
-#ifdef DEBUG_OSC
-			printf(("phase = 0x%x, phase_mod = 0x%x)\n"), phase, phase_mod);
-#endif
-
-			small_step = (phase_mod < mantissa_ext);
-		} else {
-
-			int rev_phase = bitreverse(phase >> 1, PHASE_BITS-1) >> REV_PHASE_SHR;
-			int rev_phase_shifted = (rev_phase << shift_count) & ((1 << (PHASE_BITS-1)) - 1);
-
-			//if (phase == 2048) printf("phase = 0x%x, mantissa_ext = 0x%x, rev_phase_shifted = 0x%x\n", phase, mantissa_ext, rev_phase_shifted);
-
-
-			small_step = (rev_phase_shifted < mantissa_ext);
-			//small_step = ((rev_phase_shifted >> REV_PHASE_SHR) < (mantissa_ext >> REV_PHASE_SHR));
-
-#ifdef DEBUG_OSC
-			printf("rev_phase_shifted = 0x%x, mantissa_ext = 0x%x ", rev_phase_shifted, mantissa_ext);
-#endif
-		}
-	}
-
-#ifdef DEBUG_OSC
-	printf("delayed = %d, small_step = 0x%x, lfsr_en = %d\n", delayed, small_step, lfsr_en);
-#endif
-
-	if (lfsr_en) {
-		if (!delayed && small_step) phase += 1;
-		else {
-			int x = ((phase >> 1)&((1<<BITS)-1)) | (m.lfsr_extra_bits << (BITS-1));
-
-			int lfsr_bit;
-			if (lfsr_18) {
-#ifdef DEBUG_OSC
-				printf("18 bit: lfsr_extra_bits = 0x%x, x = 0x%x\n", m.lfsr_extra_bits, x);
-#endif
+// Read the whole state of the RTL into m: the readable channel registers and the core registers.
+// The registers that can't be read (sweeps and cfg) are copied from shadow, which should hold the written values.
+//
+// With the new read, the reads are batched: reg_raddr_p_valid is held high while the addresses are stepped
+// back to back, one cycle per register, and the core registers are read through ireg_raddr in the same cycles.
+// This takes NUM_CHANNELS*7 + 1 cycles instead of two per register and one per core register.
+// The synth is paused with en_external during the snapshot, since the read only pauses it from the cycle after
+// reg_raddr_p_valid goes high, and continues where it was afterwards. pipeline_curr_channel is turned off meanwhile,
+// so that the channel is taken directly from reg_raddr_p; the pipelined channel is not updated while paused.
+void read_snapshot_from_rtl(Model &m, const Model &shadow) {
+	m = shadow;
+#ifdef USE_NEW_READ
+	int en_external = top->en_external;
+	int pipeline_curr_channel = top->pipeline_curr_channel;
+	top->en_external = 0;
+	top->pipeline_curr_channel = 0;
+	top->reg_raddr_p_valid = 1;
 
-				// 18 bit LFSR
-				bool bit17 = ((x>>17)&1);
-				bool bit6 = ((x>>6)&1);
-				bool zeros = ( (x & ((1<<17)-1) ) == 0);
-				lfsr_bit = bit17 ^ (bit6 | zeros); // include zero state
-			} else {
-				// 11 bit LFSR
-				bool bit10 = ((x>>10)&1);
-				bool bit8 = ((x>>8)&1);
-				bool zeros = ( (x & ((1<<10)-1) ) == 0);
-				lfsr_bit = bit10 ^ (bit8 | zeros); // include zero state
+	int core_addr = 0;
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+		for (int reg = 0; reg < REGS_PER_CHANNEL; reg++) {
+			if (!reg_readable(reg)) continue;
+			top->reg_raddr_p = get_reg_address_p(channel, reg);
+			top->ireg_raddr = core_addr < TST_ADDR_NUM ? core_addr : -1;
+			timestep();
+			m.set_reg(channel, reg, top->reg_rdata_p);
+			if (core_addr < TST_ADDR_NUM) {
+				set_core_reg(m, core_addr, core_reg_from_rdata(core_addr, top->ireg_rdata));
+				core_addr++;
 			}
-			x = (x << 1) | lfsr_bit;
-			phase = (x & ((1<<BITS)-1)) << 1;
-			if (!skip && lfsr_18) m.lfsr_extra_bits = (x >> (BITS-1)) & 127;
-		}
-	} else {
-		int prev_phase = phase;
-		phase = (phase + ((small_step ? 1 : 2) << shift_count)) & ((1 << PHASE_BITS) - 1);
-		if (!do_osc_sync) m.last_osc_wrapped = !skip && ((phase & (1 << (BITS-1)))==0) && ((prev_phase & (1 << (BITS-1)))!=0);
-	}
-
-	if (do_osc_sync) {
-		m.acc = sync_phase & ((1 << BITS) - 1);
-		m.set_channel_reg(REG_PHASE, m.acc);
-	} else {
-		m.acc = phase & ((1 << BITS) - 1);
-		if (!skip) m.set_channel_reg(REG_PHASE, m.acc);
-	}
-}
-
-
-// Depends on channel, subchannel, detune_exp for channel, phase for channel
-void model_detune(Model &m, int old_phase) {
-	int detune_exp = m.get_channel_reg(REG_MODE) & 7;
-	int subchannel = m.get_subchannel();
-
-	int mode = m.get_channel_reg(REG_MODE);
-	bool enable_3x = (subchannel == 0) && m.phase_factor_en() && ((mode & MODE_FLAG_3X) != 0);
-
-#ifdef DEBUG_DETUNE
-	printf("detune_exp_orig = 0x%x\n", detune_exp);
-#endif
-	//if ((mode & MODE_FLAG_DETUNE_FIFTH) != 0 && subchannel == 0 && detune_exp != 0) detune_exp++;
-	if ((mode & MODE_FLAG_DETUNE_FIFTH) != 0 && subchannel == 0) detune_exp++;
-#ifdef DEBUG_DETUNE
-	printf("detune_exp_mod = 0x%x\n", detune_exp);
-#endif
-
-	bool detune_disable = (subchannel == 0 && m.phase_factor_en() && !enable_3x && ((mode & (3 << MODE_BIT_X2N0)) != 0));
-
-	bool swap_detune_sign = false;
-	int stereo_pos = m.get_channel_stereo_pos();
-	if (m.stereo_pos_en() && stereo_pos <= 4) swap_detune_sign = (m.oct_counter & 1) != 0;
-
-	//int x = old_phase;
-	int x = m.get_channel_reg(REG_PHASE);
-
-#ifdef USE_SWAPPED_DETUNE_SIGNS
-	swap_detune_sign = !swap_detune_sign;
-#endif
-
-#ifdef DEBUG_DETUNE
-	printf("enable_3x = %d, detune_disable = %d, subchannel = %d, cfg = 0x%x, swap_detune_sign = %d, x = 0x%x\n", enable_3x, detune_disable, subchannel, m.cfg, swap_detune_sign, x);
-#endif
-
-	if (enable_3x) {
-		x += m.acc << 1;
-	} else {
-		int detune = 0;
-		if (detune_exp != 0 && !detune_disable) {
-			//int detune_src = m.oct_counter >> 6;
-			//detune = detune_src >> (7 - detune_exp);
-			detune = m.oct_counter >> ((6+7) - detune_exp);
-
-			if ((subchannel == 0) != swap_detune_sign) x += detune;
-			else x -= detune;
 		}
-
-		x -= subchannel ^ swap_detune_sign;
-
-#ifdef DEBUG_DETUNE
-		printf("detune = 0x%x, x = 0x%x\n", detune, x);
-#endif
 	}
 
-
-	m.acc = signed_wrap(x);
-}
-
-void model_detune(Model &m) {
-	model_detune(m, m.get_channel_reg(REG_PHASE));
-}
-
-// Depends on acc, PWM offset for channel
-void model_tri_pwm_offset(Model &m) {
-	int mode = m.get_channel_reg(REG_MODE);
-	int pwm_offset = (m.get_channel_reg(REG_PWM_OFFSET) << (BITS-2-8)) - (1 << (BITS-2));
-	int lshift = (m.get_subchannel() == 1 && m.phase_factor_en()) ? (mode >> MODE_BIT_X2N0) & 3 : 0;
-
-	int x = m.acc & ((1 << BITS) - 1);
-#ifdef DEBUG_TRI
-		printf("initial:\tpwm_offset = 0x%x, x = 0x%x\n", pwm_offset, x);
-#endif
-
-	if (get_orion_en(mode)) {
-#ifdef USE_ORION_WAVE_PWM
-		if (((m.acc << lshift)&(1 << (BITS-1))) != 0) pwm_offset = ~pwm_offset;
-#endif
-
-#ifdef DEBUG_TRI
-		printf("orion:\tpwm_offset = 0x%x, x = 0x%x\n", pwm_offset, x);
-#endif
-
-		m.acc = signed_wrap((x << lshift) + pwm_offset);
-		m.part = 0;
-		return;
-	}
-
-	// Left shift
-	x = (x << lshift) & ((1 << BITS)-1);
-
-	bool part = (x >= (1 << (BITS-1)));
-
-	// Triangle wave
-	if (part) x = ~x;
-	x &= ((1 << (BITS - 1)) - 1);
-#ifdef DEBUG_TRI
-	printf("x = 0x%x\n", x);
-#endif
-
-	// Apply PWM offset and saturate
-	x += pwm_offset;
-#ifdef DEBUG_TRI
-	printf("x = 0x%x\n", x);
-#endif
-	if (x >= (1 << (BITS-2))) x = (1 << (BITS-2)) - 1;
-#ifdef DEBUG_TRI
-	printf("x = 0x%x\n", x);
-#endif
-
-	m.acc = x;
-	m.part = part;
-}
-
-int bitshuffle(int x) {
-	int y = 0;
-#ifndef USE_ORION_WAVE_MASK
-	// y |= ((x >> -1)&1) <<  0;
-	y |= ((x >>  4)&1) <<  1;
-	// y |= ((x >> -1)&1) <<  2;
-	y |= ((x >>  7)&1) <<  3;
-	y |= ((x >>  8)&1) <<  4;
-	// y |= ((x >> -1)&1) <<  5;
-	y |= ((x >> 10)&1) <<  6;
-	// y |= ((x >> -1)&1) <<  7;
-	// y |= ((x >> -1)&1) <<  8;
-	y |= ((x >>  9)&1) <<  9;
-	y |= ((x >> 11)&1) << 10;
-	// y |= ((x >> -1)&1) << 11;
-	// y |= ((x >> -1)&1) << 12;
+	top->reg_raddr_p_valid = 0;
+	top->ireg_raddr = -1;
+	timestep(); // next_en must be high the cycle before the synth is enabled again
+	top->pipeline_curr_channel = pipeline_curr_channel;
+	top->en_external = en_external;
 #else
-	//y |= ((x >> 11)&1) <<  0;
-	y |= ((x >>  4)&1) <<  1;
-	//y |= ((x >> 10)&1) <<  2;
-	y |= ((x >>  7)&1) <<  3;
-	y |= ((x >>  8)&1) <<  4;
-	y |= ((x >> 6)&1) <<  5;
-	y |= ((x >> 10)&1) <<  6;
-	y |= ((x >> 11)&1) <<  7;
-	y |= ((x >> 8)&1) <<  8;
-	y |= ((x >>  9)&1) <<  9;
-	y |= ((x >> 11)&1) << 10;
-	// y |= ((x >> -1)&1) << 11;
-	// y |= ((x >> -1)&1) << 12;
-#endif
-	return y;
-}
-
-// Depends on channel, part, slope for the channel and part, acc
-void model_slope(Model &m) {
-	int mode = m.get_channel_reg(REG_MODE);
-	//printf("get_orion_en = %d\n", get_orion_en(mode));
-	int y;
-	if (get_orion_en(mode)) {
-		//acc = (bitshuffle(acc) & mask) + offset
-		int acc = bitshuffle(m.acc);
-		//printf("orion: acc in = 0x%x, bitshuffle = 0x%x\n", m.acc, acc);
-
-		int slope1 = m.get_channel_reg(REG_SLOPE1);
-		int src2_mask = -1;
-		src2_mask &= ~0xff << (BITS-1-8);
-		if (slope1&1) src2_mask |= ~(-1 << (BITS-1-8)); // replicate the bottom mask bit
-		src2_mask |= slope1 << (BITS-1-8);
-		acc &= src2_mask;
-		//printf("orion: src2_mask = 0x%x, acc = 0x%x\n", src2_mask, acc);
-
-		acc += m.get_channel_reg(REG_SLOPE0) << (BITS-3-4);
-		//printf("orion: offset: acc = 0x%x\n", acc);
-		m.acc = acc;
-
-		//acc = acc + (acc << 1)
-		acc *= 3;
-		//printf("orion: 3x: acc = 0x%x\n", acc);
-		// acc = sext_wrap(acc)
-		acc = acc & ((1 << (BITS-1))-1);
-		acc |= ((acc >> (BITS-2))&1) << (BITS-1);
-		//printf("orion: sext: acc = 0x%x\n", acc);
-
-		y = signed_wrap(acc);
-	} else {
-		int slope = m.get_channel_reg(m.part ? REG_SLOPE1 : REG_SLOPE0);
-		int slope_exp = slope >> 4;
-		int slope_offset = (slope & 15) << (BITS-3-4);
-		int x = m.acc;
-
-		//printf("slope = 0x%x, part = %d, acc = 0x%x\n", slope, m.part, x);
-
-		x <<= slope_exp;
-		int x1 = 2*x;
-		int x2 = x + (x >= 0 ? slope_offset : -slope_offset);
-
-		y = x1;
-		if ((x >= 0 && x2 < y) || (x < 0 && x2 > y)) y = x2;
-		bool cmp = ((x1 - x2) < 0) ^ (x < 0);
-
-		y = sat(y);
-		m.pred = cmp;
-	}
-
-	if (m.common_sat_store()) { // store result to out_acc instead
-		m.out_acc &= ((1 << OUT_ACC_FRAC_BITS) - 1);
-		m.out_acc |= y & (-1 << OUT_ACC_FRAC_BITS);
-	} else {
-#ifdef USE_4_BIT_MODE
-		if ((m.get_channel_reg(REG_MODE) & (MODE_FLAG_OSC_SYNC_EN | MODE_FLAG_OSC_SYNC_SOFT)) == MODE_FLAG_OSC_SYNC_SOFT) y &= -1 << (BITS-1-4);
-#endif
-		m.acc = y;
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+		for (int reg = 0; reg < REGS_PER_CHANNEL; reg++) {
+			if (reg_readable(reg)) m.set_reg(channel, reg, read_reg_from_rtl(channel, reg));
+		}
 	}
-
-	//printf("slope = %d, x = %d, x1 = %d, x2 = %d, y = %d\n", slope, x, x1, x2, y);
-}
-
-void model_add_common_sat(Model &m) {
-	int out_acc = m.out_acc;
-	out_acc &= -1 << OUT_ACC_FRAC_BITS;
-#ifdef DEBUG_ADD_COMMON_SAT
-	printf("add_common_sat:\tout_acc = 0x%x, out_acc_masked = 0x%x, acc = 0x%x\n", m.out_acc, out_acc, m.acc);
-#endif
-	m.acc = sat(m.acc + out_acc);
-#ifdef DEBUG_ADD_COMMON_SAT
-	printf("add_common_sat:\tacc = 0x%x\n", m.acc);
+	for (int addr = 0; addr < TST_ADDR_NUM; addr++) set_core_reg(m, addr, read_core_reg_from_rtl(addr));
 #endif
 }
 
-// Depends on channel, amp for channel, acc, out_acc. Special behavior for term_index == 0 (sigma-delta)
-void model_amp_clamp_out(Model &m) {
-	int x = m.acc;
-	int amp = m.get_channel_reg(REG_AMP) << (BITS-2-6);
-
-#ifdef DEBUG_AMP_CLAMP
-	printf("initial:\tx = 0x%x, amp = 0x%x\n", x, amp);
-#endif
-
-	if (m.stereo_pos_en()) {
-		int factor = 2;
-		int stereo_pos = m.get_channel_stereo_pos();
-		if (m.get_subchannel() == 0) {
-			if ((stereo_pos&3) == 3) factor = 1;
-			else if (stereo_pos == 4) factor = 0;
-		} else {
-			if ((stereo_pos&3) == 1) factor = 1;
-			else if (stereo_pos == 0) factor = 0;
+// Compare a snapshot against the model and print the differences. acc, pred and part are only compared if core is true,
+// since they are scratch state during a sample and are not tracked exactly between samples.
+bool compare_snapshot(const Model &m, const Model &rtl, const char *position, bool core) {
+	bool ok = true;
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+		for (int reg = 0; reg < REGS_PER_CHANNEL; reg++) {
+			if (!reg_readable(reg)) continue;
+			int mask = (1 << reg_data_bits[reg]) - 1;
+			if ((m.get_reg(channel, reg) & mask) != (rtl.get_reg(channel, reg) & mask)) {
+				printf("%s: Mismatch in channel %d reg %d, model: 0x%x, RTL: 0x%x\n", position, channel, reg, m.get_reg(channel, reg) & mask, rtl.get_reg(channel, reg) & mask);
+				ok = false;
+			}
 		}
-		amp = (amp * factor) >> 1;
 	}
 
-	bool saturated_neg = false;
-	if (x >= 0 && x >  amp) x = amp;
-	if (x <  0 && x < -amp) { x = -amp; saturated_neg = true; }
-
-#ifdef DEBUG_AMP_CLAMP
-	printf("clamp:\tamp = 0x%x, x = 0x%x\n", amp, x);
-#endif
-
-	if (saturated_neg) x = -x; // amp is right shifted before negation, compensate
-	if (m.common_sat_add()) x >>= (OUT_RSHIFT-1);
-	else x >>= OUT_RSHIFT;
-	if (saturated_neg) x = -x; // amp is right shifted before negation, compensate
-
-	int y = m.out_acc;
-#ifdef DEBUG_AMP_CLAMP
-	printf("rshift:\tx = 0x%x, y = 0x%x\n", x, y);
-#endif
-
-
-	if (m.term_index == 0 || (m.term_index == 1 && m.stereo_en()) || m.common_sat_add()) {
-		// Reset out_acc except the frac bits
-		y &= (1 << OUT_ACC_FRAC_BITS) - 1;
-		if (m.stereo_en()) {
-			int old_alt_frac = m.out_acc_alt_frac;
-			m.out_acc_alt_frac = y;
-			y = old_alt_frac;
+	static const char *core_names[TST_ADDR_NUM] = {"acc", "out_acc", "pred", "part", "lfsr_extra_bits", "oct_counter", "out_acc_alt_frac", "last_osc_wrapped"};
+	int model_core[TST_ADDR_NUM] = {m.acc, m.out_acc, m.pred, m.part, m.lfsr_extra_bits, m.oct_counter, m.out_acc_alt_frac, m.last_osc_wrapped};
+	int rtl_core[TST_ADDR_NUM] = {rtl.acc, rtl.out_acc, rtl.pred, rtl.part, rtl.lfsr_extra_bits, rtl.oct_counter, rtl.out_acc_alt_frac, rtl.last_osc_wrapped};
+	for (int addr = 0; addr < TST_ADDR_NUM; addr++) {
+		if (!core && (addr == TST_ADDR_ACC || addr == TST_ADDR_PRED || addr == TST_ADDR_PART)) continue;
+		int mask = (1 << core_reg_bits[addr]) - 1;
+		if ((model_core[addr] & mask) != (rtl_core[addr] & mask)) {
+			printf("%s: Mismatch in %s, model: 0x%x, RTL: 0x%x\n", position, core_names[addr], model_core[addr] & mask, rtl_core[addr] & mask);
+			ok = false;
 		}
-		y |= (m.stereo_en() ? OUT_ACC_INITIAL_TOP_STEREO : OUT_ACC_INITIAL_TOP) << OUT_ACC_FRAC_BITS;
 	}
-
-#ifdef DEBUG_AMP_CLAMP
-	printf("mask:\tx = 0x%x, y = 0x%x\n", x, y);
-#endif
-
-	y += x;
-#ifdef DEBUG_AMP_CLAMP
-	printf("add:\ty = 0x%x\n", y);
-#endif
-
-	m.out_acc = signed_wrap(y);
+	return ok;
 }
 
-// Depends on oct_counter (oct_enables, sweep_channel, sweep_index), value and sweep value for swept parameter
-int model_sweep(Model &m) {
-	int sweep_channel = m.oct_counter & ((1 << LOG2_NUM_CHANNELS) - 1);
-
-	int sweep_index;
-	int pre_sweep_index = (m.oct_counter >> LOG2_NUM_CHANNELS) & 7;
-	int sweep_oct_counter_term = 8;
-	if ((pre_sweep_index & 1) == 0) sweep_index = 0;
-	else {
-		sweep_index = (pre_sweep_index >> 1) & 3;
-		if (sweep_index == 0) sweep_index = 4;
-		sweep_oct_counter_term = 32;
-	}
-
-	int sweep = 0;
-	switch (sweep_index) {
-		case REG_PERIOD: sweep = m.get_reg(sweep_channel, REG_SWEEP_PA) >> 8; break;
-		case REG_AMP: sweep = m.get_reg(sweep_channel, REG_SWEEP_PA) & 255; break;
-		case REG_SLOPE0: case REG_SLOPE1: sweep = m.get_reg(sweep_channel, REG_SWEEP_WS) & 255; break;
-		case REG_PWM_OFFSET: sweep = m.get_reg(sweep_channel, REG_SWEEP_WS) >> 8; break;
-	}
-
-	int rate = sweep & 15;
-	int sign = (sweep >> 4) & 1;
-
-	int oct_enables = m.oct_counter & ~(m.oct_counter + sweep_oct_counter_term);
-	bool enable;
-	if (rate == 0) enable = false;
-	else if (rate == 1) enable = true;
-	else enable = (oct_enables >> rate) & 1;
-
-	int value = m.get_reg(sweep_channel, sweep_index);
-
-	if (sweep_index == REG_AMP) {
-		int amp_target = ((sweep >> 4)&7)*9;
-		sign = (value > amp_target);
-		if (value == amp_target) enable = 0;
-	} else if (sweep_index == REG_SLOPE0 || sweep_index == REG_SLOPE1) {
-		int dir = (sweep >> 5) & 3;
-		if (dir == 0 && sweep_index == REG_SLOPE1) sign = !sign;
-		if (dir == 2 && sweep_index == REG_SLOPE0) enable = false;
-		if (dir == 1 && sweep_index == REG_SLOPE1) enable = false;
-	}
+void set_reg_both(Model &m, int channel, int reg, int data) { m.set_reg(channel, reg, data); write_reg_to_rtl(channel, reg, data); }
 
-	if (sign && value == 0) enable = false;
-	if (!sign && value == (1 << reg_bits[sweep_index]) - 1) enable = false;
 
-	value += sign ? -1 : 1;
-	m.acc = value;
-	if (enable) m.set_reg(sweep_channel, sweep_index, value);
-
-	return reg_bits[sweep_index];
-}
 
 void write_cfg_to_rtl(int cfg) { write_reg_to_rtl(2, REG_OCT_COUNTER, cfg);}
 
@@ -921,7 +400,7 @@ bool run_step_tests() {
 	for (int slope = 0; slope < 256; slope += 1) {
 		//m.set_reg(0, REG_SLOPE0, slope);
 		//write_reg_to_rtl(0, REG_SLOPE0, slope);
-		m.set_reg_both(0, REG_SLOPE0, slope);
+		set_reg_both(m, 0, REG_SLOPE0, slope);
 
 		for (int acc = -1024; acc < 1024; acc++) {
 	//	for (int acc = -512; acc < 512; acc += 64) {
@@ -971,7 +450,7 @@ bool run_step_tests() {
 		for (int detune_exp = 0; detune_exp <= 7; detune_exp++) {
 //		for (int detune_exp = 7; detune_exp >= 0; detune_exp--) {
 			if (detune_exp == 7 && detune_fifth == 1 && subchannel == 0) continue;
-			m.set_reg_both(0, REG_MODE, detune_exp | (detune_fifth << MODE_BIT_DETUNE_FIFTH));
+			set_reg_both(m, 0, REG_MODE, detune_exp | (detune_fifth << MODE_BIT_DETUNE_FIFTH));
 			//int detune_exp_eff = detune_exp + (detune_fifth && subchannel == 0);
 			int detune_exp_eff = detune_exp + (detune_fifth && subchannel == 0 && detune_exp != 0);
 
@@ -979,7 +458,7 @@ bool run_step_tests() {
 			for (int detune = 0; detune < 4096; detune++) {
 				int phase = (detune*0x2345) & ((1 << BITS) - 1);
 				int oct_counter = (detune << (6 + 7 - detune_exp_eff)) & ((1<<24)-1);
-				m.set_reg_both(0, REG_PHASE, phase);
+				set_reg_both(m, 0, REG_PHASE, phase);
 				m.oct_counter = oct_counter;
 				write_core_reg_to_rtl(TST_ADDR_OCT_COUNTER, oct_counter);
 
@@ -1028,7 +507,7 @@ bool run_step_tests() {
 	printf("\nTesting amp clamp+output step\n");
 	m.term_index = 1;
 	for (int amp = 0; amp < 64; amp++) {
-		m.set_reg_both(0, REG_AMP, amp);
+		set_reg_both(m, 0, REG_AMP, amp);
 
 		for (int acc = -1024; acc < 1024; acc++) {
 			int out_acc = (acc * 0x1234) & ((1 << BITS) - 1);
@@ -1076,7 +555,7 @@ bool run_step_tests() {
 	m.term_index = 0;
 
 	for (int pwm_offset = 0; pwm_offset < 256; pwm_offset++) {
-		m.set_reg_both(0, REG_PWM_OFFSET, pwm_offset);
+		set_reg_both(m, 0, REG_PWM_OFFSET, pwm_offset);
 		for (int acc = 0; acc < (1 << BITS); acc++) {
 			m.acc = acc; write_core_reg_to_rtl(TST_ADDR_ACC, acc);
 
@@ -1139,12 +618,12 @@ bool run_step_tests() {
 				case REG_PWM_OFFSET: sweep_ws = sweep << 8; break;
 			}
 
-			m.set_reg_both(0, REG_SWEEP_PA, sweep_pa);
-			m.set_reg_both(0, REG_SWEEP_WS, sweep_ws);
+			set_reg_both(m, 0, REG_SWEEP_PA, sweep_pa);
+			set_reg_both(m, 0, REG_SWEEP_WS, sweep_ws);
 
 			int num_changed = 0;
 			for (int value = 0; value < (1 << (nbits)); value++) {
-				m.set_reg_both(0, sweep_index, value);
+				set_reg_both(m, 0, sweep_index, value);
 
 				exec_step(0, STATE_OUT_ACC, 1); // Set part, also clears write collision
 				for (int i = 0; i <= 3; i++) exec_step(m.term_index, i);
@@ -1195,8 +674,8 @@ bool run_step_tests() {
 		}
 		if (!ok) break;
 	}
-	m.set_reg_both(0, REG_SWEEP_PA, 0);
-	m.set_reg_both(0, REG_SWEEP_WS, 0);
+	set_reg_both(m, 0, REG_SWEEP_PA, 0);
+	set_reg_both(m, 0, REG_SWEEP_WS, 0);
 
 	printf("\nNumber of cases tested ok: %d\n", num_ok);
 	printf("Number of cases failed: %d\n\n", num_fail);
@@ -1221,9 +700,9 @@ bool run_step_tests() {
 		int f_period = j == 0 ? 0 : 0x155;
 		int num_samples = (1024 + f_period) << 8;
 
-		m.set_reg_both(channel, REG_PHASE, 0);
-		m.set_reg_both(channel, REG_PERIOD, f_period); // Start without delay. TODO: Test with delay
-		m.set_reg_both(channel, REG_MODE, MODE_FLAG_NOISE);
+		set_reg_both(m, channel, REG_PHASE, 0);
+		set_reg_both(m, channel, REG_PERIOD, f_period); // Start without delay. TODO: Test with delay
+		set_reg_both(m, channel, REG_MODE, MODE_FLAG_NOISE);
 		int phase = 0;
 		for (int i = 0; i < num_samples; i++) {
 			exec_step(m.term_index, STATE_CMP_REV_PHASE);
@@ -1265,8 +744,8 @@ bool run_step_tests() {
 
 
 #ifdef TEST_OCT_COUNTER_INC
-	m.set_reg_both(0, REG_SWEEP_PA, 257);
-	m.set_reg_both(0, REG_SWEEP_WS, 257);
+	set_reg_both(m, 0, REG_SWEEP_PA, 257);
+	set_reg_both(m, 0, REG_SWEEP_WS, 257);
 
 	ok = true;
 	num_ok = 0;
@@ -1311,8 +790,8 @@ bool run_step_tests() {
 	if (num_fail > 0) { printf("SOME CASES FAILED!\n"); all_ok = false; }
 
 	top->write_collision_en = 1;
-	m.set_reg_both(0, REG_SWEEP_PA, 0);
-	m.set_reg_both(0, REG_SWEEP_WS, 0);
+	set_reg_both(m, 0, REG_SWEEP_PA, 0);
+	set_reg_both(m, 0, REG_SWEEP_WS, 0);
 #endif
 
 
@@ -1337,7 +816,7 @@ bool run_step_tests() {
 		m.term_index = 0;
 		m.oct_counter = 0;
 		write_core_reg_to_rtl(TST_ADDR_OCT_COUNTER, m.oct_counter);
-		m.set_reg_both(0, REG_MODE, pwl_osc_en ? MODE_FLAG_PWL_OSC : 0); // Disable LFSR, set pwl mode on/off
+		set_reg_both(m, 0, REG_MODE, pwl_osc_en ? MODE_FLAG_PWL_OSC : 0); // Disable LFSR, set pwl mode on/off
 		for (int f_period = 0; f_period < (8 << MANTISSA_BITS); f_period++) {
 //		for (int f_period = 4; f_period <= 4; f_period++) {
 //		for (int f_period = 0; f_period < (5 << MANTISSA_BITS); f_period++) {
@@ -1366,8 +845,8 @@ bool run_step_tests() {
 			if (do_print) printf("f_period = %d, period = %d, num_samples = %d\n", f_period, period, num_samples);
 
 			int phase = 0;
-			m.set_reg_both(0, REG_PERIOD, f_period);
-			m.set_reg_both(0, REG_PHASE, 0);
+			set_reg_both(m, 0, REG_PERIOD, f_period);
+			set_reg_both(m, 0, REG_PHASE, 0);
 			bool nonzero = false;
 			for (int i = 0; i < num_samples; i++) {
 				m.oct_counter = i; write_core_reg_to_rtl(TST_ADDR_OCT_COUNTER, m.oct_counter);
@@ -1433,12 +912,31 @@ bool run_step_tests() {
 	return all_ok;
 }
 
+#ifdef TEST_SOAK
+// Random numbers for the tests come from rand(), unless the thread has its own generator state (used by the soak test,
+// so that each segment is reproducible)
+thread_local uint64_t *rng_state = NULL;
+
+int test_rand() {
+	if (rng_state == NULL) return rand();
+	// xorshift64*
+	uint64_t x = *rng_state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*rng_state = x;
+	return (int)((x * 0x2545F4914F6CDD1Dull) >> 33);
+}
+#else
+int test_rand() { return rand(); }
+#endif
+
 int random(int range) {
-	return rand() % range;
+	return test_rand() % range;
 }
 
 int rand_bits(int nbits) {
-	return rand() & ((1 << nbits)-1);
+	return test_rand() & ((1 << nbits)-1);
 }
 
 void randomize(Model &m, int horizon) {
@@ -1498,7 +996,7 @@ void randomize(Model &m, int horizon) {
 	}
 }
 
-int check_match_counter = 0;
+SOAK_THREAD_LOCAL int check_match_counter = 0;
 
 void check_match(const Model &m, bool &ok, const char *position, int nbits = BITS) {
 	int mask = (1 << nbits) - 1;
@@ -1522,7 +1020,8 @@ void check_match(const Model &m, bool &ok, const char *position, int nbits = BIT
 	check_match_counter++;
 }
 
-bool run_sequence_test(int num_samples, int horizon) {
+// Reset the RTL and load the state in m, ready to run samples from it
+void start_sequence(Model &m) {
 	// No read, no write
 	top->data_write_n = 3;
 	top->data_read_n = 3;
@@ -1538,15 +1037,16 @@ bool run_sequence_test(int num_samples, int horizon) {
 	for (int i = 0; i < 10; i++) timestep();
 	top->rst_n = 1;
 
-	bool all_ok = true;
-
-	Model m;
-	randomize(m, horizon);
 	write_core_regs_to_rtl(m);
 	write_reg_array_to_rtl(m);
 
 	top->en_external = 1;
 	top->step_part_enables = 7;
+}
+
+// Run num_samples samples on both the RTL and the model, starting from the current state. Returns false if anything differs.
+bool run_sequence_samples(Model &m, int num_samples) {
+	bool all_ok = true;
 
 	int num_samples_ok = 0;
 #ifdef DEBUG_PRINTS
@@ -1625,6 +1125,12 @@ bool run_sequence_test(int num_samples, int horizon) {
 		m.acc = top->acc_out; // Read back current acc update to account for bits in acc that we ignored
 		m.oct_counter++;
 
+#ifdef TEST_SEQ_SNAPSHOTS
+		Model rtl;
+		read_snapshot_from_rtl(rtl, m);
+		if (!compare_snapshot(m, rtl, "snapshot      ", false)) all_ok = false;
+#endif
+
 		if (all_ok) num_samples_ok = sample_index+1;
 
 		if (!all_ok) break;
@@ -1635,6 +1141,13 @@ bool run_sequence_test(int num_samples, int horizon) {
 	return all_ok;
 }
 
+bool run_sequence_test(int num_samples, int horizon) {
+	Model m;
+	randomize(m, horizon);
+	start_sequence(m);
+	return run_sequence_samples(m, num_samples);
+}
+
 bool run_sequence_tests() {
 	bool all_ok = true;
 
@@ -1678,8 +1191,383 @@ bool run_sequence_tests() {
 	return all_ok;
 }
 
+// Check the cycle timing model against the new_out_acc output of the RTL, running freely from random initial values
+bool run_timing_test(int num_samples, int &min_cycles, int &max_cycles) {
+	// No read, no write
+	top->data_write_n = 3;
+	top->data_read_n = 3;
+	top->ireg_raddr = -1;
+	top->ireg_waddr = -1;
+
+	top->en_external = 0;
+	top->state_override_en = 0;
+	top->pipeline_curr_channel = 1;
+	top->write_collision_en = 1;
+
+	top->rst_n = 0;
+	for (int i = 0; i < 10; i++) timestep();
+	top->rst_n = 1;
+
+	Model m;
+	randomize(m, 1);
+	write_core_regs_to_rtl(m);
+	write_reg_array_to_rtl(m);
+
+	top->en_external = 1;
+	top->step_part_enables = 7;
+	top->eval();
+
+	TimingState s = {0, 0};
+	for (int sample_index = 0; sample_index < num_samples; sample_index++) {
+		SampleTiming t;
+		model_sample_timing(m, t);
+		min_cycles = std::min(min_cycles, t.num_cycles);
+		max_cycles = std::max(max_cycles, t.num_cycles);
+		for (int cycle = 0; cycle < t.num_cycles; cycle++) {
+			bool expected = timing_new_out_acc(m, s);
+			if (top->new_out_acc != expected) {
+				printf("Timing mismatch: sample = %d, cycle = %d, term_index = %d, state = %d, cfg = %d, mode[0] = 0x%x: new_out_acc = %d, expected %d\n",
+					sample_index, cycle, s.term_index, s.state, m.cfg, m.get_reg(0, REG_MODE), top->new_out_acc, expected);
+				return false;
+			}
+			bool new_sample = timing_step(m, s);
+			if (new_sample != (cycle == t.num_cycles - 1)) {
+				printf("Timing model error: sample length %d cycles, but new sample after cycle %d\n", t.num_cycles, cycle);
+				return false;
+			}
+			timestep();
+		}
+	}
+	return true;
+}
+
+// Write random states to the RTL and check that a snapshot reads them back
+bool run_snapshot_tests() {
+	const int num_tests = 1 << 10;
+
+	printf("Testing snapshots of random states\n");
+
+	// No read, no write
+	top->data_write_n = 3;
+	top->data_read_n = 3;
+	top->ireg_raddr = -1;
+	top->ireg_waddr = -1;
+
+	top->en_external = 0;
+	top->state_override_en = 0;
+	top->pipeline_curr_channel = 0;
+	top->write_collision_en = 1;
+
+	top->rst_n = 0;
+	for (int i = 0; i < 10; i++) timestep();
+	top->rst_n = 1;
+
+	int num_tests_ok = 0;
+	for (int i = 0; i < num_tests; i++) {
+		Model m, rtl;
+		randomize(m, 1);
+		write_core_regs_to_rtl(m);
+		write_reg_array_to_rtl(m);
+
+		read_snapshot_from_rtl(rtl, m);
+		if (!compare_snapshot(m, rtl, "snapshot", true)) break;
+		num_tests_ok++;
+	}
+
+	printf("\n%d snapshot tests ok\n\n", num_tests_ok);
+	return num_tests_ok == num_tests;
+}
+
+bool run_timing_tests() {
+	const int num_tests = 1 << 10;
+	const int num_samples = 8;
+
+	printf("Testing cycle timing with random initial values: length = %d\n", num_samples);
+
+	int num_tests_ok = 0;
+	int min_cycles = MAX_CYCLES_PER_SAMPLE, max_cycles = 0;
+	for (int i = 0; i < num_tests; i++) {
+		if (!run_timing_test(num_samples, min_cycles, max_cycles)) break;
+		num_tests_ok++;
+	}
+
+	printf("\n%d timing tests ok, cycles per sample: %d - %d\n\n", num_tests_ok, min_cycles, max_cycles);
+	return num_tests_ok == num_tests;
+}
+
+#ifdef TEST_SOAK
+// Soak test: check the RTL against the model continuously over a full oct_counter period, so that everything that
+// depends on the high oct_counter bits is reached: low octave enables, slow sweep rates, detune shifts and LFSR octave skipping.
+// The period is split into segments that start at evenly spaced oct_counter values and run in parallel, one model per thread.
+// Each segment starts from a random state, and loads a new random patch every reload_interval samples (keeping the phases,
+// cfg, core state and oct_counter). At every checkpoint_interval samples, the full state is compared through a snapshot
+// and the segment's state is saved to the checkpoint file, so that an interrupted run can be resumed.
+// A failed segment is saved at its last checkpoint, so resuming reruns the failing stretch.
+
+const int default_soak_segments = 256;
+const int default_soak_reload_interval = 1 << 12;
+const int default_soak_checkpoint_interval = 1 << 16;
+
+const int SOAK_RUNNING = 0;
+const int SOAK_DONE = 1;
+const int SOAK_FAILED = 2;
+
+struct SoakSegment {
+	int first_oct_counter, num_samples;
+	int samples_done;
+	int status;
+	uint64_t rng; // random generator state at samples_done
+	Model m; // state at samples_done
+};
+
+struct SoakRun {
+	int total_samples, num_segments, seed, reload_interval, checkpoint_interval;
+	const char *checkpoint_fname; // NULL for no checkpoints
+	std::vector<SoakSegment> segments;
+
+	std::mutex mutex;
+	uint64_t samples_checked;
+	int last_percent;
+};
+
+void soak_init_segments(SoakRun &run) {
+	run.segments.resize(run.num_segments);
+	for (int i = 0; i < run.num_segments; i++) {
+		SoakSegment &seg = run.segments[i];
+		seg.first_oct_counter = (int)((int64_t)run.total_samples * i / run.num_segments);
+		seg.num_samples = (int)((int64_t)run.total_samples * (i + 1) / run.num_segments) - seg.first_oct_counter;
+		seg.samples_done = 0;
+		seg.status = SOAK_RUNNING;
+
+		// splitmix64 of the seed and segment index, never zero
+		uint64_t z = ((uint64_t)run.seed << 32) + i + 0x9E3779B97F4A7C15ull;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		seg.rng = (z ^ (z >> 31)) | 1;
+
+		rng_state = &seg.rng;
+		seg.m = Model();
+		randomize(seg.m, 1);
+		seg.m.oct_counter = seg.first_oct_counter;
+		rng_state = NULL;
+	}
+}
+
+// Checkpoint file: a header line with the run parameters, then one line per segment with its progress and state
+bool soak_save_checkpoint(SoakRun &run) {
+	std::string tmp_fname = std::string(run.checkpoint_fname) + ".tmp";
+	FILE *fp = fopen(tmp_fname.c_str(), "w");
+	if (!fp) {
+		printf("Failed to create checkpoint file: %s\n", tmp_fname.c_str());
+		return false;
+	}
+	fprintf(fp, "soak %d %d %d %d\n", run.total_samples, run.num_segments, run.seed, run.reload_interval);
+	for (int i = 0; i < run.num_segments; i++) {
+		const SoakSegment &seg = run.segments[i];
+		const Model &m = seg.m;
+		fprintf(fp, "segment %d %d %d %llu %d %d %d %d %d %d %d %d %d", i, seg.samples_done, seg.status, (unsigned long long)seg.rng,
+			m.acc, m.out_acc, m.out_acc_alt_frac, m.pred, m.part, m.lfsr_extra_bits, m.oct_counter, m.cfg, m.last_osc_wrapped);
+		for (int j = 0; j < NUM_CHANNELS*REGS_PER_CHANNEL; j++) fprintf(fp, " %d", m.regs[j]);
+		fprintf(fp, "\n");
+	}
+	bool ok = fclose(fp) == 0 && rename(tmp_fname.c_str(), run.checkpoint_fname) == 0;
+	if (!ok) printf("Failed to write checkpoint file: %s\n", run.checkpoint_fname);
+	return ok;
+}
+
+// Returns false if the file exists but doesn't match the run, and sets resumed if segments were loaded from it
+bool soak_load_checkpoint(SoakRun &run, bool &resumed) {
+	resumed = false;
+	FILE *fp = fopen(run.checkpoint_fname, "r");
+	if (!fp) return true; // start from the beginning
+
+	int total_samples, num_segments, seed, reload_interval;
+	if (fscanf(fp, "soak %d %d %d %d", &total_samples, &num_segments, &seed, &reload_interval) != 4 ||
+			total_samples != run.total_samples || num_segments != run.num_segments || seed != run.seed || reload_interval != run.reload_interval) {
+		printf("Checkpoint file %s is for a different soak run: use the same options, or remove it\n", run.checkpoint_fname);
+		fclose(fp);
+		return false;
+	}
+	for (int i = 0; i < run.num_segments; i++) {
+		SoakSegment &seg = run.segments[i];
+		Model &m = seg.m;
+		int index, last_osc_wrapped;
+		unsigned long long rng;
+		bool ok = fscanf(fp, " segment %d %d %d %llu %d %d %d %d %d %d %d %d %d", &index, &seg.samples_done, &seg.status, &rng,
+			&m.acc, &m.out_acc, &m.out_acc_alt_frac, &m.pred, &m.part, &m.lfsr_extra_bits, &m.oct_counter, &m.cfg, &last_osc_wrapped) == 13 && index == i;
+		for (int j = 0; ok && j < NUM_CHANNELS*REGS_PER_CHANNEL; j++) ok = fscanf(fp, "%d", &m.regs[j]) == 1;
+		if (!ok) {
+			printf("Failed to read segment %d from checkpoint file %s\n", i, run.checkpoint_fname);
+			fclose(fp);
+			return false;
+		}
+		seg.rng = rng;
+		m.last_osc_wrapped = last_osc_wrapped;
+		if (seg.status == SOAK_FAILED) seg.status = SOAK_RUNNING;
+	}
+	fclose(fp);
+	resumed = true;
+	return true;
+}
+
+// Load a new random patch into the model and the RTL, with the synth paused.
+// Keeps the phases, cfg, core state and oct_counter.
+void soak_reload(Model &m) {
+	Model r;
+	randomize(r, 1);
+	top->en_external = 0;
+	for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+		for (int reg = 0; reg < REGS_PER_CHANNEL; reg++) {
+			if (reg != REG_PHASE) set_reg_both(m, channel, reg, r.get_reg(channel, reg));
+		}
+	}
+	top->en_external = 1;
+}
+
+// Record a checkpoint for a segment; the state is only saved if the segment is still ok
+void soak_checkpoint(SoakRun &run, SoakSegment &seg, int samples_done, int new_samples, const Model &m, uint64_t rng, int status) {
+	std::lock_guard<std::mutex> lock(run.mutex);
+	if (status != SOAK_FAILED) {
+		seg.samples_done = samples_done;
+		seg.rng = rng;
+		seg.m = m;
+	}
+	seg.status = status;
+	run.samples_checked += new_samples;
+	if (run.checkpoint_fname != NULL) soak_save_checkpoint(run);
+
+	int percent = (int)(100 * run.samples_checked / run.total_samples);
+	if (percent != run.last_percent) {
+		run.last_percent = percent;
+		printf("Soak: %llu / %d samples checked (%d%%)\n", (unsigned long long)run.samples_checked, run.total_samples, percent);
+		fflush(stdout);
+	}
+}
+
+bool run_soak_segment(SoakRun &run, int index) {
+	SoakSegment &seg = run.segments[index];
+	Model m;
+	uint64_t rng;
+	int n;
+	{
+		std::lock_guard<std::mutex> lock(run.mutex);
+		m = seg.m;
+		rng = seg.rng;
+		n = seg.samples_done;
+	}
+
+	VerilatedContext context;
+	top = new Vtqvp_toivoh_pwl_synth(&context);
+	rng_state = &rng;
+	start_sequence(m);
+
+	bool ok = true;
+	int last_checkpoint = n;
+	while (n < seg.num_samples) {
+		if (n > 0 && n % run.reload_interval == 0) soak_reload(m);
+
+		int oct_counter = m.oct_counter;
+		bool sample_ok = run_sequence_samples(m, 1);
+		m.oct_counter &= OCT_COUNTER_MASK; // wrap like the RTL
+		if (!sample_ok) {
+			printf("Soak segment %d failed at sample %d, oct_counter = 0x%x\n", index, n, oct_counter);
+			ok = false;
+			break;
+		}
+		n++;
+
+		if (n % run.checkpoint_interval == 0 || n == seg.num_samples) {
+			Model rtl;
+			read_snapshot_from_rtl(rtl, m);
+			if (!compare_snapshot(m, rtl, "soak snapshot", false)) {
+				printf("Soak segment %d: snapshot mismatch after sample %d, oct_counter = 0x%x\n", index, n - 1, oct_counter);
+				ok = false;
+				break;
+			}
+			soak_checkpoint(run, seg, n, n - last_checkpoint, m, rng, n == seg.num_samples ? SOAK_DONE : SOAK_RUNNING);
+			last_checkpoint = n;
+		}
+	}
+	if (!ok) soak_checkpoint(run, seg, n, 0, m, rng, SOAK_FAILED);
+
+	rng_state = NULL;
+	delete top;
+	top = NULL;
+	return ok;
+}
+
+bool run_soak_test(SoakRun &run, int num_threads) {
+	soak_init_segments(run);
+	bool resumed = false;
+	if (run.checkpoint_fname != NULL && !soak_load_checkpoint(run, resumed)) return false;
+
+	std::vector<int> todo;
+	run.samples_checked = 0;
+	run.last_percent = -1;
+	for (int i = 0; i < run.num_segments; i++) {
+		run.samples_checked += run.segments[i].samples_done;
+		if (run.segments[i].status != SOAK_DONE) todo.push_back(i);
+	}
+
+	printf("Soak test: %d samples from oct_counter 0 in %d segments, %d threads, seed %d\n", run.total_samples, run.num_segments, num_threads, run.seed);
+	if (resumed) printf("Resuming from %s: %llu samples already checked, %d segments left\n", run.checkpoint_fname, (unsigned long long)run.samples_checked, (int)todo.size());
+
+	std::vector<char> segment_ok(todo.size());
+	parallel_for(todo.size(), num_threads, [&](int i) { segment_ok[i] = run_soak_segment(run, todo[i]); });
+
+	int num_failed = 0;
+	for (char ok : segment_ok) num_failed += !ok;
+	if (num_failed == 0) printf("\nSoak test ok: %d samples checked\n\n", run.total_samples);
+	else printf("\nSoak test: %d of %d segments FAILED\n\n", num_failed, run.num_segments);
+	return num_failed == 0;
+}
+#endif
+
+
+// Usage: Vtqvp_toivoh_pwl_synth                      run the tests
+//        Vtqvp_toivoh_pwl_synth -soak [options]      run the soak test instead (needs TEST_SOAK)
+//     -samples <n>               number of samples, from oct_counter = 0 (default: 2^24, a full oct_counter period)
+//     -segments <n>              number of segments (default: 256)
+//     -j <n>                     number of threads (default: all cores)
+//     -seed <n>                  seed for the random states (default: 1)
+//     -reload <n>                samples between random patch reloads (default: 4096)
+//     -checkpoint <file>         checkpoint file, the run resumes from it if it exists
+//     -checkpoint_interval <n>   samples between checkpoints in each segment (default: 65536)
 int main(int argc, char** argv) {
 	Verilated::commandArgs(argc, argv);
+#ifdef TEST_SOAK
+	bool soak = false;
+	int num_threads = default_num_threads();
+	SoakRun run;
+	run.total_samples = 1 << OCT_COUNTER_BITS;
+	run.num_segments = default_soak_segments;
+	run.seed = 1;
+	run.reload_interval = default_soak_reload_interval;
+	run.checkpoint_interval = default_soak_checkpoint_interval;
+	run.checkpoint_fname = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-soak")) soak = true;
+		else if (!strcmp(argv[i], "-samples") && i + 1 < argc) run.total_samples = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-segments") && i + 1 < argc) run.num_segments = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-seed") && i + 1 < argc) run.seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-reload") && i + 1 < argc) run.reload_interval = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-checkpoint") && i + 1 < argc) run.checkpoint_fname = argv[++i];
+		else if (!strcmp(argv[i], "-checkpoint_interval") && i + 1 < argc) run.checkpoint_interval = atoi(argv[++i]);
+		else if (argv[i][0] != '+') { // leave +verilator+ arguments to Verilated
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (soak) {
+		if (run.total_samples < 1 || run.total_samples > (1 << OCT_COUNTER_BITS) || run.num_segments < 1 || run.num_segments > run.total_samples ||
+				num_threads < 1 || run.reload_interval < 1 || run.checkpoint_interval < 1) {
+			printf("Bad soak options: need 1 <= segments <= samples <= 2^%d, and threads and intervals >= 1\n", OCT_COUNTER_BITS);
+			return 1;
+		}
+		return run_soak_test(run, num_threads) ? 0 : 1;
+	}
+#endif
 
 	top = new Vtqvp_toivoh_pwl_synth();
 
@@ -1711,6 +1599,12 @@ int main(int argc, char** argv) {
 	all_ok &= run_step_tests();
 	//all_ok &= run_sequence_test(256, 32);
 	all_ok &= run_sequence_tests();
+#ifdef TEST_TIMING
+	all_ok &= run_timing_tests();
+#endif
+#ifdef TEST_SNAPSHOT
+	all_ok &= run_snapshot_tests();
+#endif
 	if (!all_ok) printf("\n\nSOME TESTS FAILED!\n\n");
 
 #ifdef TRACE_ON
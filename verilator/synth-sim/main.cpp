@@ -8,11 +8,15 @@
 #include <string.h>
 #include <algorithm>
 #include <stdint.h>
+#include <deque>
 
 #include "Vpwls_multichannel_ALU_unit.h"
 #include "verilated.h"
 #include <verilated_vcd_c.h>
 
+#include "../model/pwls_filter.h"
+#include "../model/pwls_driver.h"
+
 //#define STEREO_ON
 //#define STEREO_POS_ON // might have an effect even if stereo is off, affecting the subchannels
 
@@ -26,9 +30,23 @@ int trace_countdown = 0;
 
 const char* audio_fname = "audio.raw";
 
+// Save the register writes as an event script, to be rendered with model-render
+//#define SAVE_EVENTS
+const char* events_fname = "events.txt";
+
+// Save the PWM pins every cycle, packed 64 cycles to a 64 bit word with bit i = cycle i,
+// to be filtered to audio with pwmout in model-render. With STEREO_ON, pwm_out and pwm_out_right words are interleaved.
+//#define SAVE_PWM
+const char* pwm_fname = "pwm.bin";
+
 
 #define USE_NEW_REGMAP_B
 
+#ifdef USE_NEW_REGMAP_B
+// Skip register writes that wouldn't change anything, see pwls_driver.h
+#define COALESCE_WRITES
+#endif
+
 
 #define DOWNSAMPLE
 const int log2_downsampling = 4;
@@ -80,25 +98,10 @@ const int PARAMS_ADDR = 3;
 const int SWEEP_ADDR = 4;
 #endif
 
-const int MODE_BIT_DETUNE0 = 0;
-const int MODE_BIT_NOISE = 3;
-const int MODE_FLAG_NOISE = 1 << MODE_BIT_NOISE;
-const int MODE_BIT_3X = 4;
-const int MODE_FLAG_3X = 1 << MODE_BIT_3X;
-const int MODE_BIT_X2N0 = 5;
-const int MODE_BIT_X2N1 = 6;
-const int MODE_FLAG_COMMON_SAT = 128;
-const int MODE_FLAG_PWL_OSC = 256;
-const int MODE_FLAGS_ORION = MODE_FLAG_NOISE | MODE_FLAG_PWL_OSC;
-const int MODE_FLAG_OSC_SYNC_EN = 1 << 9;
-const int MODE_FLAG_OSC_SYNC_SOFT = 1 << 10;
+// The mode and cfg flags are in pwls_model.h
 const int MODE_FLAG_4_BIT = MODE_FLAG_OSC_SYNC_SOFT; // use without MODE_FLAG_OSC_SYNC_EN for 4 bit mode
 
 
-const int CFG_FLAG_STEREO_EN = 1;
-const int CFG_FLAG_STEREO_POS_EN = 2;
-
-
 #ifdef DOWNSAMPLE
 const int LOG2_DOWNSAMPLING = log2_downsampling;
 #else
@@ -106,23 +109,7 @@ const int LOG2_DOWNSAMPLING = 0;
 #endif
 
 
-const int MAX_CYCLES_PER_SAMPLE = 64;
-const int NUM_CHANNELS = 4;
-
-const int BITS = 12;
-const int OCT_BITS = 3;
-const int MANTISSA_BITS = 10;
-const int PERIOD_BITS = OCT_BITS + MANTISSA_BITS;
-const int OUT_ACC_FRAC_BITS = 4;
-
-const int FILTER_OUT_TAPS = 8;
-const int LOG2_FILTER_DOWNSAMPLING = 4;
-const int FILTER_DOWNSAMPLING = 1 << LOG2_FILTER_DOWNSAMPLING;
-const int FILTER_SIZE = FILTER_OUT_TAPS * FILTER_DOWNSAMPLING;
-
-// sum = 1
-const float filter_kernel[FILTER_SIZE] = {1.9704187094300935e-5, 1.672124152367472e-5, 2.2091120095941078e-5, 2.685891825533267e-5, 2.986240567308994e-5, 2.9534150836547966e-5, 2.383946150169849e-5, 1.021951780838429e-5, -1.4411480429666529e-5, -5.36959988669223e-5, -0.00011180932123201447, -0.00019337588931160458, -0.00030342804910631955, -0.0004472782832528414, -0.0006303462676022846, -0.0008579957004840749, -0.001135309212249831, -0.0014667842276546196, -0.0018561320074222429, -0.002305912685078532, -0.002817258691731319, -0.0033895263704930615, -0.004020051222580581, -0.004703836003274322, -0.005433308142276695, -0.006198184498962297, -0.006985310407430402, -0.007778614246666663, -0.008559181086983851, -0.009305396042280256, -0.009993152391113985, -0.01059623243525253, -0.011086746809076363, -0.011435691266594215, -0.011613589672186135, -0.011591213583084728, -0.01134036359811593, -0.01083472103358854, -0.010050661114540156, -0.008968128717767905, -0.007571458653177024, -0.005850114301831013, -0.0037993853835723837, -0.0014209444872459675, 0.0012766983496119864, 0.00427794488352387, 0.007559983645916518, 0.011092860474231525, 0.014839750460875892, 0.018757433256881124, 0.022796916419864335, 0.026904280440575086, 0.031021680252996835, 0.03508844165879476, 0.03904232782324128, 0.0428208684017619, 0.04636270832694564, 0.04960900440934792, 0.05250477911818976, 0.05500018257543565, 0.05705170155105929, 0.05862317927162731, 0.059686702941030734, 0.060223274017816915, 0.060223274017816915, 0.059686702941030734, 0.05862317927162731, 0.05705170155105929, 0.05500018257543565, 0.05250477911818976, 0.04960900440934792, 0.04636270832694564, 0.0428208684017619, 0.03904232782324128, 0.03508844165879476, 0.031021680252996835, 0.026904280440575086, 0.022796916419864335, 0.018757433256881124, 0.014839750460875892, 0.011092860474231525, 0.007559983645916518, 0.00427794488352387, 0.0012766983496119864, -0.0014209444872459675, -0.0037993853835723837, -0.005850114301831013, -0.007571458653177024, -0.008968128717767905, -0.010050661114540156, -0.01083472103358854, -0.01134036359811593, -0.011591213583084728, -0.011613589672186135, -0.011435691266594215, -0.011086746809076363, -0.01059623243525253, -0.009993152391113985, -0.009305396042280256, -0.008559181086983851, -0.007778614246666663, -0.006985310407430402, -0.006198184498962297, -0.005433308142276695, -0.004703836003274322, -0.004020051222580581, -0.0033895263704930615, -0.002817258691731319, -0.002305912685078532, -0.0018561320074222429, -0.0014667842276546196, -0.001135309212249831, -0.0008579957004840749, -0.0006303462676022846, -0.0004472782832528414, -0.00030342804910631955, -0.00019337588931160458, -0.00011180932123201447, -5.36959988669223e-5, -1.4411480429666529e-5, 1.021951780838429e-5, 2.383946150169849e-5, 2.9534150836547966e-5, 2.986240567308994e-5, 2.685891825533267e-5, 2.2091120095941078e-5, 1.672124152367472e-5, 1.9704187094300935e-5};
-
+// MAX_CYCLES_PER_SAMPLE, NUM_CHANNELS and the bit widths are in pwls_model.h
 
 const int note_mantissas[12] = {909, 801, 698, 601, 510, 424, 343, 266, 194, 125, 61, 0};
 
@@ -143,8 +130,135 @@ inline void trace() {
 
 int pwm_acc;
 
+#ifdef SAVE_EVENTS
+FILE* events_fp;
+int event_frame = 0; // output sample index that register writes take effect from
+#endif
+
+#ifdef SAVE_PWM
+#ifdef STEREO_ON
+const int NUM_PWM_PINS = 2;
+#else
+const int NUM_PWM_PINS = 1;
+#endif
+FILE* pwm_fp = NULL; // opened after reset
+uint64_t pwm_words[2];
+int pwm_cycle = 0;
+
+void save_pwm_cycle() {
+	if (pwm_fp == NULL) return;
+	pwm_words[0] |= (uint64_t)(top->pwm_out & 1) << pwm_cycle;
+	pwm_words[1] |= (uint64_t)(top->pwm_out_right & 1) << pwm_cycle;
+	if (++pwm_cycle == 64) {
+		fwrite(pwm_words, sizeof(uint64_t), NUM_PWM_PINS, pwm_fp);
+		pwm_words[0] = pwm_words[1] = 0;
+		pwm_cycle = 0;
+	}
+}
+#endif
+
+
+// Bus master model for concurrent register writes, enabled with -bus <interval>.
+//
+// Instead of pausing the synth for each write, writes are queued and issued one per cycle with en = 1, at most one
+// every write_interval cycles, like a CPU store loop on the TinyQV bus. The synth keeps running; when an external write
+// coincides with an internal register write, the synth stalls for a cycle and the current sample gets one cycle longer.
+// Stalls are detected as cycles where term_index/state don't advance.
+struct BusWrite {
+	int addr, channel, data;
+	uint64_t request_cycle;
+};
+
+const int MAX_STALL_HISTOGRAM = 8;
+
+struct BusMaster {
+	bool enabled;
+	int write_interval; // minimum number of cycles between writes, at least 2 since reg_wdata is read the cycle after reg_we
+	std::deque<BusWrite> queue;
+	uint64_t cycle, last_write_cycle;
+	FILE *log_fp; // per write log if not NULL
+
+	// Statistics
+	uint64_t num_writes, num_stalls, total_latency, max_latency;
+	uint64_t num_intervals; // between new_out_acc pulses
+	uint64_t stall_histogram[MAX_STALL_HISTOGRAM+1]; // number of intervals with a given number of stall cycles
+	int interval_stalls, last_interval_stalls;
+
+	BusMaster() : enabled(false), write_interval(16), cycle(0), last_write_cycle(0), log_fp(NULL) { reset_stats(); }
+
+	void reset_stats() {
+		num_writes = num_stalls = total_latency = max_latency = num_intervals = 0;
+		memset(stall_histogram, 0, sizeof(stall_histogram));
+		interval_stalls = last_interval_stalls = 0;
+	}
+
+	void request(int addr, int channel, int data) {
+		BusWrite w = {addr, channel, data, cycle};
+		queue.push_back(w);
+	}
+
+	// Drive the next write for this cycle if there is one and the bus is free. Returns true if one was started.
+	bool start_write() {
+		if (queue.empty() || (num_writes > 0 && cycle - last_write_cycle < (uint64_t)write_interval)) return false;
+		const BusWrite &w = queue.front();
+		top->reg_waddr = w.addr*4 + w.channel;
+		top->reg_wdata = w.data & 0xffff;
+		top->reg_we = 1;
+#ifdef SAVE_EVENTS
+		fprintf(events_fp, "%d %d %d %d\n", event_frame, w.addr, w.channel, w.data & 0xffff);
+#endif
+		uint64_t latency = cycle - w.request_cycle;
+		total_latency += latency;
+		max_latency = std::max(max_latency, latency);
+		num_writes++;
+		last_write_cycle = cycle;
+		return true;
+	}
+
+	void end_write(bool stalled) {
+		const BusWrite &w = queue.front();
+		if (log_fp != NULL) fprintf(log_fp, "%llu %d %d %d %llu %d\n", (unsigned long long)cycle, w.addr, w.channel, w.data & 0xffff, (unsigned long long)(cycle - w.request_cycle), stalled);
+		queue.pop_front();
+		top->reg_we = 0;
+		if (stalled) {
+			num_stalls++;
+			interval_stalls++;
+		}
+	}
+
+	void new_out_acc() {
+		num_intervals++;
+		stall_histogram[std::min(interval_stalls, MAX_STALL_HISTOGRAM)]++;
+		last_interval_stalls = interval_stalls;
+		interval_stalls = 0;
+	}
+
+	int max_interval_stalls() const {
+		for (int i = MAX_STALL_HISTOGRAM; i > 0; i--) if (stall_histogram[i] != 0) return i;
+		return 0;
+	}
+
+	void print_stats(FILE *fp) const {
+		double seconds = cycle / CLOCK_FREQUENCY;
+		fprintf(fp, "Bus writes: %llu (%.0f/s), latency mean %.1f max %llu cycles, %llu stalls (%.1f%% of writes)\n",
+			(unsigned long long)num_writes, num_writes / seconds, num_writes ? (double)total_latency / num_writes : 0.0,
+			(unsigned long long)max_latency, (unsigned long long)num_stalls, num_writes ? 100.0 * num_stalls / num_writes : 0.0);
+		fprintf(fp, "Sample timing: %llu intervals, stall cycles per interval:", (unsigned long long)num_intervals);
+		for (int i = 0; i <= MAX_STALL_HISTOGRAM; i++) if (stall_histogram[i] != 0) fprintf(fp, " %d%s: %llu", i, i == MAX_STALL_HISTOGRAM ? "+" : "", (unsigned long long)stall_histogram[i]);
+		fprintf(fp, "\n");
+	}
+};
+
+BusMaster bus;
+
 void timestep() {
 	pwm_acc += top->pwm_out;
+#ifdef SAVE_PWM
+	save_pwm_cycle();
+#endif
+
+	bool writing = bus.enabled && bus.start_write();
+	int term_index = top->term_index_out, state = top->state_out;
 
 	top->clk = 0;
 	top->eval();
@@ -152,14 +266,26 @@ void timestep() {
 	top->clk = 1;
 	top->eval();
 	trace();
+
+	if (writing) bus.end_write(term_index == top->term_index_out && state == top->state_out);
+	if (bus.enabled && top->new_out_acc) bus.new_out_acc();
+	bus.cycle++;
 }
 
 
 
-void reg_write(int addr, int channel, int data) {
+void raw_reg_write(int addr, int channel, int data) {
+	if (bus.enabled) {
+		bus.request(addr, channel, data);
+		return;
+	}
+
 	top->reg_waddr = addr*4 + channel;
 	top->reg_wdata = data & 0xffff;
 	top->reg_we = 1;
+#ifdef SAVE_EVENTS
+	fprintf(events_fp, "%d %d %d %d\n", event_frame, addr, channel, data & 0xffff);
+#endif
 	top->en = 0; // pause the synth to avoid chaning the timing
 	timestep();
 	pwm_acc--; // the PWM output is not paused and the total will be increased by one, compensate
@@ -167,6 +293,28 @@ void reg_write(int addr, int channel, int data) {
 	top->en = 1;
 }
 
+RegDriver reg_driver(raw_reg_write);
+
+// Stage a register write, issued by reg_flush
+void reg_set(int addr, int channel, int data) {
+#ifdef COALESCE_WRITES
+	reg_driver.set(addr, channel, data);
+#else
+	raw_reg_write(addr, channel, data);
+#endif
+}
+
+void reg_flush() {
+#ifdef COALESCE_WRITES
+	reg_driver.flush();
+#endif
+}
+
+void reg_write(int addr, int channel, int data) {
+	reg_set(addr, channel, data);
+	reg_flush();
+}
+
 int encode_sweep_rate(int sweep_rate) {
 	if (sweep_rate != 0 && sweep_rate <= fastest_sweep) {
 		if (fastest_sweep == fastest_sweep_supported) return 1;
@@ -188,10 +336,11 @@ void cfg_write(int cfg) { reg_write(OC_ADDR, 2, cfg); }
 
 // 8 bit pwm_offset and slopes
 void modeparams_write(int channel, int detune_exp, int pwm_offset, int slope0, int slope1, int flags=0) {
-	reg_write(MODE_ADDR, channel, ((detune_exp*DETUNE_ON)&7) | flags); // TODO: lfsr_en?
-	reg_write(PWM_OFFSET_ADDR, channel, pwm_offset);
-	reg_write(SLOPE0_ADDR, channel, slope0);
-	reg_write(SLOPE1_ADDR, channel, slope1);
+	reg_set(MODE_ADDR, channel, ((detune_exp*DETUNE_ON)&7) | flags); // TODO: lfsr_en?
+	reg_set(PWM_OFFSET_ADDR, channel, pwm_offset);
+	reg_set(SLOPE0_ADDR, channel, slope0);
+	reg_set(SLOPE1_ADDR, channel, slope1);
+	reg_flush();
 }
 
 void sweep_period_amp_write(int channel, int period_sweep_rate, int period_sign, int amp_sweep_rate=0, int amp_target=0) {
@@ -222,9 +371,72 @@ void sweep_period_amp_write(int channel, int period_sweep_rate, int period_sign,
 
 
 
+// Find the highest rate of back to back bus writes that keeps the sample timing jitter within max_stall_rate
+// stall cycles per sample on average. The writes rewrite the amplitude of a silent channel while channel 0 plays a note.
+void run_bus_rate_test(int num_intervals, double max_stall_rate) {
+	bus.enabled = false; // set up the note with paused writes
+	amp_write(0, 63);
+	period_write(0, 3, note_mantissas[0]); // C4
+	bus.enabled = true;
+
+	static const int intervals[] = {256, 128, 96, 64, 48, 32, 24, 16, 12, 8, 6, 4, 3, 2};
+	double best_rate = 0;
+	int best_interval = 0;
+	printf("\ninterval  writes/s  stalls/write  stall cycles/sample  max stall cycles/sample\n");
+	for (int interval : intervals) {
+		bus.write_interval = interval;
+		bus.queue.clear();
+		bus.reset_stats();
+		uint64_t start_cycle = bus.cycle;
+		while (bus.num_intervals < (uint64_t)num_intervals) {
+			if (bus.queue.size() < 2) bus.request(AMP_ADDR, 3, 0); // keep the CPU busy
+			timestep();
+		}
+
+		double rate = bus.num_writes / ((bus.cycle - start_cycle) / CLOCK_FREQUENCY);
+		double stall_rate = (double)bus.num_stalls / bus.num_intervals;
+		printf("%8d  %8.0f  %12.3f  %19.4f  %23d\n", interval, rate, (double)bus.num_stalls / bus.num_writes, stall_rate, bus.max_interval_stalls());
+		if (stall_rate <= max_stall_rate && rate > best_rate) {
+			best_rate = rate;
+			best_interval = interval;
+		}
+	}
+	if (best_interval == 0) printf("\nNo tested rate keeps the stall rate within %g cycles per sample\n", max_stall_rate);
+	else printf("\nMaximum sustainable update rate: %.0f writes/s (one write per %d cycles) with at most %g stall cycles per sample\n", best_rate, best_interval, max_stall_rate);
+}
+
+
 int main(int argc, char** argv) {
 	Verilated::commandArgs(argc, argv);
 
+	// Usage: Vpwls_multichannel_ALU_unit [-bus interval] [-bus_log file] [-bus_rate_test] [-max_stall_rate r]
+	//     -bus <interval>      issue register writes concurrently with the synth running, see BusMaster
+	//     -bus_log <file>      log each bus write: cycle addr channel data latency stalled
+	//     -bus_rate_test       measure the sample timing jitter for different write rates instead of playing the tune
+	//     -max_stall_rate <r>  stall cycles per sample that -bus_rate_test accepts as sustainable (default: 0.01)
+	bool bus_rate_test = false;
+	double max_stall_rate = 0.01;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-bus") && i + 1 < argc) {
+			bus.enabled = true;
+			bus.write_interval = std::max(2, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "-bus_log") && i + 1 < argc) {
+			const char *fname = argv[++i];
+			bus.log_fp = fopen(fname, "w");
+			if (!bus.log_fp) {
+				printf("Failed to create bus log file: %s\n", fname);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "-bus_rate_test")) bus_rate_test = true;
+		else if (!strcmp(argv[i], "-max_stall_rate") && i + 1 < argc) max_stall_rate = atof(argv[++i]);
+		else if (argv[i][0] != '+') { // leave +verilator+ arguments to Verilated
+			printf("Unexpected argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	bool bus_enabled = bus.enabled;
+	bus.enabled = false; // not during reset
+
 	top = new Vpwls_multichannel_ALU_unit();
 
 #ifdef TRACE_ON
@@ -244,6 +456,13 @@ int main(int argc, char** argv) {
 	for (int i = 0; i < 10; i++) timestep();
 	top->rst_n = 1;
 	//top->reset = 0;
+	bus.enabled = bus_enabled;
+
+	if (bus_rate_test) {
+		run_bus_rate_test(4096, max_stall_rate);
+		delete top;
+		return 0;
+	}
 
 	int output_offset = top->pwm_out_offset;
 #ifdef STEREO_ON
@@ -288,6 +507,22 @@ int main(int argc, char** argv) {
 	}
 #endif
 
+#ifdef SAVE_EVENTS
+	events_fp = fopen(events_fname, "w");
+	if (!events_fp) {
+		printf("Failed to create event output file: %s", events_fname);
+		return 1;
+	}
+#endif
+
+#ifdef SAVE_PWM
+	pwm_fp = fopen(pwm_fname, "wb");
+	if (!pwm_fp) {
+		printf("Failed to create PWM output file: %s", pwm_fname);
+		return 1;
+	}
+#endif
+
 
 // Tune setup
 // ==========
@@ -430,6 +665,8 @@ int main(int argc, char** argv) {
 	int prev_pwm_acc = -1;
 	int sample_print_counter = 0;
 
+	int num_pwm_mismatches = 0;
+
 	int next_sweep_update_time = 0;
 	int sweep_rate = fastest_sweep;
 
@@ -492,7 +729,10 @@ int main(int argc, char** argv) {
 #ifndef STEREO_ON // TODO: test even with stereo
 			int pwm_adj = pwm_acc - curr_pwm_offset;
 			//if (i > 0 && pwm_acc > 0 && pwm_adj*16 != sample) {
-			if (i > 0 && pwm_adj*16 != sample) {
+			if (i > 0 && pwm_adj*16 != sample && bus.enabled) {
+				// Writes that stall the synth change the sample timing, count instead of stopping
+				num_pwm_mismatches++;
+			} else if (i > 0 && pwm_adj*16 != sample) {
 #ifdef STEREO_ON
 				printf("side = %d: ", side);
 #endif
@@ -543,6 +783,10 @@ int main(int argc, char** argv) {
 // Tune update
 // ===========
 
+#ifdef SAVE_EVENTS
+		event_frame = i + 1;
+#endif
+
 		if (tune == 0 || tune == 14) {
 			// Play a melody on channel 0
 			if ((i & ((1 << LOG2_SAMPLES_PER_NOTE) - 1)) == 0) {
@@ -680,11 +924,25 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	printf("\n\nDone!");
+	printf("\n\nDone!\n");
+#ifdef COALESCE_WRITES
+	reg_driver.print_stats(stdout);
+#endif
+	if (bus.enabled) {
+		bus.print_stats(stdout);
+		printf("Samples where the PWM output didn't match: %d\n", num_pwm_mismatches);
+		if (bus.log_fp != NULL) fclose(bus.log_fp);
+	}
 
 #ifdef SAVE_AUDIO
 	fclose(audio_fp);
 #endif
+#ifdef SAVE_EVENTS
+	fclose(events_fp);
+#endif
+#ifdef SAVE_PWM
+	fclose(pwm_fp);
+#endif
 
 #ifdef TRACE_ON
 	m_trace->close();